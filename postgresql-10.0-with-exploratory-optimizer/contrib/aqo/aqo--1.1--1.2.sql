@@ -0,0 +1,110 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION aqo UPDATE TO '1.2'" to load this file. \quit
+
+-- Objects of the feature subspaces predicted by kNN (aqo.model_selection)
+CREATE TABLE public.aqo_data (
+	fspace_hash		int NOT NULL REFERENCES public.aqo_queries ON DELETE CASCADE,
+	fsspace_hash	int NOT NULL,
+	nfeatures		int NOT NULL,
+	features		double precision[][],
+	targets			double precision[]
+);
+
+CREATE UNIQUE INDEX aqo_fss_access_idx ON public.aqo_data (fspace_hash, fsspace_hash);
+
+-- The model each feature subspace is planned with, the mean cardinality of
+-- the constant model and the errors and latencies of all models
+CREATE TABLE public.aqo_fss_models (
+	fspace_hash		int NOT NULL REFERENCES public.aqo_queries ON DELETE CASCADE,
+	fsspace_hash	int NOT NULL,
+	model			int NOT NULL,
+	nsamples		int NOT NULL,
+	mean_target		double precision NOT NULL,
+	errors			double precision[] NOT NULL,
+	latencies		double precision[] NOT NULL
+);
+
+CREATE UNIQUE INDEX aqo_fss_models_access_idx ON public.aqo_fss_models (fspace_hash, fsspace_hash);
+
+/*per executor node type model of the node execution time, used to rank the final plans*/
+CREATE TABLE public.aqo_node_latency (
+	node_type		int PRIMARY KEY,
+	nfeatures		int NOT NULL,
+	features		double precision[][],
+	targets			double precision[]
+);
+
+CREATE UNIQUE INDEX aqo_node_latency_idx ON public.aqo_node_latency (node_type);
+
+CREATE FUNCTION aqo_planning_budget_stat(OUT budget_exceeded bigint,
+										 OUT skipped_estimates bigint)
+	RETURNS record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION aqo_planning_stats(OUT function text,
+								   OUT template integer,
+								   OUT fss integer,
+								   OUT calls bigint,
+								   OUT total_time double precision,
+								   OUT mean_time double precision,
+								   OUT p99_time double precision,
+								   OUT bytes_detoasted bigint)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE VIEW aqo_planning_stats AS
+	SELECT * FROM aqo_planning_stats();
+
+CREATE FUNCTION aqo_planning_stats_reset() RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+-- When a model was used last, for the age eviction of aqo_vacuum()
+ALTER TABLE public.aqo_data_lwpr ADD COLUMN last_used timestamptz;
+
+CREATE FUNCTION aqo_vacuum(OUT evicted_fss bigint,
+						   OUT removed_rfs bigint,
+						   OUT deleted_datahouse_rows bigint,
+						   OUT bytes_before bigint,
+						   OUT bytes_after bigint)
+	RETURNS record
+	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE;
+
+-- How much the relations of a model changed since it was learned
+ALTER TABLE public.aqo_data_lwpr ADD COLUMN staleness double precision;
+
+-- Relations a feature subspace is built on and their number of tuples when
+-- the model was learned or last checked
+CREATE TABLE public.aqo_fss_relations (
+	fspace_hash		int NOT NULL REFERENCES public.aqo_queries ON DELETE CASCADE,
+	fsspace_hash	int NOT NULL,
+	relid			oid NOT NULL,
+	reltuples		real NOT NULL
+);
+
+CREATE INDEX aqo_fss_relations_access_idx ON public.aqo_fss_relations (fspace_hash, fsspace_hash, relid);
+CREATE INDEX aqo_fss_relations_relid_idx ON public.aqo_fss_relations (relid);
+
+CREATE FUNCTION aqo_export_models(path text) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION aqo_import_models(path text) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION aqo_ingest_spool(dir text) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION aqo_retrain(nworkers integer DEFAULT 0) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION aqo_set_storage_precision(storage_precision text) RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE;
+
+-- Most frequent next templates of the Markov states kept in shared memory
+CREATE FUNCTION aqo_markov_sketch(OUT hist_query_hash integer,
+								  OUT template integer,
+								  OUT probability double precision)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION aqo_markov_sketch_reset() RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
@@ -3,6 +3,7 @@
 PG_MODULE_MAGIC;
 
 void _PG_init(void);
+static void aqo_shmem_startup(void);
 
 
 /* Strategy of determining feature space for new queries. */
@@ -48,11 +49,54 @@ double      avg_error_threshold = 1;
 /*the number of history queries that used to predict the distribution of future queries(use markov model)*/
 int         num_history_data_compute_probability_fs = 3;
 int         num_query_pattern = 7;
+/* template of queries which are none of the known ones, 0 means they are not optimized by AQO (aqo.default_query_template) */
+int         default_query_template = 0;
 /*use our learned cost model?--->maybe future work*/
 int         num_two_costs_save = 66; /*the number of query's two best costs we need to save for each query template*/
 double      rate_to_compare_best_est_cost = 1;
 /*prune the plan with higher cost for given workload*/
 double      prune_rate_for_add_path_explore = 1.01;
+/* time AQO may spend on planning one query, 0 disables the limit (aqo.planning_time_budget_ms) */
+int         planning_time_budget_ms = 0;
+int64       planning_budget_exceeded_count = 0;     /* number of queries which exhausted the budget */
+int64       planning_budget_skipped_estimates = 0;  /* estimates made by default estimators due to the budget */
+/* choose the final plan by the learned plan-latency model (latency_model.c) */
+bool        use_latency_model = false;
+double      latency_model_cost_window = 1.5; /* only paths with cost <= best cost * window are compared */
+int         latency_model_K = 64;            /* max number of objects in the model of one node type */
+/* re-plan a query when a join produces more than factor * estimated rows, 0 disables (aqo.reoptimize_factor) */
+double      reoptimize_factor = 0;
+double      reoptimize_explore_threshold = 0.5; /* joins with a higher explore value get checkpoints */
+/* shared-memory statistics of AQO hot path functions (planning_stats.c) */
+bool        track_planning_stats = true;
+int         planning_stats_max = 5000;      /* max number of (function, template, fss) entries */
+/* print per-node prediction details in EXPLAIN (explain_details.c) */
+bool        aqo_show_details = false;
+/* model vacuum (vacuum.c) */
+int         vacuum_max_age = 0;          /* evict models unused for this time (s), 0 - never */
+int         vacuum_max_size = 0;         /* limit of the size of models (kB), 0 - no limit */
+double      vacuum_min_rf_data = 1;      /* remove RFs which have seen less objects */
+int         vacuum_naptime = 0;          /* period of the vacuum worker (s), 0 - paused */
+char       *vacuum_database = NULL;      /* database the vacuum worker connects to */
+/* statistics drift (drift.c) */
+double      stale_threshold = 0.2;       /* relative change of reltuples which makes models stale, 0 - off */
+/* standby spool (spool.c) */
+char       *standby_spool_dir = NULL;    /* where a hot standby writes observed objects, empty - off */
+
+/* sample log (samplelog.c) */
+char       *sample_log_dir = NULL;       /* where learned objects are logged, empty - off */
+int         sample_log_max_size = 102400; /* kB of a log file before it is rotated, 0 - no limit */
+/* cardinality model selection (cardinality_models.c) */
+bool        model_selection = false;     /* choose the model of every feature subspace, off - LWPR only */
+double      model_error_tolerance = 0.1; /* error of log-cardinality a cheaper model may add */
+double      learn_error_threshold = 0;   /* log-error below which an object is not learned, 0 - learn all */
+double      learn_large_error = 2.0;     /* log-error above which an object is always learned */
+int         learn_sample_size = 0;       /* objects per subspace kept by reservoir sampling, 0 - learn all */
+int         learn_max_per_second = 0;    /* updates of a subspace per second, 0 - unlimited */
+/* Markov sketch of query templates (markov_sketch.c) */
+int         markov_states = 1024;        /* Markov states kept in shared memory, 0 - use aqo_markov_table only */
+int         markov_sketch_width = 1024;  /* columns of the count-min sketch */
+double      markov_half_life = 3600;     /* half-life of the template counts (s), 0 - no decay */
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /*
  * Currently we use it only to store query_text string which is initialized
@@ -66,6 +110,8 @@ char				*query_text = NULL;
 post_parse_analyze_hook_type				prev_post_parse_analyze_hook;
 planner_hook_type							prev_planner_hook;
 ExecutorStart_hook_type						prev_ExecutorStart_hook;
+ExecutorRun_hook_type						prev_ExecutorRun_hook;
+shmem_startup_hook_type						prev_shmem_startup_hook;
 ExecutorEnd_hook_type						prev_ExecutorEnd_hook;
 set_baserel_rows_estimate_hook_type			prev_set_baserel_rows_estimate_hook;
 get_parameterized_baserel_size_hook_type	prev_get_parameterized_baserel_size_hook;
@@ -73,9 +119,12 @@ set_joinrel_size_estimates_hook_type		prev_set_joinrel_size_estimates_hook;
 get_parameterized_joinrel_size_hook_type	prev_get_parameterized_joinrel_size_hook;
 copy_generic_path_info_hook_type			prev_copy_generic_path_info_hook;
 ExplainOnePlan_hook_type					prev_ExplainOnePlan_hook;
+ExplainOneNode_hook_type					prev_ExplainOneNode_hook;
 //path
 join_search_hook_type                       prev_join_search_hook;
 set_rel_pathlist_hook_type                  prev_set_rel_pathlist_hook;
+choose_final_path_hook_type                 prev_choose_final_path_hook;
+object_access_hook_type						prev_object_access_hook;
 /*****************************************************************************
  *
  *	CREATE/DROP EXTENSION FUNCTIONS
@@ -97,12 +146,364 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomIntVariable("aqo.default_query_template",
+							"Query template of the queries which are none of the known templates.",
+							"Zero plans such queries with the standard optimizer.",
+							&default_query_template,
+							0,
+							0,
+							num_query_pattern,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.planning_time_budget_ms",
+							"Time AQO may spend on planning of one query.",
+							"When the budget is exhausted, the rest of the query is planned with the standard estimators. Zero disables the limit.",
+							&planning_time_budget_ms,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("aqo.use_latency_model",
+							 "Chooses the final plan by the execution time predicted by the learned plan-latency model.",
+							 "Learning times every node of the executed plans to train the model.",
+							 &use_latency_model,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("aqo.latency_model_cost_window",
+							 "Paths whose cost exceeds the cost of the cheapest path by no more than this factor are ranked by the plan-latency model.",
+							 NULL,
+							 &latency_model_cost_window,
+							 1.5,
+							 1,
+							 1e10,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("aqo.latency_model_k",
+							"Maximum number of objects in the plan-latency model of one node type.",
+							"A stored model with more objects is not used and is learned again.",
+							&latency_model_K,
+							64,
+							2,
+							INT_MAX / 1024,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("aqo.track_planning_stats",
+							 "Collects time statistics of AQO planning and learning functions.",
+							 NULL,
+							 &track_planning_stats,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("aqo.planning_stats_max",
+							"Maximum number of function, template and feature subspace triples tracked by aqo_planning_stats.",
+							NULL,
+							&planning_stats_max,
+							5000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.markov_states",
+							"Number of Markov states of the query template sketch.",
+							"Zero reads the distribution of the next template from aqo_markov_table only.",
+							&markov_states,
+							1024,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.markov_sketch_width",
+							"Number of columns of the count-min sketch of query templates.",
+							NULL,
+							&markov_sketch_width,
+							1024,
+							16,
+							INT_MAX / 8,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("aqo.markov_half_life",
+							 "Half-life of the query template counts of the Markov sketch in seconds.",
+							 "Zero disables the decay.",
+							 &markov_half_life,
+							 3600,
+							 0,
+							 1e10,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("aqo.reoptimize_factor",
+							 "Re-plans a query when a checkpoint join returns more rows than this factor times its estimate.",
+							 "Zero disables mid-execution re-optimization.",
+							 &reoptimize_factor,
+							 0,
+							 0,
+							 1e10,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("aqo.reoptimize_explore_threshold",
+							 "Minimal explore value of a join to get a re-optimization checkpoint.",
+							 NULL,
+							 &reoptimize_explore_threshold,
+							 0.5,
+							 0,
+							 1,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("aqo.show_details",
+							 "Shows AQO prediction details of each plan node in EXPLAIN.",
+							 "The source, explore value and cost of the prediction, and the error of the estimate in EXPLAIN ANALYZE.",
+							 &aqo_show_details,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("aqo.vacuum_max_age",
+							"aqo_vacuum evicts models of feature subspaces not used for this time.",
+							"Zero disables the eviction by age.",
+							&vacuum_max_age,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.vacuum_max_size",
+							"aqo_vacuum evicts least recently used models until the models take no more than this size.",
+							"Zero disables the limit.",
+							&vacuum_max_size,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("aqo.vacuum_min_rf_data",
+							 "aqo_vacuum removes receptive fields which have seen less objects.",
+							 NULL,
+							 &vacuum_min_rf_data,
+							 1,
+							 0,
+							 1e10,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("aqo.vacuum_naptime",
+							"Period of running aqo_vacuum by the background worker.",
+							"The worker is started if AQO is in shared_preload_libraries and aqo.vacuum_database is set. Zero pauses it.",
+							&vacuum_naptime,
+							0,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("aqo.vacuum_database",
+							   "Database in which the background worker runs aqo_vacuum.",
+							   "The worker is started only if it is set. Empty disables the worker.",
+							   &vacuum_database,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomRealVariable("aqo.stale_threshold",
+							 "Relative change of the number of tuples of a relation which makes models of its feature subspaces stale.",
+							 "Stale models are trusted less until they are relearned. Zero disables the check.",
+							 &stale_threshold,
+							 0.2,
+							 0,
+							 1e10,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("aqo.sample_log_dir",
+							   "Directory where every object AQO learns on is logged.",
+							   "aqo_retrain() rebuilds the models from the log. Empty disables the log.",
+							   &sample_log_dir,
+							   "",
+							   PGC_SUSET,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("aqo.sample_log_max_size",
+							"Size of a sample log file after which the backend starts a new one.",
+							"A backend keeps its current and its previous log file and removes older ones. Zero disables the limit.",
+							&sample_log_max_size,
+							102400,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("aqo.model_selection",
+							 "Chooses the cardinality model of every feature subspace.",
+							 "Learning trains LWPR, kNN and constant models and plans with the fastest one whose error is close to the best.",
+							 &model_selection,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("aqo.model_error_tolerance",
+							 "Error of log-cardinality a faster model may have above the most accurate one.",
+							 NULL,
+							 &model_error_tolerance,
+							 0.1,
+							 0,
+							 1e10,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("aqo.learn_error_threshold",
+							 "Error of log-cardinality below which an executed node is not learned.",
+							 "Zero learns all nodes.",
+							 &learn_error_threshold,
+							 0,
+							 0,
+							 1e10,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("aqo.learn_large_error",
+							 "Error of log-cardinality above which an executed node is learned regardless of sampling and rate limits.",
+							 NULL,
+							 &learn_large_error,
+							 2.0,
+							 0,
+							 1e10,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("aqo.learn_sample_size",
+							"Size of the reservoir sample of the nodes a backend learns by a feature subspace.",
+							"Each backend samples the nodes it executes separately. The n-th node of the backend since the reservoir restarted is learned with probability size/n. The reservoir restarts after 16 times its size and after a node with aqo.learn_large_error. Zero learns all nodes.",
+							&learn_sample_size,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.learn_max_per_second",
+							"Maximum number of updates of a feature subspace per second by a backend.",
+							"The limit applies to each backend separately, so N backends may update a subspace up to N times as often. Zero means no limit.",
+							&learn_max_per_second,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("aqo.standby_spool_dir",
+							   "Directory where a hot standby writes the objects AQO would learn on.",
+							   "The files are learned on the primary by aqo_ingest_spool(). Empty disables the spool.",
+							   &standby_spool_dir,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
 	prev_planner_hook							= planner_hook;
 	planner_hook								= aqo_planner;
 	prev_post_parse_analyze_hook				= post_parse_analyze_hook;
 	post_parse_analyze_hook						= get_query_text;
 	prev_ExecutorStart_hook						= ExecutorStart_hook;
 	ExecutorStart_hook							= aqo_ExecutorStart;
+	prev_ExecutorRun_hook						= ExecutorRun_hook;
+	ExecutorRun_hook							= aqo_ExecutorRun;
 	prev_ExecutorEnd_hook						= ExecutorEnd_hook;
 	ExecutorEnd_hook							= learn_query_stat;
 	prev_set_baserel_rows_estimate_hook			= set_baserel_rows_estimate_hook;
@@ -117,6 +518,8 @@ _PG_init(void)
 	copy_generic_path_info_hook					= aqo_copy_generic_path_info;
 	prev_ExplainOnePlan_hook					= ExplainOnePlan_hook;
 	ExplainOnePlan_hook							= print_into_explain;
+	prev_ExplainOneNode_hook					= ExplainOneNode_hook;
+	ExplainOneNode_hook							= aqo_explain_node;
 	//join hook
 	prev_join_search_hook                       = join_search_hook;
 	join_search_hook                            = aqo_join_search;
@@ -125,10 +528,38 @@ _PG_init(void)
 	set_rel_pathlist_hook                       = aqo_set_rel_pathlist;
 	parampathinfo_postinit_hook					= ppi_hook;
 	estimated_cost_hook                         = aqo_estimated_cost_hook;
+	prev_choose_final_path_hook                 = choose_final_path_hook;
+	choose_final_path_hook                      = aqo_choose_final_path;
+	prev_object_access_hook						= object_access_hook;
+	object_access_hook							= aqo_object_access;
+	if (process_shared_preload_libraries_in_progress)
+	{
+		aqo_stat_request_shmem();
+		markov_sketch_request_shmem();
+		learn_queue_request_shmem();
+		prev_shmem_startup_hook					= shmem_startup_hook;
+		shmem_startup_hook						= aqo_shmem_startup;
+		aqo_vacuum_register_worker();
+	}
+	aqo_drift_register_callbacks();
 	init_deactivated_queries_storage();
 	AQOMemoryContext = AllocSetContextCreate(TopMemoryContext, "AQOMemoryContext", ALLOCSET_DEFAULT_SIZES);
 }
 
+/*
+ * Initializes the shared memory of AQO.
+ */
+static void
+aqo_shmem_startup(void)
+{
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	aqo_stat_shmem_startup();
+	markov_sketch_shmem_startup();
+	learn_queue_shmem_startup();
+}
+
 PG_FUNCTION_INFO_V1(invalidate_deactivated_queries_cache);
 
 /*
@@ -143,6 +574,28 @@ invalidate_deactivated_queries_cache(PG_FUNCTION_ARGS)
 	PG_RETURN_POINTER(NULL);
 }
 
+PG_FUNCTION_INFO_V1(aqo_planning_budget_stat);
+
+/*
+ * Returns how often the planning time budget was exhausted in this backend
+ * and how many estimates were made by the standard estimators because of it.
+ */
+Datum
+aqo_planning_budget_stat(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[2];
+	bool		nulls[2] = {false, false};
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	values[0] = Int64GetDatum(planning_budget_exceeded_count);
+	values[1] = Int64GetDatum(planning_budget_skipped_estimates);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
 /*我们需要的hash函数,在存储过程中需要调用*/
 PG_FUNCTION_INFO_V1(imdb_get_array_hash);
 Datum imdb_get_array_hash(PG_FUNCTION_ARGS)
@@ -118,6 +118,7 @@
 #include "postgres.h"
 
 #include "fmgr.h"
+#include "funcapi.h"
 
 #include "access/hash.h"
 #include "access/htup_details.h"
@@ -126,6 +127,7 @@
 #include "catalog/namespace.h"
 #include "catalog/index.h"
 #include "catalog/indexing.h"
+#include "catalog/objectaccess.h"
 #include "catalog/pg_type.h"
 #include "catalog/pg_operator.h"
 #include "commands/explain.h"
@@ -149,6 +151,10 @@
 #include "utils/tqual.h"
 #include "utils/fmgroids.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
 
 
 /* Check PostgreSQL version (9.6.0 contains important changes in planner) */
@@ -214,6 +220,12 @@ typedef struct QueryContextData
    Cost    best_est_cost;
    Cost    best_pred_cost;
    /**/
+	/* Planning time budget of the query was exhausted */
+	bool		planning_budget_exhausted;
+	/* The query may be re-planned at a checkpoint (0 if not) */
+	int			reoptimize_generation;
+	/* Objects are written to the standby spool instead of being learned */
+	bool		spool_samples;
 } QueryContextData;
 
 /* Parameters of autotuning */
@@ -241,10 +253,93 @@ extern int    num_pred_error_history; /*how much error of RF to save*/
 extern double avg_error_threshold; /*this threshold is used to determine whether using this rf to predict*/
 extern int    num_history_data_compute_probability_fs;
 extern int    num_query_pattern;
+extern int    default_query_template;
 extern int    num_two_costs_save;  
 extern double rate_to_compare_best_est_cost; /* the rate between estimate cost, modified by jim 2021.3.15*/
 extern double prune_rate_for_add_path_explore;
 extern int    cardinality_type;
+/* Planning time budget */
+extern int    planning_time_budget_ms;
+extern int64  planning_budget_exceeded_count;
+extern int64  planning_budget_skipped_estimates;
+/* Learned plan-latency model */
+extern bool   use_latency_model;
+extern double latency_model_cost_window;
+extern int    latency_model_K;
+/* Mid-execution re-optimization */
+extern double reoptimize_factor;
+extern double reoptimize_explore_threshold;
+/* Hot path statistics */
+extern bool   track_planning_stats;
+extern int    planning_stats_max;
+/* Prediction details in EXPLAIN */
+extern bool   aqo_show_details;
+/* Model vacuum */
+extern int    vacuum_max_age;
+extern int    vacuum_max_size;
+extern double vacuum_min_rf_data;
+extern int    vacuum_naptime;
+extern char  *vacuum_database;
+extern bool   aqo_vacuum_in_progress;
+
+/* Statistics drift */
+extern double stale_threshold;
+/* Spool of objects observed on a hot standby */
+extern char  *standby_spool_dir;
+/* Log of learned objects */
+extern char  *sample_log_dir;
+extern int    sample_log_max_size;
+/* Cardinality model selection */
+extern bool   model_selection;
+extern double model_error_tolerance;
+/* Learning policy */
+extern double learn_error_threshold;
+extern double learn_large_error;
+extern int    learn_sample_size;
+extern int    learn_max_per_second;
+/* Markov sketch of query templates */
+extern int    markov_states;
+extern int    markov_sketch_width;
+extern double markov_half_life;
+
+/* Functions measured by the hot path statistics */
+typedef enum
+{
+	AQO_STAT_GET_QUERY_HASH,
+	AQO_STAT_GET_FSS_FOR_OBJECT,
+	AQO_STAT_LOAD_FSS_RFWR,
+	AQO_STAT_LWPR_PREDICT_EXPLORE,
+	AQO_STAT_UPDATE_FSS_HISTORY,
+	AQO_STAT_LOAD_RF_DATAHOUSE,
+	AQO_STAT_LEARN_QUERY_STAT,
+	AQO_STAT_UPDATE_TWO_BEST_COSTS_RECORD,
+	AQO_STAT_LEARN_MERGE,
+	AQO_STAT_LEARN_MERGE_DROPPED,
+	AQO_STAT_LEARN_FSS_OBJECT,
+	AQO_STAT_LEARN_SKIP_ACCURATE,
+	AQO_STAT_LEARN_SKIP_SAMPLED,
+	AQO_STAT_LEARN_SKIP_RATE,
+	AQO_STAT_LEARN_DEFERRED,
+	AQO_STAT_LEARN_FOLDED,
+	AQO_STAT_NFUNCS
+}	AqoStatFunc;
+
+typedef struct AqoStatTimer
+{
+	bool		active;
+	instr_time	start;
+	int64		bytes;			/* aqo_detoasted_bytes at the start */
+} AqoStatTimer;
+
+extern int64 aqo_detoasted_bytes;
+
+/* An object to learn on, as kept by the deferred learning queue */
+typedef struct AqoLearnObject
+{
+	double	   *features;
+	double		target;
+} AqoLearnObject;
+
 /* Locally weighted projection regression parameters */
 //1. 定义 kernel 的类型
 typedef enum {
@@ -257,9 +352,14 @@ typedef struct{
    double est_uncof;
    double est_future;
    double rate; /*range [0,1] represent the combine rate between est_conf and est_future*/
+   int active_rfs; /* number of RFs whose weight exceeds the cutoff */
+   int knn_rfs; /* number of them predicted by kNN instead of PLS */
 }Explore_Value;
 
 // 2. 定义工作空间
+/* Largest number of inputs of models sharing a workspace */
+#define LWPR_MAX_SHARED_WS_NIN 64
+
 typedef struct LWPR_Workspace {
    int *derivOk;           /**< \brief Used within lwpr_aux_update_distance_metric for storing which PLS directions can be trusted */
    double *storage;        /**< \brief Pointer to the allocated memory */
@@ -286,6 +386,26 @@ typedef struct LWPR_Workspace {
    double *sum_ddRdxdx;    /**< \brief Intermediate results used within lwpr_aux_predict_one_gH */   
 } LWPR_Workspace;
 
+/* Largest number of inputs with specialised kernels */
+#define LWPR_MAX_SPECIALISED_NIN 8
+
+/*
+ * Inner loops of the model, specialised by the number of inputs
+ * (see lwpr_kernels).
+ */
+typedef struct LWPR_Kernels {
+   /* Computes xc = x - c and returns the kernel distance xc'*D*xc */
+   double (*rf_distance)(int nIn, int nInS, const double *D, const double *c,
+                         const double *x, double *xc);
+   void (*compute_projection)(int nIn, int nInS, int nReg, double *s, const double *x,
+                              const double *U, const double *P, LWPR_Workspace *WS);
+   void (*compute_projection_r)(int nIn, int nInS, int nReg, double *s, double *xres,
+                                const double *x, const double *U, const double *P);
+   void (*dist_derivatives)(int nIn, int nInS, double *dwdM, double *dJ2dM, double w, double dwdq,
+                            const double *RF_D, const double *RF_M, const double *dx,
+                            int diag_only, double penalty);
+} LWPR_Kernels;
+
 //3. 定义有效域
 typedef struct {
    int nReg;           /**< \brief The number of PLS regression directions */
@@ -332,6 +452,50 @@ typedef struct {
    double pred_error_num;
 } LWPR_ReceptiveField;
 
+/*
+ * The recent inputs of a model observed with one query template. A model has
+ * entries only for the templates it was observed with (see lwpr_history_add).
+ */
+typedef struct LWPR_TemplateHistory {
+   int query_hash;      /** the template, 1..num_query_pattern */
+   int num;             /** number of inputs, up to num_history_data_compute_probability_rf */
+   int next;            /** slot of the next input; the oldest one once the buffer is full */
+   double *xn;          /** ring buffer of num_history_data_compute_probability_rf inputs (nIn each) */
+} LWPR_TemplateHistory;
+
+/* Models with fewer RFs scan all of them instead of the index */
+#define LWPR_RF_INDEX_MIN_RFS 32
+/* RFs in a leaf of the index */
+#define LWPR_RF_INDEX_LEAF_RFS 8
+
+/*
+ * A node of the index over the RF centres of a model. It holds the RFs
+ * order[begin..end) and bounds them by the box of their centres and the
+ * smallest diagonal of their distance metrics (lo, hi and dmin of the index).
+ */
+typedef struct LWPR_RFIndexNode {
+   int begin;
+   int end;
+   int left;            /** children, -1 at a leaf */
+   int right;
+} LWPR_RFIndexNode;
+
+/*
+ * k-d tree over the RF centres (see lwpr_rf_candidates). It is built on
+ * first use and dropped when RFs or their distance metrics change.
+ */
+typedef struct LWPR_RFIndex {
+   int numRFS;          /** RFs the index was built over */
+   int numNodes;        /** 0 if the metrics are not diagonal: no index */
+   LWPR_RFIndexNode *nodes;
+   int *order;          /** RF numbers grouped by the nodes */
+   double *lo;          /** numNodes x nIn */
+   double *hi;
+   double *dmin;
+   int *stack;          /** scratch space of the searches */
+   int *result;
+} LWPR_RFIndex;
+
 //4. 定义 Lwpr 模型
 typedef struct LWPR_Model {
    //输入的维数
@@ -363,16 +527,21 @@ typedef struct LWPR_Model {
    //不需要存储
    LWPR_ReceptiveField **rf;
    LWPR_Workspace *ws;  /**< \brief Array of Workspaces, one for each thread (cf. LWPR_NUM_THREADS) */
+   bool   ws_shared;    /** ws is shared by the models with the same nIn (see lwpr_shared_ws) */
+   const LWPR_Kernels *kernels; /** inner loops for nIn inputs */
    double *storage;     /**< \brief Pointer to allocated memory. Do not touch. */
    double *xn;          /**< \brief Used to hold a normalised input vector (Nx1) */
    double yn;          /**< \brief Used to hold a normalised output vector (Nx1) */
    int    fss_hash;    /** save current hash value*/
+   double staleness;    /** 0..1, how much the statistics of the relations changed since the model was learned */
    //求探索价值
    Explore_Value *explore_values; /* save the explore value of current query */
    //保留最近的num_history_data_compute_probability_rf个查询
-   double **history_data_matrix;
-   //当前保存的历史数据个数
-   double *num_history_data;
+   LWPR_TemplateHistory *history;
+   int num_history;     /** entries of history */
+   int max_history;     /** allocated entries of history */
+   MemoryContext cxt;   /** context of the model, the history is allocated lazily */
+   LWPR_RFIndex *rf_index; /** NULL until the first search */
 } LWPR_Model;
 
 
@@ -407,6 +576,8 @@ extern MemoryContext AQOMemoryContext;
 extern post_parse_analyze_hook_type prev_post_parse_analyze_hook;
 extern planner_hook_type prev_planner_hook;
 extern ExecutorStart_hook_type prev_ExecutorStart_hook;
+extern ExecutorRun_hook_type prev_ExecutorRun_hook;
+extern shmem_startup_hook_type prev_shmem_startup_hook;
 extern ExecutorEnd_hook_type prev_ExecutorEnd_hook;
 extern		set_baserel_rows_estimate_hook_type
 			prev_set_baserel_rows_estimate_hook;
@@ -419,9 +590,12 @@ extern		get_parameterized_joinrel_size_hook_type
 extern		copy_generic_path_info_hook_type
 			prev_copy_generic_path_info_hook;
 extern ExplainOnePlan_hook_type prev_ExplainOnePlan_hook;
+extern ExplainOneNode_hook_type prev_ExplainOneNode_hook;
 //our explore method to generate plan
 extern join_search_hook_type prev_join_search_hook;
 extern set_rel_pathlist_hook_type prev_set_rel_pathlist_hook;
+extern choose_final_path_hook_type prev_choose_final_path_hook;
+extern object_access_hook_type prev_object_access_hook;
 
 /* Hash functions */
 int			get_query_hash(Query *parse, const char *query_text);
@@ -447,6 +621,8 @@ bool load_fss(int fss_hash, int ncols,
 bool load_rf_datahouse(int fss_hash, int rf_hash, double **matrix, double *targets, int *rows);
 bool load_best_two_costs(int query_pattern, double **matrix, double *est_cost, double *true_cost, int *rows, int nfeatures); //modified by jim 2021.3.11
 bool load_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model);
+bool load_latency_model(int node_type, int ncols,
+				   double **matrix, double *targets, int *rows);
 /*add by jim 2021.2.13*/
 bool load_query_distribution(int num_history_data, int query_history_hash, QueryContextData *query_context);
 bool load_query_distribution2(int query_hash, QueryContextData *query_context);
@@ -458,8 +634,15 @@ bool update_fss(int fss_hash, int nrows, int ncols,
 		   int old_nrows, List *changed_rows);
 bool update_rf_datahouse(int fss_hash, int rf_hash, int ncols, int nrows, double **matrix, double *targets);
 bool update_best_two_costs(int query_pattern, int ncols, int nrows, double **matrix, double *est_cost, double *true_cost); //modified by jim 2021.3.11
-bool update_fss_rfwr(int fss_hash, int nfeature, LWPR_Model *model);
+bool update_fss_rfwr(int fss_hash, int nfeature, LWPR_Model *model,
+				bool *busy);
+bool update_latency_model(int node_type, int nrows, int ncols,
+					 double **matrix, double *targets);
 bool update_fss_rfwr2(int fss_hash, int nfeature, LWPR_Model *model);
+bool update_fss_history(int fspace_hash, int fss_hash,
+				   Datum history_data_matrix, Datum num_history_data);
+bool		register_fss_relations(int fspace_hash, int fss_hash, List *relids);
+int			mark_stale_fss(Oid relid);
 QueryStat  *get_aqo_stat(int query_hash);
 void		update_aqo_stat(int query_hash, QueryStat * stat);
 void		init_deactivated_queries_storage(void);
@@ -479,6 +662,7 @@ void print_into_explain(PlannedStmt *plannedstmt, IntoClause *into,
 			   ExplainState *es, const char *queryString,
 			   ParamListInfo params, const instr_time *planduration);
 void		disable_aqo_for_query(void);
+bool		aqo_planning_budget_exhausted(void);
 
 /* Cardinality estimation hooks */
 void		aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel);
@@ -525,17 +709,151 @@ double predict_for_relation(List *restrict_clauses,
 double predict_for_relation_lwpr(List *restrict_clauses, 
                 List *selectivities,
                 List *relids);
+void		fss_model_cache_begin(void);
+void		fss_model_cache_end(bool write_back);
+void		queue_fss_history(int fss_hash, LWPR_Model *model);
+void		flush_fss_history(bool write);
 // 不仅输出基数值，也输出探索价值
 void predict_for_relation_lwpr_explore(List *restrict_clauses, List *selectivities, List *relids, Explore_Value *ev);
 //void calculate_current_best_estimate_cost(PlannerInfo *root, int query_pattern, int nfeatures, double *input_feature);
 void calculate_current_best_estimate_cost(QueryContextData	*query_context2, int query_pattern, int nfeatures, double *input_feature);
 void update_two_best_costs_record(int current_query_pattern, int nfeatures, double *current_query_features, Cost best_est_cost, double total_time);
+
+/* Cardinality models a feature subspace may be predicted with */
+typedef enum
+{
+	AQO_MODEL_LWPR = 0,
+	AQO_MODEL_KNN,
+	AQO_MODEL_CONST,
+	AQO_NUM_MODELS
+} AqoModelKind;
+
+/* Model selection statistics of a feature subspace (aqo_fss_models) */
+typedef struct FssModelStats
+{
+	AqoModelKind model;			/* the model planning uses */
+	int			nsamples;		/* objects learned with model selection */
+	double		mean_target;	/* the constant model */
+	/* decaying means of error of log-cardinality and of time (ms) of load
+	 * and prediction of each model, negative if not measured yet */
+	double		errors[AQO_NUM_MODELS];
+	double		latencies[AQO_NUM_MODELS];
+} FssModelStats;
+
+/*
+ * A cardinality model. Every model keeps its own storage; predictions are
+ * logarithms of cardinality, -9999 if the model cannot predict.
+ */
+typedef struct AqoCardinalityModel
+{
+	const char *name;
+	int			min_features;	/* subspaces with less features are not modelled */
+	/* loads the model of the subspace, NULL if there is none */
+	void	   *(*load) (int fss_hash, int nfeatures, FssModelStats *stats);
+	double		(*predict) (void *state, double *features);
+	void		(*predict_explore) (void *state, double *features,
+									Explore_Value *result);
+	/* queues what predictions changed in the model to be written back */
+	void		(*serialize) (void *state, int fss_hash);
+	/* learns the object and stores the model, true if it is created */
+	bool		(*update) (int fss_hash, int nfeatures, double *features,
+						   double target, FssModelStats *stats);
+	void		(*free) (void *state);
+} AqoCardinalityModel;
+
+extern const AqoCardinalityModel *const aqo_models[AQO_NUM_MODELS];
+
+const AqoCardinalityModel *choose_fss_model(int fss_hash, int nfeatures,
+				 FssModelStats *stats);
+bool		learn_fss_models(int fss_hash, int nfeatures, double *features,
+				 double target);
+bool		load_fss_model_stats(int fss_hash, FssModelStats *stats);
+bool		update_fss_model_stats(int fss_hash, FssModelStats *stats);
+
+/* Plan latency model */
+void		learn_plan_latency(PlanState *planstate);
+Path *aqo_choose_final_path(PlannerInfo *root, RelOptInfo *final_rel,
+					  Path *best_path, double tuple_fraction);
+
 /* Query execution statistics collecting hooks */
 void		aqo_ExecutorStart(QueryDesc *queryDesc, int eflags);
 void		aqo_copy_generic_path_info(PlannerInfo *root, Plan *dest, Path *src);
 void		learn_query_stat(QueryDesc *queryDesc);
+void		learn_checkpoint(PlanState *p, double rows);
+void		collect_node_objects(PlanState *p, List **clauselist,
+					 List **selectivities, List **relidslist);
+bool		ExtractFromQueryContext(QueryDesc *queryDesc);
+void		RemoveFromQueryContext(QueryDesc *queryDesc);
+void		atomic_fss_learn_step(int fss_hash, int matrix_cols,
+					  double **matrix, double *targets,
+					  double *features, double target);
+bool		atomic_fss_learn_step_rfwr(int fss_hash, int nfeatures,
+						   LWPR_Model *model, double *features,
+						   double target);
+void		learn_replayed_sample(int fspace_hash, int fss_hash,
+					  int query_template, List *relids, int nfeatures,
+					  double *features, double target);
+
+/* Mid-execution re-optimization */
+void		reoptimize_save_query(Query *parse, int cursorOptions);
+void		reoptimize_save_plan(PlannedStmt *stmt);
+bool		reoptimize_is_replanning(void);
+void		aqo_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+				uint64 count, bool execute_once);
+
+/* Hot path statistics */
+void		aqo_stat_request_shmem(void);
+void		aqo_stat_shmem_startup(void);
+void		aqo_stat_begin(AqoStatTimer *timer);
+void		aqo_stat_end(AqoStatTimer *timer, AqoStatFunc func, int fss_hash);
+void		aqo_stat_count(AqoStatFunc func, int fss_hash);
+
+/* Deferred learning of the objects of busy models */
+void		learn_queue_request_shmem(void);
+void		learn_queue_shmem_startup(void);
+bool		learn_queue_push(int fss_hash, int nfeatures, List *objects);
+List	   *learn_queue_pop(int fss_hash, int nfeatures);
+
+/* Markov sketch of query templates */
+void		markov_sketch_request_shmem(void);
+void		markov_sketch_shmem_startup(void);
+void		markov_sketch_observe(int state, int template);
+bool		markov_sketch_predict(int state, double *distribution);
+void		markov_sketch_forget_database(void);
+void		aqo_object_access(ObjectAccessType access, Oid classId,
+				  Oid objectId, int subId, void *arg);
+
+/* Prediction details in EXPLAIN */
+void		aqo_details_reset(void);
+void		aqo_details_record(int fss_hash, Explore_Value *ev,
+				   double load_time, double predict_time);
+void		aqo_details_set_default_rows(double rows);
+void		aqo_explain_node(ExplainState *es, PlanState *ps, Plan *plan);
+
+/* Statistics drift */
+void		aqo_drift_register_callbacks(void);
+void		aqo_drift_check(void);
+void		aqo_drift_recheck(Oid relid);
+bool		get_relation_reltuples(Oid relid, double *reltuples);
+
+/* Standby spool */
+bool		spool_is_enabled(void);
+void		spool_sample(int fspace_hash, int fss_hash, List *relids,
+			 int nfeatures, double *features, double target);
+
+/* Sample log and offline retraining */
+bool		sample_log_is_enabled(void);
+void		sample_log_write(int fspace_hash, int fss_hash, int query_template,
+				 List *relids, int nfeatures, double *features,
+				 double target, double predicted);
+void		aqo_retrain_main(Datum main_arg) pg_attribute_noreturn();
+
+/* Model vacuum */
+void		aqo_vacuum_register_worker(void);
+void		aqo_vacuum_main(Datum main_arg) pg_attribute_noreturn();
 
 /* Machine learning techniques */
+double	  **OkNNr_allocate_matrix(int rows, int cols);
 double OkNNr_predict(int matrix_rows, int matrix_cols,
 			  double **matrix, double *targets,
 			  double *nw_features, int aqo_k);
@@ -557,6 +875,10 @@ List *OkNNr_learn2(int matrix_rows, int matrix_cols,
 int lwpr_init_model(LWPR_Model *model, int nIn, int nOut);
 // 模型更新
 int lwpr_update(LWPR_Model *model, const double *x, const double y);
+// 写入lwpr_update产生的数据仓库对象
+void lwpr_reset_datahouse(void);
+int lwpr_store_datahouse(void);
+int lwpr_discard_datahouse(void);
 // 模型预测
 double lwpr_predict(LWPR_Model *model, const double *x, double cutoff);
 void lwpr_predict_explore(LWPR_Model *model, const double *x, double cutoff, Explore_Value *ev);
@@ -577,6 +899,7 @@ void lwpr_aux_compute_projection_r(int nIn, int nInS, int nReg,
 void lwpr_aux_dist_derivatives(int nIn, int nInS, double *dwdM, double *dJ2dM, double w, double dwdq, const double *RF_D, const double *RF_M, const double *dx, int diag_only, double penalty);
 int lwpr_aux_update_one_add_prune(LWPR_Model *model, LWPR_ThreadData *TD, const double *xn, double yn);
 LWPR_ReceptiveField *lwpr_aux_add_rf(LWPR_Model *model, int nReg);
+void lwpr_remove_rf(LWPR_Model *model, int i);
 int lwpr_aux_init_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, const LWPR_ReceptiveField *RFT, const double *xc, double y);
 // math method
 double lwpr_math_dot_product(const double *x, const double *y, int n);
@@ -592,6 +915,12 @@ double norm_ditribution_function(double a,double b,double x);
 //分配内存
 int lwpr_mem_alloc_model(LWPR_Model *model, int nIn, int storeRFS);
 int lwpr_mem_alloc_ws(LWPR_Workspace *ws, int nIn);
+LWPR_Workspace *lwpr_shared_ws(int nIn);
+const LWPR_Kernels *lwpr_kernels(int nIn);
+LWPR_TemplateHistory *lwpr_history_entry(LWPR_Model *model, int query_hash, bool create);
+void lwpr_history_add(LWPR_Model *model, int query_hash, const double *xn);
+int lwpr_rf_candidates(LWPR_Model *model, const double *xn, double cutoff, int **rfs);
+void lwpr_rf_index_reset(LWPR_Model *model);
 int lwpr_mem_realloc_rf(LWPR_ReceptiveField *RF, int nRegStore, int nInStore);
 int lwpr_mem_alloc_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, int nReg, int nRegStore);
 //explore value
@@ -631,5 +960,6 @@ void deform_matrix(Datum datum, double **matrix);
 ArrayType *form_vector(double *vector, int nrows);
 //static ArrayType *strlist_to_textarray_two(List *list);
 void deform_vector(Datum datum, double *vector, int *nelems);
+void form_history(LWPR_Model *model, Datum *matrix, Datum *nums);
 
 #endif
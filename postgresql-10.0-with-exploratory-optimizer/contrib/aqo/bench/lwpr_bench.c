@@ -0,0 +1,348 @@
+#include "aqo.h"
+#include "lwpr_bench.h"
+
+#include <time.h>
+#include <unistd.h>
+
+/*****************************************************************************
+ *
+ *	LWPR AND kNN MICRO-BENCHMARK
+ *
+ * Builds an LWPR model of a synthetic feature subspace and measures the
+ * prediction and learning functions of AQO outside of a server:
+ *
+ *	lwpr_predict, lwpr_predict_explore, lwpr_update,
+ *	OkNNr_predict, OkNNr_learn2.
+ *
+ * The features are drawn around a given number of centres, so the model gets
+ * about one receptive field per centre. For every function the benchmark
+ * reports the time per call, palloc calls and bytes per call and, as a proxy
+ * of cache misses, the number of receptive fields touched per call and the
+ * size of the model. The accuracy of the trained model is reported as the
+ * mean absolute error of lwpr_predict on the test objects; with -f the
+ * matrices which aqo_set_storage_precision('float4') stores as real[] are
+ * rounded to float4 after every update, as a store and load cycle would, and
+ * so are the features kept in the RF data houses.
+ *
+ * Usage: lwpr_bench [-n nIn] [-r RFs] [-H history] [-q patterns]
+ *					 [-k kNN rows] [-i iterations] [-s seed] [-f]
+ *
+ *****************************************************************************/
+
+typedef struct BenchResult
+{
+	const char *name;
+	int			iterations;
+	double		elapsed_ns;
+	int64		nallocs;
+	int64		alloc_bytes;
+	double		touched_rfs;	/* -1 if unknown */
+} BenchResult;
+
+static uint64 rng_state = 88172645463325252ULL;
+
+static double random_uniform(void);
+static double random_normal(void);
+static double now_ns(void);
+static double target_function(const double *x, int nIn);
+static void bench_begin(BenchResult *result, const char *name,
+			int iterations, double *start);
+static void bench_end(BenchResult *result, double start,
+		  int64 nallocs, int64 alloc_bytes);
+static void print_result(BenchResult *result);
+static void round_to_float4(LWPR_Model *model);
+static void usage(const char *progname);
+
+
+static double
+random_uniform(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double
+random_normal(void)
+{
+	double		u = random_uniform();
+	double		v = random_uniform();
+
+	return sqrt(-2.0 * log(Max(u, 1e-300))) * cos(2.0 * M_PI * v);
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * The logarithm of the cardinality of the synthetic subspace: the features
+ * are logarithms of selectivities. A sum of sines keeps the target
+ * non-linear, so the receptive fields have different local slopes, and
+ * positive for every feature, so it needs no clamping.
+ */
+static double
+target_function(const double *x, int nIn)
+{
+	double		y = 3.0 * nIn;
+	int			i;
+
+	for (i = 0; i < nIn; ++i)
+		y += 2.0 * sin(0.7 * x[i] + i);
+	return y;
+}
+
+static void
+bench_begin(BenchResult *result, const char *name, int iterations,
+			double *start)
+{
+	result->name = name;
+	result->iterations = iterations;
+	result->touched_rfs = -1;
+	result->nallocs = shim_nallocs;
+	result->alloc_bytes = shim_alloc_bytes;
+	*start = now_ns();
+}
+
+static void
+bench_end(BenchResult *result, double start, int64 nallocs, int64 alloc_bytes)
+{
+	result->elapsed_ns = now_ns() - start;
+	result->nallocs = nallocs - result->nallocs;
+	result->alloc_bytes = alloc_bytes - result->alloc_bytes;
+}
+
+static void
+print_result(BenchResult *result)
+{
+	printf("%-22s %12.1f %12.2f %12.1f",
+		   result->name,
+		   result->elapsed_ns / result->iterations,
+		   (double) result->nallocs / result->iterations,
+		   (double) result->alloc_bytes / result->iterations);
+	if (result->touched_rfs >= 0)
+		printf(" %10.2f\n", result->touched_rfs / result->iterations);
+	else
+		printf(" %10s\n", "-");
+}
+
+/*
+ * Rounds D, U, P and the history of the model to float4.
+ */
+static void
+round_to_float4(LWPR_Model *model)
+{
+	int			nIn = model->nIn;
+	int			nInS = model->nInStore;
+	int			i,
+				j;
+
+	for (i = 0; i < model->numRFS; ++i)
+	{
+		LWPR_ReceptiveField *RF = model->rf[i];
+
+		for (j = 0; j < nInS * nIn; ++j)
+			RF->D[j] = (float4) RF->D[j];
+		for (j = 0; j < nInS * RF->nReg; ++j)
+		{
+			RF->U[j] = (float4) RF->U[j];
+			RF->P[j] = (float4) RF->P[j];
+		}
+	}
+	for (i = 0; i < model->num_history; ++i)
+		for (j = 0; j < nIn * model->history[i].num; ++j)
+			model->history[i].xn[j] = (float4) model->history[i].xn[j];
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr,
+			"Usage: %s [-n nIn] [-r RFs] [-H history] [-q patterns] "
+			"[-k kNN rows] [-i iterations] [-s seed] [-f]\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int			nIn = 4;
+	int			nrfs = 16;
+	int			knn_rows = 30;
+	int			iterations = 10000;
+	double		cutoff = 0.001;
+	bool		float4_storage = false;
+	double		mae = 0;
+	double	   *centres;
+	double	   *points;
+	double	   *targets;
+	double	  **matrix;
+	double	   *knn_targets;
+	double	   *knn_true;
+	LWPR_Model	model;
+	Explore_Value ev;
+	BenchResult result;
+	double		start;
+	int64		model_bytes;
+	int			c;
+	int			i,
+				j;
+
+	while ((c = getopt(argc, argv, "n:r:H:q:k:i:s:f")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				nIn = atoi(optarg);
+				break;
+			case 'r':
+				nrfs = atoi(optarg);
+				break;
+			case 'H':
+				num_history_data_compute_probability_rf = atoi(optarg);
+				break;
+			case 'q':
+				num_query_pattern = atoi(optarg);
+				break;
+			case 'k':
+				knn_rows = atoi(optarg);
+				break;
+			case 'i':
+				iterations = atoi(optarg);
+				break;
+			case 's':
+				rng_state = strtoull(optarg, NULL, 10) | 1;
+				break;
+			case 'f':
+				float4_storage = true;
+				shim_float4_datahouse = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (nIn < 1 || nrfs < 1 || knn_rows < 1 || iterations < 1 ||
+		num_history_data_compute_probability_rf < 1 || num_query_pattern < 1)
+		usage(argv[0]);
+
+	/* The benchmarked query belongs to the first of equally likely patterns */
+	query_context.current_query_hash = 1;
+	query_context.query_distribution = palloc(sizeof(double) * num_query_pattern);
+	for (i = 0; i < num_query_pattern; ++i)
+		query_context.query_distribution[i] = 1.0 / num_query_pattern;
+
+	/* Centres of the receptive fields, far enough from each other */
+	centres = palloc(sizeof(double) * nrfs * nIn);
+	for (i = 0; i < nrfs * nIn; ++i)
+		centres[i] = -10.0 * random_uniform();
+
+	/* Test objects around the centres, generated before measurements */
+	points = palloc(sizeof(double) * iterations * nIn);
+	targets = palloc(sizeof(double) * iterations);
+	for (i = 0; i < iterations; ++i)
+	{
+		double	   *centre = centres + (i % nrfs) * nIn;
+
+		for (j = 0; j < nIn; ++j)
+			points[i * nIn + j] = centre[j] + 0.05 * random_normal();
+		targets[i] = target_function(points + i * nIn, nIn);
+	}
+
+	/*
+	 * Train the model until every centre has a trustworthy receptive field,
+	 * i.e. more than 2 * nIn objects.
+	 */
+	lwpr_init_model(&model, nIn, 1);
+	model.fss_hash = 1;
+	for (i = 0; i < nrfs * (4 * nIn + 4); ++i)
+	{
+		double	   *x = points + (i % iterations) * nIn;
+
+		lwpr_update(&model, x, targets[i % iterations]);
+		lwpr_store_datahouse();
+		if (float4_storage)
+			round_to_float4(&model);
+	}
+	/* fill the history of the subspace which est_future depends on */
+	for (i = 0; i < num_history_data_compute_probability_rf; ++i)
+		lwpr_predict_explore(&model, points + (i % iterations) * nIn,
+							 cutoff, &ev);
+	model_bytes = shim_live_bytes;
+
+	for (i = 0; i < iterations; ++i)
+		mae += fabs(lwpr_predict(&model, points + i * nIn, cutoff) - targets[i]);
+	mae /= iterations;
+
+	/* kNN data: knn_rows objects and the costs OkNNr_learn2 is fed with */
+	matrix = OkNNr_allocate_matrix(knn_rows, nIn);
+	knn_targets = palloc(sizeof(double) * knn_rows);
+	knn_true = palloc(sizeof(double) * knn_rows);
+	for (i = 0; i < knn_rows; ++i)
+	{
+		memcpy(matrix[i], points + (i % iterations) * nIn,
+			   sizeof(double) * nIn);
+		knn_targets[i] = targets[i % iterations];
+		knn_true[i] = targets[i % iterations];
+	}
+
+	printf("nIn=%d RFs=%d (requested %d) history=%d patterns=%d "
+		   "kNN rows=%d iterations=%d\n",
+		   nIn, model.numRFS, nrfs, num_history_data_compute_probability_rf,
+		   num_query_pattern, knn_rows, iterations);
+	printf("model size=%.1f kB, RF data house entries=%d\n",
+		   model_bytes / 1024.0, shim_datahouse_size());
+	printf("prediction MAE=%.6f (%s storage)\n\n",
+		   mae, float4_storage ? "float4" : "float8");
+	printf("%-22s %12s %12s %12s %10s\n",
+		   "function", "ns/op", "allocs/op", "bytes/op", "RFs/op");
+
+	bench_begin(&result, "lwpr_predict", iterations, &start);
+	for (i = 0; i < iterations; ++i)
+		lwpr_predict(&model, points + i * nIn, cutoff);
+	bench_end(&result, start, shim_nallocs, shim_alloc_bytes);
+	print_result(&result);
+
+	bench_begin(&result, "lwpr_predict_explore", iterations, &start);
+	result.touched_rfs = 0;
+	for (i = 0; i < iterations; ++i)
+	{
+		lwpr_predict_explore(&model, points + i * nIn, cutoff, &ev);
+		result.touched_rfs += ev.active_rfs;
+	}
+	bench_end(&result, start, shim_nallocs, shim_alloc_bytes);
+	print_result(&result);
+
+	bench_begin(&result, "OkNNr_predict", iterations, &start);
+	for (i = 0; i < iterations; ++i)
+		OkNNr_predict(knn_rows, nIn, matrix, knn_targets,
+					  points + i * nIn, aqo_k);
+	bench_end(&result, start, shim_nallocs, shim_alloc_bytes);
+	print_result(&result);
+
+	bench_begin(&result, "OkNNr_learn2", iterations, &start);
+	for (i = 0; i < iterations; ++i)
+		list_free(OkNNr_learn2(knn_rows, nIn, matrix, knn_targets, knn_true,
+							   points + i * nIn, targets[i], targets[i],
+							   knn_rows));
+	bench_end(&result, start, shim_nallocs, shim_alloc_bytes);
+	print_result(&result);
+
+	/* Learning changes the model, so it goes last */
+	bench_begin(&result, "lwpr_update", iterations, &start);
+	for (i = 0; i < iterations; ++i)
+	{
+		lwpr_update(&model, points + i * nIn, targets[i]);
+		lwpr_store_datahouse();
+	}
+	bench_end(&result, start, shim_nallocs, shim_alloc_bytes);
+	print_result(&result);
+
+	lwpr_free_model(&model);
+	return 0;
+}
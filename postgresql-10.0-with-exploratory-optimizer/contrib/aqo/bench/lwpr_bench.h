@@ -0,0 +1,14 @@
+#ifndef LWPR_BENCH_H
+#define LWPR_BENCH_H
+
+/*
+ * Counters of the palloc shim (pg_shim.c) used by the micro-benchmark.
+ */
+extern int64 shim_nallocs;			/* number of palloc/palloc0/repalloc calls */
+extern int64 shim_alloc_bytes;		/* bytes requested by them */
+extern int64 shim_live_bytes;		/* bytes allocated and not freed yet */
+extern bool shim_float4_datahouse;	/* round the stored RF data houses to float4 */
+
+extern int	shim_datahouse_size(void);
+
+#endif							/* LWPR_BENCH_H */
@@ -0,0 +1,277 @@
+#include "aqo.h"
+#include "lwpr_bench.h"
+
+/*****************************************************************************
+ *
+ *	BACKEND SHIM FOR THE MICRO-BENCHMARK
+ *
+ * Minimal replacements of the backend functions and AQO globals used by
+ * machine_learning_lwpr.c and machine_learning.c, so that they can be built
+ * and measured outside of a server. palloc and friends are served by malloc
+ * and count allocations; the RF data house is kept in process memory, so its
+ * access cost is not included in the measurements.
+ *
+ *****************************************************************************/
+
+/* Same defaults as in aqo.c */
+double		object_selection_object_threshold = 0.1;
+double		learning_rate = 1e-1;
+int			aqo_k = 2;
+int			num_history_data_compute_probability_rf = 10;
+double		confidence_bound_percentile = 0.01;
+double		rate_between_explore_value = 0.6;
+double		outer_future_value = 1;
+double		use_aqo_threshold = 1e-5;
+int			num_pred_error_history = 2;
+double		avg_error_threshold = 1;
+int			num_query_pattern = 7;
+QueryContextData query_context;
+/* Contexts are not distinguished: all chunks come from malloc */
+MemoryContext CurrentMemoryContext = NULL;
+MemoryContext AQOMemoryContext = NULL;
+
+int64		shim_nallocs = 0;
+int64		shim_alloc_bytes = 0;
+int64		shim_live_bytes = 0;
+bool		shim_float4_datahouse = false;
+
+/* Every chunk is preceded by its size */
+#define SHIM_HEADER_SIZE MAXALIGN(sizeof(Size))
+
+typedef struct ShimDatahouseEntry
+{
+	int			fss_hash;
+	int			rf_hash;
+	int			ncols;
+	int			nrows;
+	double	   *matrix;			/* nrows * ncols */
+	double	   *targets;
+} ShimDatahouseEntry;
+
+static ShimDatahouseEntry *datahouse = NULL;
+static int	datahouse_size = 0;
+static int	datahouse_allocated = 0;
+
+static ShimDatahouseEntry *datahouse_find(int fss_hash, int rf_hash);
+
+
+static void *
+shim_alloc(Size size, bool zero)
+{
+	char	   *chunk;
+
+	chunk = zero ? calloc(1, SHIM_HEADER_SIZE + size) :
+		malloc(SHIM_HEADER_SIZE + size);
+	if (chunk == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	*((Size *) chunk) = size;
+
+	shim_nallocs++;
+	shim_alloc_bytes += size;
+	shim_live_bytes += size;
+
+	return chunk + SHIM_HEADER_SIZE;
+}
+
+void *
+palloc(Size size)
+{
+	return shim_alloc(size, false);
+}
+
+void *
+palloc0(Size size)
+{
+	return shim_alloc(size, true);
+}
+
+void
+pfree(void *pointer)
+{
+	char	   *chunk = ((char *) pointer) - SHIM_HEADER_SIZE;
+
+	shim_live_bytes -= *((Size *) chunk);
+	free(chunk);
+}
+
+void *
+repalloc(void *pointer, Size size)
+{
+	char	   *chunk = ((char *) pointer) - SHIM_HEADER_SIZE;
+
+	shim_live_bytes -= *((Size *) chunk);
+	chunk = realloc(chunk, SHIM_HEADER_SIZE + size);
+	if (chunk == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	*((Size *) chunk) = size;
+
+	shim_nallocs++;
+	shim_alloc_bytes += size;
+	shim_live_bytes += size;
+
+	return chunk + SHIM_HEADER_SIZE;
+}
+
+List *
+lappend_int(List *list, int datum)
+{
+	ListCell   *cell = palloc(sizeof(ListCell));
+
+	cell->data.int_value = datum;
+	cell->next = NULL;
+
+	if (list == NIL)
+	{
+		list = palloc(sizeof(List));
+		list->type = T_IntList;
+		list->length = 0;
+		list->head = cell;
+	}
+	else
+		list->tail->next = cell;
+
+	list->tail = cell;
+	list->length++;
+	return list;
+}
+
+void
+list_free(List *list)
+{
+	ListCell   *cell;
+
+	if (list == NIL)
+		return;
+
+	cell = list->head;
+	while (cell != NULL)
+	{
+		ListCell   *next = cell->next;
+
+		pfree(cell);
+		cell = next;
+	}
+	pfree(list);
+}
+
+int
+int_cmp(const void *a, const void *b)
+{
+	if (*(int *) a < *(int *) b)
+		return -1;
+	else if (*(int *) a > *(int *) b)
+		return 1;
+	else
+		return 0;
+}
+
+/* port.h maps qsort to pg_qsort; the shim serves both from the C library */
+#undef qsort
+
+void
+pg_qsort(void *base, size_t nel, size_t elsize,
+		 int (*cmp) (const void *, const void *))
+{
+	qsort(base, nel, elsize, cmp);
+}
+
+void
+qsort_arg(void *base, size_t nel, size_t elsize, qsort_arg_comparator cmp,
+		  void *arg)
+{
+	qsort_r(base, nel, elsize, cmp, arg);
+}
+
+int
+get_int_array_hash2(double *arr, int len)
+{
+	const unsigned char *bytes = (const unsigned char *) arr;
+	uint32		hash = 2166136261u;
+	int			i;
+
+	for (i = 0; i < len * (int) sizeof(*arr); ++i)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	return (int) hash;
+}
+
+static ShimDatahouseEntry *
+datahouse_find(int fss_hash, int rf_hash)
+{
+	int			i;
+
+	for (i = 0; i < datahouse_size; ++i)
+		if (datahouse[i].fss_hash == fss_hash &&
+			datahouse[i].rf_hash == rf_hash)
+			return &datahouse[i];
+	return NULL;
+}
+
+bool
+load_rf_datahouse(int fss_hash, int rf_hash, double **matrix, double *targets,
+				  int *rows)
+{
+	ShimDatahouseEntry *entry = datahouse_find(fss_hash, rf_hash);
+	int			i;
+
+	if (entry == NULL)
+		return false;
+
+	for (i = 0; i < entry->nrows; ++i)
+	{
+		memcpy(matrix[i], entry->matrix + i * entry->ncols,
+			   sizeof(double) * entry->ncols);
+		targets[i] = entry->targets[i];
+	}
+	*rows = entry->nrows;
+	return true;
+}
+
+bool
+update_rf_datahouse(int fss_hash, int rf_hash, int ncols, int nrows,
+					double **matrix, double *targets)
+{
+	ShimDatahouseEntry *entry = datahouse_find(fss_hash, rf_hash);
+	int			i;
+
+	if (entry == NULL)
+	{
+		if (datahouse_size == datahouse_allocated)
+		{
+			datahouse_allocated = Max(16, datahouse_allocated * 2);
+			datahouse = realloc(datahouse,
+								sizeof(*datahouse) * datahouse_allocated);
+		}
+		entry = &datahouse[datahouse_size++];
+		entry->fss_hash = fss_hash;
+		entry->rf_hash = rf_hash;
+		entry->matrix = NULL;
+		entry->targets = NULL;
+	}
+
+	entry->ncols = ncols;
+	entry->nrows = nrows;
+	entry->matrix = realloc(entry->matrix, sizeof(double) * ncols * nrows);
+	entry->targets = realloc(entry->targets, sizeof(double) * nrows);
+	for (i = 0; i < nrows; ++i)
+	{
+		memcpy(entry->matrix + i * ncols, matrix[i], sizeof(double) * ncols);
+		entry->targets[i] = targets[i];
+	}
+	/* The features of aqo_data_house_lwpr may be stored as real[] */
+	if (shim_float4_datahouse)
+		for (i = 0; i < ncols * nrows; ++i)
+			entry->matrix[i] = (float4) entry->matrix[i];
+	return true;
+}
+
+int
+shim_datahouse_size(void)
+{
+	return datahouse_size;
+}
@@ -7,8 +7,230 @@
  * This is the module in which cardinality estimation problem obtained from
  * cardinality_hooks turns into machine learning problem.
  *
+ * During the planning of one query the same feature subspace is estimated
+ * many times: once for each joinrel of a DP level which has the same set of
+ * clauses, and again for parameterized paths. Models are therefore loaded
+ * once per feature subspace into the model cache and predicted in memory.
+ * The model of a subspace is LWPR unless aqo.model_selection chose another
+ * one (see cardinality_models.c).
+ *
+ * Predictions also update the history of queries of LWPR models. The planner
+ * does not write it: the changed histories are kept in AQOMemoryContext and
+ * written by the leader backend at the end of the query execution, which
+ * allows to use AQO for planning in parallel mode.
+ *
  *****************************************************************************/
 
+/* Entry of the per-planning model cache */
+typedef struct FssModelCacheKey
+{
+	int			fspace_hash;
+	int			fss_hash;
+} FssModelCacheKey;
+
+typedef struct FssModelCacheEntry
+{
+	FssModelCacheKey key;
+	int			nfeatures;
+	const AqoCardinalityModel *routine;
+	void	   *state;		/* the loaded model, NULL if there is none */
+	bool		dirty;		/* the model must be written back */
+} FssModelCacheEntry;
+
+/* History of queries of a model waiting to be written */
+typedef struct PendingFssHistory
+{
+	int			fspace_hash;
+	int			fss_hash;
+	Datum		history_data_matrix;	/* formed by form_history */
+	Datum		num_history_data;
+} PendingFssHistory;
+
+static MemoryContext fss_model_cache_cxt = NULL;
+static HTAB *fss_model_cache = NULL;
+static int	fss_model_cache_depth = 0;
+static List *pending_fss_history = NIL;
+
+static FssModelCacheEntry *fss_model_cache_lookup(int fss_hash, int nfeatures);
+static void *load_fss_model(int fss_hash, int nfeatures,
+			   const AqoCardinalityModel **routine);
+static void free_pending_fss_history(PendingFssHistory *pending);
+
+
+/*
+ * Starts using the model cache for the planning of a query.
+ * Nested planner calls share the cache of the outermost one.
+ */
+void
+fss_model_cache_begin(void)
+{
+	HASHCTL		hash_ctl;
+
+	if (fss_model_cache_depth++ > 0)
+		return;
+
+	if (fss_model_cache_cxt == NULL)
+		fss_model_cache_cxt = AllocSetContextCreate(AQOMemoryContext,
+													"AQO model cache",
+													ALLOCSET_DEFAULT_SIZES);
+
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(FssModelCacheKey);
+	hash_ctl.entrysize = sizeof(FssModelCacheEntry);
+	hash_ctl.hcxt = fss_model_cache_cxt;
+	fss_model_cache = hash_create("AQO model cache", 64, &hash_ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * Finishes the planning of a query. At the outermost level the histories of
+ * changed models are queued for writing (unless the planning failed or the
+ * query must not change AQO data) and the cache is released.
+ */
+void
+fss_model_cache_end(bool write_back)
+{
+	HASH_SEQ_STATUS hash_seq;
+	FssModelCacheEntry *entry;
+
+	if (fss_model_cache_depth == 0 || --fss_model_cache_depth > 0)
+		return;
+
+	if (write_back && query_context.learn_aqo)
+	{
+		hash_seq_init(&hash_seq, fss_model_cache);
+		while ((entry = (FssModelCacheEntry *) hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (entry->dirty)
+				entry->routine->serialize(entry->state, entry->key.fss_hash);
+		}
+	}
+
+	fss_model_cache = NULL;
+	MemoryContextReset(fss_model_cache_cxt);
+}
+
+static void
+free_pending_fss_history(PendingFssHistory *pending)
+{
+	pfree(DatumGetPointer(pending->history_data_matrix));
+	pfree(DatumGetPointer(pending->num_history_data));
+	pfree(pending);
+}
+
+/*
+ * Saves a copy of the history of queries of the model into AQOMemoryContext.
+ * A newer history of the same feature subspace replaces the older one.
+ */
+void
+queue_fss_history(int fss_hash, LWPR_Model *model)
+{
+	PendingFssHistory *pending;
+	MemoryContext oldCxt;
+	ListCell   *l;
+
+	oldCxt = MemoryContextSwitchTo(AQOMemoryContext);
+
+	foreach(l, pending_fss_history)
+	{
+		pending = (PendingFssHistory *) lfirst(l);
+		if (pending->fspace_hash == query_context.fspace_hash &&
+			pending->fss_hash == fss_hash)
+		{
+			pending_fss_history = list_delete_ptr(pending_fss_history, pending);
+			free_pending_fss_history(pending);
+			break;
+		}
+	}
+
+	pending = palloc(sizeof(*pending));
+	pending->fspace_hash = query_context.fspace_hash;
+	pending->fss_hash = fss_hash;
+	form_history(model, &pending->history_data_matrix,
+				 &pending->num_history_data);
+	pending_fss_history = lappend(pending_fss_history, pending);
+
+	MemoryContextSwitchTo(oldCxt);
+}
+
+/*
+ * Writes the queued histories of queries into aqo_data_lwpr, or just drops
+ * them if 'write' is false. Must not be called in parallel mode.
+ */
+void
+flush_fss_history(bool write)
+{
+	ListCell   *l;
+
+	foreach(l, pending_fss_history)
+	{
+		PendingFssHistory *pending = (PendingFssHistory *) lfirst(l);
+
+		if (write)
+			update_fss_history(pending->fspace_hash, pending->fss_hash,
+							   pending->history_data_matrix,
+							   pending->num_history_data);
+		free_pending_fss_history(pending);
+	}
+	list_free(pending_fss_history);
+	pending_fss_history = NIL;
+}
+
+/*
+ * Returns the cache entry of the given feature subspace, loading the model
+ * on first access. Returns NULL if the cache is not in use or the subspace
+ * is cached with another number of features.
+ */
+static FssModelCacheEntry *
+fss_model_cache_lookup(int fss_hash, int nfeatures)
+{
+	FssModelCacheKey key;
+	FssModelCacheEntry *entry;
+	MemoryContext oldCxt;
+	bool		found;
+
+	if (fss_model_cache == NULL)
+		return NULL;
+
+	key.fspace_hash = query_context.fspace_hash;
+	key.fss_hash = fss_hash;
+	entry = (FssModelCacheEntry *) hash_search(fss_model_cache, &key,
+											   HASH_ENTER, &found);
+	if (found)
+		return (entry->nfeatures == nfeatures) ? entry : NULL;
+
+	oldCxt = MemoryContextSwitchTo(fss_model_cache_cxt);
+	entry->nfeatures = nfeatures;
+	entry->dirty = false;
+	entry->state = load_fss_model(fss_hash, nfeatures, &entry->routine);
+	MemoryContextSwitchTo(oldCxt);
+
+	return entry;
+}
+
+/*
+ * Loads the model planning uses for the feature subspace. If the chosen model
+ * is missing, LWPR is tried. Returns NULL if there is no model.
+ */
+static void *
+load_fss_model(int fss_hash, int nfeatures,
+			   const AqoCardinalityModel **routine)
+{
+	FssModelStats stats;
+	void	   *state = NULL;
+
+	*routine = choose_fss_model(fss_hash, nfeatures, &stats);
+	if (nfeatures >= (*routine)->min_features)
+		state = (*routine)->load(fss_hash, nfeatures, &stats);
+	if (state == NULL && *routine != aqo_models[AQO_MODEL_LWPR] &&
+		nfeatures >= aqo_models[AQO_MODEL_LWPR]->min_features)
+	{
+		*routine = aqo_models[AQO_MODEL_LWPR];
+		state = (*routine)->load(fss_hash, nfeatures, &stats);
+	}
+	return state;
+}
+
 /*
  * General method for prediction the cardinality of given relation using online knn
  */
@@ -22,14 +244,11 @@ predict_for_relation(List *restrict_clauses, List *selectivities, List *relids)
 	double	   *features;
 	double		result;
 	int			rows;
-	int			i;
 
 	get_fss_for_object(restrict_clauses, selectivities, relids,
 					   &nfeatures, &fss_hash, &features);
 
-	matrix = palloc(sizeof(*matrix) * aqo_K);
-	for (i = 0; i < aqo_K; ++i)
-		matrix[i] = palloc0(sizeof(**matrix) * nfeatures);
+	matrix = OkNNr_allocate_matrix(aqo_K, nfeatures);
 	target = palloc0(sizeof(*target) * aqo_K);
 
 	if (load_fss(fss_hash, nfeatures, matrix, target, &rows))
@@ -38,8 +257,6 @@ predict_for_relation(List *restrict_clauses, List *selectivities, List *relids)
 		result = -1;
 
 	pfree(features);
-	for (i = 0; i < aqo_K; ++i)
-		pfree(matrix[i]);
 	pfree(matrix);
 	pfree(target);
 	list_free_deep(selectivities);
@@ -91,7 +308,9 @@ predict_for_relation_lwpr(List *restrict_clauses, List *selectivities, List *rel
 		return exp(result);
 }
 /**
- * General method for prediction the cardinality and PEV of given relation using LWPR
+ * General method for prediction the cardinality and PEV of given relation
+ * using the model of its feature subspace (LWPR unless model selection chose
+ * another one)
  */
 void predict_for_relation_lwpr_explore(List *restrict_clauses, List *selectivities, List *relids,  Explore_Value *result)
 {
@@ -99,18 +318,41 @@ void predict_for_relation_lwpr_explore(List *restrict_clauses, List *selectiviti
 	int			nfeatures;
 	int			fss_hash;
 	double	   *features;
-    double      cutoff = 0.001;
-	//获取当前的LWPR模型
-	LWPR_Model  model;
+	const AqoCardinalityModel *routine;
+	void	   *state;
+	FssModelCacheEntry *entry;
+	instr_time	start_time;
+	instr_time	load_time;
+	instr_time	predict_time;
+
+	/* the rest of the query is estimated by default estimators */
+	if (aqo_planning_budget_exhausted())
+	{
+		planning_budget_skipped_estimates++;
+		result->rows = -1;
+		list_free_deep(selectivities);
+		list_free(restrict_clauses);
+		list_free(relids);
+		return;
+	}
 	//获取相关参数
 	get_fss_for_object(restrict_clauses, selectivities, relids,
 					   &nfeatures, &fss_hash, &features);
-	//初始化并分配空间给model
-    lwpr_init_model(&model, nfeatures, 1);
-    //加载model
-	if (load_fss_rfwr(fss_hash, nfeatures, &model))
+	/* use the model cached for the current planning, if any */
+	INSTR_TIME_SET_CURRENT(start_time);
+	entry = fss_model_cache_lookup(fss_hash, nfeatures);
+	if (entry != NULL)
+	{
+		routine = entry->routine;
+		state = entry->state;
+	}
+	else
+		state = load_fss_model(fss_hash, nfeatures, &routine);
+	INSTR_TIME_SET_CURRENT(load_time);
+
+	if (state != NULL)
 	{
-		lwpr_predict_explore(&model, features, cutoff, result);
+		routine->predict_explore(state, features, result);
 		if (result->rows == -9999){
 			//当为-9999时，则说明使用原基数估计方法
 			result->rows = -1;
@@ -119,17 +361,28 @@ void predict_for_relation_lwpr_explore(List *restrict_clauses, List *selectiviti
 			/* code */
 			result->rows= exp(result->rows);
 		}
-		//更新模型
-		update_fss_rfwr2(fss_hash, nfeatures, &model);
+		/* the history of the model was changed, write it back later */
+		if (routine->serialize != NULL)
+		{
+			if (entry != NULL)
+				entry->dirty = true;
+			else if (query_context.learn_aqo)
+				routine->serialize(state, fss_hash);
+		}
 	}
 	else
-	{
 		result->rows = -1;
-	}
+	INSTR_TIME_SET_CURRENT(predict_time);
+	INSTR_TIME_SUBTRACT(predict_time, load_time);
+	INSTR_TIME_SUBTRACT(load_time, start_time);
+	aqo_details_record(fss_hash, result,
+					   INSTR_TIME_GET_MILLISEC(load_time),
+					   INSTR_TIME_GET_MILLISEC(predict_time));
 
 	pfree(features);
 	//free model
-    lwpr_free_model(&model);
+	if (state != NULL && entry == NULL)
+		routine->free(state);
 	list_free_deep(selectivities);
 	list_free(restrict_clauses);
 	list_free(relids);
@@ -151,6 +151,11 @@ aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
 										relids, &ev);
 		if (ev.rows >= 0)
 		{
+			if (aqo_show_details)
+			{
+				call_default_set_baserel_rows_estimate(root, rel);
+				aqo_details_set_default_rows(rel->rows);
+			}
 			rel->rows = ev.rows;
 			/* maybe some day, we will change the calculation method */
 			rel->explore_value = (ev.est_uncof*ev.rate + ev.est_future*(1-ev.rate))*1;
@@ -162,11 +167,13 @@ aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
 			if(rel->baserestrictinfo == NIL){
 				rel->explore_value = 0;
 				call_default_set_baserel_rows_estimate(root, rel);
+				aqo_details_set_default_rows(rel->rows);
 			}else{
 				// whenever the base table have no corresponding model or the current model have lower accuacy for current query, we set explore_value = 1;
 				rel->explore_value = 0.5;
 				//rel->explore_value = ev.est_uncof*ev.rate + ev.est_future*(1-ev.rate);
 				call_default_set_baserel_rows_estimate(root, rel);
+				aqo_details_set_default_rows(rel->rows);
 
 			}
 		}
@@ -243,13 +250,19 @@ aqo_get_parameterized_baserel_size(PlannerInfo *root,
 		{
 			/* set the value of rel's explore value */
 			ppi_explore_value = ev.est_uncof*ev.rate + ev.est_future*(1-ev.rate);
+			if (aqo_show_details)
+				aqo_details_set_default_rows(
+					call_default_get_parameterized_baserel_size(root, rel,
+																param_clauses));
 			return ev.rows;
 		}
 		else
 		{
 			ppi_explore_value = 1;
-			return call_default_get_parameterized_baserel_size(root, rel,
-															param_clauses);
+			predicted = call_default_get_parameterized_baserel_size(root, rel,
+																	param_clauses);
+			aqo_details_set_default_rows(predicted);
+			return predicted;
 		}
 	}
 }
@@ -310,6 +323,15 @@ aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
 		predict_for_relation_lwpr_explore(allclauses, selectivities, relids, &ev);
 		if (ev.rows >= 0)
 		{
+			if (aqo_show_details)
+			{
+				call_default_set_joinrel_size_estimates(root, rel,
+														outer_rel,
+														inner_rel,
+														sjinfo,
+														restrictlist);
+				aqo_details_set_default_rows(rel->rows);
+			}
 			rel->rows = ev.rows;
 			rel->explore_value = (ev.est_uncof*ev.rate + ev.est_future*(1-ev.rate))*1;
 		}else
@@ -321,6 +343,7 @@ aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
 													inner_rel,
 													sjinfo,
 													restrictlist);
+			aqo_details_set_default_rows(rel->rows);
 		}
 	}
 }
@@ -378,16 +401,25 @@ aqo_get_parameterized_joinrel_size(PlannerInfo *root,
 		if (ev.rows >= 0)
 		{
 			ppi_explore_value = ev.est_uncof*ev.rate + ev.est_future*(1-ev.rate);
+			if (aqo_show_details)
+				aqo_details_set_default_rows(
+					call_default_get_parameterized_joinrel_size(root, rel,
+																outer_path,
+																inner_path,
+																sjinfo,
+																restrict_clauses));
 			return ev.rows;
 		}
 		else
 		{
 			ppi_explore_value = 1;
-			return call_default_get_parameterized_joinrel_size(root, rel,
-															outer_path,
-															inner_path,
-															sjinfo,
-															restrict_clauses);
+			predicted = call_default_get_parameterized_joinrel_size(root, rel,
+																	outer_path,
+																	inner_path,
+																	sjinfo,
+																	restrict_clauses);
+			aqo_details_set_default_rows(predicted);
+			return predicted;
 		}
 	}
 }
@@ -0,0 +1,423 @@
+#include "aqo.h"
+
+/*****************************************************************************
+ *
+ *	CARDINALITY MODELS
+ *
+ * The cardinality of a feature subspace is predicted by one of the models:
+ *
+ *	lwpr	LWPR with the values of exploration (aqo_data_lwpr);
+ *	knn		OkNNr over the last aqo_K objects (aqo_data);
+ *	const	the mean cardinality (aqo_fss_models), which also serves the
+ *			subspaces without features.
+ *
+ * Without aqo.model_selection only LWPR is learned and used. With it, every
+ * object is first predicted by each model, which maintains the decaying means
+ * of their errors and of their times of loading and predicting, and then all
+ * of the models learn it. Planning uses the fastest model whose error is at
+ * most aqo.model_error_tolerance above the error of the most accurate one
+ * (see select_fss_model), so trivial subspaces are not predicted by LWPR.
+ *
+ *****************************************************************************/
+
+/* Objects learned before a model other than LWPR may be chosen */
+#define AQO_MODEL_MIN_SAMPLES	5
+/* Weight of the newest measurement in the decaying means */
+#define AQO_MODEL_STATS_WEIGHT	0.2
+/* Activation of receptive fields which take part in LWPR predictions */
+#define LWPR_PREDICT_CUTOFF		0.001
+
+typedef struct KnnModelState
+{
+	int			nfeatures;
+	int			rows;
+	double	  **matrix;
+	double	   *targets;
+	double		error;
+} KnnModelState;
+
+typedef struct ConstModelState
+{
+	double		mean;
+	double		error;
+} ConstModelState;
+
+static void *lwpr_model_load(int fss_hash, int nfeatures, FssModelStats *stats);
+static double lwpr_model_predict(void *state, double *features);
+static void lwpr_model_predict_explore(void *state, double *features,
+						   Explore_Value *result);
+static void lwpr_model_serialize(void *state, int fss_hash);
+static bool lwpr_model_update(int fss_hash, int nfeatures, double *features,
+				  double target, FssModelStats *stats);
+static void lwpr_model_free(void *state);
+static void *knn_model_load(int fss_hash, int nfeatures, FssModelStats *stats);
+static double knn_model_predict(void *state, double *features);
+static void knn_model_predict_explore(void *state, double *features,
+						  Explore_Value *result);
+static bool knn_model_update(int fss_hash, int nfeatures, double *features,
+				 double target, FssModelStats *stats);
+static void knn_model_free(void *state);
+static void *const_model_load(int fss_hash, int nfeatures, FssModelStats *stats);
+static double const_model_predict(void *state, double *features);
+static void const_model_predict_explore(void *state, double *features,
+							Explore_Value *result);
+static bool const_model_update(int fss_hash, int nfeatures, double *features,
+				   double target, FssModelStats *stats);
+static void set_explore_value(Explore_Value *result, double rows, double error);
+static void apply_staleness(LWPR_Model *model, Explore_Value *result);
+static void init_fss_model_stats(FssModelStats *stats, int nfeatures);
+static AqoModelKind select_fss_model(FssModelStats *stats, int nfeatures);
+static void update_decaying_mean(double *mean, double value);
+
+static const AqoCardinalityModel lwpr_model = {
+	"lwpr", 1,
+	lwpr_model_load, lwpr_model_predict, lwpr_model_predict_explore,
+	lwpr_model_serialize, lwpr_model_update, lwpr_model_free
+};
+
+static const AqoCardinalityModel knn_model = {
+	"knn", 1,
+	knn_model_load, knn_model_predict, knn_model_predict_explore,
+	NULL, knn_model_update, knn_model_free
+};
+
+static const AqoCardinalityModel const_model = {
+	"const", 0,
+	const_model_load, const_model_predict, const_model_predict_explore,
+	NULL, const_model_update, pfree
+};
+
+const AqoCardinalityModel *const aqo_models[AQO_NUM_MODELS] = {
+	&lwpr_model, &knn_model, &const_model
+};
+
+
+/*
+ * Returns the model planning uses for the feature subspace. stats receives
+ * the statistics of the subspace, which the constant model is loaded from.
+ */
+const AqoCardinalityModel *
+choose_fss_model(int fss_hash, int nfeatures, FssModelStats *stats)
+{
+	if (!model_selection || !load_fss_model_stats(fss_hash, stats))
+	{
+		init_fss_model_stats(stats, nfeatures);
+		return &lwpr_model;
+	}
+	return aqo_models[stats->model];
+}
+
+/*
+ * Measures the models of the feature subspace on the object, then all of them
+ * learn it and the model to plan with is chosen again. Returns true if the
+ * LWPR model did not exist before.
+ */
+bool
+learn_fss_models(int fss_hash, int nfeatures, double *features, double target)
+{
+	FssModelStats stats;
+	bool		created = false;
+	int			i;
+
+	if (!load_fss_model_stats(fss_hash, &stats))
+		init_fss_model_stats(&stats, nfeatures);
+
+	for (i = 0; i < AQO_NUM_MODELS; ++i)
+	{
+		const AqoCardinalityModel *model = aqo_models[i];
+		instr_time	start_time;
+		instr_time	elapsed;
+		void	   *state;
+		double		predicted = -9999;
+
+		if (nfeatures < model->min_features)
+			continue;
+
+		INSTR_TIME_SET_CURRENT(start_time);
+		state = model->load(fss_hash, nfeatures, &stats);
+		if (state != NULL)
+		{
+			predicted = model->predict(state, features);
+			model->free(state);
+		}
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, start_time);
+
+		if (predicted == -9999)
+			continue;
+		update_decaying_mean(&stats.errors[i], fabs(predicted - target));
+		update_decaying_mean(&stats.latencies[i],
+							 INSTR_TIME_GET_MILLISEC(elapsed));
+	}
+
+	for (i = 0; i < AQO_NUM_MODELS; ++i)
+	{
+		if (nfeatures >= aqo_models[i]->min_features &&
+			aqo_models[i]->update(fss_hash, nfeatures, features, target, &stats))
+			created = true;
+	}
+
+	stats.nsamples++;
+	stats.model = select_fss_model(&stats, nfeatures);
+	update_fss_model_stats(fss_hash, &stats);
+
+	return created;
+}
+
+static void
+init_fss_model_stats(FssModelStats *stats, int nfeatures)
+{
+	int			i;
+
+	stats->model = (nfeatures > 0) ? AQO_MODEL_LWPR : AQO_MODEL_CONST;
+	stats->nsamples = 0;
+	stats->mean_target = 0;
+	for (i = 0; i < AQO_NUM_MODELS; ++i)
+	{
+		stats->errors[i] = -1;
+		stats->latencies[i] = -1;
+	}
+}
+
+/*
+ * Chooses the fastest of the models whose errors are close to the smallest
+ * one. LWPR is kept until the other models have seen enough objects.
+ */
+static AqoModelKind
+select_fss_model(FssModelStats *stats, int nfeatures)
+{
+	AqoModelKind best = stats->model;
+	double		min_error = -1;
+	int			i;
+
+	if (nfeatures > 0 && stats->nsamples < AQO_MODEL_MIN_SAMPLES)
+		return AQO_MODEL_LWPR;
+
+	for (i = 0; i < AQO_NUM_MODELS; ++i)
+	{
+		if (nfeatures < aqo_models[i]->min_features || stats->errors[i] < 0)
+			continue;
+		if (min_error < 0 || stats->errors[i] < min_error)
+			min_error = stats->errors[i];
+	}
+	if (min_error < 0)
+		return best;
+
+	best = AQO_NUM_MODELS;
+	for (i = 0; i < AQO_NUM_MODELS; ++i)
+	{
+		if (nfeatures < aqo_models[i]->min_features || stats->errors[i] < 0 ||
+			stats->errors[i] > min_error + model_error_tolerance)
+			continue;
+		if (best == AQO_NUM_MODELS ||
+			stats->latencies[i] < stats->latencies[best])
+			best = (AqoModelKind) i;
+	}
+	return best;
+}
+
+static void
+update_decaying_mean(double *mean, double value)
+{
+	if (*mean < 0)
+		*mean = value;
+	else
+		*mean += AQO_MODEL_STATS_WEIGHT * (value - *mean);
+}
+
+/*
+ * Models other than LWPR have no confidence bounds; their uncertainty is their
+ * observed error, and they are not explored.
+ */
+static void
+set_explore_value(Explore_Value *result, double rows, double error)
+{
+	lwpr_men_alloc_ev(result);
+	result->rows = rows;
+	result->est_uncof = (error < 0) ? 1 : Min(error, 1);
+}
+
+/*
+ * A model marked stale by the statistics drift check is trusted less: its
+ * uncertainty is raised, so that the feature subspace is explored again, and
+ * while it is mostly stale the standard estimators, which use the fresh
+ * statistics, make the estimate.
+ */
+static void
+apply_staleness(LWPR_Model *model, Explore_Value *result)
+{
+	if (model->staleness <= 0)
+		return;
+
+	result->est_uncof = model->staleness +
+		(1 - model->staleness) * result->est_uncof;
+	if (model->staleness > 0.5)
+		result->rows = -9999;
+}
+
+static void *
+lwpr_model_load(int fss_hash, int nfeatures, FssModelStats *stats)
+{
+	LWPR_Model *model = palloc(sizeof(*model));
+
+	lwpr_init_model(model, nfeatures, 1);
+	if (load_fss_rfwr(fss_hash, nfeatures, model))
+		return model;
+
+	lwpr_free_model(model);
+	pfree(model);
+	return NULL;
+}
+
+static double
+lwpr_model_predict(void *state, double *features)
+{
+	return lwpr_predict((LWPR_Model *) state, features, LWPR_PREDICT_CUTOFF);
+}
+
+static void
+lwpr_model_predict_explore(void *state, double *features,
+						   Explore_Value *result)
+{
+	LWPR_Model *model = (LWPR_Model *) state;
+	AqoStatTimer stat_timer;
+
+	aqo_stat_begin(&stat_timer);
+	lwpr_predict_explore(model, features, LWPR_PREDICT_CUTOFF, result);
+	aqo_stat_end(&stat_timer, AQO_STAT_LWPR_PREDICT_EXPLORE, model->fss_hash);
+	apply_staleness(model, result);
+}
+
+/* Predictions add to the history of queries of the model */
+static void
+lwpr_model_serialize(void *state, int fss_hash)
+{
+	queue_fss_history(fss_hash, (LWPR_Model *) state);
+}
+
+static bool
+lwpr_model_update(int fss_hash, int nfeatures, double *features,
+				  double target, FssModelStats *stats)
+{
+	LWPR_Model	model;
+	bool		created;
+
+	lwpr_init_model(&model, nfeatures, 1);
+	created = atomic_fss_learn_step_rfwr(fss_hash, nfeatures, &model,
+										 features, target);
+	lwpr_free_model(&model);
+	return created;
+}
+
+static void
+lwpr_model_free(void *state)
+{
+	lwpr_free_model((LWPR_Model *) state);
+	pfree(state);
+}
+
+static void *
+knn_model_load(int fss_hash, int nfeatures, FssModelStats *stats)
+{
+	KnnModelState *knn = palloc(sizeof(*knn));
+
+	knn->nfeatures = nfeatures;
+	knn->error = stats->errors[AQO_MODEL_KNN];
+	knn->matrix = OkNNr_allocate_matrix(aqo_K, nfeatures);
+	knn->targets = palloc0(sizeof(*knn->targets) * aqo_K);
+
+	if (load_fss(fss_hash, nfeatures, knn->matrix, knn->targets, &knn->rows) &&
+		knn->rows > 0)
+		return knn;
+
+	knn_model_free(knn);
+	return NULL;
+}
+
+static double
+knn_model_predict(void *state, double *features)
+{
+	KnnModelState *knn = (KnnModelState *) state;
+	double		result;
+
+	result = OkNNr_predict(knn->rows, knn->nfeatures, knn->matrix,
+						   knn->targets, features, aqo_k);
+	return (result < 0) ? -9999 : result;
+}
+
+static void
+knn_model_predict_explore(void *state, double *features,
+						  Explore_Value *result)
+{
+	set_explore_value(result, knn_model_predict(state, features),
+					  ((KnnModelState *) state)->error);
+}
+
+static bool
+knn_model_update(int fss_hash, int nfeatures, double *features,
+				 double target, FssModelStats *stats)
+{
+	double	  **matrix;
+	double	   *targets;
+
+	matrix = OkNNr_allocate_matrix(aqo_K, nfeatures);
+	targets = palloc0(sizeof(*targets) * aqo_K);
+
+	atomic_fss_learn_step(fss_hash, nfeatures, matrix, targets,
+						  features, target);
+
+	pfree(matrix);
+	pfree(targets);
+	return false;
+}
+
+static void
+knn_model_free(void *state)
+{
+	KnnModelState *knn = (KnnModelState *) state;
+
+	pfree(knn->matrix);
+	pfree(knn->targets);
+	pfree(knn);
+}
+
+static void *
+const_model_load(int fss_hash, int nfeatures, FssModelStats *stats)
+{
+	ConstModelState *model;
+
+	if (stats->nsamples == 0)
+		return NULL;
+
+	model = palloc(sizeof(*model));
+	model->mean = stats->mean_target;
+	model->error = stats->errors[AQO_MODEL_CONST];
+	return model;
+}
+
+static double
+const_model_predict(void *state, double *features)
+{
+	return ((ConstModelState *) state)->mean;
+}
+
+static void
+const_model_predict_explore(void *state, double *features,
+							Explore_Value *result)
+{
+	set_explore_value(result, ((ConstModelState *) state)->mean,
+					  ((ConstModelState *) state)->error);
+}
+
+/* The mean is stored with the statistics by learn_fss_models */
+static bool
+const_model_update(int fss_hash, int nfeatures, double *features,
+				   double target, FssModelStats *stats)
+{
+	if (stats->nsamples == 0)
+		stats->mean_target = target;
+	else
+		stats->mean_target += AQO_MODEL_STATS_WEIGHT *
+			(target - stats->mean_target);
+	return false;
+}
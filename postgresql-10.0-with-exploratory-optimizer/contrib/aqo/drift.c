@@ -0,0 +1,136 @@
+#include "aqo.h"
+#include "access/transam.h"
+#include "catalog/pg_class.h"
+#include "utils/inval.h"
+#include "utils/syscache.h"
+
+/*****************************************************************************
+ *
+ *	STATISTICS DRIFT
+ *
+ * The models of feature subspaces are learned on the data the relations had
+ * at that time. After bulk loads and deletes they predict the old
+ * cardinalities with full confidence, so AQO keeps plans which the fresh
+ * statistics would have fixed.
+ *
+ * When a model is created, the relations of its feature subspace are
+ * remembered in aqo_fss_relations together with their pg_class.reltuples.
+ * ANALYZE, VACUUM and DDL invalidate the relcache entries of relations; the
+ * callback below only remembers which relations were invalidated. The next
+ * planning with AQO compares their reltuples with the remembered ones, and if
+ * a relation changed by more than aqo.stale_threshold, the models built on it
+ * are marked stale (see mark_stale_fss). A stale model is trusted less
+ * (see apply_staleness) and its staleness decays as it learns on new
+ * executions.
+ *
+ *****************************************************************************/
+
+/* Relations invalidated since the last check */
+#define DRIFT_MAX_PENDING_RELS 64
+
+static Oid	pending_rels[DRIFT_MAX_PENDING_RELS];
+static int	npending_rels = 0;
+/* Too many or all relations were invalidated, check all of them */
+static bool pending_all_rels = false;
+
+static void drift_relcache_callback(Datum arg, Oid relid);
+
+
+/*
+ * Registers the invalidation callback. It is called once per backend from
+ * _PG_init.
+ */
+void
+aqo_drift_register_callbacks(void)
+{
+	CacheRegisterRelcacheCallback(drift_relcache_callback, (Datum) 0);
+}
+
+/*
+ * Remembers the invalidated relation. Callbacks may be called in any state
+ * of the transaction, so the check itself is deferred until the next
+ * planning.
+ */
+static void
+drift_relcache_callback(Datum arg, Oid relid)
+{
+	aqo_drift_recheck(relid);
+}
+
+/*
+ * Makes the next check look at the relation again, InvalidOid means all
+ * relations.
+ */
+void
+aqo_drift_recheck(Oid relid)
+{
+	int			i;
+
+	if (pending_all_rels)
+		return;
+
+	if (!OidIsValid(relid))
+	{
+		pending_all_rels = true;
+		return;
+	}
+
+	/* Models are not built on system catalogs */
+	if (relid < FirstNormalObjectId)
+		return;
+
+	for (i = 0; i < npending_rels; ++i)
+		if (pending_rels[i] == relid)
+			return;
+
+	if (npending_rels == DRIFT_MAX_PENDING_RELS)
+		pending_all_rels = true;
+	else
+		pending_rels[npending_rels++] = relid;
+}
+
+/*
+ * Marks stale the models built on the relations invalidated since the last
+ * check. Writes to AQO tables, so it must not be called in read-only
+ * transactions.
+ */
+void
+aqo_drift_check(void)
+{
+	Oid			rels[DRIFT_MAX_PENDING_RELS];
+	int			nrels = npending_rels;
+	bool		all_rels = pending_all_rels;
+	int			i;
+
+	if (stale_threshold <= 0 || (nrels == 0 && !all_rels))
+		return;
+
+	/* The check may receive new invalidations */
+	memcpy(rels, pending_rels, sizeof(Oid) * nrels);
+	npending_rels = 0;
+	pending_all_rels = false;
+
+	if (all_rels)
+		mark_stale_fss(InvalidOid);
+	else
+		for (i = 0; i < nrels; ++i)
+			mark_stale_fss(rels[i]);
+}
+
+/*
+ * Returns the number of tuples of the relation as seen by the planner
+ * statistics, or false if the relation does not exist.
+ */
+bool
+get_relation_reltuples(Oid relid, double *reltuples)
+{
+	HeapTuple	tuple;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		return false;
+
+	*reltuples = ((Form_pg_class) GETSTRUCT(tuple))->reltuples;
+	ReleaseSysCache(tuple);
+	return true;
+}
@@ -0,0 +1,245 @@
+#include "aqo.h"
+
+/*****************************************************************************
+ *
+ *	PREDICTION DETAILS IN EXPLAIN
+ *
+ * If aqo.show_details is on, every cardinality prediction made while planning
+ * is remembered together with its source, explore value and cost. EXPLAIN
+ * looks up the feature subspace of each plan node and prints the prediction
+ * made for it; EXPLAIN ANALYZE also prints the error of the estimate.
+ *
+ * The details are kept until the next query is planned, so EXPLAIN shows
+ * only the predictions made for the query being explained.
+ *
+ *****************************************************************************/
+
+typedef struct AqoPredictionDetails
+{
+	int			fss_hash;		/* hash key, must be first */
+	double		rows;			/* AQO prediction, -1 if not predicted */
+	double		default_rows;	/* estimate of the default estimator, -1 if unknown */
+	double		est_uncof;
+	double		est_future;
+	double		rate;
+	int			active_rfs;
+	int			knn_rfs;
+	int			npredictions;
+	double		load_time;		/* milliseconds, of all predictions */
+	double		predict_time;	/* milliseconds, of all predictions */
+} AqoPredictionDetails;
+
+static MemoryContext details_context = NULL;
+static HTAB *details_htab = NULL;
+/* The entry of the last prediction, it awaits the default estimate */
+static AqoPredictionDetails *last_details = NULL;
+
+static const char *prediction_source(AqoPredictionDetails *details);
+static double log_error(double predicted, double actual);
+
+
+/*
+ * Forgets the details of the previously planned query.
+ */
+void
+aqo_details_reset(void)
+{
+	HASHCTL		info;
+
+	last_details = NULL;
+	details_htab = NULL;
+
+	if (details_context != NULL)
+		MemoryContextReset(details_context);
+
+	if (!aqo_show_details)
+		return;
+
+	if (details_context == NULL)
+		details_context = AllocSetContextCreate(TopMemoryContext,
+												"AQO prediction details",
+												ALLOCSET_DEFAULT_SIZES);
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(int);
+	info.entrysize = sizeof(AqoPredictionDetails);
+	info.hcxt = details_context;
+	details_htab = hash_create("AQO prediction details", 64, &info,
+							   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * Remembers a prediction for the feature subspace. ev->rows is -1 if the
+ * default estimator has to be used. Times are in milliseconds.
+ */
+void
+aqo_details_record(int fss_hash, Explore_Value *ev,
+				   double load_time, double predict_time)
+{
+	AqoPredictionDetails *details;
+	bool		found;
+
+	if (details_htab == NULL)
+		return;
+
+	details = (AqoPredictionDetails *) hash_search(details_htab, &fss_hash,
+												   HASH_ENTER, &found);
+	if (!found)
+	{
+		details->npredictions = 0;
+		details->load_time = 0;
+		details->predict_time = 0;
+	}
+	details->rows = ev->rows;
+	details->default_rows = -1;
+	details->est_uncof = ev->est_uncof;
+	details->est_future = ev->est_future;
+	details->rate = ev->rate;
+	details->active_rfs = ev->active_rfs;
+	details->knn_rfs = ev->knn_rfs;
+	details->npredictions++;
+	details->load_time += load_time;
+	details->predict_time += predict_time;
+
+	last_details = details;
+}
+
+/*
+ * Remembers the estimate of the default estimator for the last prediction.
+ */
+void
+aqo_details_set_default_rows(double rows)
+{
+	if (last_details == NULL)
+		return;
+
+	last_details->default_rows = rows;
+	last_details = NULL;
+}
+
+static const char *
+prediction_source(AqoPredictionDetails *details)
+{
+	if (details->rows < 0)
+		return "default";
+	if (details->knn_rfs > 0)
+		return "kNN";
+	return "LWPR";
+}
+
+/*
+ * Returns the absolute difference of logarithms of the estimated and the
+ * actual number of rows, as learning does.
+ */
+static double
+log_error(double predicted, double actual)
+{
+	return fabs(log(Max(predicted, 1)) - log(Max(actual, 1)));
+}
+
+/*
+ * Prints the prediction made for the feature subspace of the plan node.
+ */
+void
+aqo_explain_node(ExplainState *es, PlanState *ps, Plan *plan)
+{
+	AqoPredictionDetails *details;
+	List	   *clauselist = NIL;
+	List	   *selectivities = NIL;
+	List	   *relidslist = NIL;
+	int			nfeatures;
+	int			fss_hash;
+	double	   *features;
+	double		explore_value;
+	bool		has_actual;
+	double		actual_rows = 0;
+
+	if (prev_ExplainOneNode_hook)
+		prev_ExplainOneNode_hook(es, ps, plan);
+
+	if (details_htab == NULL || !plan->had_path)
+		return;
+
+	collect_node_objects(ps, &clauselist, &selectivities, &relidslist);
+	get_fss_for_object(clauselist, selectivities, relidslist,
+					   &nfeatures, &fss_hash, &features);
+	pfree(features);
+	list_free(clauselist);
+	list_free(selectivities);
+	list_free(relidslist);
+
+	details = (AqoPredictionDetails *) hash_search(details_htab, &fss_hash,
+												   HASH_FIND, NULL);
+	if (details == NULL)
+		return;
+
+	explore_value = details->est_uncof * details->rate +
+		details->est_future * (1 - details->rate);
+	has_actual = (es->analyze && ps->instrument != NULL &&
+				  ps->instrument->nloops > 0);
+	if (has_actual)
+		actual_rows = ps->instrument->ntuples / ps->instrument->nloops;
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		appendStringInfoSpaces(es->str, es->indent * 2);
+		appendStringInfo(es->str, "AQO: fss=%d source=%s", fss_hash,
+						 prediction_source(details));
+		if (details->rows >= 0)
+			appendStringInfo(es->str, " rows=%.0f", details->rows);
+		if (details->default_rows >= 0)
+			appendStringInfo(es->str, " default rows=%.0f",
+							 details->default_rows);
+		appendStringInfo(es->str, " RFs=%d kNN RFs=%d\n",
+						 details->active_rfs, details->knn_rfs);
+
+		appendStringInfoSpaces(es->str, es->indent * 2);
+		appendStringInfo(es->str,
+						 "AQO Explore: uncertainty=%.3f future=%.3f value=%.3f\n",
+						 details->est_uncof, details->est_future,
+						 explore_value);
+
+		appendStringInfoSpaces(es->str, es->indent * 2);
+		appendStringInfo(es->str,
+						 "AQO Time: load=%.3f ms predict=%.3f ms predictions=%d\n",
+						 details->load_time, details->predict_time,
+						 details->npredictions);
+
+		if (has_actual)
+		{
+			appendStringInfoSpaces(es->str, es->indent * 2);
+			appendStringInfo(es->str, "AQO Error: %.3f",
+							 log_error(plan->plan_rows, actual_rows));
+			if (details->default_rows >= 0)
+				appendStringInfo(es->str, " default=%.3f",
+								 log_error(details->default_rows, actual_rows));
+			appendStringInfoChar(es->str, '\n');
+		}
+	}
+	else
+	{
+		ExplainPropertyInteger("AQO Feature Subspace", fss_hash, es);
+		ExplainPropertyText("AQO Source", prediction_source(details), es);
+		if (details->rows >= 0)
+			ExplainPropertyFloat("AQO Predicted Rows", details->rows, 0, es);
+		if (details->default_rows >= 0)
+			ExplainPropertyFloat("AQO Default Rows", details->default_rows, 0, es);
+		ExplainPropertyInteger("AQO Active RFs", details->active_rfs, es);
+		ExplainPropertyInteger("AQO kNN RFs", details->knn_rfs, es);
+		ExplainPropertyFloat("AQO Uncertainty", details->est_uncof, 3, es);
+		ExplainPropertyFloat("AQO Future Value", details->est_future, 3, es);
+		ExplainPropertyFloat("AQO Explore Value", explore_value, 3, es);
+		ExplainPropertyFloat("AQO Load Time", details->load_time, 3, es);
+		ExplainPropertyFloat("AQO Predict Time", details->predict_time, 3, es);
+		ExplainPropertyInteger("AQO Predictions", details->npredictions, es);
+		if (has_actual)
+		{
+			ExplainPropertyFloat("AQO Error",
+								 log_error(plan->plan_rows, actual_rows), 3, es);
+			if (details->default_rows >= 0)
+				ExplainPropertyFloat("AQO Default Error",
+									 log_error(details->default_rows,
+											   actual_rows), 3, es);
+		}
+	}
+}
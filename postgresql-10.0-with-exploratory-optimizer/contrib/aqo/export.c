@@ -0,0 +1,522 @@
+#include "aqo.h"
+#include "executor/spi.h"
+#include "libpq/pqformat.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+#include "utils/lsyscache.h"
+
+#include <arpa/inet.h>
+
+/*****************************************************************************
+ *
+ *	MODEL EXPORT AND IMPORT
+ *
+ * aqo_export_models(path) writes the learned state of AQO into a file on the
+ * server, aqo_import_models(path) replaces the state with the one from the
+ * file. So the models can be trained on one server and shipped to others.
+ *
+ * The file consists of
+ *
+ *	header:	magic, format version, number of tables;
+ *	table:	name, number of columns, name and type of every column, the rows
+ *			and -1 at the end;
+ *	row:	number of columns and the binary (send/receive) representation of
+ *			every column: its length, -1 for NULL, and the bytes;
+ *	trailer: CRC-32C of all the preceding bytes.
+ *
+ * All integers are in network byte order. The import reads the file in one
+ * sequential pass and inserts the rows as it goes; a checksum mismatch
+ * raises an error, which rolls back the whole import.
+ *
+ * Relations the feature subspaces are built on (aqo_fss_relations) are not
+ * exported: their OIDs are meaningless on another server.
+ *
+ *****************************************************************************/
+
+#define AQO_EXPORT_MAGIC		"AQOMODEL"
+#define AQO_EXPORT_MAGIC_LEN	8
+#define AQO_EXPORT_VERSION		1
+/* Rows fetched from a table at once by the export */
+#define AQO_EXPORT_BATCH		1000
+
+/*
+ * Exported tables. The order satisfies the foreign keys: aqo_queries goes
+ * first.
+ */
+static const char *const export_tables[] = {
+	"aqo_queries",
+	"aqo_data",
+	"aqo_fss_models",
+	"aqo_query_texts",
+	"aqo_markov_table",
+	"aqo_best_two_costs_table",
+	"aqo_node_latency",
+	"aqo_data_lwpr",
+	"aqo_data_house_lwpr"
+};
+
+#define NUM_EXPORT_TABLES lengthof(export_tables)
+
+typedef struct ModelFile
+{
+	FILE	   *file;
+	const char *path;
+	pg_crc32c	crc;
+} ModelFile;
+
+static void check_export_privileges(const char *func);
+static void model_file_write(ModelFile *mf, const void *data, Size len);
+static void model_file_write_int16(ModelFile *mf, int16 value);
+static void model_file_write_int32(ModelFile *mf, int32 value);
+static void model_file_write_string(ModelFile *mf, const char *str);
+static void model_file_read(ModelFile *mf, void *data, Size len);
+static int16 model_file_read_int16(ModelFile *mf);
+static int32 model_file_read_int32(ModelFile *mf);
+static char *model_file_read_string(ModelFile *mf);
+static int64 export_table(ModelFile *mf, const char *table);
+static void export_table_header(ModelFile *mf, const char *table,
+					TupleDesc tupdesc, FmgrInfo **send_funcs);
+static int64 import_table(ModelFile *mf);
+static bool is_export_table(const char *table);
+
+
+PG_FUNCTION_INFO_V1(aqo_export_models);
+
+/*
+ * Writes all AQO models into the file. Returns the number of written rows.
+ * Run it in a REPEATABLE READ transaction to get a consistent snapshot of
+ * models being learned concurrently.
+ */
+Datum
+aqo_export_models(PG_FUNCTION_ARGS)
+{
+	ModelFile	mf;
+	int64		nrows = 0;
+	int			i;
+
+	check_export_privileges("aqo_export_models");
+
+	mf.path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	mf.file = AllocateFile(mf.path, PG_BINARY_W);
+	if (mf.file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", mf.path)));
+	INIT_CRC32C(mf.crc);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "aqo_export_models: SPI_connect failed");
+
+	model_file_write(&mf, AQO_EXPORT_MAGIC, AQO_EXPORT_MAGIC_LEN);
+	model_file_write_int32(&mf, AQO_EXPORT_VERSION);
+	model_file_write_int32(&mf, NUM_EXPORT_TABLES);
+	for (i = 0; i < NUM_EXPORT_TABLES; ++i)
+		nrows += export_table(&mf, export_tables[i]);
+
+	/* The checksum itself is not checksummed */
+	FIN_CRC32C(mf.crc);
+	mf.crc = htonl(mf.crc);
+	if (fwrite(&mf.crc, sizeof(mf.crc), 1, mf.file) != 1)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", mf.path)));
+
+	SPI_finish();
+
+	if (FreeFile(mf.file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", mf.path)));
+
+	PG_RETURN_INT64(nrows);
+}
+
+PG_FUNCTION_INFO_V1(aqo_import_models);
+
+/*
+ * Replaces AQO models with the ones from the file written by
+ * aqo_export_models. The statistics of queries in aqo_query_stat are removed
+ * together with the old queries. Returns the number of read rows.
+ */
+Datum
+aqo_import_models(PG_FUNCTION_ARGS)
+{
+	ModelFile	mf;
+	char		magic[AQO_EXPORT_MAGIC_LEN];
+	pg_crc32c	file_crc;
+	int32		version;
+	int32		ntables;
+	int64		nrows = 0;
+	int			i;
+
+	check_export_privileges("aqo_import_models");
+	if (RecoveryInProgress())
+		elog(ERROR, "aqo_import_models cannot be executed during recovery");
+
+	mf.path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	mf.file = AllocateFile(mf.path, PG_BINARY_R);
+	if (mf.file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", mf.path)));
+	INIT_CRC32C(mf.crc);
+
+	model_file_read(&mf, magic, AQO_EXPORT_MAGIC_LEN);
+	if (memcmp(magic, AQO_EXPORT_MAGIC, AQO_EXPORT_MAGIC_LEN) != 0)
+		elog(ERROR, "file \"%s\" is not an AQO model file", mf.path);
+	version = model_file_read_int32(&mf);
+	if (version != AQO_EXPORT_VERSION)
+		elog(ERROR, "AQO model file \"%s\" has unsupported version %d",
+			 mf.path, version);
+	ntables = model_file_read_int32(&mf);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "aqo_import_models: SPI_connect failed");
+
+	/* Dependent tables first, the rest goes with aqo_queries by cascade */
+	for (i = NUM_EXPORT_TABLES - 1; i >= 0; --i)
+	{
+		char	   *sql = psprintf("DELETE FROM public.%s",
+								   quote_identifier(export_tables[i]));
+
+		if (SPI_execute(sql, false, 0) != SPI_OK_DELETE)
+			elog(ERROR, "aqo_import_models: cannot clean %s", export_tables[i]);
+		pfree(sql);
+	}
+
+	for (i = 0; i < ntables; ++i)
+		nrows += import_table(&mf);
+
+	/* The sketch must not override the imported aqo_markov_table */
+	markov_sketch_forget_database();
+
+	FIN_CRC32C(mf.crc);
+	if (fread(&file_crc, sizeof(file_crc), 1, mf.file) != 1)
+		elog(ERROR, "AQO model file \"%s\" is truncated", mf.path);
+	if (!EQ_CRC32C(ntohl(file_crc), mf.crc))
+		elog(ERROR, "AQO model file \"%s\" has incorrect checksum", mf.path);
+
+	SPI_finish();
+	FreeFile(mf.file);
+
+	PG_RETURN_INT64(nrows);
+}
+
+/*
+ * The functions read and write files on the server, as COPY does.
+ */
+static void
+check_export_privileges(const char *func)
+{
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to use %s", func)));
+}
+
+static void
+model_file_write(ModelFile *mf, const void *data, Size len)
+{
+	if (len > 0 && fwrite(data, len, 1, mf->file) != 1)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", mf->path)));
+	COMP_CRC32C(mf->crc, data, len);
+}
+
+static void
+model_file_write_int16(ModelFile *mf, int16 value)
+{
+	uint16		n = htons((uint16) value);
+
+	model_file_write(mf, &n, sizeof(n));
+}
+
+static void
+model_file_write_int32(ModelFile *mf, int32 value)
+{
+	uint32		n = htonl((uint32) value);
+
+	model_file_write(mf, &n, sizeof(n));
+}
+
+static void
+model_file_write_string(ModelFile *mf, const char *str)
+{
+	int32		len = strlen(str);
+
+	model_file_write_int32(mf, len);
+	model_file_write(mf, str, len);
+}
+
+static void
+model_file_read(ModelFile *mf, void *data, Size len)
+{
+	if (len > 0 && fread(data, len, 1, mf->file) != 1)
+	{
+		if (ferror(mf->file))
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", mf->path)));
+		elog(ERROR, "AQO model file \"%s\" is truncated", mf->path);
+	}
+	COMP_CRC32C(mf->crc, data, len);
+}
+
+static int16
+model_file_read_int16(ModelFile *mf)
+{
+	uint16		n;
+
+	model_file_read(mf, &n, sizeof(n));
+	return (int16) ntohs(n);
+}
+
+static int32
+model_file_read_int32(ModelFile *mf)
+{
+	uint32		n;
+
+	model_file_read(mf, &n, sizeof(n));
+	return (int32) ntohl(n);
+}
+
+static char *
+model_file_read_string(ModelFile *mf)
+{
+	int32		len = model_file_read_int32(mf);
+	char	   *str;
+
+	if (len < 0 || len > NAMEDATALEN)
+		elog(ERROR, "AQO model file \"%s\" is corrupted", mf->path);
+	str = palloc(len + 1);
+	model_file_read(mf, str, len);
+	str[len] = '\0';
+	return str;
+}
+
+/*
+ * Writes the table into the file. Rows are fetched through a cursor in
+ * batches, so the models need not fit in memory. Returns the number of rows.
+ */
+static int64
+export_table(ModelFile *mf, const char *table)
+{
+	char	   *sql = psprintf("SELECT * FROM public.%s",
+							   quote_identifier(table));
+	Portal		portal;
+	FmgrInfo   *send_funcs = NULL;
+	MemoryContext row_cxt;
+	MemoryContext old_cxt;
+	int64		nrows = 0;
+
+	row_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									"AQO export row",
+									ALLOCSET_DEFAULT_SIZES);
+
+	portal = SPI_cursor_open_with_args(NULL, sql, 0, NULL, NULL, NULL,
+									   true, 0);
+	for (;;)
+	{
+		TupleDesc	tupdesc;
+		uint64		i;
+
+		SPI_cursor_fetch(portal, true, AQO_EXPORT_BATCH);
+		tupdesc = SPI_tuptable->tupdesc;
+		if (send_funcs == NULL)
+			export_table_header(mf, table, tupdesc, &send_funcs);
+		if (SPI_processed == 0)
+			break;
+
+		for (i = 0; i < SPI_processed; ++i)
+		{
+			HeapTuple	tuple = SPI_tuptable->vals[i];
+			int			j;
+
+			old_cxt = MemoryContextSwitchTo(row_cxt);
+			model_file_write_int16(mf, tupdesc->natts);
+			for (j = 0; j < tupdesc->natts; ++j)
+			{
+				bool		isnull;
+				Datum		value = SPI_getbinval(tuple, tupdesc, j + 1, &isnull);
+				bytea	   *data;
+
+				if (isnull)
+				{
+					model_file_write_int32(mf, -1);
+					continue;
+				}
+				data = SendFunctionCall(&send_funcs[j], value);
+				model_file_write_int32(mf, VARSIZE(data) - VARHDRSZ);
+				model_file_write(mf, VARDATA(data), VARSIZE(data) - VARHDRSZ);
+			}
+			MemoryContextSwitchTo(old_cxt);
+			MemoryContextReset(row_cxt);
+		}
+		nrows += SPI_processed;
+		SPI_freetuptable(SPI_tuptable);
+	}
+	model_file_write_int16(mf, -1);
+
+	SPI_cursor_close(portal);
+	MemoryContextDelete(row_cxt);
+	pfree(send_funcs);
+	pfree(sql);
+	return nrows;
+}
+
+/*
+ * Writes the name and the columns of the table and prepares the send
+ * functions of the columns.
+ */
+static void
+export_table_header(ModelFile *mf, const char *table, TupleDesc tupdesc,
+					FmgrInfo **send_funcs)
+{
+	int			i;
+
+	*send_funcs = palloc(sizeof(FmgrInfo) * Max(tupdesc->natts, 1));
+
+	model_file_write_string(mf, table);
+	model_file_write_int16(mf, tupdesc->natts);
+	for (i = 0; i < tupdesc->natts; ++i)
+	{
+		Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+		Oid			typsend;
+		bool		typisvarlena;
+
+		model_file_write_string(mf, NameStr(attr->attname));
+		model_file_write_int32(mf, attr->atttypid);
+		getTypeBinaryOutputInfo(attr->atttypid, &typsend, &typisvarlena);
+		fmgr_info(typsend, &(*send_funcs)[i]);
+	}
+}
+
+/*
+ * Reads the next table from the file and inserts its rows. Returns the
+ * number of rows.
+ */
+static int64
+import_table(ModelFile *mf)
+{
+	char	   *table = model_file_read_string(mf);
+	int16		ncols = model_file_read_int16(mf);
+	Oid		   *argtypes;
+	FmgrInfo   *recv_funcs;
+	Oid		   *typioparams;
+	Datum	   *values;
+	char	   *nulls;
+	StringInfoData sql;
+	StringInfoData buf;
+	SPIPlanPtr	plan;
+	MemoryContext row_cxt;
+	MemoryContext old_cxt;
+	int64		nrows = 0;
+	int			i;
+
+	if (!is_export_table(table))
+		elog(ERROR, "AQO model file \"%s\" contains unknown table \"%s\"",
+			 mf->path, table);
+	if (ncols <= 0)
+		elog(ERROR, "AQO model file \"%s\" is corrupted", mf->path);
+
+	argtypes = palloc(sizeof(*argtypes) * ncols);
+	recv_funcs = palloc(sizeof(*recv_funcs) * ncols);
+	typioparams = palloc(sizeof(*typioparams) * ncols);
+	values = palloc(sizeof(*values) * ncols);
+	nulls = palloc(sizeof(*nulls) * ncols);
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "INSERT INTO public.%s (", quote_identifier(table));
+	for (i = 0; i < ncols; ++i)
+	{
+		char	   *column = model_file_read_string(mf);
+		Oid			typreceive;
+
+		argtypes[i] = model_file_read_int32(mf);
+		getTypeBinaryInputInfo(argtypes[i], &typreceive, &typioparams[i]);
+		fmgr_info(typreceive, &recv_funcs[i]);
+		appendStringInfo(&sql, "%s%s", (i > 0) ? ", " : "",
+						 quote_identifier(column));
+	}
+	appendStringInfoString(&sql, ") VALUES (");
+	for (i = 0; i < ncols; ++i)
+		appendStringInfo(&sql, "%s$%d", (i > 0) ? ", " : "", i + 1);
+	appendStringInfoChar(&sql, ')');
+
+	plan = SPI_prepare(sql.data, ncols, argtypes);
+	if (plan == NULL)
+		elog(ERROR, "aqo_import_models: cannot prepare \"%s\": %s",
+			 sql.data, SPI_result_code_string(SPI_result));
+
+	row_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									"AQO import row",
+									ALLOCSET_DEFAULT_SIZES);
+	initStringInfo(&buf);
+
+	for (;;)
+	{
+		int16		nfields = model_file_read_int16(mf);
+		int			ret;
+
+		if (nfields == -1)
+			break;
+		if (nfields != ncols)
+			elog(ERROR, "AQO model file \"%s\" is corrupted", mf->path);
+
+		old_cxt = MemoryContextSwitchTo(row_cxt);
+		for (i = 0; i < ncols; ++i)
+		{
+			int32		len = model_file_read_int32(mf);
+
+			if (len == -1)
+			{
+				values[i] = (Datum) 0;
+				nulls[i] = 'n';
+				continue;
+			}
+			if (len < 0 || !AllocSizeIsValid(len))
+				elog(ERROR, "AQO model file \"%s\" is corrupted", mf->path);
+
+			resetStringInfo(&buf);
+			enlargeStringInfo(&buf, len);
+			model_file_read(mf, buf.data, len);
+			buf.len = len;
+			buf.data[len] = '\0';
+			values[i] = ReceiveFunctionCall(&recv_funcs[i], &buf,
+											typioparams[i], -1);
+			nulls[i] = ' ';
+		}
+		MemoryContextSwitchTo(old_cxt);
+
+		ret = SPI_execute_plan(plan, values, nulls, false, 0);
+		if (ret != SPI_OK_INSERT)
+			elog(ERROR, "aqo_import_models: cannot insert into %s: %s",
+				 table, SPI_result_code_string(ret));
+		MemoryContextReset(row_cxt);
+		nrows++;
+	}
+
+	SPI_freeplan(plan);
+	MemoryContextDelete(row_cxt);
+	pfree(buf.data);
+	pfree(sql.data);
+	pfree(nulls);
+	pfree(values);
+	pfree(typioparams);
+	pfree(recv_funcs);
+	pfree(argtypes);
+	pfree(table);
+	return nrows;
+}
+
+static bool
+is_export_table(const char *table)
+{
+	int			i;
+
+	for (i = 0; i < NUM_EXPORT_TABLES; ++i)
+		if (strcmp(table, export_tables[i]) == 0)
+			return true;
+	return false;
+}
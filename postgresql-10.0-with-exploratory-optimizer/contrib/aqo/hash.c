@@ -97,7 +97,9 @@ get_fss_for_object(List *clauselist, List *selectivities, List *relidslist,
 				m;
 	int			sh = 0,
 				old_sh;
+	AqoStatTimer stat_timer;
 
+	aqo_stat_begin(&stat_timer);
 	n = list_length(clauselist);
 
 	get_eclasses(clauselist, &nargs, &args_hash, &eclass_hash);
@@ -167,6 +169,7 @@ get_fss_for_object(List *clauselist, List *selectivities, List *relidslist,
 	pfree(clause_has_consts);
 	pfree(args_hash);
 	pfree(eclass_hash);
+	aqo_stat_end(&stat_timer, AQO_STAT_GET_FSS_FOR_OBJECT, *fss_hash);
 }
 
 /*
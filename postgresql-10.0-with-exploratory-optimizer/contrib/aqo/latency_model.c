@@ -0,0 +1,468 @@
+#include "aqo.h"
+
+/*****************************************************************************
+ *
+ *	PLAN LATENCY MODEL
+ *
+ * Path costs are computed by costsize.c from estimated cardinalities and
+ * static cost constants, so a plan with the lowest cost is not necessarily
+ * the fastest one. This module learns the execution time of each executor
+ * node type from instrumented executions and uses it to choose the final
+ * plan among the cheapest candidate paths by predicted wall-clock time.
+ *
+ * Each node is described by the logarithms of its output rows and input rows
+ * (both per loop), its tuple width and its number of loops. The target is the
+ * logarithm of the node's own (exclusive) execution time per loop in
+ * microseconds. For each node type an OkNNr model is kept in the
+ * aqo_node_latency table.
+ *
+ *****************************************************************************/
+
+#define LATENCY_NFEATURES	4
+
+/* One observed executor node */
+typedef struct LatencySample
+{
+	int			node_type;
+	double		features[LATENCY_NFEATURES];
+	double		target;
+} LatencySample;
+
+/* OkNNr model of one node type, loaded for the current query */
+typedef struct LatencyModel
+{
+	int			node_type;
+	int			rows;
+	double	  **matrix;
+	double	   *targets;
+} LatencyModel;
+
+static void form_latency_features(double *features, double rows_out,
+					  double rows_in, double width, double loops);
+static bool collect_node_latency(PlanState *p, List **samples);
+static LatencyModel *get_latency_model(List **models, int node_type);
+static void free_latency_models(List *models);
+static bool predict_node_latency(List **models, int node_type,
+					 double rows_out, double rows_in, double width,
+					 double loops, double *latency);
+static bool predict_path_latency(Path *path, double loops, List **models,
+					 double *latency);
+
+
+/*
+ * Fills the feature vector of a node.
+ */
+static void
+form_latency_features(double *features, double rows_out, double rows_in,
+					  double width, double loops)
+{
+	features[0] = log(1 + rows_out);
+	features[1] = log(1 + rows_in);
+	features[2] = log(1 + width);
+	features[3] = log(Max(loops, 1));
+}
+
+/*
+ * Walks over the executed PlanState tree and collects a sample for each node
+ * whose exclusive time can be computed from its instrumentation. Nodes with
+ * children other than lefttree and righttree, and nodes whose children run in
+ * parallel workers, are skipped.
+ */
+static bool
+collect_node_latency(PlanState *p, List **samples)
+{
+	Instrumentation *instr = p->instrument;
+	LatencySample *sample;
+	double		self_time;
+	double		rows_in = 0;
+
+	if (instr != NULL && instr->need_timer)
+		InstrEndLoop(instr);
+
+	switch (nodeTag(p))
+	{
+		case T_AppendState:
+		case T_MergeAppendState:
+		case T_ModifyTableState:
+		case T_SubqueryScanState:
+		case T_BitmapAndState:
+		case T_BitmapOrState:
+		case T_CustomScanState:
+		case T_GatherState:
+		case T_GatherMergeState:
+			instr = NULL;
+			break;
+		default:
+			break;
+	}
+
+	if (instr != NULL && instr->need_timer && instr->nloops > 0)
+	{
+		self_time = instr->total;
+		if (outerPlanState(p) != NULL && outerPlanState(p)->instrument)
+		{
+			InstrEndLoop(outerPlanState(p)->instrument);
+			self_time -= outerPlanState(p)->instrument->total;
+			rows_in += outerPlanState(p)->instrument->ntuples;
+		}
+		if (innerPlanState(p) != NULL && innerPlanState(p)->instrument)
+		{
+			InstrEndLoop(innerPlanState(p)->instrument);
+			self_time -= innerPlanState(p)->instrument->total;
+			rows_in += innerPlanState(p)->instrument->ntuples;
+		}
+
+		sample = palloc(sizeof(*sample));
+		sample->node_type = (int) nodeTag(p->plan);
+		form_latency_features(sample->features,
+							  instr->ntuples / instr->nloops,
+							  rows_in / instr->nloops,
+							  p->plan->plan_width,
+							  instr->nloops);
+		sample->target = log(1 + Max(self_time, 0) * 1e6 / instr->nloops);
+		*samples = lappend(*samples, sample);
+	}
+
+	return planstate_tree_walker(p, collect_node_latency, samples);
+}
+
+/*
+ * Updates latency models of all node types of the executed plan.
+ * It is supposed that the query was executed with INSTRUMENT_TIMER.
+ */
+void
+learn_plan_latency(PlanState *planstate)
+{
+	List	   *samples = NIL;
+	List	   *done_types = NIL;
+	ListCell   *l,
+			   *m;
+	double	  **matrix;
+	double	   *targets;
+	int			rows;
+
+	collect_node_latency(planstate, &samples);
+
+	matrix = OkNNr_allocate_matrix(latency_model_K, LATENCY_NFEATURES);
+	targets = palloc0(sizeof(*targets) * latency_model_K);
+
+	foreach(l, samples)
+	{
+		LatencySample *sample = (LatencySample *) lfirst(l);
+
+		if (list_member_int(done_types, sample->node_type))
+			continue;
+		done_types = lappend_int(done_types, sample->node_type);
+
+		if (!load_latency_model(sample->node_type, LATENCY_NFEATURES,
+								matrix, targets, &rows))
+			rows = 0;
+
+		/* Learn all samples of this node type at once */
+		for_each_cell(m, l)
+		{
+			LatencySample *cur = (LatencySample *) lfirst(m);
+			List	   *changed_lines;
+			ListCell   *c;
+
+			if (cur->node_type != sample->node_type)
+				continue;
+
+			changed_lines = OkNNr_learn(rows, LATENCY_NFEATURES,
+										matrix, targets,
+										cur->features, cur->target,
+										latency_model_K);
+			foreach(c, changed_lines)
+			{
+				if (lfirst_int(c) >= rows)
+					rows = lfirst_int(c) + 1;
+			}
+			list_free(changed_lines);
+		}
+
+		update_latency_model(sample->node_type, rows, LATENCY_NFEATURES,
+							 matrix, targets);
+	}
+
+	pfree(matrix);
+	pfree(targets);
+	list_free(done_types);
+	list_free_deep(samples);
+}
+
+/*
+ * Returns the model of given node type, loading it from aqo_node_latency on
+ * first access. Models are cached in the 'models' list for the duration of
+ * one choice of the final path.
+ */
+static LatencyModel *
+get_latency_model(List **models, int node_type)
+{
+	LatencyModel *model;
+	ListCell   *l;
+
+	foreach(l, *models)
+	{
+		model = (LatencyModel *) lfirst(l);
+		if (model->node_type == node_type)
+			return model;
+	}
+
+	model = palloc(sizeof(*model));
+	model->node_type = node_type;
+	model->matrix = OkNNr_allocate_matrix(latency_model_K, LATENCY_NFEATURES);
+	model->targets = palloc0(sizeof(*model->targets) * latency_model_K);
+	if (!load_latency_model(node_type, LATENCY_NFEATURES,
+							model->matrix, model->targets, &model->rows))
+		model->rows = 0;
+
+	*models = lappend(*models, model);
+	return model;
+}
+
+static void
+free_latency_models(List *models)
+{
+	ListCell   *l;
+
+	foreach(l, models)
+	{
+		LatencyModel *model = (LatencyModel *) lfirst(l);
+
+		pfree(model->matrix);
+		pfree(model->targets);
+	}
+	list_free_deep(models);
+}
+
+/*
+ * Predicts the total time (in microseconds, over all loops) of one node.
+ * Returns false if the model of the node type is not trained enough.
+ */
+static bool
+predict_node_latency(List **models, int node_type, double rows_out,
+					 double rows_in, double width, double loops,
+					 double *latency)
+{
+	LatencyModel *model = get_latency_model(models, node_type);
+	double		features[LATENCY_NFEATURES];
+	double		result;
+
+	if (model->rows < aqo_k)
+		return false;
+
+	form_latency_features(features, rows_out, rows_in, width, loops);
+	result = OkNNr_predict(model->rows, LATENCY_NFEATURES,
+						   model->matrix, model->targets, features, aqo_k);
+	if (result < 0)
+		return false;
+
+	*latency += (exp(result) - 1) * Max(loops, 1);
+	return true;
+}
+
+/*
+ * Predicts the execution time of the plan which would be created from the
+ * given path, executed 'loops' times. Returns false if some node of the plan
+ * cannot be predicted.
+ */
+static bool
+predict_path_latency(Path *path, double loops, List **models, double *latency)
+{
+	List	   *children = NIL;
+	ListCell   *lc;
+	double		rows_in = 0;
+	double		width = path->pathtarget->width;
+	int			node_type = (int) path->pathtype;
+	bool		result = true;
+
+	switch (nodeTag(path))
+	{
+		case T_NestPath:
+			{
+				JoinPath   *jpath = (JoinPath *) path;
+
+				children = list_make2(jpath->outerjoinpath, jpath->innerjoinpath);
+			}
+			break;
+		case T_MergePath:
+			{
+				MergePath  *mpath = (MergePath *) path;
+				Path	   *outer = mpath->jpath.outerjoinpath;
+				Path	   *inner = mpath->jpath.innerjoinpath;
+
+				/* Sort and Material nodes are added to the plan by createplan.c */
+				if (mpath->outersortkeys != NIL &&
+					!predict_node_latency(models, T_Sort, outer->rows,
+										  outer->rows, outer->pathtarget->width,
+										  loops, latency))
+					return false;
+				if (mpath->innersortkeys != NIL &&
+					!predict_node_latency(models, T_Sort, inner->rows,
+										  inner->rows, inner->pathtarget->width,
+										  loops, latency))
+					return false;
+				if (mpath->materialize_inner &&
+					!predict_node_latency(models, T_Material, inner->rows,
+										  inner->rows, inner->pathtarget->width,
+										  loops, latency))
+					return false;
+				children = list_make2(outer, inner);
+			}
+			break;
+		case T_HashPath:
+			{
+				Path	   *inner = ((JoinPath *) path)->innerjoinpath;
+
+				/* The Hash node is added to the plan by createplan.c */
+				if (!predict_node_latency(models, T_Hash, inner->rows,
+										  inner->rows, inner->pathtarget->width,
+										  loops, latency))
+					return false;
+				children = list_make2(((JoinPath *) path)->outerjoinpath, inner);
+			}
+			break;
+		case T_BitmapHeapPath:
+			{
+				Path	   *bitmapqual = ((BitmapHeapPath *) path)->bitmapqual;
+
+				if (!IsA(bitmapqual, IndexPath))
+					return false;
+				if (!predict_node_latency(models, T_BitmapIndexScan,
+										  bitmapqual->rows, 0, 0,
+										  loops, latency))
+					return false;
+				rows_in = bitmapqual->rows;
+			}
+			break;
+		case T_ProjectionPath:
+			/* A projection usually does not produce a separate plan node */
+			return predict_path_latency(((ProjectionPath *) path)->subpath,
+										loops, models, latency);
+		case T_MaterialPath:
+			children = list_make1(((MaterialPath *) path)->subpath);
+			break;
+		case T_UniquePath:
+			children = list_make1(((UniquePath *) path)->subpath);
+			break;
+		case T_ProjectSetPath:
+			children = list_make1(((ProjectSetPath *) path)->subpath);
+			break;
+		case T_SortPath:
+			children = list_make1(((SortPath *) path)->subpath);
+			break;
+		case T_GroupPath:
+			children = list_make1(((GroupPath *) path)->subpath);
+			break;
+		case T_UpperUniquePath:
+			children = list_make1(((UpperUniquePath *) path)->subpath);
+			break;
+		case T_AggPath:
+			children = list_make1(((AggPath *) path)->subpath);
+			break;
+		case T_GroupingSetsPath:
+			children = list_make1(((GroupingSetsPath *) path)->subpath);
+			break;
+		case T_WindowAggPath:
+			children = list_make1(((WindowAggPath *) path)->subpath);
+			break;
+		case T_SetOpPath:
+			children = list_make1(((SetOpPath *) path)->subpath);
+			break;
+		case T_LockRowsPath:
+			children = list_make1(((LockRowsPath *) path)->subpath);
+			break;
+		case T_LimitPath:
+			children = list_make1(((LimitPath *) path)->subpath);
+			break;
+		case T_Path:
+		case T_IndexPath:
+		case T_TidPath:
+		case T_ForeignPath:
+		case T_ResultPath:
+		case T_MinMaxAggPath:
+			/* Leaf nodes */
+			break;
+		default:
+			/* Nodes which are not learned by collect_node_latency() */
+			return false;
+	}
+
+	/*
+	 * Compute input rows per loop of the node. The inner side of a nested
+	 * loop is rescanned for each outer row.
+	 */
+	foreach(lc, children)
+	{
+		Path	   *child = (Path *) lfirst(lc);
+		double		cur_loops = loops;
+
+		if (IsA(path, NestPath) && child == ((JoinPath *) path)->innerjoinpath)
+			cur_loops = loops * Max(((JoinPath *) path)->outerjoinpath->rows, 1);
+
+		rows_in += child->rows * cur_loops / Max(loops, 1);
+		if (!predict_path_latency(child, cur_loops, models, latency))
+		{
+			result = false;
+			break;
+		}
+	}
+	list_free(children);
+
+	if (!result)
+		return false;
+
+	return predict_node_latency(models, node_type, path->rows, rows_in,
+								width, loops, latency);
+}
+
+/*
+ * Chooses the final path of the query by predicted execution time.
+ *
+ * Only the paths whose cost is within latency_model_cost_window of the path
+ * chosen by the cost-based rules are considered, and the choice falls back to
+ * that path whenever its latency cannot be predicted.
+ */
+Path *
+aqo_choose_final_path(PlannerInfo *root, RelOptInfo *final_rel,
+					  Path *best_path, double tuple_fraction)
+{
+	List	   *models = NIL;
+	Path	   *result = best_path;
+	double		best_latency = 0;
+	ListCell   *l;
+
+	if (prev_choose_final_path_hook)
+		best_path = result = prev_choose_final_path_hook(root, final_rel,
+														 best_path,
+														 tuple_fraction);
+
+	if (!use_latency_model || !query_context.use_aqo ||
+		root->search_plan_mode == 0 || tuple_fraction > 0.0 ||
+		list_length(final_rel->pathlist) < 2)
+		return result;
+
+	if (predict_path_latency(best_path, 1, &models, &best_latency))
+	{
+		foreach(l, final_rel->pathlist)
+		{
+			Path	   *path = (Path *) lfirst(l);
+			double		latency = 0;
+
+			if (path == best_path ||
+				path->param_info != NULL ||
+				path->total_cost > best_path->total_cost * latency_model_cost_window)
+				continue;
+
+			if (predict_path_latency(path, 1, &models, &latency) &&
+				latency < best_latency)
+			{
+				best_latency = latency;
+				result = path;
+			}
+		}
+	}
+
+	free_latency_models(models);
+	return result;
+}
@@ -0,0 +1,206 @@
+#include "aqo.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+/*****************************************************************************
+ *
+ *	DEFERRED LEARNING
+ *
+ * A learned object changes the row of its model in aqo_data_lwpr, so a
+ * backend learning on a feature subspace whose row is being updated by
+ * another transaction would wait for that transaction to end. Instead, the
+ * backend publishes the object into this shared queue and goes on. The next
+ * backend which learns on the subspace takes the queued objects and learns
+ * them together with its own one before it stores the model. lwpr_update
+ * changes the model by one object, so the queued objects are exactly the
+ * deltas the stored model misses.
+ *
+ * The queue has AQO_LEARN_QUEUE_PARTITIONS partitions of AQO_LEARN_QUEUE_SLOTS
+ * objects. A subspace belongs to one partition, which has its own lock of the
+ * "aqo_learn_queue" tranche. The lock is held only to copy the objects, never
+ * while a model is learned or a table is accessed. An object with more than
+ * AQO_LEARN_QUEUE_MAX_FEATURES features, or which does not fit into the
+ * partition, is not queued: its backend waits for the row as before.
+ *
+ * The queued objects are lost at a restart of the server, and the objects
+ * taken by a transaction are lost if it aborts, as its own object is. The
+ * queue is available only if AQO is loaded via shared_preload_libraries.
+ *
+ *****************************************************************************/
+
+#define AQO_LEARN_QUEUE_PARTITIONS 16
+#define AQO_LEARN_QUEUE_SLOTS 64
+#define AQO_LEARN_QUEUE_MAX_FEATURES 32
+
+typedef struct AqoLearnQueueSlot
+{
+	bool		used;
+	Oid			dbid;
+	int			fspace_hash;
+	int			fss_hash;
+	int			nfeatures;
+	double		target;
+	double		features[AQO_LEARN_QUEUE_MAX_FEATURES];
+} AqoLearnQueueSlot;
+
+typedef struct AqoLearnQueuePartition
+{
+	LWLock	   *lock;
+	int			nused;
+	AqoLearnQueueSlot slots[AQO_LEARN_QUEUE_SLOTS];
+} AqoLearnQueuePartition;
+
+static AqoLearnQueuePartition *learn_queue = NULL;
+
+static Size learn_queue_memsize(void);
+static AqoLearnQueuePartition *learn_queue_partition(int fss_hash);
+static bool learn_queue_slot_matches(AqoLearnQueueSlot *slot, int fss_hash,
+						 int nfeatures);
+
+
+static Size
+learn_queue_memsize(void)
+{
+	return mul_size(AQO_LEARN_QUEUE_PARTITIONS,
+					sizeof(AqoLearnQueuePartition));
+}
+
+/*
+ * Requests the shared memory for the queue. Must be called from _PG_init
+ * while shared_preload_libraries are loaded.
+ */
+void
+learn_queue_request_shmem(void)
+{
+	RequestAddinShmemSpace(learn_queue_memsize());
+	RequestNamedLWLockTranche("aqo_learn_queue", AQO_LEARN_QUEUE_PARTITIONS);
+}
+
+void
+learn_queue_shmem_startup(void)
+{
+	bool		found;
+	int			i;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	learn_queue = ShmemInitStruct("aqo_learn_queue", learn_queue_memsize(),
+								  &found);
+	if (!found)
+	{
+		LWLockPadded *locks = GetNamedLWLockTranche("aqo_learn_queue");
+
+		MemSet(learn_queue, 0, learn_queue_memsize());
+		for (i = 0; i < AQO_LEARN_QUEUE_PARTITIONS; ++i)
+			learn_queue[i].lock = &locks[i].lock;
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+static AqoLearnQueuePartition *
+learn_queue_partition(int fss_hash)
+{
+	return &learn_queue[(uint32) fss_hash % AQO_LEARN_QUEUE_PARTITIONS];
+}
+
+/*
+ * Whether the slot keeps an object of the subspace of the current feature
+ * space in the current database.
+ */
+static bool
+learn_queue_slot_matches(AqoLearnQueueSlot *slot, int fss_hash, int nfeatures)
+{
+	return slot->used && slot->dbid == MyDatabaseId &&
+		slot->fspace_hash == query_context.fspace_hash &&
+		slot->fss_hash == fss_hash && slot->nfeatures == nfeatures;
+}
+
+/*
+ * Queues the objects (a list of AqoLearnObject) of the subspace. Queues all
+ * of them or none; returns false in the latter case.
+ */
+bool
+learn_queue_push(int fss_hash, int nfeatures, List *objects)
+{
+	AqoLearnQueuePartition *part;
+	ListCell   *l;
+	int			i = 0;
+
+	if (learn_queue == NULL || nfeatures > AQO_LEARN_QUEUE_MAX_FEATURES)
+		return false;
+
+	part = learn_queue_partition(fss_hash);
+	LWLockAcquire(part->lock, LW_EXCLUSIVE);
+
+	if (part->nused + list_length(objects) > AQO_LEARN_QUEUE_SLOTS)
+	{
+		LWLockRelease(part->lock);
+		return false;
+	}
+
+	foreach(l, objects)
+	{
+		AqoLearnObject *obj = (AqoLearnObject *) lfirst(l);
+		AqoLearnQueueSlot *slot;
+
+		while (part->slots[i].used)
+			++i;
+		slot = &part->slots[i];
+		slot->used = true;
+		slot->dbid = MyDatabaseId;
+		slot->fspace_hash = query_context.fspace_hash;
+		slot->fss_hash = fss_hash;
+		slot->nfeatures = nfeatures;
+		slot->target = obj->target;
+		memcpy(slot->features, obj->features, sizeof(double) * nfeatures);
+		part->nused++;
+	}
+
+	LWLockRelease(part->lock);
+	return true;
+}
+
+/*
+ * Removes the queued objects of the subspace from the queue and returns them
+ * as a list of AqoLearnObject in the current memory context.
+ */
+List *
+learn_queue_pop(int fss_hash, int nfeatures)
+{
+	AqoLearnQueuePartition *part;
+	List	   *objects = NIL;
+	int			i;
+
+	if (learn_queue == NULL || nfeatures > AQO_LEARN_QUEUE_MAX_FEATURES)
+		return NIL;
+
+	part = learn_queue_partition(fss_hash);
+
+	/* A racy look is enough to skip the lock when nothing is queued */
+	if (part->nused == 0)
+		return NIL;
+
+	LWLockAcquire(part->lock, LW_EXCLUSIVE);
+	for (i = 0; i < AQO_LEARN_QUEUE_SLOTS && part->nused > 0; ++i)
+	{
+		AqoLearnQueueSlot *slot = &part->slots[i];
+		AqoLearnObject *obj;
+
+		if (!learn_queue_slot_matches(slot, fss_hash, nfeatures))
+			continue;
+
+		obj = palloc(sizeof(*obj));
+		obj->features = palloc(sizeof(double) * nfeatures);
+		memcpy(obj->features, slot->features, sizeof(double) * nfeatures);
+		obj->target = slot->target;
+		objects = lappend(objects, obj);
+
+		slot->used = false;
+		part->nused--;
+	}
+	LWLockRelease(part->lock);
+
+	return objects;
+}
@@ -13,26 +13,86 @@
  *
  *****************************************************************************/
 
-static double fs_distance(double *a, double *b, int len);
+/* Neighbours up to this k are kept on the stack */
+#define OKNNR_STACK_K	16
+
+/*
+ * A candidate neighbour: the squared L2-distance to the object and the row of
+ * the matrix. Ranking by the squared distance gives the same order as by the
+ * distance, so the square root is taken for the chosen neighbours only.
+ */
+typedef struct OkNNrNeighbour
+{
+	double		dist2;
+	int			idx;
+} OkNNrNeighbour;
+
+static double fs_distance2(const double *a, const double *b, int len);
+static double fs_distance_of(double dist2, int len);
 static double fs_similarity(double dist);
-static void OkNNr_compute_weights(double *distances, int matrix_rows,
-					  double **w, double *w_sum, int **idx, int aqo_k);
+static int OkNNr_nearest(int matrix_rows, int matrix_cols, double **matrix,
+			  const double *nw_features, int k, OkNNrNeighbour *nb);
+static void OkNNr_sift_down(OkNNrNeighbour *heap, int n, int i);
+static double OkNNr_compute_weights(OkNNrNeighbour *nb, int n, int matrix_cols,
+					  double *w);
 
 
 /*
- * Computes L2-distance between two given vectors.
+ * Allocates a zeroed matrix whose rows lie contiguously in one chunk after
+ * the row pointers. The matrix is freed by a single pfree.
  */
-double
-fs_distance(double *a, double *b, int len)
+double **
+OkNNr_allocate_matrix(int rows, int cols)
+{
+	double	  **matrix;
+	double	   *data;
+	int			i;
+
+	matrix = palloc0(MAXALIGN(sizeof(*matrix) * rows) +
+					 sizeof(**matrix) * rows * cols);
+	data = (double *) ((char *) matrix + MAXALIGN(sizeof(*matrix) * rows));
+	for (i = 0; i < rows; ++i)
+		matrix[i] = data + (size_t) i * cols;
+	return matrix;
+}
+
+/*
+ * Computes squared L2-distance between two given vectors. Four independent
+ * sums let the compiler keep the loop in vector registers.
+ */
+static double
+fs_distance2(const double *a, const double *b, int len)
 {
-	double		res = 0;
+	double		s0 = 0,
+				s1 = 0,
+				s2 = 0,
+				s3 = 0;
 	int			i;
 
-	for (i = 0; i < len; ++i)
-		res += (a[i] - b[i]) * (a[i] - b[i]);
-	if (len != 0)
-		res = sqrt(res / len);
-	return res;
+	for (i = 0; i + 4 <= len; i += 4)
+	{
+		double		d0 = a[i] - b[i];
+		double		d1 = a[i + 1] - b[i + 1];
+		double		d2 = a[i + 2] - b[i + 2];
+		double		d3 = a[i + 3] - b[i + 3];
+
+		s0 += d0 * d0;
+		s1 += d1 * d1;
+		s2 += d2 * d2;
+		s3 += d3 * d3;
+	}
+	for (; i < len; ++i)
+		s0 += (a[i] - b[i]) * (a[i] - b[i]);
+	return (s0 + s1) + (s2 + s3);
+}
+
+/*
+ * Converts squared distance into the normalized L2-distance the method uses.
+ */
+static double
+fs_distance_of(double dist2, int len)
+{
+	return (len != 0) ? sqrt(dist2 / len) : dist2;
 }
 
 /*
@@ -45,46 +105,101 @@ fs_similarity(double dist)
 }
 
 /*
- * Compute weights necessary for both prediction and learning.
- * Creates and returns w, w_sum and idx based on given distances ad matrix_rows.
+ * Finds the k nearest rows of the matrix to the object. nb receives them in
+ * the order of increasing distance, the rows being the tiebreak, and the
+ * number of found neighbours is returned.
  *
- * Appeared as a separate function because of "don't repeat your code"
- * principle.
+ * The candidates are kept in a max-heap of size k, so every row costs one
+ * comparison with the farthest candidate unless it is closer.
  */
-void
-OkNNr_compute_weights(double *distances, int matrix_rows,
-					  double **w, double *w_sum, int **idx, int aqo_k)
+static int
+OkNNr_nearest(int matrix_rows, int matrix_cols, double **matrix,
+			  const double *nw_features, int k, OkNNrNeighbour *nb)
 {
-	int			i,
-				j;
-	int			to_insert,
-				tmp;
+	int			n = 0;
+	int			i;
 
-	*w_sum = 0;
+	for (i = 0; i < matrix_rows; ++i)
+	{
+		double		dist2 = fs_distance2(matrix[i], nw_features, matrix_cols);
 
-	*idx = palloc0(sizeof(**idx) * aqo_k);
-	for (i = 0; i < aqo_k; ++i)
-		(*idx)[i] = -1;
-	(*w) = palloc0(sizeof(**w) * aqo_k);
+		if (n < k)
+		{
+			int			j = n++;
 
-	for (i = 0; i < matrix_rows; ++i)
-		for (j = 0; j < aqo_k; ++j)
-			if ((*idx)[j] == -1 || distances[i] < distances[(*idx)[j]])
+			/* Sift up; the row is the largest one seen, so ties stay below */
+			while (j > 0 && nb[(j - 1) / 2].dist2 <= dist2)
 			{
-				to_insert = i;
-				for (; j < aqo_k; ++j)
-				{
-					tmp = (*idx)[j];
-					(*idx)[j] = to_insert;
-					to_insert = tmp;
-				}
-				break;
+				nb[j] = nb[(j - 1) / 2];
+				j = (j - 1) / 2;
 			}
-	for (i = 0; i < aqo_k && (*idx)[i] != -1; ++i)
+			nb[j].dist2 = dist2;
+			nb[j].idx = i;
+		}
+		else if (n > 0 && dist2 < nb[0].dist2)
+		{
+			nb[0].dist2 = dist2;
+			nb[0].idx = i;
+			OkNNr_sift_down(nb, n, 0);
+		}
+	}
+
+	/* Heapsort into the increasing order */
+	for (i = n - 1; i > 0; --i)
+	{
+		OkNNrNeighbour tmp = nb[0];
+
+		nb[0] = nb[i];
+		nb[i] = tmp;
+		OkNNr_sift_down(nb, i, 0);
+	}
+	return n;
+}
+
+static void
+OkNNr_sift_down(OkNNrNeighbour *heap, int n, int i)
+{
+	OkNNrNeighbour item = heap[i];
+
+	for (;;)
 	{
-		(*w)[i] = fs_similarity(distances[(*idx)[i]]);
-		*w_sum += (*w)[i];
+		int			child = 2 * i + 1;
+
+		if (child >= n)
+			break;
+		if (child + 1 < n &&
+			(heap[child + 1].dist2 > heap[child].dist2 ||
+			 (heap[child + 1].dist2 == heap[child].dist2 &&
+			  heap[child + 1].idx > heap[child].idx)))
+			child++;
+		if (heap[child].dist2 < item.dist2 ||
+			(heap[child].dist2 == item.dist2 && heap[child].idx < item.idx))
+			break;
+		heap[i] = heap[child];
+		i = child;
 	}
+	heap[i] = item;
+}
+
+/*
+ * Compute weights necessary for both prediction and learning. Fills w for the
+ * given neighbours and returns the sum of weights.
+ *
+ * Appeared as a separate function because of "don't repeat your code"
+ * principle.
+ */
+static double
+OkNNr_compute_weights(OkNNrNeighbour *nb, int n, int matrix_cols, double *w)
+{
+	double		w_sum = 0;
+	int			i;
+
+	for (i = 0; i < n; ++i)
+	{
+		w[i] = fs_similarity(fs_distance_of(nb[i].dist2, matrix_cols));
+		w_sum += w[i];
+	}
+	return w_sum;
 }
 
 /*
@@ -98,34 +213,39 @@ OkNNr_predict(int matrix_rows, int matrix_cols,
 			  double **matrix, double *targets,
 			  double *nw_features, int aqo_k)
 {
-	double	   *distances;
-	int			i;
-	int		   *idx;
-	double	   *w;
+	OkNNrNeighbour nb_buf[OKNNR_STACK_K];
+	double		w_buf[OKNNR_STACK_K];
+	OkNNrNeighbour *nb = nb_buf;
+	double	   *w = w_buf;
 	double		w_sum;
 	double		result = 0;
+	int			n;
+	int			i;
 
-	distances = palloc0(sizeof(*distances) * matrix_rows);
-
-	for (i = 0; i < matrix_rows; ++i)
-		distances[i] = fs_distance(matrix[i], nw_features, matrix_cols);
+	if (aqo_k > OKNNR_STACK_K)
+	{
+		nb = palloc(sizeof(*nb) * aqo_k);
+		w = palloc(sizeof(*w) * aqo_k);
+	}
 
-	OkNNr_compute_weights(distances, matrix_rows, &w, &w_sum, &idx, aqo_k);
+	n = OkNNr_nearest(matrix_rows, matrix_cols, matrix, nw_features, aqo_k, nb);
+	w_sum = OkNNr_compute_weights(nb, n, matrix_cols, w);
 
-	for (i = 0; i < aqo_k; ++i)
-		if (idx[i] != -1)
-			result += targets[idx[i]] * w[i] / w_sum;
+	for (i = 0; i < n; ++i)
+		result += targets[nb[i].idx] * w[i] / w_sum;
 
 	if (result < 0)
 		result = 0;
 
 	/* this should never happen */
-	if (idx[0] == -1)
+	if (n == 0)
 		result = -1;
 
-	pfree(w);
-	pfree(distances);
-	pfree(idx);
+	if (nb != nb_buf)
+	{
+		pfree(nb);
+		pfree(w);
+	}
 
 	return result;
 }
@@ -135,45 +255,43 @@ OkNNr_predict2(int matrix_rows, int matrix_cols,
 			  double **matrix, double *targets,
 			  double *nw_features, int aqo_k)
 {
-	double	   *distances;
-	int			i;
-	int		   *idx;
-	double	   *w;
+	OkNNrNeighbour nb_buf[OKNNR_STACK_K];
+	double		w_buf[OKNNR_STACK_K];
+	OkNNrNeighbour *nb = nb_buf;
+	double	   *w = w_buf;
 	double		w_sum;
 	double		result = 0;
-    double      threshold_distance = 0.1;
-	double      min_distance = 9999;
+	double      threshold_distance = 0.1;
+	int			n;
+	int			i;
+
 	if(matrix_rows == 0){
 		return 0;
 	}
-	distances = palloc0(sizeof(*distances) * matrix_rows);
-    
-	for (i = 0; i < matrix_rows; ++i){
-		distances[i] = fs_distance(matrix[i], nw_features, matrix_cols);
-		if(distances[i] < min_distance){
-			min_distance = distances[i];
-		}
-	}
-	//判断当min_distance小于threshold_distance时，默认为0
-	if(min_distance > threshold_distance){
-		return 0;
+	if (aqo_k > OKNNR_STACK_K)
+	{
+		nb = palloc(sizeof(*nb) * aqo_k);
+		w = palloc(sizeof(*w) * aqo_k);
 	}
-	OkNNr_compute_weights(distances, matrix_rows, &w, &w_sum, &idx, aqo_k);
-
-	for (i = 0; i < aqo_k; ++i)
-		if (idx[i] != -1)
-			result += targets[idx[i]] * w[i] / w_sum;
 
-	if (result < 0)
-		result = 0;
+	n = OkNNr_nearest(matrix_rows, matrix_cols, matrix, nw_features, aqo_k, nb);
+	//判断当min_distance小于threshold_distance时，默认为0
+	if (n > 0 &&
+		fs_distance_of(nb[0].dist2, matrix_cols) <= threshold_distance)
+	{
+		w_sum = OkNNr_compute_weights(nb, n, matrix_cols, w);
+		for (i = 0; i < n; ++i)
+			result += targets[nb[i].idx] * w[i] / w_sum;
 
-	/* this should never happen */
-	if (idx[0] == -1)
-		result = -1;
+		if (result < 0)
+			result = 0;
+	}
 
-	pfree(w);
-	pfree(distances);
-	pfree(idx);
+	if (nb != nb_buf)
+	{
+		pfree(nb);
+		pfree(w);
+	}
 
 	return result;
 }
@@ -191,29 +309,31 @@ OkNNr_learn(int matrix_rows, int matrix_cols,
 			double *nw_features, double nw_target, int aqo_k)
 {
 	List	   *lst = NIL;
-	double	   *distances;
+	OkNNrNeighbour nb_buf[OKNNR_STACK_K];
+	double		w_buf[OKNNR_STACK_K];
+	OkNNrNeighbour *nb = nb_buf;
+	double	   *w = w_buf;
+	int			n;
 	int			i,
 				j;
-	int			min_distance_id = 0;
-	int		   *idx;
-	double	   *w;
+	int			min_distance_id;
 	double		w_sum;
 	double	   *cur_row;
 	double		coef1,
 				coef2;
 	double		result = 0;
 
-	distances = palloc0(sizeof(*distances) * matrix_rows);
-
-	for (i = 0; i < matrix_rows; ++i)
+	if (aqo_k > OKNNR_STACK_K)
 	{
-		distances[i] = fs_distance(matrix[i], nw_features, matrix_cols);
-		if (distances[i] < distances[min_distance_id])
-			min_distance_id = i;
+		nb = palloc(sizeof(*nb) * aqo_k);
+		w = palloc(sizeof(*w) * aqo_k);
 	}
+
+	n = OkNNr_nearest(matrix_rows, matrix_cols, matrix, nw_features, aqo_k, nb);
 	if (matrix_rows < aqo_k)
 	{
-		if (matrix_rows != 0 && distances[min_distance_id] <
+		min_distance_id = (n > 0) ? nb[0].idx : 0;
+		if (matrix_rows != 0 && fs_distance_of(nb[0].dist2, matrix_cols) <
 			object_selection_object_threshold)
 		{
 			for (j = 0; j < matrix_cols; ++j)
@@ -233,33 +353,33 @@ OkNNr_learn(int matrix_rows, int matrix_cols,
 	}
 	else
 	{
-		OkNNr_compute_weights(distances, matrix_rows, &w, &w_sum, &idx, aqo_k);
+		w_sum = OkNNr_compute_weights(nb, n, matrix_cols, w);
 
-		for (i = 0; i < aqo_k && idx[i] != -1; ++i)
-			result += targets[idx[i]] * w[i] / w_sum;
+		for (i = 0; i < n; ++i)
+			result += targets[nb[i].idx] * w[i] / w_sum;
 		coef1 = learning_rate * (result - nw_target);
 
-		for (i = 0; i < aqo_k && idx[i] != -1; ++i)
+		for (i = 0; i < n; ++i)
 		{
-			coef2 = coef1 * (targets[idx[i]] - result) * w[i] * w[i] /
+			double		distance = fs_distance_of(nb[i].dist2, matrix_cols);
+
+			coef2 = coef1 * (targets[nb[i].idx] - result) * w[i] * w[i] /
 				sqrt(matrix_cols) / w_sum;
 
-			targets[idx[i]] -= coef1 * w[i] / w_sum;
+			targets[nb[i].idx] -= coef1 * w[i] / w_sum;
+			cur_row = matrix[nb[i].idx];
 			for (j = 0; j < matrix_cols; ++j)
-			{
-				cur_row = matrix[idx[i]];
-				cur_row[j] -= coef2 * (nw_features[j] - cur_row[j]) /
-					distances[idx[i]];
-			}
+				cur_row[j] -= coef2 * (nw_features[j] - cur_row[j]) / distance;
 
-			lst = lappend_int(lst, idx[i]);
+			lst = lappend_int(lst, nb[i].idx);
 		}
+	}
 
+	if (nb != nb_buf)
+	{
+		pfree(nb);
 		pfree(w);
-		pfree(idx);
 	}
-
-	pfree(distances);
 	return lst;
 }
 
@@ -270,33 +390,21 @@ OkNNr_learn2(int matrix_rows, int matrix_cols,
 			double *nw_features, double nw_est_cost, double nw_true_cost, int aqo_k)
 {
 	List	   *lst = NIL;
-	double	   *distances;
-	int			i,
-				j;
+	int			j;
 	int			min_distance_id = 0;
-	int		   *idx;
-	double	   *w;
-	double		w_sum;
-	double	   *cur_row;
-	double		coef1,
-				coef2;
-	double		result = 0;
 	double      object_selection_object_threshold2 = 0.1;
 	double      learning_rate1 = 0.1;  // used for updating the query feature
 	double      learning_rate2 = 1;   //used for updating the estimated cost and true cost.
 	double      compare_rate = 0.01;  //cost*compare_rate < history_cost
     double      hist_cost = 0;
-	distances = palloc0(sizeof(*distances) * matrix_rows);
+	OkNNrNeighbour nearest;
     // find the nearest point
-	for (i = 0; i < matrix_rows; ++i)
-	{
-		distances[i] = fs_distance(matrix[i], nw_features, matrix_cols);
-		if (distances[i] < distances[min_distance_id])
-			min_distance_id = i;
-	}
+	if (OkNNr_nearest(matrix_rows, matrix_cols, matrix, nw_features, 1,
+					  &nearest) > 0)
+		min_distance_id = nearest.idx;
 	if (matrix_rows < aqo_k)
 	{
-		if (matrix_rows != 0 && distances[min_distance_id] <
+		if (matrix_rows != 0 && fs_distance_of(nearest.dist2, matrix_cols) <
 			object_selection_object_threshold2)
 		{
 			//judge if current nw_true_cost is less than the history point, if exist, update it, else do nothing. 2021.3.13
@@ -399,6 +507,5 @@ OkNNr_learn2(int matrix_rows, int matrix_cols,
 		}
 	}
 
-	pfree(distances);
 	return lst;
-}
\ No newline at end of file
+}
@@ -1,3 +1,5 @@
+#include <float.h>
+
 #include "aqo.h"
 
 /*****************************************************************************
@@ -6,6 +8,28 @@
  *  Written by jim 2020.4.2 
  *
  *****************************************************************************/
+/*
+ * The objects an update puts into the RF data houses. They are queued during
+ * lwpr_update and written by lwpr_store_datahouse once the caller has stored
+ * the model, so a retried merge does not store the same object twice. The
+ * queue lives in the memory context of the learning step and collects the
+ * objects of all its lwpr_updates.
+ */
+typedef struct LWPR_DatahouseObject {
+   int fss_hash;
+   int rf_hash;
+   int nIn;
+   double *features;
+   double target;
+} LWPR_DatahouseObject;
+
+static LWPR_DatahouseObject *datahouse_queue = NULL;
+static int datahouse_queue_len = 0;
+static int datahouse_queue_size = 0;
+
+static void lwpr_aux_queue_datahouse(int fss_hash, const double *subspace_pattern,
+   const double *features, double target, int nIn);
+
 /*初始化mode */
 int lwpr_init_model(LWPR_Model *model, int nIn, int nOut) {
 
@@ -42,6 +66,7 @@ int lwpr_init_model(LWPR_Model *model, int nIn, int nOut) {
    model->kernel = LWPR_GAUSSIAN_KERNEL;
    model->update_D = 1;
    model->fss_hash = 0;
+   model->staleness = 0;
    return 1;
 }
 
@@ -92,6 +117,8 @@ void lwpr_predict_explore(LWPR_Model *model, const double *x, double cutoff, Exp
    explore_values->est_future = model->explore_values->est_future;
    explore_values->est_uncof = model->explore_values->est_uncof;
    explore_values->rate = model->explore_values->rate;
+   explore_values->active_rfs = model->explore_values->active_rfs;
+   explore_values->knn_rfs = model->explore_values->knn_rfs;
    // 正则化输出
    y = TD.yn;
    y = y*model->norm_out;
@@ -113,6 +140,124 @@ int lwpr_update(LWPR_Model *model, const double *x, const double y) {
    return code;
 }
 
+/*
+ * Queues an object for the data house of the RF centred at subspace_pattern.
+ */
+static void lwpr_aux_queue_datahouse(int fss_hash, const double *subspace_pattern,
+   const double *features, double target, int nIn) {
+   LWPR_DatahouseObject *obj;
+
+   if (datahouse_queue_len >= datahouse_queue_size) {
+      datahouse_queue_size = (datahouse_queue_size > 0) ? 2*datahouse_queue_size : 4;
+      if (datahouse_queue == NULL)
+         datahouse_queue = palloc(datahouse_queue_size*sizeof(*datahouse_queue));
+      else
+         datahouse_queue = repalloc(datahouse_queue, datahouse_queue_size*sizeof(*datahouse_queue));
+   }
+   obj = &datahouse_queue[datahouse_queue_len++];
+   obj->fss_hash = fss_hash;
+   obj->rf_hash = get_int_array_hash2((double *) subspace_pattern, nIn);
+   obj->nIn = nIn;
+   obj->features = palloc(nIn*sizeof(double));
+   memcpy(obj->features, features, nIn*sizeof(double));
+   obj->target = target;
+}
+
+/*
+ * Forgets the queue, which may be left in a reset memory context by an error.
+ * Must be called before the first lwpr_update of a learning step.
+ */
+void lwpr_reset_datahouse(void) {
+   datahouse_queue = NULL;
+   datahouse_queue_len = 0;
+   datahouse_queue_size = 0;
+}
+
+/*
+ * Writes the objects queued by the lwpr_updates into the RF data houses.
+ * Returns the number of written objects.
+ */
+int lwpr_store_datahouse(void) {
+   int n = datahouse_queue_len;
+   int k;
+
+   for (k=0;k<datahouse_queue_len;k++) {
+      LWPR_DatahouseObject *obj = &datahouse_queue[k];
+      int nIn = obj->nIn;
+      double **matrix;
+      double *targets;
+      int rows;
+      List *changed_lines;
+      ListCell *l;
+      int new_matrix_rows;
+
+      matrix = OkNNr_allocate_matrix(2*nIn+1, nIn);
+      targets = palloc0(sizeof(*targets) * (2*nIn+1));
+      if (!load_rf_datahouse(obj->fss_hash, obj->rf_hash, matrix, targets, &rows))
+         rows = 0;
+      changed_lines = OkNNr_learn(rows, nIn, matrix, targets,
+                                  obj->features, obj->target, (2*nIn+1));
+      new_matrix_rows = rows;
+      foreach(l, changed_lines)
+      {
+         if (lfirst_int(l) >= new_matrix_rows)
+            new_matrix_rows = lfirst_int(l) + 1;
+      }
+      update_rf_datahouse(obj->fss_hash, obj->rf_hash, nIn, new_matrix_rows, matrix, targets);
+      list_free(changed_lines);
+      pfree(matrix);
+      pfree(targets);
+      pfree(obj->features);
+   }
+   datahouse_queue_len = 0;
+   return n;
+}
+
+/*
+ * Drops the objects queued by the lwpr_updates. Returns their number.
+ */
+int lwpr_discard_datahouse(void) {
+   int n = datahouse_queue_len;
+   int k;
+
+   for (k=0;k<datahouse_queue_len;k++)
+      pfree(datahouse_queue[k].features);
+   datahouse_queue_len = 0;
+   return n;
+}
+
+/*
+ * Returns the RF of the largest activation at the input over all RFs and
+ * sets *w_max to it. The predictions need it when no RF reaches the cutoff.
+ */
+static int lwpr_aux_max_activation(LWPR_ThreadData *TD, double *w_max) {
+   LWPR_Model *model = TD->model;
+   int idx_max = 0;
+   int n;
+
+   *w_max = 0.0;
+   for (n=0;n<model->numRFS;n++) {
+      LWPR_ReceptiveField *RF = model->rf[n];
+      double dist = model->kernels->rf_distance(model->nIn, model->nInStore, RF->D, RF->c, TD->xn, TD->ws->xc);
+      double w = 0.0;
+
+      switch(model->kernel) {
+         case LWPR_GAUSSIAN_KERNEL:
+            w = exp(-0.5*dist);
+            break;
+         case LWPR_BISQUARE_KERNEL:
+            w = 1-0.25*dist;
+            w = (w<0) ? 0 : w*w;
+            break;
+      }
+      if (w > *w_max) {
+         *w_max = w;
+         idx_max = n;
+      }
+   }
+   return idx_max;
+}
+
 /*
 *  some useful functions
 */
@@ -121,7 +266,7 @@ void lwpr_aux_predict_one_T(void *ptr) {
    LWPR_ThreadData *TD = (LWPR_ThreadData *) ptr;
    LWPR_Workspace *WS = TD->ws;
 
-   int i,j,n;
+   int i;
    int nIn=TD->model->nIn;
    int nInS=TD->model->nInStore;
    
@@ -134,12 +279,15 @@ void lwpr_aux_predict_one_T(void *ptr) {
    
    double sum_w = 0.0;
    int idx_max = 0;
+   int *rfs;
+   int r,nrfs;
    TD->w_max = 0.0;
    
    
-
-   for (n=0;n<TD->model->numRFS;n++) {
-      
+   /* the RFs out of reach of the cutoff would be skipped below anyway */
+   nrfs = lwpr_rf_candidates(TD->model, TD->xn, TD->cutoff, &rfs);
+   for (r=0;r<nrfs;r++) {
+      int n = (rfs != NULL) ? rfs[r] : r;
       double dist = 0.0;
       LWPR_ReceptiveField *RF = TD->model->rf[n];
       //读取rf数据相关变量
@@ -150,14 +298,7 @@ void lwpr_aux_predict_one_T(void *ptr) {
       int         fss_hash = TD->model->fss_hash;
       int         rf_hash;
       int			rows;
-      int			k;
-      for (i=0;i<nIn;i++) {
-         xc[i] = TD->xn[i] - RF->c[i];
-      }
-
-      for (j=0;j<nIn;j++) {
-         dist += xc[j] * lwpr_math_dot_product(RF->D + j*nInS, xc, nIn);
-      }
+      dist = TD->model->kernels->rf_distance(nIn, nInS, RF->D, RF->c, TD->xn, xc);
 
       switch(TD->model->kernel) {
          case LWPR_GAUSSIAN_KERNEL:
@@ -188,15 +329,12 @@ void lwpr_aux_predict_one_T(void *ptr) {
             if(RF->trustworthy){
                int nR = RF->nReg;
                if (RF->n_data[nR-1] <= 2*nIn) nR--;         
-               lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
+               TD->model->kernels->compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
                for (i=0;i<nR;i++) {yp_n+=s[i]*RF->beta[i];}
             }else{
                //否则使用knn进行计算
                //1.初始化矩阵
-               matrix = palloc(sizeof(*matrix) *(2.0*nIn+1));
-               for (k = 0; k < (2.0*nIn+1); ++k){
-                  matrix[k] = palloc0(sizeof(**matrix) * nIn);
-               }
+               matrix = OkNNr_allocate_matrix(2*nIn+1, nIn);
                targets = palloc0(sizeof(*targets) * (2.0*nIn+1));
                //计算当前rf_hash
                rf_hash = get_int_array_hash2(subspace_pattern, nIn);
@@ -205,8 +343,6 @@ void lwpr_aux_predict_one_T(void *ptr) {
                   yp_n = OkNNr_predict(rows,  nIn, matrix, targets, features, 2);
                }
                //释放内存
-               for (k = 0; k < (2.0*nIn+1); ++k)
-                  pfree(matrix[k]);
                pfree(matrix);
                pfree(targets);
             } 
@@ -216,6 +352,9 @@ void lwpr_aux_predict_one_T(void *ptr) {
          sum_w += w;
       }
    }
+   /* the largest activation is below the cutoff: it may be of a skipped RF */
+   if (sum_w <= 0.0 && rfs != NULL)
+      idx_max = lwpr_aux_max_activation(TD, &TD->w_max);
    // 求最终的值
    if (sum_w > 0.0) {
       yp/=sum_w;
@@ -230,21 +369,17 @@ void lwpr_aux_predict_one_T(void *ptr) {
       int         fss_hash = TD->model->fss_hash;
       int         rf_hash;
       int			rows;
-      int			k;
       // 当rf可信时，使用PLS进行计算
       if(RF->trustworthy){
          yp = RF->beta0;
          int nR = RF->nReg;
          if (RF->n_data[nR-1] <= 2*nIn) nR--;         
-         lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
+         TD->model->kernels->compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
          for (i=0;i<nR;i++) {yp+=s[i]*RF->beta[i];}
       }else{
          //否则使用knn进行计算
          //1.初始化矩阵
-         matrix = palloc(sizeof(*matrix) *(2.0*nIn+1));
-         for (k = 0; k < (2.0*nIn+1); ++k){
-            matrix[k] = palloc0(sizeof(**matrix) * nIn);
-         }
+         matrix = OkNNr_allocate_matrix(2*nIn+1, nIn);
          targets = palloc0(sizeof(*targets) * (2.0*nIn+1));
          //计算当前rf_hash
          rf_hash = get_int_array_hash2(subspace_pattern, nIn);
@@ -253,8 +388,6 @@ void lwpr_aux_predict_one_T(void *ptr) {
             yp = OkNNr_predict(rows,  nIn, matrix, targets, features, 2);
          }
          //释放内存
-         for (k = 0; k < (2.0*nIn+1); ++k)
-            pfree(matrix[k]);
          pfree(matrix);
          pfree(targets);
       }
@@ -278,16 +411,12 @@ void  lwpr_aux_predict_conf_one_T(void *ptr) {
    //get total happen weight(frequent) of all receptive field
    double *total_happen_freq;
    total_happen_freq = palloc0(sizeof(*total_happen_freq) * num_query_pattern);
-   //get history data
-   double **history_data_matrix = model->history_data_matrix;
-   //get the num of history data, modified by jim
-   double *num_history_data = model->num_history_data;
-   int current_data_matric_inx = 1;
-   int current_data_num = 1;
    //define the future_value for every query pattern
    double *future_value_pattern;
    future_value_pattern = palloc0(sizeof(*future_value_pattern) * num_query_pattern);
-   int i,j,n,m,k,k2,l;
+   int i,m,k,l,h;
+   int *rfs;
+   int r,nrfs;
    int nIn=TD->model->nIn;
    int nInS=TD->model->nInStore;
    
@@ -315,34 +444,25 @@ void  lwpr_aux_predict_conf_one_T(void *ptr) {
    //min_error used for deciding whether to use origin estimation, modified by jim in 2021.1.23
    double min_error = 9999;
    
-   //current query_distribution
-   double current_query_distribution = 0;
    // calculate the happen frequency(probability) by using the history data. Maybe someday we use more suitable method;
    // modified by jim 2021.2.16, calculate the RF frequency for every query pattern, used by calculating the explore_value for every query pattern
-   for(n=0;n<TD->model->numRFS;n++){
-      //对每一个感受野进行处理
-      LWPR_ReceptiveField *RF = TD->model->rf[n];
-      for(m=0;m<num_query_pattern;m++){
-         current_query_distribution = query_context.query_distribution[m];
-         if(current_query_distribution == 0){
-            RF->prob_rf[m] = 0;
-            total_happen_freq[m] = 0;
-         }else
-         {
-            /* code */
-            RF->prob_rf[m] = 0;
-            for(k=0;k<num_history_data[m];k++){
-               double dist = 0.0;
-               double *current_xn = palloc0(sizeof(*current_xn) * nIn);
-               for(k2=0;k2<nIn;k2++){
-                  current_xn[k2] = history_data_matrix[m][k*nIn+1+k2];
-               }
-               for (i=0;i<nIn;i++) {
-                  xc[i] = current_xn[i] - RF->c[i];
-               }
-               for (j=0;j<nIn;j++) {
-                  dist += xc[j] * lwpr_math_dot_product(RF->D + j*nInS, xc, nIn);
-               }
+   for(r=0;r<TD->model->numRFS;r++)
+      memset(TD->model->rf[r]->prob_rf, 0, sizeof(double) * num_query_pattern);
+   /* only the templates the model was observed with */
+   for(h=0;h<model->num_history;h++){
+      LWPR_TemplateHistory *history = &model->history[h];
+
+      m = history->query_hash - 1;
+      if(query_context.query_distribution[m] != 0){
+         for(k=0;k<history->num;k++){
+            /* the k-th historical input of the pattern, in any order */
+            const double *current_xn = history->xn + k*nIn;
+
+            nrfs = lwpr_rf_candidates(model, current_xn, TD->cutoff, &rfs);
+            for(r=0;r<nrfs;r++){
+               //对每一个感受野进行处理
+               LWPR_ReceptiveField *RF = TD->model->rf[(rfs != NULL) ? rfs[r] : r];
+               double dist = TD->model->kernels->rf_distance(nIn, nInS, RF->D, RF->c, current_xn, xc);
 
                switch(TD->model->kernel) {
                   case LWPR_GAUSSIAN_KERNEL:
@@ -361,42 +481,20 @@ void  lwpr_aux_predict_conf_one_T(void *ptr) {
                   RF->prob_rf[m] += 0;
                }
             }
-            total_happen_freq[m] += RF->prob_rf[m];
-         }      
-      }//num_pattern
-   //rf
-   }
-   //modified by jim 2021.2.26，将其从update的部分移入到predict部分，这里还需要保存
-   //更新历史数据矩阵，没有必要使用for语句
-   /*判断是否跟当前查询相关，如果相关，则进行处理，否则跳过,只需处理我们规定的查询模板*/
-   if (query_context.current_query_hash!=0){
-      current_data_matric_inx = query_context.current_query_hash -1;
-      current_data_num = (int) num_history_data[current_data_matric_inx];
-      if(current_data_num<num_history_data_compute_probability_rf){
-         /* 只需添加该数据 */
-         for(i=current_data_num*nIn+1; i<(current_data_num+1)*nIn+1; i++){
-            history_data_matrix[current_data_matric_inx][i] = TD->xn[i-current_data_num*nIn-1];
-         }
-         current_data_num += 1;
-         num_history_data[current_data_matric_inx] = (double) current_data_num;
-      }else
-      {
-         /* 将最之前的一个数据进行删除*/
-         for(i=1; i<num_history_data_compute_probability_rf; i++){
-            for(j=0; j<nIn; j++){
-               history_data_matrix[current_data_matric_inx][(i-1)*nIn+1+j] = history_data_matrix[current_data_matric_inx][i*nIn+1+j];
-            }
          }
-         /*将当前数据加入到矩阵最末尾 */
-         for(i=0; i<nIn; i++){
-            history_data_matrix[current_data_matric_inx][(num_history_data_compute_probability_rf-1)*nIn+1+i] = TD->xn[i];
-         }
-         //num_history_data保持不变
+         for(r=0;r<TD->model->numRFS;r++)
+            total_happen_freq[m] += TD->model->rf[r]->prob_rf[m];
       }
-   }
+   }//num_pattern
+   //modified by jim 2021.2.26，将其从update的部分移入到predict部分，这里还需要保存
+   /*判断是否跟当前查询相关，如果相关，则进行处理，否则跳过,只需处理我们规定的查询模板*/
+   if (query_context.current_query_hash!=0)
+      lwpr_history_add(model, query_context.current_query_hash, TD->xn);
 
    /* Prediction and confidence bounds in one go */
-   for (n=0;n<TD->model->numRFS;n++) {
+   nrfs = lwpr_rf_candidates(model, TD->xn, TD->cutoff, &rfs);
+   for (r=0;r<nrfs;r++) {
+      int n = (rfs != NULL) ? rfs[r] : r;
       double dist = 0.0;
       LWPR_ReceptiveField *RF = TD->model->rf[n];
 
@@ -406,15 +504,8 @@ void  lwpr_aux_predict_conf_one_T(void *ptr) {
       int         fss_hash = TD->model->fss_hash;
       int         rf_hash;
       int			rows;
-      int			k;
 
-      for (i=0;i<nIn;i++) {
-         xc[i] = TD->xn[i] - RF->c[i];
-      }
-
-      for (j=0;j<nIn;j++) {
-         dist += xc[j] * lwpr_math_dot_product(RF->D + j*nInS, xc, nIn);
-      }
+      dist = TD->model->kernels->rf_distance(nIn, nInS, RF->D, RF->c, TD->xn, xc);
 
       switch(TD->model->kernel) {
          case LWPR_GAUSSIAN_KERNEL:
@@ -440,6 +531,7 @@ void  lwpr_aux_predict_conf_one_T(void *ptr) {
          double *histroy_error_array = RF->pred_error_history;
          int num_error_array = RF->pred_error_num;
          double avg_error = 0.0;
+         explore_value->active_rfs++;
          // judge whether num_error_arry == 0, if 0 then skip it, modified by jim in 2022.6.20
          if (num_error_array > 0){
              // calculate the avg error
@@ -456,7 +548,7 @@ void  lwpr_aux_predict_conf_one_T(void *ptr) {
          for (i=0;i<nIn;i++) {
             xc[i] = TD->xn[i] - RF->mean_x[i];
          }
-         lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
+         TD->model->kernels->compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
          //计算该RF的置信度
          for (i=0;i<nR;i++) {
             yp_n+=s[i]*RF->beta[i];
@@ -489,7 +581,8 @@ void  lwpr_aux_predict_conf_one_T(void *ptr) {
          //RF->conf_rf = sqrt(sigma2)/yp_n;
          //modified by jim 2021.2.16, calculate the future value for each query pattern
          //note: 这里的future_value_pattern[l]只考虑和当前查询相关的RF，如果无关，提升为0，因此不用考虑
-         for(l=0;l<num_query_pattern;l++){
+         for(h=0;h<model->num_history;h++){
+            l = model->history[h].query_hash - 1;
             if(RF->prob_rf[l]!=0){
                RF->prob_rf[l] = RF->prob_rf[l]/total_happen_freq[l];
                future_value_pattern[l] += RF->prob_rf[l]*RF->conf_rf;
@@ -525,20 +618,16 @@ void  lwpr_aux_predict_conf_one_T(void *ptr) {
             //1.初始化矩阵
             double	  **matrix;
             double	   *targets;
-            matrix = palloc(sizeof(*matrix) *(2.0*nIn+1));
-            for (k = 0; k < (2.0*nIn+1); ++k){
-               matrix[k] = palloc0(sizeof(**matrix) * nIn);
-            }
+            matrix = OkNNr_allocate_matrix(2*nIn+1, nIn);
             targets = palloc0(sizeof(*targets) * (2.0*nIn+1));
             //计算当前rf_hash
             rf_hash = get_int_array_hash2(subspace_pattern, nIn);
             //读取RF数据
             if(load_rf_datahouse(fss_hash, rf_hash, matrix, targets, &rows)) {
+               explore_value->knn_rfs++;
                yp_n = OkNNr_predict(rows,  nIn, matrix, targets, features, 2);
             }
             //释放内存
-            for (k = 0; k < (2.0*nIn+1); ++k)
-               pfree(matrix[k]);
             pfree(matrix);
             pfree(targets);
          }
@@ -549,14 +638,16 @@ void  lwpr_aux_predict_conf_one_T(void *ptr) {
          }  
       }//cutoff
    }
+   /* the largest activation is below the cutoff: it may be of a skipped RF */
+   if (rfs != NULL && explore_value->active_rfs == 0)
+      idx_max = lwpr_aux_max_activation(TD, &TD->w_max);
    //detect if x is a outiler, if yes then let est_future=1;
    if(count_rfs==0 && exact_flag==0){
       //当该查询为一个离群查询时，假设对模型的作用为outer_future_value，那么需要考虑下一个查询的分布是什么，是否该模型属于各个查询
-      for(i=0;i<num_query_pattern;i++){
-         if(num_history_data[i]>0){
-            //当大于0时，可认为该查询具有该模型
-            explore_value->est_future += query_context.query_distribution[i]*outer_future_value;//modified by jim 2021.2.24
-         }
+      for(h=0;h<model->num_history;h++){
+         //有历史数据时，可认为该查询具有该模型
+         i = model->history[h].query_hash - 1;
+         explore_value->est_future += query_context.query_distribution[i]*outer_future_value;//modified by jim 2021.2.24
       }
    }else{
       //normal sub query space, we use the formula : est_future = SUM(query_pattern_distribution * future_value_pattern);
@@ -616,31 +707,26 @@ void  lwpr_aux_predict_conf_one_T(void *ptr) {
          int         fss_hash = TD->model->fss_hash;
          int         rf_hash;
          int			rows;
-         int			k;
          // 当rf可信时，使用PLS进行计算
          if(RF->trustworthy){
             yp = RF->beta0;
             int nR = RF->nReg;
             if (RF->n_data[nR-1] <= 2*nIn) nR--;         
-            lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
+            TD->model->kernels->compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
             for (i=0;i<nR;i++) {yp+=s[i]*RF->beta[i];}
          }else{
             //否则使用knn进行计算
             //1.初始化矩阵
-            matrix = palloc(sizeof(*matrix) *(2.0*nIn+1));
-            for (k = 0; k < (2.0*nIn+1); ++k){
-               matrix[k] = palloc0(sizeof(**matrix) * nIn);
-            }
+            matrix = OkNNr_allocate_matrix(2*nIn+1, nIn);
             targets = palloc0(sizeof(*targets) * (2.0*nIn+1));
             //计算当前rf_hash
             rf_hash = get_int_array_hash2(subspace_pattern, nIn);
             //读取RF数据
             if(load_rf_datahouse(fss_hash, rf_hash, matrix, targets, &rows)) {
+               explore_value->knn_rfs++;
                yp = OkNNr_predict(rows,  nIn, matrix, targets, features, 2);
             }
             //释放内存
-            for (k = 0; k < (2.0*nIn+1); ++k)
-               pfree(matrix[k]);
             pfree(matrix);
             pfree(targets);
          }
@@ -659,34 +745,19 @@ int lwpr_aux_update_one(LWPR_Model *model, const double *xn, double yn) {
 	TD.ws = model->ws;
     //更新
    lwpr_aux_update_one_T(&TD);      
+   /* the distance metrics have changed */
+   lwpr_rf_index_reset(model);
    //是否需要增加或剪枝rf
    return lwpr_aux_update_one_add_prune(model, &TD, xn, yn);
 }
 
-// 计算projection   
-void lwpr_aux_compute_projection(int nIn, int nInS, int nReg, 
-      double *s, const double *x, const double *U, const double *P, LWPR_Workspace *WS) {
-      
-   int i,j;
-   double sj;
-   double *xu = WS->xu; 
-   
-   for (i=0;i<nIn;i++) xu[i] = x[i];
-   
-   for (j=0;j<nReg-1;j++) {
-      s[j] = sj = lwpr_math_dot_product(U+j*nInS, xu, nIn);
-      /* for (i=0;i<nIn;i++) xu[i] -= P[i+j*nInS]*sj; */
-      lwpr_math_add_scalar_vector(xu,-sj,P+j*nInS, nIn);
-   }
-   s[nReg-1]=lwpr_math_dot_product(U+(nReg-1)*nInS, xu, nIn);           
-}
 //具体更新实现
 void lwpr_aux_update_one_T(void *ptr) {
    LWPR_ThreadData *TD = (LWPR_ThreadData *) ptr;
    LWPR_Workspace *WS = TD->ws;
    const LWPR_Model *model = TD->model;
       
-   int i,j,n,nIn,nInS;
+   int i,j,nIn,nInS;
    double *xc; 
    double e,e_cv; 
   
@@ -700,6 +771,8 @@ void lwpr_aux_update_one_T(void *ptr) {
    double sum_w = 0.0;
 
    double dwdq;
+   int *rfs = NULL;
+   int r,nrfs;
 
 
    nIn = TD->model->nIn;
@@ -707,52 +780,25 @@ void lwpr_aux_update_one_T(void *ptr) {
    xc = WS->xc;
    /* 这里需要判断是否为新建的模型，如果为新建的模型，则需要在model上更新history_query and num_history, modified by jim 2021.3.5* */
    if(model->numRFS == 0){
-       //得到当前的历史数据矩阵
-      double **history_data_matrix = TD->model->history_data_matrix;
-      double *num_history_data = TD->model->num_history_data;
-      // //历史数据矩阵的索引和个数
-      int current_data_matric_inx = 1;
-      int current_data_num = 1;
-      if (query_context.current_query_hash!=0){
-         current_data_matric_inx = query_context.current_query_hash -1;
-         current_data_num = (int) num_history_data[current_data_matric_inx];
-         if(current_data_num<num_history_data_compute_probability_rf){
-            /* 只需添加该数据 */
-            for(i=current_data_num*nIn+1; i<(current_data_num+1)*nIn+1; i++){
-               history_data_matrix[current_data_matric_inx][i] = TD->xn[i-current_data_num*nIn-1];
-            }
-            current_data_num += 1;
-            num_history_data[current_data_matric_inx] = (double) current_data_num;
-         }else
-         {
-            /* 将最之前的一个数据进行删除*/
-            for(i=1; i<num_history_data_compute_probability_rf; i++){
-               for(j=0; j<nIn; j++){
-                  history_data_matrix[current_data_matric_inx][(i-1)*nIn+1+j] = history_data_matrix[current_data_matric_inx][i*nIn+1+j];
-               }
-            }
-            /*将当前数据加入到矩阵最末尾 */
-            for(i=0; i<nIn; i++){
-               history_data_matrix[current_data_matric_inx][(num_history_data_compute_probability_rf-1)*nIn+1+i] = TD->xn[i];
-            }
-            //num_history_data保持不变
-         }
-      }
+      if (query_context.current_query_hash!=0)
+         lwpr_history_add(TD->model, query_context.current_query_hash, TD->xn);
    }else{
+      /*
+       * Only the RFs with w > 0.001 are updated; w_max and w_sec are exact
+       * above that, which is all adding and pruning RFs look at. The index
+       * is used if predictions have built it, it is dropped after the update.
+       */
+      nrfs = model->numRFS;
+      if (model->rf_index != NULL)
+         nrfs = lwpr_rf_candidates(TD->model, TD->xn, 0.001, &rfs);
       // 对每个接受域进行更新
-      for (n=0;n<model->numRFS;n++) {
-      
+      for (r=0;r<nrfs;r++) {
+         int n = (rfs != NULL) ? rfs[r] : r;
          double dist = 0.0;
          // 获取当前的更新域
          LWPR_ReceptiveField *RF = TD->model->rf[n];
          //计算输入向量和中心点的差值
-         for (i=0;i<nIn;i++) {
-            xc[i] = TD->xn[i] - RF->c[i];
-         }
-         //计算核距离
-         for (j=0;j<nIn;j++) {
-            dist += xc[j] * lwpr_math_dot_product(RF->D + j*nInS, xc, nIn);
-         }
+         dist = TD->model->kernels->rf_distance(nIn, nInS, RF->D, RF->c, TD->xn, xc);
          switch(TD->model->kernel) {
             case LWPR_GAUSSIAN_KERNEL:
                w = exp(-0.5*dist);
@@ -874,22 +920,9 @@ void lwpr_aux_update_regression(LWPR_ReceptiveField *RF, double *yp, double *e_c
    double ypred = 0.0;
    double ws2_SSs2 = 0.0;
    int i,j;
-   //读取rf数据相关变量
-   double      *subspace_pattern = RF->c;
-	double	  **matrix;
-	double	   *targets;
-	double	   *features = model->xn;
-	double		result = model->yn;
-   int         fss_hash = model->fss_hash;
-   int         rf_hash;
-	int			rows;
-	int			k;
-   List	     *changed_lines = NIL;
-   ListCell   *l;
-   int         new_matrix_rows = 0;
-   
-   
-   lwpr_aux_compute_projection_r(nIn,nInS,nReg,RF->s,xres,x,RF->U,RF->P);
+   
+   
+   model->kernels->compute_projection_r(nIn,nInS,nReg,RF->s,xres,x,RF->U,RF->P);
    // 计算yres
    yres[0] = RF->beta[0] * RF->s[0];
    for (i=1;i<nReg;i++) {
@@ -945,7 +978,7 @@ void lwpr_aux_update_regression(LWPR_ReceptiveField *RF, double *yp, double *e_c
    // this value for calculating the confidence
    RF->SSp = RF->lambda[nReg-1]*RF->SSp + ws2_SSs2;
    
-   lwpr_aux_compute_projection(nIn,nInS,nReg,RF->s,x,RF->U,RF->P,WS);
+   model->kernels->compute_projection(nIn,nInS,nReg,RF->s,x,RF->U,RF->P,WS);
    
    /* new addition: do not include last PLS dimension if not trustworthy yet */
    /* TODO: check stuff below, in particular e_cv_R */
@@ -977,34 +1010,7 @@ void lwpr_aux_update_regression(LWPR_ReceptiveField *RF, double *yp, double *e_c
       RF->trustworthy = 1;
    }else{
       /* 当RF不可信时，保存数据到相应的RF数据仓库中 */
-      //1.初始化矩阵
-      matrix = palloc(sizeof(*matrix) *(2.0*nIn+1));
-      for (k = 0; k < (2.0*nIn+1); ++k){
-         matrix[k] = palloc0(sizeof(**matrix) * nIn);
-      }
-      targets = palloc0(sizeof(*targets) * (2.0*nIn+1));
-      //计算当前rf_hash
-      rf_hash = get_int_array_hash2(subspace_pattern, nIn);
-      if (!load_rf_datahouse(fss_hash, rf_hash, matrix, targets, &rows))
-		   rows = 0;
-      //学习
-      changed_lines = OkNNr_learn(rows, nIn,
-                           matrix, targets,
-                           features, result, (2.0*nIn+1));
-
-      new_matrix_rows = rows;
-      foreach(l, changed_lines)
-      {
-         if (lfirst_int(l) >= new_matrix_rows)
-            new_matrix_rows = lfirst_int(l) + 1;
-      }
-	   //将数据写入表中
-      update_rf_datahouse(fss_hash, rf_hash, nIn,  new_matrix_rows, matrix, targets);
-      //释放内存
-      for (k = 0; k < (2.0*nIn+1); ++k)
-			pfree(matrix[k]);
-		pfree(matrix);
-		pfree(targets);
+      lwpr_aux_queue_datahouse(model->fss_hash, RF->c, model->xn, model->yn, nIn);
    }
 }
 /* 更新距离矩阵 */
@@ -1087,7 +1093,7 @@ double lwpr_aux_update_distance_metric(LWPR_ReceptiveField *RF,
    wW = w/W;
    
    for (i=0;i<nIn;i++) dx[i]=xn[i]-RF->c[i];
-   lwpr_aux_dist_derivatives(nIn, nInS, dwdM, dJ2dM, w, dwdq, RF->D, RF->M, dx, model->diag_only, penalty);  
+   model->kernels->dist_derivatives(nIn, nInS, dwdM, dJ2dM, w, dwdq, RF->D, RF->M, dx, model->diag_only, penalty);  
    
    if (model->diag_only) {
    
@@ -1202,64 +1208,6 @@ int lwpr_aux_check_add_projection(LWPR_ReceptiveField *RF, const LWPR_Model *mod
       return 0;
    }
 }
-void lwpr_aux_compute_projection_r(int nIn, int nInS, int nReg, 
-      double *s, double *xres, const double *x, const double *U, const double *P) {
-      
-   int i,j;
-   double sj;
-   
-   for (i=0;i<nIn;i++) xres[i] = x[i];
-   for (j=0;j<nReg-1;j++) {
-      s[j] = sj = lwpr_math_dot_product(U+j*nInS, xres + j*nInS, nIn);
-      for (i=0;i<nIn;i++) {
-         xres[i + (j+1)*nInS] = xres[i + j*nInS] - P[i+j*nInS]*sj;
-      }
-   }
-   s[nReg-1] = lwpr_math_dot_product(U+(nReg-1)*nInS, xres + (nReg-1)*nInS, nIn);          
-}
-
-void lwpr_aux_dist_derivatives(int nIn,int nInS,double *dwdM, double *dJ2dM, double w, double dwdq, 
-        const double *RF_D, const double *RF_M, const double *dx, int diag_only, double penalty) {
-         
-   int m,n;
-   /* Fill elements (n,m) */ 
-   
-   /* penalty only occurs with a factor 2, so we take it out */
-   penalty+=penalty;
-   
-   if (diag_only) {
-		/* diagonal case WITHOUT meta learning */               
-		for (n=0;n<nIn;n++) {
-		int n_n = n + n*nInS;
-		/* take the derivative of q=dx'*D*dx with respect to nn_th element of M */            
-
-		double aux = 2.0 * RF_M[n_n];
-
-		dwdM[n_n] = dx[n] * dx[n] * aux * dwdq;
-		dJ2dM[n_n] = penalty * RF_D[n_n] * aux;
-		}
-	    return;
-   }
-	/* non-diagonal (= upper-triangular) case WITHOUT meta learning*/   
-   for (n=0;n<nIn;n++) {
-		for (m=n;m<nIn;m++) {
-		double sum_aux = 0.0;
-		double dqdM_nm = 0.0;
-		int i;
-
-		/* take the derivative of q = dx'*D*dx with respect to nm_th element of M */
-		for (i=n;i<nIn;i++) {
-			/* aux corresponds to the i,n_th (= n,i_th) element of dDdm_nm  
-				this is directly processed for dwdM and dJ2dM   */
-			double M_ni = RF_M[n+i*nInS];
-			dqdM_nm += dx[i] * M_ni;       /* additional factor 2.0*dx[m] comes after the loop */        
-			sum_aux += RF_D[i + m*nInS] * M_ni;                         
-		}
-		dwdM[n+m*nInS] = 2.0 * dx[m] * dqdM_nm * dwdq;
-		dJ2dM[n+m*nInS] = 2.0 * penalty * sum_aux;
-		}
-	}
-}
 int lwpr_aux_update_one_add_prune(LWPR_Model *model, LWPR_ThreadData *TD, const double *xn, double yn) {
    // 判断最大的w是否大于w_gen   
    if (TD->w_max <= model->w_gen) {
@@ -1291,24 +1239,31 @@ int lwpr_aux_update_one_add_prune(LWPR_Model *model, LWPR_ThreadData *TD, const
       /* TODO: ORIGINAL LOGIC WAS REVERSED -- CHECK */
       prune = (tr_max < tr_sec) ? TD->ind_max : TD->ind_sec;
       
-      lwpr_mem_free_rf(model->rf[prune]);
-      pfree(model->rf[prune]);
-      
-      if (prune < model->numRFS-1) {
-         /* Fill the gap with last RF (we just move around the pointer) */      
-         model->rf[prune] = model->rf[model->numRFS-1];
-      }
-      model->numRFS--;
-      model->n_pruned++;
+      lwpr_remove_rf(model, prune);
       
       /* printf("Output %d, pruned RF %d\n",dim+1,prune+1); */
-      //相应删除datahouse数据
-      //。。。。。后续进行补充
+      //相应删除datahouse数据: aqo_vacuum() deletes the data of removed RFs
    }
    
    return 1;   
 }
 
+/*
+ * Removes the RF from the model. The last RF takes its place.
+ */
+void lwpr_remove_rf(LWPR_Model *model, int i) {
+   lwpr_rf_index_reset(model);
+   lwpr_mem_free_rf(model->rf[i]);
+   pfree(model->rf[i]);
+   
+   if (i < model->numRFS-1) {
+      /* Fill the gap with last RF (we just move around the pointer) */      
+      model->rf[i] = model->rf[model->numRFS-1];
+   }
+   model->numRFS--;
+   model->n_pruned++;
+}
+
 LWPR_ReceptiveField *lwpr_aux_add_rf(LWPR_Model *model, int nReg) {
    LWPR_ReceptiveField *RF;
    int nIn = model->nIn;
@@ -1334,6 +1289,7 @@ LWPR_ReceptiveField *lwpr_aux_add_rf(LWPR_Model *model, int nReg) {
    }
    
    model->rf[model->numRFS++]=RF;
+   lwpr_rf_index_reset(model);
    
    return RF;  
 }
@@ -1392,49 +1348,8 @@ int lwpr_aux_init_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, const LWP
          RF->b[i+j*nInS] = log(RF->alpha[i+j*nInS] + 1e-10);
       }
    }
-   //将该数据写如到datahouse中
-   //读取rf数据相关变量
-   double      *subspace_pattern = xc;
-	double	  **matrix;
-	double	   *targets;
-	double	   *features = xc;
-	double		result = y;
-   int         fss_hash = model->fss_hash;
-   int         rf_hash;
-	int			rows;
-	int			k;
-   List	     *changed_lines = NIL;
-   ListCell   *l;
-   int         new_matrix_rows = 0;
    /* 当RF不可信时，保存数据到相应的RF数据仓库中 */
-   //1.初始化矩阵
-   matrix = palloc(sizeof(*matrix) *(2.0*nIn+1));
-   for (k = 0; k < (2.0*nIn+1); ++k){
-      matrix[k] = palloc0(sizeof(**matrix) * nIn);
-   }
-   targets = palloc0(sizeof(*targets) * (2.0*nIn+1));
-   //计算当前rf_hash
-   rf_hash = get_int_array_hash2(subspace_pattern, nIn);
-   if (!load_rf_datahouse(fss_hash, rf_hash, matrix, targets, &rows))
-      rows = 0;
-   //学习
-   changed_lines = OkNNr_learn(rows, nIn,
-                        matrix, targets,
-                        features, result, (2.0*nIn+1));
-
-   new_matrix_rows = rows;
-   foreach(l, changed_lines)
-   {
-      if (lfirst_int(l) >= new_matrix_rows)
-         new_matrix_rows = lfirst_int(l) + 1;
-   }
-   //将数据写入表中
-   update_rf_datahouse(fss_hash, rf_hash, nIn,  new_matrix_rows, matrix, targets);
-   //释放内存
-   for (k = 0; k < (2.0*nIn+1); ++k)
-      pfree(matrix[k]);
-   pfree(matrix);
-   pfree(targets);
+   lwpr_aux_queue_datahouse(model->fss_hash, xc, xc, y, nIn);
    return 1;   
 }
 /*
@@ -1590,19 +1505,45 @@ void lwpr_free_model(LWPR_Model *model) {
         pfree(model->rf[j]);
     }
     pfree(model->rf);
-    lwpr_mem_free_ws(model->ws);
-    pfree(model->ws);
+    if (!model->ws_shared) {
+       lwpr_mem_free_ws(model->ws);
+       pfree(model->ws);
+    }
     //释放explore_value
     pfree(model->explore_values);
-    //释放history_data_matrix
-    for(j=0;j<num_query_pattern;j++){
-       pfree(model->history_data_matrix[j]);
+    //释放history
+    for(j=0;j<model->num_history;j++){
+       pfree(model->history[j].xn);
     }
-    pfree(model->history_data_matrix);
+    if (model->history != NULL)
+       pfree(model->history);
+    lwpr_rf_index_reset(model);
     //free其它
     pfree(model->storage);
 }
 
+/*
+ * A workspace only holds scratch data of one update or prediction, so all the
+ * models with the same number of inputs share one workspace. It is allocated
+ * in AQOMemoryContext on first use and lives as long as the backend, so the
+ * models of planning and learning passes do not allocate it again.
+ * Returns NULL if the number of inputs is too large to be shared.
+ */
+LWPR_Workspace *lwpr_shared_ws(int nIn) {
+   static LWPR_Workspace *shared_ws[LWPR_MAX_SHARED_WS_NIN + 1];
+   MemoryContext oldcxt;
+
+   if (nIn <= 0 || nIn > LWPR_MAX_SHARED_WS_NIN)
+      return NULL;
+   if (shared_ws[nIn] == NULL) {
+      oldcxt = MemoryContextSwitchTo(AQOMemoryContext);
+      shared_ws[nIn] = (LWPR_Workspace *) palloc(sizeof(LWPR_Workspace));
+      lwpr_mem_alloc_ws(shared_ws[nIn], nIn);
+      MemoryContextSwitchTo(oldcxt);
+   }
+   return shared_ws[nIn];
+}
+
 int lwpr_mem_alloc_model(LWPR_Model *model, int nIn, int storeRFS) {
    int nInS;
    double *storage;
@@ -1610,20 +1551,22 @@ int lwpr_mem_alloc_model(LWPR_Model *model, int nIn, int storeRFS) {
    nInS = (nIn&1)?(nIn+1):nIn;
    
    //分配ws 
-   model->ws = (LWPR_Workspace *) palloc(sizeof(LWPR_Workspace)*1);
-   if (model->ws == NULL) {
-      return 0;
-   }
-   if (!lwpr_mem_alloc_ws(model->ws,nIn)) {
-      lwpr_mem_free_ws(model->ws);
-      pfree(model->ws);
-      return 0;
+   model->ws = lwpr_shared_ws(nIn);
+   model->ws_shared = (model->ws != NULL);
+   if (!model->ws_shared) {
+      model->ws = (LWPR_Workspace *) palloc(sizeof(LWPR_Workspace)*1);
+      if (!lwpr_mem_alloc_ws(model->ws,nIn)) {
+         pfree(model->ws);
+         return 0;
+      }
    }
    //分配model
-   storage = (double *) palloc0(sizeof(double)*(1 + nInS*(3*nIn + 2) + num_query_pattern));
+   storage = (double *) palloc0(sizeof(double)*(1 + nInS*(3*nIn + 2)));
    if (storage==NULL) {
-      lwpr_mem_free_ws(model->ws);      
-      pfree(model->ws);
+      if (!model->ws_shared) {
+         lwpr_mem_free_ws(model->ws);
+         pfree(model->ws);
+      }
       return 0;
    } 
    model->storage = storage;
@@ -1634,7 +1577,6 @@ int lwpr_mem_alloc_model(LWPR_Model *model, int nIn, int storeRFS) {
    model->init_alpha = storage; storage+=nInS*nIn;
    model->norm_in = storage;    storage+=nInS;
    model->xn = storage;         storage+=nInS;
-   model->num_history_data = storage;
    model->norm_out = 1;
    model->yn = 1;
    model->n_pruned = 0;   
@@ -1645,8 +1587,10 @@ int lwpr_mem_alloc_model(LWPR_Model *model, int nIn, int storeRFS) {
       if (model->rf == NULL) {
          model->numPointers = 0;
          pfree(model->rf);
-         lwpr_mem_free_ws(model->ws);                  
-         pfree(model->ws);
+         if (!model->ws_shared) {
+            lwpr_mem_free_ws(model->ws);
+            pfree(model->ws);
+         }
          pfree(model->storage);
          return 0;
       }
@@ -1654,22 +1598,268 @@ int lwpr_mem_alloc_model(LWPR_Model *model, int nIn, int storeRFS) {
 
    model->nIn = nIn;
    model->nInStore = nInS;
+   model->kernels = lwpr_kernels(nIn);
    //初始化探索价值结构体
 	model->explore_values = (Explore_Value *) palloc(sizeof(Explore_Value));
    /* initialial */
    lwpr_men_alloc_ev(model->explore_values);
    
    
-   //初始化历史数据矩阵
-   model->history_data_matrix = palloc(sizeof(*model->history_data_matrix) * num_query_pattern);
-   for (int i = 0; i < num_query_pattern; i++){
-      model->history_data_matrix[i] = palloc0(sizeof(**model->history_data_matrix) * (num_history_data_compute_probability_rf*nIn+1));
-      //save the query pattern, modified by jim 2021.2.22
-      model->history_data_matrix[i][0] = i+1;
-   }
+   //历史数据按查询模板分配, see lwpr_history_entry
+   model->history = NULL;
+   model->num_history = 0;
+   model->max_history = 0;
+   model->cxt = CurrentMemoryContext;
+   model->rf_index = NULL;
    return 1;
 }
 
+/*
+ * Returns the history of the model for the template, or NULL if there is
+ * none and create is false. A model is observed with few templates, so the
+ * entries are searched linearly.
+ */
+LWPR_TemplateHistory *lwpr_history_entry(LWPR_Model *model, int query_hash, bool create) {
+   LWPR_TemplateHistory *history;
+   MemoryContext oldcxt;
+   int i;
+
+   for (i = 0; i < model->num_history; i++)
+      if (model->history[i].query_hash == query_hash)
+         return &model->history[i];
+   if (!create)
+      return NULL;
+
+   /* predictions add to the history of a model loaded in another context */
+   oldcxt = MemoryContextSwitchTo(model->cxt);
+   if (model->num_history == model->max_history) {
+      model->max_history = (model->max_history > 0) ? 2*model->max_history : 2;
+      if (model->history == NULL)
+         model->history = palloc(sizeof(*model->history) * model->max_history);
+      else
+         model->history = repalloc(model->history, sizeof(*model->history) * model->max_history);
+   }
+   history = &model->history[model->num_history++];
+   history->query_hash = query_hash;
+   history->num = 0;
+   history->next = 0;
+   history->xn = palloc(sizeof(double) * model->nIn * num_history_data_compute_probability_rf);
+   MemoryContextSwitchTo(oldcxt);
+   return history;
+}
+
+/*
+ * Remembers the input of a query of the template. Once the buffer is full,
+ * the input replaces the oldest one.
+ */
+void lwpr_history_add(LWPR_Model *model, int query_hash, const double *xn) {
+   LWPR_TemplateHistory *history = lwpr_history_entry(model, query_hash, true);
+
+   memcpy(history->xn + history->next*model->nIn, xn, sizeof(double) * model->nIn);
+   history->next = (history->next + 1) % num_history_data_compute_probability_rf;
+   if (history->num < num_history_data_compute_probability_rf)
+      history->num++;
+}
+
+typedef struct {
+   const LWPR_Model *model;
+   int dim;
+} LWPR_RFIndexSortArg;
+
+static int lwpr_rf_index_cmp(const void *a, const void *b, void *arg) {
+   const LWPR_RFIndexSortArg *sort_arg = (const LWPR_RFIndexSortArg *) arg;
+   double ca = sort_arg->model->rf[*(const int *) a]->c[sort_arg->dim];
+   double cb = sort_arg->model->rf[*(const int *) b]->c[sort_arg->dim];
+
+   return (ca < cb) ? -1 : (ca > cb) ? 1 : 0;
+}
+
+/*
+ * Builds the node over order[begin..end) and its subtree, returns the node.
+ * The RFs are split at the median centre of the dimension of the widest
+ * spread, measured in the smallest metric of the dimension.
+ */
+static int lwpr_rf_index_build_node(LWPR_Model *model, LWPR_RFIndex *index, int begin, int end) {
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int node = index->numNodes++;
+   double *lo = index->lo + node*nIn;
+   double *hi = index->hi + node*nIn;
+   double *dmin = index->dmin + node*nIn;
+   double spread = -1.0;
+   int i,k,dim = 0;
+
+   index->nodes[node].begin = begin;
+   index->nodes[node].end = end;
+   index->nodes[node].left = index->nodes[node].right = -1;
+   for (i=0;i<nIn;i++) {
+      lo[i] = DBL_MAX;
+      hi[i] = -DBL_MAX;
+      dmin[i] = DBL_MAX;
+   }
+   for (k=begin;k<end;k++) {
+      const LWPR_ReceptiveField *RF = model->rf[index->order[k]];
+
+      for (i=0;i<nIn;i++) {
+         lo[i] = Min(lo[i], RF->c[i]);
+         hi[i] = Max(hi[i], RF->c[i]);
+         dmin[i] = Min(dmin[i], RF->D[i+i*nInS]);
+      }
+   }
+
+   if (end - begin > LWPR_RF_INDEX_LEAF_RFS) {
+      LWPR_RFIndexSortArg sort_arg;
+      int mid = (begin + end) / 2;
+
+      for (i=0;i<nIn;i++) {
+         double s = (hi[i]-lo[i])*(hi[i]-lo[i])*dmin[i];
+
+         if (s > spread) {
+            spread = s;
+            dim = i;
+         }
+      }
+      sort_arg.model = model;
+      sort_arg.dim = dim;
+      qsort_arg(index->order + begin, end - begin, sizeof(int), lwpr_rf_index_cmp, &sort_arg);
+      index->nodes[node].left = lwpr_rf_index_build_node(model, index, begin, mid);
+      index->nodes[node].right = lwpr_rf_index_build_node(model, index, mid, end);
+   }
+   return node;
+}
+
+/*
+ * Builds the index over the RFs of the model. The bounds need diagonal
+ * distance metrics; if a metric is not diagonal, the index has no nodes and
+ * the searches return all RFs.
+ */
+static LWPR_RFIndex *lwpr_rf_index_build(LWPR_Model *model) {
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   /* a leaf has at least LWPR_RF_INDEX_LEAF_RFS/2 RFs, so nodes are fewer than RFs */
+   int maxNodes = model->numRFS;
+   LWPR_RFIndex *index;
+   MemoryContext oldcxt;
+   int i,j,n;
+
+   oldcxt = MemoryContextSwitchTo(model->cxt);
+   index = palloc0(sizeof(LWPR_RFIndex));
+   index->numRFS = model->numRFS;
+   MemoryContextSwitchTo(oldcxt);
+
+   for (n=0;n<model->numRFS;n++)
+      for (j=0;j<nIn;j++)
+         for (i=0;i<nIn;i++)
+            if (i != j && model->rf[n]->D[i+j*nInS] != 0.0)
+               return index;
+
+   oldcxt = MemoryContextSwitchTo(model->cxt);
+   index->nodes = palloc(sizeof(LWPR_RFIndexNode) * maxNodes);
+   index->order = palloc(sizeof(int) * model->numRFS);
+   index->lo = palloc(sizeof(double) * maxNodes * nIn);
+   index->hi = palloc(sizeof(double) * maxNodes * nIn);
+   index->dmin = palloc(sizeof(double) * maxNodes * nIn);
+   index->stack = palloc(sizeof(int) * maxNodes);
+   index->result = palloc(sizeof(int) * model->numRFS);
+   MemoryContextSwitchTo(oldcxt);
+
+   for (n=0;n<model->numRFS;n++)
+      index->order[n] = n;
+   lwpr_rf_index_build_node(model, index, 0, model->numRFS);
+   Assert(index->numNodes <= maxNodes);
+   return index;
+}
+
+void lwpr_rf_index_reset(LWPR_Model *model) {
+   LWPR_RFIndex *index = model->rf_index;
+
+   if (index == NULL)
+      return;
+   if (index->numNodes > 0) {
+      pfree(index->nodes);
+      pfree(index->order);
+      pfree(index->lo);
+      pfree(index->hi);
+      pfree(index->dmin);
+      pfree(index->stack);
+      pfree(index->result);
+   }
+   pfree(index);
+   model->rf_index = NULL;
+}
+
+/*
+ * Finds the RFs whose activation at xn may exceed the cutoff. With a diagonal
+ * metric the kernel distance of an RF of a node is at least
+ * sum(dmin[i] * gap[i]^2), gap being the distance from xn to the box of the
+ * node, so the nodes whose bound exceeds the distance of the cutoff are
+ * skipped. The candidates are returned in *rfs in the increasing order, so
+ * the sums over them are computed as over all RFs.
+ *
+ * Returns the number of candidates. *rfs is NULL if there is no index, then
+ * all RFs are the candidates.
+ */
+int lwpr_rf_candidates(LWPR_Model *model, const double *xn, double cutoff, int **rfs) {
+   LWPR_RFIndex *index = model->rf_index;
+   int nIn = model->nIn;
+   double reach;
+   int ncand = 0;
+   int top = 0;
+   int i,k;
+
+   *rfs = NULL;
+   if (model->numRFS < LWPR_RF_INDEX_MIN_RFS || !model->diag_only)
+      return model->numRFS;
+
+   /* w > cutoff holds within this kernel distance only */
+   if (model->kernel == LWPR_GAUSSIAN_KERNEL)
+      reach = (cutoff > 0.0) ? -2.0*log(cutoff) : DBL_MAX;
+   else
+      reach = (cutoff >= 0.0) ? 4.0*(1.0 - sqrt(Min(cutoff, 1.0))) : DBL_MAX;
+   if (reach == DBL_MAX)
+      return model->numRFS;
+   /* rounding of the distances must not lose an RF at the border */
+   reach = reach*(1.0 + 1e-9) + 1e-12;
+
+   if (index != NULL && index->numRFS != model->numRFS)
+      lwpr_rf_index_reset(model);
+   if (model->rf_index == NULL)
+      model->rf_index = lwpr_rf_index_build(model);
+   index = model->rf_index;
+   if (index->numNodes == 0)
+      return model->numRFS;
+
+   index->stack[top++] = 0;
+   while (top > 0) {
+      int node = index->stack[--top];
+      const double *lo = index->lo + node*nIn;
+      const double *hi = index->hi + node*nIn;
+      const double *dmin = index->dmin + node*nIn;
+      double bound = 0.0;
+
+      for (i=0;i<nIn && bound <= reach;i++) {
+         double gap = (xn[i] < lo[i]) ? lo[i] - xn[i] :
+                      (xn[i] > hi[i]) ? xn[i] - hi[i] : 0.0;
+
+         bound += dmin[i]*gap*gap;
+      }
+      if (bound > reach)
+         continue;
+
+      if (index->nodes[node].left < 0) {
+         for (k=index->nodes[node].begin;k<index->nodes[node].end;k++)
+            index->result[ncand++] = index->order[k];
+      } else {
+         index->stack[top++] = index->nodes[node].right;
+         index->stack[top++] = index->nodes[node].left;
+      }
+   }
+
+   qsort(index->result, ncand, sizeof(int), int_cmp);
+   *rfs = index->result;
+   return ncand;
+}
+
 int lwpr_mem_realloc_rf(LWPR_ReceptiveField *RF, int nRegStore, int nInStore) {
    double *newStorage, *storage;
    int nInS,nReg;
@@ -1783,6 +1973,8 @@ int lwpr_men_alloc_ev(Explore_Value *ev){
    ev->est_future=0;
    ev->est_uncof=0;
    ev->rate=rate_between_explore_value;
+   ev->active_rfs=0;
+   ev->knn_rfs=0;
    return 1;
 }
 
@@ -1846,4 +2038,194 @@ int lwpr_mem_alloc_ws(LWPR_Workspace *ws, int nIn) {
    ws->s        = storage; storage+=nIn;            
    
    return 1;
-}
\ No newline at end of file
+}
+/*****************************************************************************
+ *
+ *	SPECIALISED KERNELS
+ *
+ * Most feature subspaces have only a few features, and the inner loops of
+ * distances and projections run over nIn with runtime bounds and strides.
+ * The bodies below are always inlined, so the kernels instantiated for a
+ * constant nIn = 1..LWPR_MAX_SPECIALISED_NIN get fully unrolled loops with
+ * constant strides and keep their vectors in registers. A model picks its
+ * kernels when its memory is allocated (see lwpr_kernels); larger models use
+ * the generic ones.
+ *
+ *****************************************************************************/
+
+#if defined(__GNUC__)
+#define LWPR_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define LWPR_ALWAYS_INLINE inline
+#endif
+
+/* Computes xc = x - c and returns the kernel distance xc'*D*xc */
+static LWPR_ALWAYS_INLINE double
+lwpr_rf_distance_body(int nIn, int nInS, const double *D, const double *c,
+                      const double *x, double *xc) {
+   double dist = 0.0;
+   int i,j;
+
+   for (i=0;i<nIn;i++) xc[i] = x[i] - c[i];
+   for (j=0;j<nIn;j++) {
+      double dj = 0.0;
+      for (i=0;i<nIn;i++) dj += D[i+j*nInS]*xc[i];
+      dist += xc[j]*dj;
+   }
+   return dist;
+}
+
+/* xu is a scratch vector of nIn elements */
+static LWPR_ALWAYS_INLINE void
+lwpr_compute_projection_body(int nIn, int nInS, int nReg, double *s,
+                             const double *x, const double *U, const double *P, double *xu) {
+   int i,j;
+   double sj;
+
+   for (i=0;i<nIn;i++) xu[i] = x[i];
+   for (j=0;j<nReg-1;j++) {
+      sj = 0.0;
+      for (i=0;i<nIn;i++) sj += U[i+j*nInS]*xu[i];
+      s[j] = sj;
+      for (i=0;i<nIn;i++) xu[i] -= P[i+j*nInS]*sj;
+   }
+   sj = 0.0;
+   for (i=0;i<nIn;i++) sj += U[i+(nReg-1)*nInS]*xu[i];
+   s[nReg-1] = sj;
+}
+
+static LWPR_ALWAYS_INLINE void
+lwpr_compute_projection_r_body(int nIn, int nInS, int nReg, double *s, double *xres,
+                               const double *x, const double *U, const double *P) {
+   int i,j;
+   double sj;
+
+   for (i=0;i<nIn;i++) xres[i] = x[i];
+   for (j=0;j<nReg-1;j++) {
+      sj = 0.0;
+      for (i=0;i<nIn;i++) sj += U[i+j*nInS]*xres[i+j*nInS];
+      s[j] = sj;
+      for (i=0;i<nIn;i++) xres[i+(j+1)*nInS] = xres[i+j*nInS] - P[i+j*nInS]*sj;
+   }
+   sj = 0.0;
+   for (i=0;i<nIn;i++) sj += U[i+(nReg-1)*nInS]*xres[i+(nReg-1)*nInS];
+   s[nReg-1] = sj;
+}
+
+static LWPR_ALWAYS_INLINE void
+lwpr_dist_derivatives_body(int nIn, int nInS, double *dwdM, double *dJ2dM, double w, double dwdq,
+                           const double *RF_D, const double *RF_M, const double *dx, int diag_only, double penalty) {
+   int m,n;
+   /* Fill elements (n,m) */ 
+   
+   /* penalty only occurs with a factor 2, so we take it out */
+   penalty+=penalty;
+   
+   if (diag_only) {
+		/* diagonal case WITHOUT meta learning */               
+		for (n=0;n<nIn;n++) {
+		int n_n = n + n*nInS;
+		/* take the derivative of q=dx'*D*dx with respect to nn_th element of M */            
+
+		double aux = 2.0 * RF_M[n_n];
+
+		dwdM[n_n] = dx[n] * dx[n] * aux * dwdq;
+		dJ2dM[n_n] = penalty * RF_D[n_n] * aux;
+		}
+	    return;
+   }
+	/* non-diagonal (= upper-triangular) case WITHOUT meta learning*/   
+   for (n=0;n<nIn;n++) {
+		for (m=n;m<nIn;m++) {
+		double sum_aux = 0.0;
+		double dqdM_nm = 0.0;
+		int i;
+
+		/* take the derivative of q = dx'*D*dx with respect to nm_th element of M */
+		for (i=n;i<nIn;i++) {
+			/* aux corresponds to the i,n_th (= n,i_th) element of dDdm_nm  
+				this is directly processed for dwdM and dJ2dM   */
+			double M_ni = RF_M[n+i*nInS];
+			dqdM_nm += dx[i] * M_ni;       /* additional factor 2.0*dx[m] comes after the loop */        
+			sum_aux += RF_D[i + m*nInS] * M_ni;                         
+		}
+		dwdM[n+m*nInS] = 2.0 * dx[m] * dqdM_nm * dwdq;
+		dJ2dM[n+m*nInS] = 2.0 * penalty * sum_aux;
+		}
+	}
+}
+
+/* Generic kernels */
+static double lwpr_rf_distance_generic(int nIn, int nInS, const double *D, const double *c,
+                                       const double *x, double *xc) {
+   return lwpr_rf_distance_body(nIn, nInS, D, c, x, xc);
+}
+
+// 计算projection   
+void lwpr_aux_compute_projection(int nIn, int nInS, int nReg, 
+      double *s, const double *x, const double *U, const double *P, LWPR_Workspace *WS) {
+   lwpr_compute_projection_body(nIn, nInS, nReg, s, x, U, P, WS->xu);
+}
+
+void lwpr_aux_compute_projection_r(int nIn, int nInS, int nReg, 
+      double *s, double *xres, const double *x, const double *U, const double *P) {
+   lwpr_compute_projection_r_body(nIn, nInS, nReg, s, xres, x, U, P);
+}
+
+void lwpr_aux_dist_derivatives(int nIn,int nInS,double *dwdM, double *dJ2dM, double w, double dwdq, 
+        const double *RF_D, const double *RF_M, const double *dx, int diag_only, double penalty) {
+   lwpr_dist_derivatives_body(nIn, nInS, dwdM, dJ2dM, w, dwdq, RF_D, RF_M, dx, diag_only, penalty);
+}
+
+/*
+ * Kernels for N inputs. They keep the signatures of the generic ones and
+ * ignore the passed nIn and nInS, which are always N and LWPR_NINS(N).
+ */
+#define LWPR_NINS(N) (((N)&1) ? (N)+1 : (N))
+#define LWPR_DEFINE_KERNELS(N) \
+static double lwpr_rf_distance_##N(int nIn, int nInS, const double *D, const double *c, \
+                                   const double *x, double *xc) { \
+   return lwpr_rf_distance_body(N, LWPR_NINS(N), D, c, x, xc); \
+} \
+static void lwpr_compute_projection_##N(int nIn, int nInS, int nReg, double *s, const double *x, \
+                                        const double *U, const double *P, LWPR_Workspace *WS) { \
+   double xu[N]; \
+   lwpr_compute_projection_body(N, LWPR_NINS(N), nReg, s, x, U, P, xu); \
+} \
+static void lwpr_compute_projection_r_##N(int nIn, int nInS, int nReg, double *s, double *xres, \
+                                          const double *x, const double *U, const double *P) { \
+   lwpr_compute_projection_r_body(N, LWPR_NINS(N), nReg, s, xres, x, U, P); \
+} \
+static void lwpr_dist_derivatives_##N(int nIn, int nInS, double *dwdM, double *dJ2dM, double w, double dwdq, \
+                                      const double *RF_D, const double *RF_M, const double *dx, \
+                                      int diag_only, double penalty) { \
+   lwpr_dist_derivatives_body(N, LWPR_NINS(N), dwdM, dJ2dM, w, dwdq, RF_D, RF_M, dx, diag_only, penalty); \
+}
+
+LWPR_DEFINE_KERNELS(1)
+LWPR_DEFINE_KERNELS(2)
+LWPR_DEFINE_KERNELS(3)
+LWPR_DEFINE_KERNELS(4)
+LWPR_DEFINE_KERNELS(5)
+LWPR_DEFINE_KERNELS(6)
+LWPR_DEFINE_KERNELS(7)
+LWPR_DEFINE_KERNELS(8)
+
+#define LWPR_KERNELS(N) \
+   {lwpr_rf_distance_##N, lwpr_compute_projection_##N, \
+    lwpr_compute_projection_r_##N, lwpr_dist_derivatives_##N}
+
+/* Indexed by nIn, the first entry is generic */
+static const LWPR_Kernels lwpr_kernels_table[LWPR_MAX_SPECIALISED_NIN + 1] = {
+   {lwpr_rf_distance_generic, lwpr_aux_compute_projection,
+    lwpr_aux_compute_projection_r, lwpr_aux_dist_derivatives},
+   LWPR_KERNELS(1), LWPR_KERNELS(2), LWPR_KERNELS(3), LWPR_KERNELS(4),
+   LWPR_KERNELS(5), LWPR_KERNELS(6), LWPR_KERNELS(7), LWPR_KERNELS(8)
+};
+
+/* Returns the kernels for models with nIn inputs */
+const LWPR_Kernels *lwpr_kernels(int nIn) {
+   if (nIn > 0 && nIn <= LWPR_MAX_SPECIALISED_NIN)
+      return &lwpr_kernels_table[nIn];
+   return &lwpr_kernels_table[0];
+}
@@ -0,0 +1,561 @@
+#include "aqo.h"
+#include "access/genam.h"
+#include "access/sysattr.h"
+#include "catalog/pg_extension.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+/*****************************************************************************
+ *
+ *	MARKOV SKETCH OF QUERY TEMPLATES
+ *
+ * The future value of a plan weighs the templates by the probability that
+ * they are the next query after the last num_history_data_compute_probability_fs
+ * ones (the Markov state). The shared memory keeps a bounded estimate of these
+ * probabilities, which is updated by every planned query and read by the
+ * planner without any table access:
+ *
+ *	- a count-min sketch of aqo.markov_sketch_width columns counts the pairs
+ *	  (state, template); template 0 counts all the queries of the state;
+ *	- a table of aqo.markov_states slots keeps the AQO_MARKOV_TOP_K most
+ *	  frequent next templates of a state with their counts. A state may be in
+ *	  one of two slots; a new state evicts the one with less queries.
+ *
+ * Counts decay exponentially with the half-life aqo.markov_half_life. The
+ * decay is forward: a query observed at time t adds 2^((t - landmark) / half
+ * life) instead of 1, so the stored counts never need to be aged, and only
+ * their ratios are used. All the counts are rescaled when the weight grows too
+ * large.
+ *
+ * Templates and states are numbered in each database, so the pairs and the
+ * states are counted per database. The queries of a database are forgotten
+ * when AQO is created or dropped there and when aqo_import_models replaces
+ * aqo_markov_table: the counts of the database then continue in a new epoch,
+ * which the count-min sketch hashes too, and its states are removed. Only
+ * AQO_MARKOV_MAX_EPOCHS databases may be in a new epoch; one more resets the
+ * whole sketch.
+ *
+ * The sketch is available only if AQO is loaded via shared_preload_libraries.
+ * Otherwise, and for the states it has seen less than AQO_MARKOV_MIN_QUERIES
+ * (decayed) queries of, the distribution comes from aqo_markov_table.
+ *
+ *****************************************************************************/
+
+/* Rows of the count-min sketch */
+#define AQO_MARKOV_CM_DEPTH 4
+/* Next templates kept for a state */
+#define AQO_MARKOV_TOP_K 8
+/* Weight at which all the counts are rescaled */
+#define AQO_MARKOV_MAX_WEIGHT 1e18
+/* Decayed number of queries of a state before its distribution is trusted */
+#define AQO_MARKOV_MIN_QUERIES 10
+/* Databases which forgot their queries */
+#define AQO_MARKOV_MAX_EPOCHS 16
+
+typedef struct AqoMarkovEpoch
+{
+	Oid			dbid;
+	uint32		epoch;
+} AqoMarkovEpoch;
+
+typedef struct AqoMarkovSlot
+{
+	bool		used;
+	Oid			dbid;
+	int			state;
+	int			ntop;
+	double		total;
+	int			templates[AQO_MARKOV_TOP_K];
+	double		counts[AQO_MARKOV_TOP_K];
+} AqoMarkovSlot;
+
+typedef struct AqoMarkovSharedState
+{
+	LWLock	   *lock;
+	TimestampTz landmark;		/* the time of the weight 1 */
+	uint32		last_epoch;
+	int			nepochs;
+	AqoMarkovEpoch epochs[AQO_MARKOV_MAX_EPOCHS];
+	/* AQO_MARKOV_CM_DEPTH * markov_sketch_width counters follow */
+} AqoMarkovSharedState;
+
+static AqoMarkovSharedState *markov_state = NULL;
+static double *markov_cm = NULL;
+static AqoMarkovSlot *markov_slots = NULL;
+
+static Size markov_cm_size(void);
+static Size markov_slots_size(void);
+static double markov_weight(TimestampTz now);
+static void markov_rescale(double factor);
+static void markov_reset(void);
+static uint32 markov_epoch(void);
+static double markov_cm_add(int state, int template, double weight);
+static AqoMarkovSlot *markov_find_slot(int state, bool create);
+static bool is_aqo_extension(Oid extoid);
+
+
+static Size
+markov_cm_size(void)
+{
+	return mul_size(mul_size(AQO_MARKOV_CM_DEPTH, markov_sketch_width),
+					sizeof(double));
+}
+
+static Size
+markov_slots_size(void)
+{
+	return mul_size(markov_states, sizeof(AqoMarkovSlot));
+}
+
+/*
+ * Requests the shared memory for the sketch. Must be called from _PG_init
+ * while shared_preload_libraries are loaded.
+ */
+void
+markov_sketch_request_shmem(void)
+{
+	if (markov_states <= 0)
+		return;
+
+	RequestAddinShmemSpace(add_size(MAXALIGN(sizeof(AqoMarkovSharedState)),
+									add_size(markov_cm_size(),
+											 markov_slots_size())));
+	RequestNamedLWLockTranche("aqo_markov_sketch", 1);
+}
+
+void
+markov_sketch_shmem_startup(void)
+{
+	bool		found;
+	char	   *ptr;
+
+	if (markov_states <= 0)
+		return;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	ptr = ShmemInitStruct("aqo_markov_sketch",
+						  add_size(MAXALIGN(sizeof(AqoMarkovSharedState)),
+								   add_size(markov_cm_size(),
+											markov_slots_size())),
+						  &found);
+	markov_state = (AqoMarkovSharedState *) ptr;
+	markov_cm = (double *) (ptr + MAXALIGN(sizeof(AqoMarkovSharedState)));
+	markov_slots = (AqoMarkovSlot *) ((char *) markov_cm + markov_cm_size());
+
+	if (!found)
+	{
+		markov_state->lock =
+			&(GetNamedLWLockTranche("aqo_markov_sketch"))->lock;
+		markov_reset();
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Weight of a query observed now. Rescales the counts if it is too large.
+ * The caller holds the lock exclusively.
+ */
+static double
+markov_weight(TimestampTz now)
+{
+	double		weight;
+
+	if (markov_half_life <= 0)
+		return 1;
+
+	weight = exp2((double) (now - markov_state->landmark) /
+				  (markov_half_life * USECS_PER_SEC));
+	if (weight > AQO_MARKOV_MAX_WEIGHT)
+	{
+		markov_rescale(1 / weight);
+		markov_state->landmark = now;
+		weight = 1;
+	}
+	return weight;
+}
+
+static void
+markov_rescale(double factor)
+{
+	int			i;
+	int			j;
+
+	for (i = 0; i < AQO_MARKOV_CM_DEPTH * markov_sketch_width; ++i)
+		markov_cm[i] *= factor;
+	for (i = 0; i < markov_states; ++i)
+	{
+		markov_slots[i].total *= factor;
+		for (j = 0; j < markov_slots[i].ntop; ++j)
+			markov_slots[i].counts[j] *= factor;
+	}
+}
+
+/*
+ * Forgets all the observed queries. The caller holds the lock exclusively.
+ */
+static void
+markov_reset(void)
+{
+	markov_state->landmark = GetCurrentTimestamp();
+	markov_state->last_epoch = 0;
+	markov_state->nepochs = 0;
+	MemSet(markov_cm, 0, markov_cm_size());
+	MemSet(markov_slots, 0, markov_slots_size());
+}
+
+/*
+ * Returns the epoch of the current database, 0 if it never forgot its
+ * queries.
+ */
+static uint32
+markov_epoch(void)
+{
+	int			i;
+
+	for (i = 0; i < markov_state->nepochs; ++i)
+		if (markov_state->epochs[i].dbid == MyDatabaseId)
+			return markov_state->epochs[i].epoch;
+	return 0;
+}
+
+/*
+ * Adds the weight to the count of the pair and returns the new estimate of
+ * the count.
+ */
+static double
+markov_cm_add(int state, int template, double weight)
+{
+	double		estimate = 0;
+	uint32		epoch = markov_epoch();
+	int			row;
+
+	for (row = 0; row < AQO_MARKOV_CM_DEPTH; ++row)
+	{
+		int32		key[5];
+		double	   *cell;
+
+		key[0] = (int32) MyDatabaseId;
+		key[1] = (int32) epoch;
+		key[2] = state;
+		key[3] = template;
+		key[4] = row;
+		cell = &markov_cm[row * markov_sketch_width +
+						  (uint32) DatumGetInt32(hash_any((const unsigned char *) key,
+														  sizeof(key))) %
+						  markov_sketch_width];
+		*cell += weight;
+		if (row == 0 || *cell < estimate)
+			estimate = *cell;
+	}
+	return estimate;
+}
+
+/*
+ * Returns the slot of the state, or NULL if there is no one and create is
+ * false. A created slot is empty.
+ */
+static AqoMarkovSlot *
+markov_find_slot(int state, bool create)
+{
+	uint32		h = (uint32) state ^ (uint32) MyDatabaseId;
+	AqoMarkovSlot *first = &markov_slots[h % markov_states];
+	AqoMarkovSlot *second = &markov_slots[(h >> 16 | h << 16) % markov_states];
+	AqoMarkovSlot *victim;
+
+	if (first->used && first->dbid == MyDatabaseId && first->state == state)
+		return first;
+	if (second->used && second->dbid == MyDatabaseId && second->state == state)
+		return second;
+	if (!create)
+		return NULL;
+
+	if (!first->used)
+		victim = first;
+	else if (!second->used)
+		victim = second;
+	else
+		victim = (first->total <= second->total) ? first : second;
+
+	MemSet(victim, 0, sizeof(*victim));
+	victim->used = true;
+	victim->dbid = MyDatabaseId;
+	victim->state = state;
+	return victim;
+}
+
+/*
+ * Forgets the queries observed in the current database.
+ */
+void
+markov_sketch_forget_database(void)
+{
+	int			i;
+
+	if (markov_state == NULL)
+		return;
+
+	LWLockAcquire(markov_state->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < markov_state->nepochs; ++i)
+		if (markov_state->epochs[i].dbid == MyDatabaseId)
+			break;
+	if (i == AQO_MARKOV_MAX_EPOCHS)
+		markov_reset();
+	else
+	{
+		if (i == markov_state->nepochs)
+		{
+			markov_state->epochs[i].dbid = MyDatabaseId;
+			markov_state->nepochs++;
+		}
+		markov_state->epochs[i].epoch = ++markov_state->last_epoch;
+
+		for (i = 0; i < markov_states; ++i)
+			if (markov_slots[i].dbid == MyDatabaseId)
+				MemSet(&markov_slots[i], 0, sizeof(markov_slots[i]));
+	}
+
+	LWLockRelease(markov_state->lock);
+}
+
+/*
+ * Whether the extension is AQO. The extension may be created by the current
+ * command, so its row is looked for with SnapshotSelf.
+ */
+static bool
+is_aqo_extension(Oid extoid)
+{
+	Relation	rel;
+	SysScanDesc scan;
+	ScanKeyData key;
+	HeapTuple	tuple;
+	bool		result;
+
+	rel = heap_open(ExtensionRelationId, AccessShareLock);
+	ScanKeyInit(&key,
+				ObjectIdAttributeNumber,
+				BTEqualStrategyNumber,
+				F_OIDEQ,
+				ObjectIdGetDatum(extoid));
+	scan = systable_beginscan(rel, ExtensionOidIndexId, true,
+							  SnapshotSelf, 1, &key);
+	tuple = systable_getnext(scan);
+	result = HeapTupleIsValid(tuple) &&
+		strcmp(NameStr(((Form_pg_extension) GETSTRUCT(tuple))->extname),
+			   "aqo") == 0;
+	systable_endscan(scan);
+	heap_close(rel, AccessShareLock);
+
+	return result;
+}
+
+/*
+ * Forgets the queries of the database when AQO is created or dropped in it:
+ * the templates of the new aqo_markov_table are numbered anew.
+ */
+void
+aqo_object_access(ObjectAccessType access, Oid classId, Oid objectId,
+				  int subId, void *arg)
+{
+	if (prev_object_access_hook)
+		(*prev_object_access_hook) (access, classId, objectId, subId, arg);
+
+	if (classId == ExtensionRelationId && markov_state != NULL &&
+		(access == OAT_POST_CREATE || access == OAT_DROP) &&
+		is_aqo_extension(objectId))
+		markov_sketch_forget_database();
+}
+
+/*
+ * Accounts the query of the template which follows the Markov state.
+ */
+void
+markov_sketch_observe(int state, int template)
+{
+	AqoMarkovSlot *slot;
+	double		weight;
+	double		count;
+	int			min = 0;
+	int			i;
+
+	if (markov_state == NULL || template <= 0 ||
+		template > num_query_pattern)
+		return;
+
+	LWLockAcquire(markov_state->lock, LW_EXCLUSIVE);
+
+	weight = markov_weight(GetCurrentTimestamp());
+	count = markov_cm_add(state, template, weight);
+	slot = markov_find_slot(state, true);
+	slot->total = markov_cm_add(state, 0, weight);
+
+	for (i = 0; i < slot->ntop; ++i)
+	{
+		if (slot->templates[i] == template)
+			break;
+		if (slot->counts[i] < slot->counts[min])
+			min = i;
+	}
+
+	if (i < slot->ntop)
+		slot->counts[i] = count;
+	else if (slot->ntop < AQO_MARKOV_TOP_K)
+	{
+		slot->templates[slot->ntop] = template;
+		slot->counts[slot->ntop++] = count;
+	}
+	else if (count > slot->counts[min])
+	{
+		slot->templates[min] = template;
+		slot->counts[min] = count;
+	}
+
+	LWLockRelease(markov_state->lock);
+}
+
+/*
+ * Fills the distribution of the next template (num_query_pattern elements,
+ * the template i at i - 1) for the Markov state. The probability not covered
+ * by the most frequent templates is spread uniformly over the others. Returns
+ * false if the sketch has seen too few queries of the state.
+ */
+bool
+markov_sketch_predict(int state, double *distribution)
+{
+	AqoMarkovSlot *slot;
+	int			templates[AQO_MARKOV_TOP_K];
+	double		counts[AQO_MARKOV_TOP_K];
+	double		total;
+	double		weight = 1;
+	double		sum = 0;
+	double		rest;
+	int			ntop;
+	int			i;
+
+	if (markov_state == NULL)
+		return false;
+
+	LWLockAcquire(markov_state->lock, LW_SHARED);
+	slot = markov_find_slot(state, false);
+	/* The weight of a query observed now turns the total into a count */
+	if (slot != NULL && markov_half_life > 0)
+		weight = exp2((double) (GetCurrentTimestamp() - markov_state->landmark) /
+					  (markov_half_life * USECS_PER_SEC));
+	if (slot == NULL || slot->total < AQO_MARKOV_MIN_QUERIES * weight)
+	{
+		LWLockRelease(markov_state->lock);
+		return false;
+	}
+	ntop = slot->ntop;
+	total = slot->total;
+	memcpy(templates, slot->templates, sizeof(*templates) * ntop);
+	memcpy(counts, slot->counts, sizeof(*counts) * ntop);
+	LWLockRelease(markov_state->lock);
+
+	for (i = 0; i < ntop; ++i)
+		sum += counts[i];
+	/* the count-min sketch overestimates the counts */
+	if (sum > total)
+		total = sum;
+
+	for (i = 0; i < num_query_pattern; ++i)
+		distribution[i] = 0;
+	for (i = 0; i < ntop; ++i)
+		distribution[templates[i] - 1] = counts[i] / total;
+
+	if (ntop < num_query_pattern)
+	{
+		rest = (1 - sum / total) / (num_query_pattern - ntop);
+		for (i = 0; i < num_query_pattern; ++i)
+			if (distribution[i] == 0)
+				distribution[i] = rest;
+	}
+	return true;
+}
+
+PG_FUNCTION_INFO_V1(aqo_markov_sketch);
+
+/*
+ * Returns the most frequent next templates of every known Markov state of the
+ * current database with their probabilities.
+ */
+Datum
+aqo_markov_sketch(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			i;
+	int			j;
+
+	if (markov_state == NULL)
+		elog(ERROR, "aqo must be loaded via shared_preload_libraries to keep the Markov sketch");
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		elog(ERROR, "set-valued function called in context that cannot accept a set");
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(markov_state->lock, LW_SHARED);
+
+	for (i = 0; i < markov_states; ++i)
+	{
+		AqoMarkovSlot *slot = &markov_slots[i];
+
+		if (!slot->used || slot->dbid != MyDatabaseId || slot->total <= 0)
+			continue;
+
+		for (j = 0; j < slot->ntop; ++j)
+		{
+			Datum		values[3];
+			bool		nulls[3] = {false, false, false};
+
+			values[0] = Int32GetDatum(slot->state);
+			values[1] = Int32GetDatum(slot->templates[j]);
+			values[2] = Float8GetDatum(Min(slot->counts[j] / slot->total, 1));
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	LWLockRelease(markov_state->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(aqo_markov_sketch_reset);
+
+/*
+ * Forgets all the observed queries of all the databases.
+ */
+Datum
+aqo_markov_sketch_reset(PG_FUNCTION_ARGS)
+{
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to use aqo_markov_sketch_reset")));
+	if (markov_state == NULL)
+		elog(ERROR, "aqo must be loaded via shared_preload_libraries to keep the Markov sketch");
+
+	LWLockAcquire(markov_state->lock, LW_EXCLUSIVE);
+	markov_reset();
+	LWLockRelease(markov_state->lock);
+
+	PG_RETURN_VOID();
+}
@@ -48,6 +48,10 @@ aqo_join_search(PlannerInfo *root, int levels_needed, List *initial_rels)
 		 */
 		join_search_one_level(root, lev);
 
+		/* out of planning time: build the remaining levels in the standard way */
+		if (root->search_plan_mode != 0 && aqo_planning_budget_exhausted())
+			root->search_plan_mode = 0;
+
 		/*
 		 * Run generate_gather_paths() for each just-processed joinrel.  We
 		 * could not do this earlier because both regular and partial paths
@@ -95,7 +99,7 @@ void aqo_set_rel_pathlist(PlannerInfo *root, RelOptInfo *rel, Index rti, RangeTb
 {
     ListCell   *p;
 	/*decide the plan search mode*/
-	if (aqo_mode == AQO_MODE_DISABLED){
+	if (aqo_mode == AQO_MODE_DISABLED || aqo_planning_budget_exhausted()){
 		root->search_plan_mode = 0;
 	}else
 	{
@@ -124,12 +128,9 @@ void calculate_current_best_estimate_cost(QueryContextData	*query_context2, int
 	double **feature_matrix;
 	double *best_est_costs;
 	double *best_true_costs;
-	int i,k;
 	double  est_best_cost = 0;
 	int     rows;
-	feature_matrix = palloc(sizeof(*feature_matrix) * num_two_costs_save);
-	for (i = 0; i < num_two_costs_save; ++i)
-		feature_matrix[i] = palloc0(sizeof(**feature_matrix) * nfeatures);
+	feature_matrix = OkNNr_allocate_matrix(num_two_costs_save, nfeatures);
 	best_est_costs = palloc0(sizeof(*best_est_costs) * num_two_costs_save);
 	best_true_costs = palloc0(sizeof(*best_true_costs) * num_two_costs_save);
 	//2. load the current features and two costs. rows = 0 indicate the table have no history data of this query_pattern
@@ -141,9 +142,7 @@ void calculate_current_best_estimate_cost(QueryContextData	*query_context2, int
 			  input_feature, 2);
 	query_context2->best_pred_cost = est_best_cost;
 	//4. free the memory
-	for (k = 0; k < num_two_costs_save; ++k)
-      pfree(feature_matrix[k]);
-   pfree(feature_matrix);
+	pfree(feature_matrix);
    pfree(best_est_costs);
    pfree(best_true_costs);
 }
@@ -158,14 +157,14 @@ void update_two_best_costs_record(int current_query_pattern, int nfeatures, doub
 	double **feature_matrix;
 	double *best_est_costs;
 	double *best_true_costs;
-	int     i,k;
 	int     rows;
 	int     new_matrix_rows;
 	List   *changed_lines = NIL;
 	ListCell   *l;
-    feature_matrix = palloc(sizeof(*feature_matrix) * num_two_costs_save);
-	for (i = 0; i < num_two_costs_save; ++i)
-		feature_matrix[i] = palloc0(sizeof(**feature_matrix) * nfeatures);
+	AqoStatTimer stat_timer;
+
+	aqo_stat_begin(&stat_timer);
+    feature_matrix = OkNNr_allocate_matrix(num_two_costs_save, nfeatures);
 	best_est_costs = palloc0(sizeof(*best_est_costs) * num_two_costs_save);
 	best_true_costs = palloc0(sizeof(*best_true_costs) * num_two_costs_save);
     //2. load the current features and two costs. rows = 0 indicate the table have no history data of this query_pattern
@@ -185,9 +184,8 @@ void update_two_best_costs_record(int current_query_pattern, int nfeatures, doub
    //4. 将数据写入表中
    update_best_two_costs(current_query_pattern, nfeatures, new_matrix_rows, feature_matrix, best_est_costs, best_true_costs);
    //释放内存
-   for (k = 0; k < num_two_costs_save; ++k)
-      pfree(feature_matrix[k]);
    pfree(feature_matrix);
    pfree(best_est_costs);
    pfree(best_true_costs);
+   aqo_stat_end(&stat_timer, AQO_STAT_UPDATE_TWO_BEST_COSTS_RECORD, 0);
 }
\ No newline at end of file
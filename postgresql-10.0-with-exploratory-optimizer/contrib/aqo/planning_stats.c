@@ -0,0 +1,356 @@
+#include "aqo.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+
+/*****************************************************************************
+ *
+ *	HOT PATH STATISTICS
+ *
+ * Counters of the AQO functions which dominate planning and learning time.
+ * For each function, query template and feature subspace the shared hash
+ * table keeps the number of calls, the total time, a histogram of call times
+ * and the number of bytes of model data detoasted by the call. The learn_skip_*
+ * entries only count the executed nodes the learning policy did not learn,
+ * learn_deferred and learn_folded the objects put into and taken from the
+ * deferred learning queue.
+ *
+ * The statistics are available only if AQO is loaded via
+ * shared_preload_libraries. The hash table has aqo.planning_stats_max
+ * entries; calls of new keys are not counted when it is full.
+ *
+ *****************************************************************************/
+
+/* Histogram buckets: [2^(i-1), 2^i) microseconds, the first one is < 1us */
+#define AQO_STAT_BUCKETS 32
+
+typedef struct AqoStatKey
+{
+	int			func;
+	int			template_hash;
+	int			fss_hash;
+} AqoStatKey;
+
+typedef struct AqoStatEntry
+{
+	AqoStatKey	key;
+	slock_t		mutex;			/* protects the counters only */
+	int64		calls;
+	double		total_time;		/* in milliseconds */
+	int64		bytes_detoasted;
+	int64		histogram[AQO_STAT_BUCKETS];
+} AqoStatEntry;
+
+typedef struct AqoStatSharedState
+{
+	LWLock	   *lock;			/* protects the hash table */
+} AqoStatSharedState;
+
+static const char *const aqo_stat_func_names[AQO_STAT_NFUNCS] = {
+	"get_query_hash",
+	"get_fss_for_object",
+	"load_fss_rfwr",
+	"lwpr_predict_explore",
+	"update_fss_history",
+	"load_rf_datahouse",
+	"learn_query_stat",
+	"update_two_best_costs_record",
+	"learn_merge",
+	"learn_merge_dropped",
+	"learn_fss_object",
+	"learn_skip_accurate",
+	"learn_skip_sampled",
+	"learn_skip_rate",
+	"learn_deferred",
+	"learn_folded"
+};
+
+static AqoStatSharedState *aqo_stat_state = NULL;
+static HTAB *aqo_stat_hash = NULL;
+
+/* Bytes of model data detoasted by this backend */
+int64		aqo_detoasted_bytes = 0;
+
+static Size aqo_stat_memsize(void);
+static int	aqo_stat_bucket(double elapsed_ms);
+static void aqo_stat_record(AqoStatFunc func, int fss_hash,
+				double elapsed_ms, int64 bytes);
+
+
+static Size
+aqo_stat_memsize(void)
+{
+	return add_size(MAXALIGN(sizeof(AqoStatSharedState)),
+					hash_estimate_size(planning_stats_max,
+									   sizeof(AqoStatEntry)));
+}
+
+/*
+ * Requests the shared memory for statistics. Must be called from _PG_init
+ * while shared_preload_libraries are loaded.
+ */
+void
+aqo_stat_request_shmem(void)
+{
+	RequestAddinShmemSpace(aqo_stat_memsize());
+	RequestNamedLWLockTranche("aqo_planning_stats", 1);
+}
+
+void
+aqo_stat_shmem_startup(void)
+{
+	HASHCTL		info;
+	bool		found;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	aqo_stat_state = ShmemInitStruct("aqo_planning_stats",
+									 sizeof(AqoStatSharedState), &found);
+	if (!found)
+		aqo_stat_state->lock =
+			&(GetNamedLWLockTranche("aqo_planning_stats"))->lock;
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(AqoStatKey);
+	info.entrysize = sizeof(AqoStatEntry);
+	aqo_stat_hash = ShmemInitHash("aqo_planning_stats hash",
+								  planning_stats_max, planning_stats_max,
+								  &info, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Starts measuring a call. Does nothing if the statistics are not available.
+ */
+void
+aqo_stat_begin(AqoStatTimer *timer)
+{
+	timer->active = (aqo_stat_hash != NULL && track_planning_stats);
+	if (!timer->active)
+		return;
+
+	timer->bytes = aqo_detoasted_bytes;
+	INSTR_TIME_SET_CURRENT(timer->start);
+}
+
+/*
+ * Finishes measuring a call and accounts it to the current query template
+ * and the given feature subspace (0 if the call has no one).
+ */
+void
+aqo_stat_end(AqoStatTimer *timer, AqoStatFunc func, int fss_hash)
+{
+	instr_time	elapsed;
+
+	if (!timer->active)
+		return;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, timer->start);
+	aqo_stat_record(func, fss_hash, INSTR_TIME_GET_MILLISEC(elapsed),
+					aqo_detoasted_bytes - timer->bytes);
+}
+
+/*
+ * Counts an event which takes no measurable time.
+ */
+void
+aqo_stat_count(AqoStatFunc func, int fss_hash)
+{
+	if (aqo_stat_hash == NULL || !track_planning_stats)
+		return;
+
+	aqo_stat_record(func, fss_hash, 0, 0);
+}
+
+static int
+aqo_stat_bucket(double elapsed_ms)
+{
+	double		us = elapsed_ms * 1000.0;
+	int			bucket = 0;
+
+	while (us >= 1.0 && bucket < AQO_STAT_BUCKETS - 1)
+	{
+		us /= 2;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void
+aqo_stat_record(AqoStatFunc func, int fss_hash, double elapsed_ms, int64 bytes)
+{
+	AqoStatKey	key;
+	AqoStatEntry *entry;
+	bool		found;
+
+	MemSet(&key, 0, sizeof(key));
+	key.func = func;
+	key.template_hash = query_context.current_query_hash;
+	key.fss_hash = fss_hash;
+
+	LWLockAcquire(aqo_stat_state->lock, LW_SHARED);
+	entry = (AqoStatEntry *) hash_search(aqo_stat_hash, &key, HASH_FIND, NULL);
+
+	if (entry == NULL)
+	{
+		/* Need the exclusive lock to add a new entry */
+		LWLockRelease(aqo_stat_state->lock);
+		LWLockAcquire(aqo_stat_state->lock, LW_EXCLUSIVE);
+
+		if (hash_get_num_entries(aqo_stat_hash) < planning_stats_max)
+		{
+			entry = (AqoStatEntry *) hash_search(aqo_stat_hash, &key,
+												 HASH_ENTER_NULL, &found);
+			if (entry != NULL && !found)
+			{
+				SpinLockInit(&entry->mutex);
+				entry->calls = 0;
+				entry->total_time = 0;
+				entry->bytes_detoasted = 0;
+				MemSet(entry->histogram, 0, sizeof(entry->histogram));
+			}
+		}
+		else
+			entry = (AqoStatEntry *) hash_search(aqo_stat_hash, &key,
+												 HASH_FIND, NULL);
+	}
+
+	if (entry != NULL)
+	{
+		volatile AqoStatEntry *e = (volatile AqoStatEntry *) entry;
+
+		SpinLockAcquire(&e->mutex);
+		e->calls++;
+		e->total_time += elapsed_ms;
+		e->bytes_detoasted += bytes;
+		e->histogram[aqo_stat_bucket(elapsed_ms)]++;
+		SpinLockRelease(&e->mutex);
+	}
+
+	LWLockRelease(aqo_stat_state->lock);
+}
+
+PG_FUNCTION_INFO_V1(aqo_planning_stats);
+
+/*
+ * Returns the collected statistics, one row per function, query template and
+ * feature subspace. Times are in milliseconds; p99_time is the upper bound of
+ * the histogram bucket which contains the 99th percentile.
+ */
+Datum
+aqo_planning_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	AqoStatEntry *entry;
+
+	if (aqo_stat_hash == NULL)
+		elog(ERROR, "aqo must be loaded via shared_preload_libraries to collect planning statistics");
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		elog(ERROR, "set-valued function called in context that cannot accept a set");
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(aqo_stat_state->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, aqo_stat_hash);
+	while ((entry = (AqoStatEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[8];
+		bool		nulls[8] = {false, false, false, false,
+								false, false, false, false};
+		int64		calls;
+		double		total_time;
+		int64		bytes;
+		int64		histogram[AQO_STAT_BUCKETS];
+		int64		cumulative = 0;
+		int			i;
+
+		{
+			volatile AqoStatEntry *e = (volatile AqoStatEntry *) entry;
+
+			SpinLockAcquire(&e->mutex);
+			calls = e->calls;
+			total_time = e->total_time;
+			bytes = e->bytes_detoasted;
+			for (i = 0; i < AQO_STAT_BUCKETS; ++i)
+				histogram[i] = e->histogram[i];
+			SpinLockRelease(&e->mutex);
+		}
+
+		if (calls == 0)
+			continue;
+
+		for (i = 0; i < AQO_STAT_BUCKETS - 1; ++i)
+		{
+			cumulative += histogram[i];
+			if (cumulative >= 0.99 * calls)
+				break;
+		}
+
+		values[0] = CStringGetTextDatum(aqo_stat_func_names[entry->key.func]);
+		values[1] = Int32GetDatum(entry->key.template_hash);
+		values[2] = Int32GetDatum(entry->key.fss_hash);
+		values[3] = Int64GetDatum(calls);
+		values[4] = Float8GetDatum(total_time);
+		values[5] = Float8GetDatum(total_time / calls);
+		values[6] = Float8GetDatum(ldexp(1.0, i) / 1000.0);
+		values[7] = Int64GetDatum(bytes);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(aqo_stat_state->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(aqo_planning_stats_reset);
+
+/*
+ * Removes all the collected statistics.
+ */
+Datum
+aqo_planning_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AqoStatEntry *entry;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to use aqo_planning_stats_reset")));
+	if (aqo_stat_hash == NULL)
+		elog(ERROR, "aqo must be loaded via shared_preload_libraries to collect planning statistics");
+
+	LWLockAcquire(aqo_stat_state->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, aqo_stat_hash);
+	while ((entry = (AqoStatEntry *) hash_seq_search(&hash_seq)) != NULL)
+		hash_search(aqo_stat_hash, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(aqo_stat_state->lock);
+
+	PG_RETURN_VOID();
+}
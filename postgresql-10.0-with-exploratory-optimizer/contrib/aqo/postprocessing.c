@@ -1,5 +1,6 @@
 #include "aqo.h"
 #include "utils/queryenvironment.h"
+#include "access/parallel.h"
 
 /*****************************************************************************
  *
@@ -11,9 +12,57 @@
  *
  *****************************************************************************/
 
+/*
+ * How many times an object is learned on the model when its update conflicts
+ * with concurrent updates of the same feature subspace.
+ */
+#define AQO_LEARN_MERGE_ATTEMPTS 4
+
+/*
+ * Staleness of a model is multiplied by this factor with every learned object,
+ * so a model marked stale is trusted again after a few executions.
+ */
+#define AQO_STALENESS_DECAY 0.5
+
+/*
+ * The reservoir of aqo.learn_sample_size objects of a subspace restarts after
+ * this many times its size, so at least this share of the objects is learned
+ * however long the backend lives.
+ */
+#define AQO_LEARN_SAMPLE_WINDOW 16
+
 static double cardinality_sum_errors;
 static int	cardinality_num_objects;
 
+/*
+ * Learning policy state of a feature subspace of a feature space in this
+ * backend: the number of learnable objects seen since the reservoir restarted
+ * and the updates of the current second for the rate limit. Each backend
+ * keeps its own state, so the limits apply to every backend separately.
+ */
+typedef struct LearnPolicyKey
+{
+	int			fspace_hash;
+	int			fss_hash;
+} LearnPolicyKey;
+
+typedef struct LearnPolicyEntry
+{
+	LearnPolicyKey key;
+	int64		nobjects;
+	int64		window;			/* the second the updates are counted in */
+	int			window_updates;
+} LearnPolicyEntry;
+
+static HTAB *learn_policy_htab = NULL;
+
+/*
+ * The model learned on one object, its receptive fields and everything
+ * allocated by loading and storing it live in this context, which is reset
+ * once the object is learned instead of freeing the model piece by piece.
+ */
+static MemoryContext learn_model_cxt = NULL;
+
 /* It is needed to recognize stored Query-related aqo data in the query
  * environment field.
  */
@@ -21,16 +70,16 @@ static char *AQOPrivateData = "AQOPrivateData";
 
 
 /* Query execution statistics collecting utilities */
-static void atomic_fss_learn_step(int fss_hash, int matrix_cols,
-					  double **matrix, double *targets,
-					  double *features, double target);
-static void atomic_fss_learn_step_rfwr(int fss_hash, int nfeatures, LWPR_Model *model,
-					  double *features, double target);	  
 static void learn_sample(List *clauselist,
 			 List *selectivities,
 			 List *relidslist,
 			 double true_cardinality,
 			 double predicted_cardinality);
+static bool learn_policy_accepts(int fss_hash, double error);
+static MemoryContext begin_model_learning(void);
+static void end_model_learning(MemoryContext oldcxt);
+static void learn_fss_object(int fspace_hash, int fss_hash, List *relids,
+				 int nfeatures, double *features, double target);
 static int learn_sample_rfwr(List *clauselist, List *selectivities, List *relidslist,
 			 double true_cardinality, double predicted_cardinality);
 static List *restore_selectivities(List *clauselist,
@@ -48,13 +97,16 @@ static void update_query_stat_row(double *et, int *et_size,
 					  double execution_time,
 					  double cardinality_error,
 					  int64 *n_exec);
+static double get_parallel_participants(PlanState *p);
 static void StoreToQueryContext(QueryDesc *queryDesc);
-static bool ExtractFromQueryContext(QueryDesc *queryDesc);
-static void RemoveFromQueryContext(QueryDesc *queryDesc);
 
 /*
- * This is the critical section: only one runner is allowed to be inside this
- * function for one feature subspace.
+ * Learns the object in the feature subspace. Backends learning on the same
+ * subspace concurrently do not serialize on a lock for the whole learning:
+ * each one applies the object to the version of the model it has loaded. If
+ * the model was updated by somebody else meanwhile, the update of the row
+ * fails after the other transaction commits, and the object, which is all the
+ * change we make, is merged into the new version by learning it again.
  * matrix and targets are just preallocated memory for computations.
  */
 void
@@ -66,39 +118,141 @@ atomic_fss_learn_step(int fss_hash, int matrix_cols,
 	int			new_matrix_rows;
 	List	   *changed_lines = NIL;
 	ListCell   *l;
+	bool		updated;
+	int			attempt;
+	AqoStatTimer stat_timer;
 
-	if (!load_fss(fss_hash, matrix_cols, matrix, targets, &matrix_rows))
-		matrix_rows = 0;
+	for (attempt = 0;; ++attempt)
+	{
+		if (!load_fss(fss_hash, matrix_cols, matrix, targets, &matrix_rows))
+			matrix_rows = 0;
 
-	changed_lines = OkNNr_learn(matrix_rows, matrix_cols,
-								matrix, targets,
-								features, target,aqo_K);
+		changed_lines = OkNNr_learn(matrix_rows, matrix_cols,
+									matrix, targets,
+									features, target,aqo_K);
 
-	new_matrix_rows = matrix_rows;
-	foreach(l, changed_lines)
-	{
-		if (lfirst_int(l) >= new_matrix_rows)
-			new_matrix_rows = lfirst_int(l) + 1;
+		new_matrix_rows = matrix_rows;
+		foreach(l, changed_lines)
+		{
+			if (lfirst_int(l) >= new_matrix_rows)
+				new_matrix_rows = lfirst_int(l) + 1;
+		}
+		updated = update_fss(fss_hash, new_matrix_rows, matrix_cols,
+							 matrix, targets, matrix_rows, changed_lines);
+		list_free(changed_lines);
+
+		if (attempt > 0)
+			aqo_stat_end(&stat_timer, AQO_STAT_LEARN_MERGE, fss_hash);
+		if (updated || !query_context.learn_aqo ||
+			attempt + 1 >= AQO_LEARN_MERGE_ATTEMPTS)
+			break;
+		aqo_stat_begin(&stat_timer);
 	}
-	update_fss(fss_hash, new_matrix_rows, matrix_cols, matrix, targets,
-			   matrix_rows, changed_lines);
 }
 /*
  * rfwr的学习过程
+ * The model is merged with concurrent updates in the same way as in
+ * atomic_fss_learn_step(). lwpr_update changes the model incrementally by
+ * one object, so learning it again on the new version of the model applies
+ * exactly the change of this backend.
+ * The objects other backends deferred on this subspace are learned together
+ * with ours. If the model row is being updated by another transaction, we
+ * do not wait for it: all these objects are put into the deferred learning
+ * queue for the next learner of the subspace. We wait only if the queue has
+ * no room for them.
+ * lwpr_update only queues the objects for the RF data houses, they are written
+ * after the model row is stored, so a retried merge writes them once. Objects
+ * which still conflict after AQO_LEARN_MERGE_ATTEMPTS are deferred too, or
+ * dropped and counted as learn_merge_dropped in aqo_planning_stats if the
+ * queue is full.
+ * Each learned object halves the staleness of the model. Returns true if the
+ * model did not exist before.
  */
-void
+bool
 atomic_fss_learn_step_rfwr(int fss_hash, int nfeatures, LWPR_Model *model,
 					  double *features, double target)
 {
 	// 更新是否成功，1成功，0不成功
 	int result;
-	// 加载当前的model
-	load_fss_rfwr(fss_hash, nfeatures, model);
-	// 更新
-	result = lwpr_update(model, features, target);
-    if (result == 1)
-	   //更新fss
-	   update_fss_rfwr(fss_hash, nfeatures, model);
+	bool updated;
+	bool busy;
+	bool created = false;
+	bool wait = false;
+	int attempt;
+	AqoStatTimer stat_timer;
+	AqoLearnObject own;
+	List *objects;
+	ListCell *l;
+
+	own.features = features;
+	own.target = target;
+	objects = lcons(&own, learn_queue_pop(fss_hash, nfeatures));
+	for (l = lnext(list_head(objects)); l != NULL; l = lnext(l))
+		aqo_stat_count(AQO_STAT_LEARN_FOLDED, fss_hash);
+
+	lwpr_reset_datahouse();
+	for (attempt = 0;; ++attempt)
+	{
+		// 加载当前的model
+		if (!load_fss_rfwr(fss_hash, nfeatures, model))
+			created = true;
+		// 更新
+		result = 1;
+		foreach(l, objects)
+		{
+			AqoLearnObject *obj = (AqoLearnObject *) lfirst(l);
+
+			model->staleness *= AQO_STALENESS_DECAY;
+			if (model->staleness < 0.01)
+				model->staleness = 0;
+			result = lwpr_update(model, obj->features, obj->target);
+			if (result != 1)
+				break;
+		}
+		//更新fss
+		updated = (result != 1 ||
+				   update_fss_rfwr(fss_hash, nfeatures, model,
+								   wait ? NULL : &busy));
+
+		if (attempt > 0)
+			aqo_stat_end(&stat_timer, AQO_STAT_LEARN_MERGE, fss_hash);
+		if (updated && result == 1)
+		{
+			/* The model row is stored, so its RF data houses may follow */
+			lwpr_store_datahouse();
+			break;
+		}
+		lwpr_discard_datahouse();
+		if (updated || !query_context.learn_aqo)
+			break;
+
+		if ((!wait && busy) || attempt + 1 >= AQO_LEARN_MERGE_ATTEMPTS)
+		{
+			/* Leave the objects to the next learner of the subspace */
+			if (learn_queue_push(fss_hash, nfeatures, objects))
+			{
+				foreach(l, objects)
+					aqo_stat_count(AQO_STAT_LEARN_DEFERRED, fss_hash);
+				break;
+			}
+			if (attempt + 1 >= AQO_LEARN_MERGE_ATTEMPTS)
+			{
+				foreach(l, objects)
+					aqo_stat_count(AQO_STAT_LEARN_MERGE_DROPPED, fss_hash);
+				elog(DEBUG1, "AQO dropped %d objects of fss %d after %d conflicting updates of its model",
+					 list_length(objects), fss_hash, AQO_LEARN_MERGE_ATTEMPTS);
+				break;
+			}
+			/* The queue is full, so wait for the concurrent update */
+			wait = true;
+		}
+
+		/* Learn the objects again on the committed version of the model */
+		aqo_stat_begin(&stat_timer);
+		lwpr_free_model(model);
+		lwpr_init_model(model, nfeatures, 1);
+	}
+	return created;
 }
 
 /*
@@ -116,7 +270,6 @@ learn_sample(List *clauselist, List *selectivities, List *relidslist,
 	double	   *targets;
 	double	   *features;
 	double		target;
-	int			i;
 	double      targets_data;
 	double      predicts_data;
 
@@ -140,9 +293,7 @@ learn_sample(List *clauselist, List *selectivities, List *relidslist,
 	/* In the case of zero matrix we not need to learn */
 	if (matrix_cols > 0)
 	{
-		matrix = palloc(sizeof(*matrix) * aqo_K);
-		for (i = 0; i < aqo_K; ++i)
-			matrix[i] = palloc0(sizeof(**matrix) * matrix_cols);
+		matrix = OkNNr_allocate_matrix(aqo_K, matrix_cols);
 		targets = palloc0(sizeof(*targets) * aqo_K);
 
 		/* Here should be critical section */
@@ -156,15 +307,98 @@ learn_sample(List *clauselist, List *selectivities, List *relidslist,
 
 		/* Here should be the end of critical section */
 
-		for (i = 0; i < aqo_K; ++i)
-			pfree(matrix[i]);
 		pfree(matrix);
 		pfree(targets);
 	}
 	pfree(features);
 }
+/*
+ * Decides whether an object of the feature subspace with the given error of
+ * log-cardinality is worth learning. Objects predicted within
+ * aqo.learn_error_threshold are skipped. The others are reservoir-sampled and
+ * rate-limited per subspace of the feature space by this backend, unless the
+ * error reaches aqo.learn_large_error: a converged subspace is learned rarely
+ * but still follows a changed data distribution at once. Such an object also restarts the reservoir, as does
+ * the end of a window of AQO_LEARN_SAMPLE_WINDOW reservoir sizes, so the
+ * share of sampled objects does not drop to zero in a long-lived backend.
+ * Skipped objects are counted by the planning statistics.
+ */
+static bool
+learn_policy_accepts(int fss_hash, double error)
+{
+	LearnPolicyKey key;
+	LearnPolicyEntry *entry;
+	bool		found;
+	int64		now;
+
+	if (error < learn_error_threshold)
+	{
+		aqo_stat_count(AQO_STAT_LEARN_SKIP_ACCURATE, fss_hash);
+		return false;
+	}
+	if (learn_sample_size <= 0 && learn_max_per_second <= 0)
+		return true;
+
+	if (learn_policy_htab == NULL)
+	{
+		HASHCTL		info;
+
+		MemSet(&info, 0, sizeof(info));
+		info.keysize = sizeof(LearnPolicyKey);
+		info.entrysize = sizeof(LearnPolicyEntry);
+		info.hcxt = TopMemoryContext;
+		learn_policy_htab = hash_create("AQO learning policy", 64, &info,
+										HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	key.fspace_hash = query_context.fspace_hash;
+	key.fss_hash = fss_hash;
+	entry = (LearnPolicyEntry *) hash_search(learn_policy_htab, &key,
+											 HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->nobjects = 0;
+		entry->window = 0;
+		entry->window_updates = 0;
+	}
+	if (error >= learn_large_error ||
+		entry->nobjects >= (int64) learn_sample_size * AQO_LEARN_SAMPLE_WINDOW)
+		entry->nobjects = 0;
+	entry->nobjects++;
+
+	now = GetCurrentTimestamp() / USECS_PER_SEC;
+	if (now != entry->window)
+	{
+		entry->window = now;
+		entry->window_updates = 0;
+	}
+
+	if (error < learn_large_error)
+	{
+		/* The n-th object enters a reservoir of size k with probability k/n */
+		if (learn_sample_size > 0 && entry->nobjects > learn_sample_size &&
+			random() / ((double) MAX_RANDOM_VALUE + 1) >=
+			(double) learn_sample_size / entry->nobjects)
+		{
+			aqo_stat_count(AQO_STAT_LEARN_SKIP_SAMPLED, fss_hash);
+			return false;
+		}
+		if (learn_max_per_second > 0 &&
+			entry->window_updates >= learn_max_per_second)
+		{
+			aqo_stat_count(AQO_STAT_LEARN_SKIP_RATE, fss_hash);
+			return false;
+		}
+	}
+
+	entry->window_updates++;
+	return true;
+}
+
 /*
  * rfwr 学习
+ * Returns 1 if the object has features, whether the learning policy accepted
+ * it or not.
  */
 int 
 learn_sample_rfwr(List *clauselist, List *selectivities, List *relidslist,
@@ -176,13 +410,13 @@ learn_sample_rfwr(List *clauselist, List *selectivities, List *relidslist,
 	int			nfeatures;
 	double	   *features;
 	double		target;
+	double		error;
+	AqoStatTimer timer;
 	// double      targets_data;
 	// double      predicts_data;
-	//获取当前的LWPR模型
-	LWPR_Model  model;
 	// 计算autotune 的相关变量
-	cardinality_sum_errors += fabs(log(predicted_cardinality) -
-								   log(true_cardinality));
+	error = fabs(log(predicted_cardinality) - log(true_cardinality));
+	cardinality_sum_errors += error;
 	cardinality_num_objects += 1;
 	// 对输出值进行log处理
 	// targets_data =log(true_cardinality);
@@ -193,13 +427,33 @@ learn_sample_rfwr(List *clauselist, List *selectivities, List *relidslist,
 					   &nfeatures, &fss_hash, &features);
 
 	/* In the case of zero matrix we not need to learn */
-	if (nfeatures > 0)
+	if (nfeatures > 0 && query_context.spool_samples)
 	{
-		//初始化model?  question 3: 是否需要初始化和分配内存给model
-        lwpr_init_model(&model,  nfeatures, 1);
-		/* Here should be critical section question 4: 如何训练model*/
-		atomic_fss_learn_step_rfwr(fss_hash, nfeatures, &model,
-								features, target);
+		/* A standby leaves learning to the primary */
+		spool_sample(query_context.fspace_hash, fss_hash, relidslist,
+					 nfeatures, features, target);
+		flag = 1;
+	}
+	else if (nfeatures > 0)
+	{
+		if (sample_log_is_enabled())
+			sample_log_write(query_context.fspace_hash, fss_hash,
+							 query_context.current_query_hash, relidslist,
+							 nfeatures, features, target,
+							 log(predicted_cardinality));
+
+		/*
+		 * The policy limits only the local learning: the spool and the log
+		 * keep every object for the primary and for retraining.
+		 */
+		if (learn_policy_accepts(fss_hash, error))
+		{
+			/* Here should be critical section question 4: 如何训练model*/
+			aqo_stat_begin(&timer);
+			learn_fss_object(query_context.fspace_hash, fss_hash, relidslist,
+							 nfeatures, features, target);
+			aqo_stat_end(&timer, AQO_STAT_LEARN_FSS_OBJECT, fss_hash);
+		}
 		flag = 1;
 		// written by jim :collect aqo_data
 		//add_collect_data(fss_hash, nfeatures, features, targets_data, predicts_data);
@@ -208,13 +462,106 @@ learn_sample_rfwr(List *clauselist, List *selectivities, List *relidslist,
 		//add_collect_data2(fss_hash, relidslist, clauselist, selectivities, targets_data);
 
 		/* Here should be the end of critical section */
-		//free model，question 2: 如何释放rfwr的内存空间
-		lwpr_free_model(&model);
+	}
+	else if (model_selection && !query_context.spool_samples &&
+			 learn_policy_accepts(fss_hash, error))
+	{
+		/* the constant model serves the subspaces without features */
+		learn_fss_object(query_context.fspace_hash, fss_hash, relidslist,
+						 nfeatures, features, target);
 	}
 
 	pfree(features);
 	return flag;
 }
+
+/*
+ * Learns an object observed elsewhere (spooled by a standby or read from the
+ * sample log) as if it was observed by a query of the feature space
+ * fspace_hash and the query template query_template (0 if unknown).
+ */
+void
+learn_replayed_sample(int fspace_hash, int fss_hash, int query_template,
+					  List *relids, int nfeatures, double *features,
+					  double target)
+{
+	int			saved_fspace_hash = query_context.fspace_hash;
+	int			saved_query_template = query_context.current_query_hash;
+	bool		saved_learn_aqo = query_context.learn_aqo;
+
+	query_context.fspace_hash = fspace_hash;
+	query_context.current_query_hash = query_template;
+	query_context.learn_aqo = true;
+	PG_TRY();
+	{
+		learn_fss_object(fspace_hash, fss_hash, relids, nfeatures,
+						 features, target);
+	}
+	PG_CATCH();
+	{
+		query_context.fspace_hash = saved_fspace_hash;
+		query_context.current_query_hash = saved_query_template;
+		query_context.learn_aqo = saved_learn_aqo;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	query_context.fspace_hash = saved_fspace_hash;
+	query_context.current_query_hash = saved_query_template;
+	query_context.learn_aqo = saved_learn_aqo;
+}
+/*
+ * Learns the object by the models of its feature subspace: by all of them with
+ * aqo.model_selection, by LWPR otherwise. The relations of a new model are
+ * remembered for the statistics drift check.
+ */
+static void
+learn_fss_object(int fspace_hash, int fss_hash, List *relids,
+				 int nfeatures, double *features, double target)
+{
+	MemoryContext oldcxt;
+	LWPR_Model	model;
+	bool		created;
+
+	oldcxt = begin_model_learning();
+	if (model_selection)
+		created = learn_fss_models(fss_hash, nfeatures, features, target);
+	else
+	{
+		lwpr_init_model(&model, nfeatures, 1);
+		created = atomic_fss_learn_step_rfwr(fss_hash, nfeatures, &model,
+											 features, target);
+	}
+	if (created && stale_threshold > 0)
+		register_fss_relations(fspace_hash, fss_hash, relids);
+	end_model_learning(oldcxt);
+}
+
+/*
+ * Switches to the context of learning one object. The context may keep the
+ * garbage of a learning interrupted by an error, so it is reset here too.
+ */
+static MemoryContext
+begin_model_learning(void)
+{
+	if (learn_model_cxt == NULL)
+		learn_model_cxt = AllocSetContextCreate(AQOMemoryContext,
+												"AQO model learning",
+												ALLOCSET_DEFAULT_SIZES);
+	else
+		MemoryContextReset(learn_model_cxt);
+	return MemoryContextSwitchTo(learn_model_cxt);
+}
+
+/*
+ * Releases the learned model with everything allocated for it.
+ */
+static void
+end_model_learning(MemoryContext oldcxt)
+{
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextReset(learn_model_cxt);
+}
+
 /*
  * For given node specified by clauselist, relidslist and join_type restores
  * the same selectivities of clauses as were used at query optimization stage.
@@ -278,6 +625,38 @@ restore_selectivities(List *clauselist,
 	return lst;
 }
 
+/*
+ * Returns the number of processes which executed the given node of a parallel
+ * plan. The instrumentation of workers is already accumulated into the
+ * leader's node instrumentation by the Gather node, so the loops of the
+ * leader are what is left of the total.
+ */
+double
+get_parallel_participants(PlanState *p)
+{
+	WorkerInstrumentation *wi = p->worker_instrument;
+	double		worker_loops = 0;
+	double		participants = 0;
+	int			i;
+
+	/* The workers were not launched or the instrumentation is not available */
+	if (wi == NULL)
+		return p->plan->path_parallel_workers + 1;
+
+	for (i = 0; i < wi->num_workers; ++i)
+	{
+		if (wi->instrument[i].nloops > 0)
+		{
+			worker_loops += wi->instrument[i].nloops;
+			participants += 1;
+		}
+	}
+	if (p->instrument->nloops > worker_loops)
+		participants += 1;
+
+	return Max(participants, 1);
+}
+
 /*
  * Walks over obtained PlanState tree, collects relation objects with their
  * clauses, selectivivties and relids and passes each object to learn_sample.
@@ -354,8 +733,12 @@ collect_planstat(PlanState *p, List **other_plans,
 			if (p->instrument->nloops >= 0.5)
 			{
 				learn_rows = p->instrument->ntuples / p->instrument->nloops;
-				if (p->plan->path_parallel_workers > 0 && p->lefttree == NULL && p->righttree == NULL)
-					learn_rows *= (p->plan->path_parallel_workers + 1);
+				/*
+				 * A partial path is executed by every participant of the
+				 * parallel query and the rows of all of them form the relation.
+				 */
+				if (p->plan->path_parallel_workers > 0)
+					learn_rows *= get_parallel_participants(p);
 				if (learn_rows < 1)
 					learn_rows = 1;
 			}
@@ -465,6 +848,71 @@ collect_planstat(PlanState *p, List **other_plans,
 // 		}
 // 	}
 // }
+/*
+ * Collects clauses, selectivities and relids of the given node and its
+ * subtree in the same way as collect_planstat() does, but without learning.
+ */
+void
+collect_node_objects(PlanState *p, List **clauselist, List **selectivities,
+					 List **relidslist)
+{
+	List	   *cur_clauselist = NIL;
+	List	   *cur_relidslist = NIL;
+	List	   *cur_selectivities = NIL;
+
+	if (p->lefttree != NULL)
+		collect_node_objects(p->lefttree,
+							 clauselist, selectivities, relidslist);
+	if (p->righttree != NULL)
+	{
+		collect_node_objects(p->righttree,
+							 &cur_clauselist, &cur_selectivities, &cur_relidslist);
+		(*clauselist) = list_concat(cur_clauselist, (*clauselist));
+		(*relidslist) = list_concat(cur_relidslist, (*relidslist));
+		(*selectivities) = list_concat(cur_selectivities, (*selectivities));
+	}
+
+	if (p->plan->had_path)
+	{
+		cur_selectivities = restore_selectivities(p->plan->path_clauses,
+												  p->plan->path_relids,
+												  p->plan->path_jointype,
+												  p->plan->was_parametrized);
+		(*clauselist) = list_concat(list_copy(p->plan->path_clauses),
+									(*clauselist));
+		(*selectivities) = list_concat(cur_selectivities, (*selectivities));
+		if (p->plan->path_relids != NIL)
+		{
+			list_free(*relidslist);
+			(*relidslist) = list_copy(p->plan->path_relids);
+		}
+	}
+}
+
+/*
+ * Learns the number of rows returned by the node of an execution which was
+ * stopped at a re-optimization checkpoint. The node didn't finish, so the
+ * true cardinality is at least that.
+ */
+void
+learn_checkpoint(PlanState *p, double rows)
+{
+	List	   *clauselist = NIL;
+	List	   *relidslist = NIL;
+	List	   *selectivities = NIL;
+
+	if (!query_context.learn_aqo || RecoveryInProgress())
+		return;
+
+	collect_node_objects(p, &clauselist, &selectivities, &relidslist);
+	learn_sample_rfwr(clauselist, selectivities, relidslist,
+					  Max(rows, 1), p->plan->plan_rows);
+
+	list_free(clauselist);
+	list_free(selectivities);
+	list_free(relidslist);
+}
+
 /*
  * Updates given row of query statistics.
  */
@@ -521,7 +969,12 @@ aqo_ExecutorStart(QueryDesc *queryDesc, int eflags)
 	query_context.explain_only = ((eflags & EXEC_FLAG_EXPLAIN_ONLY) != 0);
 
 	if (query_context.learn_aqo && !query_context.explain_only)
+	{
 		queryDesc->instrument_options |= INSTRUMENT_ROWS;
+		/* node timings are needed to learn the plan-latency model */
+		if (use_latency_model)
+			queryDesc->instrument_options |= INSTRUMENT_TIMER;
+	}
 
 	/* Save all query-related parameters into the query context. */
 	StoreToQueryContext(queryDesc);
@@ -576,6 +1029,8 @@ aqo_copy_generic_path_info(PlannerInfo *root, Plan *dest, Path *src)
 	dest->path_relids = get_list_of_relids(root, src->parent->relids);
 	dest->path_parallel_workers = src->parallel_workers;
 	dest->was_parametrized = (src->param_info != NULL);
+	dest->path_explore_value = src->param_info ?
+		src->param_info->ppi_explore_value : src->parent->explore_value;
 }
 
 /*
@@ -595,10 +1050,16 @@ learn_query_stat(QueryDesc *queryDesc)
 	double		cardinality_error;
 	QueryStat  *stat = NULL;
 	instr_time	endtime;
+	AqoStatTimer stat_timer;
 
+	aqo_stat_begin(&stat_timer);
 	if (!ExtractFromQueryContext(queryDesc))
 		goto end;
 
+	/* Write histories of models used during planning of the query */
+	flush_fss_history(!IsParallelWorker() && !IsInParallelMode() &&
+					  !RecoveryInProgress());
+
 	if (query_context.explain_only)
 	{
 		query_context.learn_aqo = false;
@@ -620,6 +1081,9 @@ learn_query_stat(QueryDesc *queryDesc)
 							 &tmp_selectivities, &tmp_relidslist);
 			other_plans = list_delete_first(other_plans);
 		}
+
+		if (use_latency_model && !query_context.spool_samples)
+			learn_plan_latency(queryDesc->planstate);
 	}
 
 	if (query_context.collect_stat)
@@ -680,6 +1144,7 @@ learn_query_stat(QueryDesc *queryDesc)
 		pfree_query_stat(stat);
 	} */
 	RemoveFromQueryContext(queryDesc);
+	aqo_stat_end(&stat_timer, AQO_STAT_LEARN_QUERY_STAT, 0);
 
 end:
 	if (prev_ExecutorEnd_hook)
@@ -726,7 +1191,7 @@ StoreToQueryContext(QueryDesc *queryDesc)
 /*
  * Restore AQO data, related to the query.
  */
-static bool
+bool
 ExtractFromQueryContext(QueryDesc *queryDesc)
 {
 	EphemeralNamedRelation	enr;
@@ -749,7 +1214,7 @@ ExtractFromQueryContext(QueryDesc *queryDesc)
 	return true;
 }
 
-static void
+void
 RemoveFromQueryContext(QueryDesc *queryDesc)
 {
 	EphemeralNamedRelation	enr = get_ENR(queryDesc->queryEnv, AQOPrivateData);
@@ -57,8 +57,18 @@
 "SELECT 1 FROM ONLY \"public\".\"aqo_queries\" x WHERE \"query_hash\"\
  OPERATOR(pg_catalog.=) $1 FOR KEY SHARE OF x"
 
+/*
+ * The template history in aqo_queries is not updated on a hot standby, so
+ * each backend there continues the replicated history in memory.
+ */
+static double *standby_query_history = NULL;
+static int	standby_query_history_size = 0;
+static int	standby_num_history_data = 0;
+
 static bool isQueryUsingSystemRelation(Query *query);
 static bool isQueryUsingSystemRelation_walker(Node *node, void *context);
+static void save_standby_query_history(double *query_history,
+						   int num_history_data);
 
 /*
  * Saves query text into query_text variable.
@@ -118,21 +128,28 @@ aqo_planner(Query *parse,
 	int         test_vector_num=0;
 	double     *current_query;
 	int         num_feature;
+	PlannedStmt *stmt;
+	bool		read_only;
+	AqoStatTimer stat_timer;
 	selectivity_cache_clear();
+	aqo_details_reset();
 	query_context.explain_aqo = false;
+	query_context.spool_samples = false;
 
 	 /*
-	  * We do not work inside an parallel worker now by reason of insert into
-	  * heap during planning. Transactions is synchronized between parallel
-	  * section. See GetCurrentCommandId() comments also.
+	  * Inside a parallel worker or in parallel mode we can't insert into heap
+	  * (see GetCurrentCommandId() comments), so there the models are only
+	  * used, as on a hot standby. Planning itself doesn't write models: see
+	  * flush_fss_history().
 	  */
+	read_only = RecoveryInProgress() || IsInParallelMode() || IsParallelWorker();
+
 	if ((parse->commandType != CMD_SELECT && parse->commandType != CMD_INSERT &&
 	 parse->commandType != CMD_UPDATE && parse->commandType != CMD_DELETE) ||
 		strncmp(query_text, CREATE_EXTENSION_STARTSTRING_0,
 				strlen(CREATE_EXTENSION_STARTSTRING_0)) == 0 ||
 		strncmp(query_text, CREATE_EXTENSION_STARTSTRING_1,
 				strlen(CREATE_EXTENSION_STARTSTRING_1)) == 0 ||
-		IsInParallelMode() || IsParallelWorker() ||
 		aqo_mode == AQO_MODE_DISABLED || isQueryUsingSystemRelation(parse))
 	{
 		disable_aqo_for_query();
@@ -140,10 +157,16 @@ aqo_planner(Query *parse,
 	}
 
 	INSTR_TIME_SET_CURRENT(query_context.query_starttime);
+	query_context.planning_budget_exhausted = false;
+
+	/* Models built on relations changed since they were learned get stale */
+	if (!read_only)
+		aqo_drift_check();
     
 	//初始化query_context的相关内容
 	query_context.nfeatures = 0;
 	//判定查询的类型
+	aqo_stat_begin(&stat_timer);
 	query_context.current_query_hash = get_query_hash(parse, query_text);
 
 	//imdb 7 templates
@@ -168,8 +191,10 @@ aqo_planner(Query *parse,
 	{
 		query_context.current_query_hash = 7;
 	}else{
-		query_context.current_query_hash = 0;
+		query_context.current_query_hash = default_query_template;
 	}
+	/* accounted after the template is known */
+	aqo_stat_end(&stat_timer, AQO_STAT_GET_QUERY_HASH, 0);
 
 	// 我们只处理特定的几个查询模板，其它查询均使用原估计方法，并且关闭aqo
 	if (query_context.current_query_hash == 0)
@@ -226,7 +251,7 @@ aqo_planner(Query *parse,
 					 aqo_mode);
 				break;
 		}
-		if (RecoveryInProgress())
+		if (read_only)
 		{
 			if (aqo_mode == AQO_MODE_FORCED)
 			{
@@ -265,24 +290,41 @@ aqo_planner(Query *parse,
 		/* we also get the query history, modified by jim 2021.2.13*/
 		query_history = palloc0(sizeof(*query_history) * num_history_data_compute_probability_fs);
 		deform_vector(query_params[5], query_history, &test_vector_num);
+		if (RecoveryInProgress() && standby_query_history != NULL &&
+			standby_query_history_size == num_history_data_compute_probability_fs)
+		{
+			memcpy(query_history, standby_query_history,
+				   sizeof(*query_history) * standby_query_history_size);
+			num_history_data = standby_num_history_data;
+		}
 		current_query = palloc0(sizeof(*current_query) * 2);
 		deform_vector(query_params[8], current_query, &test_vector_num);
 		num_feature = DatumGetInt32(query_params[9]);
         /*next we modified query_histroy, and also predict the next query template distribution*/
-		if(num_history_data<num_history_data_compute_probability_fs){
-
-			query_history[num_history_data] = query_context.current_query_hash;
-			num_history_data += 1;
-		}else
+		/* A re-planned query is already in the history */
+		if (!reoptimize_is_replanning())
 		{
-			for(int j=1;j<num_history_data;j++){
-				query_history[j-1] = query_history[j];
+			if (num_history_data == num_history_data_compute_probability_fs)
+				markov_sketch_observe(get_int_array_hash2(query_history, num_history_data),
+									  query_context.current_query_hash);
+			if(num_history_data<num_history_data_compute_probability_fs){
+
+				query_history[num_history_data] = query_context.current_query_hash;
+				num_history_data += 1;
+			}else
+			{
+				for(int j=1;j<num_history_data;j++){
+					query_history[j-1] = query_history[j];
+				}
+				query_history[num_history_data-1] = query_context.current_query_hash;
 			}
-			query_history[num_history_data-1] = query_context.current_query_hash;
+			//更新total_num, modified by jim 2021.3.9
+			total_num = total_num + 1;
+			if (!read_only)
+				update_query2(query_context.query_hash, query_context.learn_aqo, query_context.use_aqo, query_context.fspace_hash, query_context.auto_tuning, query_history, num_history_data, total_num);
+			else if (RecoveryInProgress())
+				save_standby_query_history(query_history, num_history_data);
 		}
-		//更新total_num, modified by jim 2021.3.9
-		total_num = total_num + 1;
-		update_query2(query_context.query_hash, query_context.learn_aqo, query_context.use_aqo, query_context.fspace_hash, query_context.auto_tuning, query_history, num_history_data, total_num);
 		int query_history_hash = get_int_array_hash2(query_history, num_history_data_compute_probability_fs);
 		load_query_distribution(num_history_data, query_history_hash, &query_context);
 		//modified by jim in 2022.7.4, we consider the cost of each query
@@ -292,16 +334,35 @@ aqo_planner(Query *parse,
 		for(int i=0;i<num_feature;i++){
 			query_context.current_query_features[i] = current_query[i];
 		}
-		if (RecoveryInProgress())
+		if (read_only)
 		{
-			query_context.learn_aqo = false;
+			/* Objects observed on a standby may be learned by the primary */
+			query_context.spool_samples = query_context.learn_aqo &&
+				spool_is_enabled();
+			query_context.learn_aqo = query_context.spool_samples;
 			query_context.auto_tuning = false;
 			query_context.collect_stat = false;
 		}
 	}
 	query_context.explain_aqo = query_context.use_aqo;
+	reoptimize_save_query(parse, cursorOptions);
+
+	/* models of feature subspaces are loaded once per planning */
+	fss_model_cache_begin();
+	PG_TRY();
+	{
+		stmt = call_default_planner(parse, cursorOptions, boundParams);
+	}
+	PG_CATCH();
+	{
+		fss_model_cache_end(false);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	fss_model_cache_end(true);
+	reoptimize_save_plan(stmt);
 
-	return call_default_planner(parse, cursorOptions, boundParams);
+	return stmt;
 }
 
 /*
@@ -334,6 +395,54 @@ disable_aqo_for_query(void)
 	query_context.use_aqo = false;
 	query_context.auto_tuning = false;
 	query_context.collect_stat = false;
+	query_context.reoptimize_generation = 0;
+	query_context.spool_samples = false;
+}
+
+/*
+ * Remembers the template history of the backend on a hot standby.
+ */
+static void
+save_standby_query_history(double *query_history, int num_history_data)
+{
+	if (standby_query_history_size != num_history_data_compute_probability_fs)
+	{
+		if (standby_query_history != NULL)
+			pfree(standby_query_history);
+		standby_query_history_size = num_history_data_compute_probability_fs;
+		standby_query_history = MemoryContextAlloc(AQOMemoryContext,
+					sizeof(*standby_query_history) * standby_query_history_size);
+	}
+	memcpy(standby_query_history, query_history,
+		   sizeof(*query_history) * standby_query_history_size);
+	standby_num_history_data = num_history_data;
+}
+
+/*
+ * Returns true if the current query has exhausted the AQO planning time
+ * budget. Once it happens, the rest of the query is planned with the
+ * standard estimators and the standard path selection.
+ */
+bool
+aqo_planning_budget_exhausted(void)
+{
+	instr_time	elapsed;
+
+	if (query_context.planning_budget_exhausted)
+		return true;
+	if (planning_time_budget_ms <= 0 || !query_context.use_aqo)
+		return false;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, query_context.query_starttime);
+	if (INSTR_TIME_GET_MILLISEC(elapsed) < planning_time_budget_ms)
+		return false;
+
+	query_context.planning_budget_exhausted = true;
+	planning_budget_exceeded_count++;
+	elog(DEBUG1, "AQO planning time budget of %d ms is exhausted",
+		 planning_time_budget_ms);
+	return true;
 }
 
 /*
@@ -0,0 +1,427 @@
+#include "aqo.h"
+#include "optimizer/clauses.h"
+#include "tcop/dest.h"
+#include "utils/resowner.h"
+
+/*****************************************************************************
+ *
+ *	MID-EXECUTION RE-OPTIMIZATION
+ *
+ * An exploratory plan may be chosen in spite of uncertain estimates of its
+ * joins, and a bad guess is paid by the whole execution of the query.
+ * If aqo.reoptimize_factor is set, the joins of a SELECT query whose explore
+ * value is not less than aqo.reoptimize_explore_threshold get checkpoints.
+ * When a join returns more than factor times its estimated number of rows
+ * before any tuple of the query is sent to the client, the execution is
+ * stopped, the observed number of rows is learned as the cardinality of the
+ * join and the query is planned and executed again.
+ *
+ * The execution with checkpoints is performed inside an internal
+ * subtransaction, so the resources of the stopped execution are released by
+ * the subtransaction rollback. The executor state of the original QueryDesc
+ * is never run: the query is executed by a new QueryDesc which shares its
+ * snapshot, parameters and destination. The intermediate result of the
+ * stopped execution is not reused by the new plan.
+ *
+ * A query is re-planned at most once: while it is re-planned, the query is
+ * neither saved for re-optimization nor accounted in the template history
+ * again. A query with volatile functions is not re-optimized, as its
+ * stopped execution may have had visible side effects.
+ *
+ *****************************************************************************/
+
+/* Re-planning is not worth it for joins with a few rows */
+#define REOPTIMIZE_MIN_ROWS 1000
+
+typedef struct ReoptCheckpoint
+{
+	PlanState  *planstate;
+	ExecProcNodeMtd real_exec;	/* method of the node wrapped by checkpoint */
+	double		limit;			/* execution is stopped above this */
+	double		rows;			/* rows returned by the node so far */
+} ReoptCheckpoint;
+
+/* Destination which is started once for all the executions of a query */
+typedef struct ReoptDestReceiver
+{
+	DestReceiver pub;
+	DestReceiver *target;
+	MemoryContext cxt;			/* context the target is started in */
+	bool		started;
+} ReoptDestReceiver;
+
+/* The last planned query which may be re-planned */
+static MemoryContext reoptimize_cxt = NULL;
+static Query *saved_query = NULL;
+static int	saved_cursor_options = 0;
+static PlannedStmt *saved_stmt = NULL;
+static int	saved_generation = 0;
+
+static List *checkpoints = NIL;
+static ReoptCheckpoint *fired_checkpoint = NULL;
+
+/* The stopped query is being planned again */
+static bool replanning = false;
+
+static bool is_checkpoint_node(PlanState *ps);
+static void find_checkpoints(PlanState *ps, List **result);
+static TupleTableSlot *ExecReoptCheckpoint(PlanState *node);
+static bool reoptimize_run(QueryDesc *queryDesc, PlannedStmt *stmt,
+			   DestReceiver *dest, bool with_checkpoints);
+static void reoptimize_execute(QueryDesc *queryDesc, Query *parse,
+				   int cursorOptions);
+static bool reopt_receive(TupleTableSlot *slot, DestReceiver *self);
+static void reopt_startup(DestReceiver *self, int operation,
+			  TupleDesc typeinfo);
+static void reopt_shutdown(DestReceiver *self);
+static void reopt_destroy(DestReceiver *self);
+
+
+/*
+ * Saves a copy of the query before it is planned, if the query may be
+ * re-planned during its execution.
+ */
+void
+reoptimize_save_query(Query *parse, int cursorOptions)
+{
+	MemoryContext oldCxt;
+
+	saved_stmt = NULL;
+	query_context.reoptimize_generation = 0;
+
+	if (reoptimize_factor <= 0 || replanning || !query_context.use_aqo ||
+		!query_context.learn_aqo || query_context.spool_samples ||
+		parse->commandType != CMD_SELECT ||
+		parse->hasModifyingCTE || parse->rowMarks != NIL ||
+		contain_volatile_functions((Node *) parse))
+		return;
+
+	if (reoptimize_cxt == NULL)
+		reoptimize_cxt = AllocSetContextCreate(AQOMemoryContext,
+											   "AQO re-optimization",
+											   ALLOCSET_DEFAULT_SIZES);
+	MemoryContextReset(reoptimize_cxt);
+
+	oldCxt = MemoryContextSwitchTo(reoptimize_cxt);
+	saved_query = copyObject(parse);
+	MemoryContextSwitchTo(oldCxt);
+	saved_cursor_options = cursorOptions;
+
+	if (++saved_generation <= 0)
+		saved_generation = 1;
+	query_context.reoptimize_generation = saved_generation;
+}
+
+/*
+ * Whether the planned query is a stopped query planned again.
+ */
+bool
+reoptimize_is_replanning(void)
+{
+	return replanning;
+}
+
+/*
+ * Remembers the plan of the saved query.
+ */
+void
+reoptimize_save_plan(PlannedStmt *stmt)
+{
+	if (query_context.reoptimize_generation != 0 &&
+		query_context.reoptimize_generation == saved_generation)
+		saved_stmt = stmt;
+}
+
+/*
+ * A checkpoint is placed above an uncertain join which is executed once.
+ */
+static bool
+is_checkpoint_node(PlanState *ps)
+{
+	Plan	   *plan = ps->plan;
+
+	if (!IsA(ps, NestLoopState) && !IsA(ps, MergeJoinState) &&
+		!IsA(ps, HashJoinState))
+		return false;
+
+	return plan->had_path && !plan->was_parametrized &&
+		plan->path_explore_value >= reoptimize_explore_threshold;
+}
+
+/*
+ * Finds the checkpoint nodes of the plan. The inner side of a nested loop is
+ * rescanned, so it has no checkpoints; neither do subplans.
+ */
+static void
+find_checkpoints(PlanState *ps, List **result)
+{
+	if (ps == NULL)
+		return;
+
+	if (is_checkpoint_node(ps))
+	{
+		ReoptCheckpoint *cp = palloc(sizeof(*cp));
+
+		cp->planstate = ps;
+		cp->real_exec = NULL;
+		cp->limit = Max(ps->plan->plan_rows * reoptimize_factor,
+						REOPTIMIZE_MIN_ROWS);
+		cp->rows = 0;
+		*result = lappend(*result, cp);
+	}
+
+	find_checkpoints(ps->lefttree, result);
+	if (!IsA(ps, NestLoopState))
+		find_checkpoints(ps->righttree, result);
+}
+
+/*
+ * Counts rows returned by the node and stops the execution if the estimate
+ * of the node turns out to be too low. Once the query has sent a tuple, it
+ * can't be restarted and the checkpoint is passed.
+ */
+static TupleTableSlot *
+ExecReoptCheckpoint(PlanState *node)
+{
+	ReoptCheckpoint *cp = NULL;
+	TupleTableSlot *slot;
+	ListCell   *l;
+
+	foreach(l, checkpoints)
+	{
+		cp = (ReoptCheckpoint *) lfirst(l);
+		if (cp->planstate == node)
+			break;
+		cp = NULL;
+	}
+	if (cp == NULL)
+		elog(ERROR, "AQO re-optimization checkpoint is not found");
+
+	slot = cp->real_exec(node);
+
+	if (!TupIsNull(slot) && ++cp->rows > cp->limit &&
+		node->state->es_processed == 0)
+	{
+		fired_checkpoint = cp;
+		elog(ERROR, "AQO re-optimization checkpoint is reached");
+	}
+
+	return slot;
+}
+
+/*
+ * Executes the query with the given plan inside an internal subtransaction.
+ * Returns false if the execution was stopped at a checkpoint; in this case
+ * the observed cardinality of the checkpoint node is already learned.
+ */
+static bool
+reoptimize_run(QueryDesc *queryDesc, PlannedStmt *stmt, DestReceiver *dest,
+			   bool with_checkpoints)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	int			eflags = queryDesc->estate->es_top_eflags;
+	QueryDesc  *volatile qd = NULL;
+	volatile bool finished = true;
+	ListCell   *l;
+
+	fired_checkpoint = NULL;
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_TRY();
+	{
+		qd = CreateQueryDesc(stmt, queryDesc->sourceText, queryDesc->snapshot,
+							 queryDesc->crosscheck_snapshot, dest,
+							 queryDesc->params, NULL, 0);
+		ExecutorStart(qd, eflags);
+
+		if (with_checkpoints)
+		{
+			find_checkpoints(qd->planstate, &checkpoints);
+			foreach(l, checkpoints)
+			{
+				ReoptCheckpoint *cp = (ReoptCheckpoint *) lfirst(l);
+
+				cp->real_exec = cp->planstate->ExecProcNodeReal;
+				cp->planstate->ExecProcNodeReal = ExecReoptCheckpoint;
+			}
+		}
+
+		ExecutorRun(qd, ForwardScanDirection, 0L, true);
+		queryDesc->estate->es_processed = qd->estate->es_processed;
+		ExecutorFinish(qd);
+		ExecutorEnd(qd);
+		FreeQueryDesc(qd);
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		ReoptCheckpoint *cp = fired_checkpoint;
+		ErrorData  *edata;
+
+		fired_checkpoint = NULL;
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+
+		if (cp == NULL)
+		{
+			list_free_deep(checkpoints);
+			checkpoints = NIL;
+			ReThrowError(edata);
+		}
+		FreeErrorData(edata);
+
+		elog(DEBUG1, "AQO re-optimization: join returned more than %.0f rows, estimated %.0f",
+			 cp->limit, cp->planstate->plan->plan_rows);
+
+		/* The stopped execution will not reach ExecutorEnd */
+		if (ExtractFromQueryContext(qd))
+			RemoveFromQueryContext(qd);
+		learn_checkpoint(cp->planstate, cp->rows);
+
+		/*
+		 * The resources of the executor state are released by the rollback,
+		 * so just free its memory.
+		 */
+		MemoryContextDelete(qd->estate->es_query_cxt);
+		pfree(qd);
+		finished = false;
+	}
+	PG_END_TRY();
+
+	list_free_deep(checkpoints);
+	checkpoints = NIL;
+
+	return finished;
+}
+
+/*
+ * Executes the query with checkpoints, and re-plans and executes it again if
+ * the execution is stopped.
+ */
+static void
+reoptimize_execute(QueryDesc *queryDesc, Query *parse, int cursorOptions)
+{
+	ReoptDestReceiver dest;
+	PlannedStmt *stmt;
+
+	dest.pub.receiveSlot = reopt_receive;
+	dest.pub.rStartup = reopt_startup;
+	dest.pub.rShutdown = reopt_shutdown;
+	dest.pub.rDestroy = reopt_destroy;
+	dest.pub.mydest = queryDesc->dest->mydest;
+	dest.target = queryDesc->dest;
+	dest.cxt = queryDesc->estate->es_query_cxt;
+	dest.started = false;
+
+	/* The query is learned by the QueryDesc which executes it */
+	RemoveFromQueryContext(queryDesc);
+	query_context.reoptimize_generation = 0;
+
+	if (reoptimize_run(queryDesc, queryDesc->plannedstmt, &dest.pub, true))
+		return;
+
+	replanning = true;
+	PG_TRY();
+	{
+		stmt = planner(parse, cursorOptions, queryDesc->params);
+	}
+	PG_CATCH();
+	{
+		replanning = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	replanning = false;
+
+	reoptimize_run(queryDesc, stmt, &dest.pub, false);
+}
+
+/*
+ * Runs the query with checkpoints if it was planned with them in mind.
+ * Only a SELECT which is executed at once and sends its tuples to the client
+ * can be restarted safely.
+ */
+void
+aqo_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+				uint64 count, bool execute_once)
+{
+	PlannedStmt *stmt = queryDesc->plannedstmt;
+	List	   *candidates = NIL;
+
+	if (saved_stmt != NULL && stmt == saved_stmt &&
+		ScanDirectionIsForward(direction) && count == 0 && execute_once &&
+		queryDesc->operation == CMD_SELECT && !stmt->hasModifyingCTE &&
+		!stmt->parallelModeNeeded && !IsInParallelMode() &&
+		(queryDesc->dest->mydest == DestRemote ||
+		 queryDesc->dest->mydest == DestRemoteExecute) &&
+		ExtractFromQueryContext(queryDesc) &&
+		query_context.reoptimize_generation == saved_generation)
+	{
+		saved_stmt = NULL;
+		find_checkpoints(queryDesc->planstate, &candidates);
+		if (candidates != NIL)
+		{
+			list_free_deep(candidates);
+			/* nested queries may replace the saved query while we run */
+			reoptimize_execute(queryDesc, copyObject(saved_query),
+							   saved_cursor_options);
+			return;
+		}
+	}
+
+	if (prev_ExecutorRun_hook)
+		prev_ExecutorRun_hook(queryDesc, direction, count, execute_once);
+	else
+		standard_ExecutorRun(queryDesc, direction, count, execute_once);
+}
+
+static bool
+reopt_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+	ReoptDestReceiver *dest = (ReoptDestReceiver *) self;
+
+	return dest->target->receiveSlot(slot, dest->target);
+}
+
+static void
+reopt_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+	ReoptDestReceiver *dest = (ReoptDestReceiver *) self;
+	MemoryContext oldcontext;
+
+	if (dest->started)
+		return;
+
+	/*
+	 * The target allocates its state in the current context, which is the
+	 * executor context of a run and may be freed before the next run. The
+	 * context of the original QueryDesc lives as long as the target is used.
+	 */
+	oldcontext = MemoryContextSwitchTo(dest->cxt);
+	dest->target->rStartup(dest->target, operation, typeinfo);
+	MemoryContextSwitchTo(oldcontext);
+	dest->started = true;
+}
+
+static void
+reopt_shutdown(DestReceiver *self)
+{
+	ReoptDestReceiver *dest = (ReoptDestReceiver *) self;
+
+	dest->target->rShutdown(dest->target);
+}
+
+static void
+reopt_destroy(DestReceiver *self)
+{
+}
@@ -0,0 +1,688 @@
+#include "aqo.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/resowner.h"
+
+/*****************************************************************************
+ *
+ *	SAMPLE LOG AND OFFLINE RETRAINING
+ *
+ * Models learn one object at a time in ExecutorEnd, so a model could be
+ * rebuilt after a change of the learning code or its hyperparameters, or
+ * after a corruption, only by replaying the whole workload. If
+ * aqo.sample_log_dir is set, every learned object is also appended to the
+ * log file of the backend in that directory:
+ *
+ *	aqo_samples_<pid>_<timestamp>.log
+ *
+ * When the file of a backend reaches aqo.sample_log_max_size, the backend
+ * starts a new file and removes its file before the current one, so it keeps
+ * at most two files and the objects it learned last.
+ *
+ * aqo_retrain(nworkers) rebuilds the models of all feature subspaces found in
+ * the log: their models, data houses and relations are deleted, and their
+ * objects are learned again in the order of their timestamps. Subspaces are
+ * independent, so they are divided among nworkers background workers by
+ * fss_hash; with no workers the calling backend retrains all of them.
+ * Subspaces without objects in the log are left as they are.
+ *
+ * Every worker retrains its part in its own transaction, but does not commit
+ * it until all parts are retrained: if any part fails, every worker aborts
+ * and the old models are left intact. A worker can fail only while it
+ * commits after all parts are retrained; the models of its part then stay
+ * old, and aqo_retrain reports that with a warning.
+ *
+ * A record of the log is a SampleLogRecord followed by nrelids relation
+ * oids and nfeatures float8 features in the native byte order; the log is
+ * not portable between platforms.
+ *
+ *****************************************************************************/
+
+typedef struct SampleLogRecord
+{
+	uint32		len;			/* of the whole record */
+	int32		fspace_hash;
+	int32		fss_hash;
+	int32		query_template;
+	TimestampTz time;
+	double		target;			/* log of the true cardinality */
+	double		predicted;		/* log of the predicted cardinality */
+	int16		nrelids;
+	int16		nfeatures;
+} SampleLogRecord;
+
+/* An object of the log kept in memory for retraining */
+typedef struct RetrainSample
+{
+	SampleLogRecord header;
+	int64		seqno;			/* to keep the order of equal timestamps */
+	List	   *relids;
+	double	   *features;
+} RetrainSample;
+
+/* States of a part of the retraining */
+#define RETRAIN_PART_RUNNING	0
+#define RETRAIN_PART_READY		1	/* retrained, waits for the decision */
+#define RETRAIN_PART_COMMITTED	2
+
+/* The decision of aqo_retrain which every worker waits for */
+#define RETRAIN_PENDING			0
+#define RETRAIN_COMMIT			1
+#define RETRAIN_ABORT			2
+
+/* Shared with the retraining workers */
+typedef struct RetrainShared
+{
+	char		dir[MAXPGPATH];
+	Oid			database;
+	Oid			user;
+	int			nparts;
+	volatile int decision;
+	/* State and learned objects of each part */
+	struct
+	{
+		volatile int state;
+		int64		nsamples;
+	}			parts[FLEXIBLE_ARRAY_MEMBER];
+} RetrainShared;
+
+/* Limits of a sane record */
+#define SAMPLE_LOG_MAX_RELIDS	1000
+#define SAMPLE_LOG_MAX_FEATURES	10000
+
+static FILE *sample_log_file = NULL;
+static char sample_log_path[MAXPGPATH];
+static char sample_log_prev_path[MAXPGPATH];
+static int64 sample_log_size = 0;
+static bool sample_log_exit_callback_registered = false;
+
+static void sample_log_open(void);
+static void sample_log_rotate(void);
+static void sample_log_at_exit(int code, Datum arg);
+static int64 retrain_part(const char *dir, int part, int nparts);
+static bool retrain_wait_parts(RetrainShared *shared,
+				   BackgroundWorkerHandle **handles, int *failed);
+static void retrain_read_file(const char *path, int part, int nparts,
+				  RetrainSample ***samples, int *nsamples, int *maxsamples);
+static int	retrain_sample_cmp(const void *a, const void *b);
+static void retrain_delete_models(RetrainSample **samples, int nsamples);
+static int	retrain_part_of(int fss_hash, int nparts);
+
+
+/*
+ * Whether learned objects are written to the sample log.
+ */
+bool
+sample_log_is_enabled(void)
+{
+	return sample_log_dir != NULL && sample_log_dir[0] != '\0';
+}
+
+/*
+ * Appends the object to the sample log of the backend. Failures are reported
+ * as warnings: the query must not fail because of the log.
+ */
+void
+sample_log_write(int fspace_hash, int fss_hash, int query_template,
+				 List *relids, int nfeatures, double *features,
+				 double target, double predicted)
+{
+	SampleLogRecord header;
+	StringInfoData buf;
+	ListCell   *l;
+
+	if (nfeatures > SAMPLE_LOG_MAX_FEATURES ||
+		list_length(relids) > SAMPLE_LOG_MAX_RELIDS)
+		return;
+
+	if (sample_log_file == NULL)
+		sample_log_open();
+	if (sample_log_file == NULL)
+		return;
+
+	memset(&header, 0, sizeof(header));
+	header.len = sizeof(header) + sizeof(Oid) * list_length(relids) +
+		sizeof(double) * nfeatures;
+	header.fspace_hash = fspace_hash;
+	header.fss_hash = fss_hash;
+	header.query_template = query_template;
+	header.time = GetCurrentTimestamp();
+	header.target = target;
+	header.predicted = predicted;
+	header.nrelids = list_length(relids);
+	header.nfeatures = nfeatures;
+
+	/* One write per record, so concurrent readers see whole records */
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, (char *) &header, sizeof(header));
+	foreach(l, relids)
+	{
+		Oid			relid = (Oid) lfirst_int(l);
+
+		appendBinaryStringInfo(&buf, (char *) &relid, sizeof(relid));
+	}
+	appendBinaryStringInfo(&buf, (char *) features, sizeof(double) * nfeatures);
+
+	if (sample_log_max_size > 0 && sample_log_size > 0 &&
+		sample_log_size + buf.len > (int64) sample_log_max_size * 1024)
+	{
+		sample_log_rotate();
+		if (sample_log_file == NULL)
+		{
+			pfree(buf.data);
+			return;
+		}
+	}
+
+	if (fwrite(buf.data, buf.len, 1, sample_log_file) != 1 ||
+		fflush(sample_log_file) != 0)
+	{
+		elog(WARNING, "could not write AQO sample log \"%s\": %m",
+			 sample_log_path);
+		fclose(sample_log_file);
+		sample_log_file = NULL;
+	}
+	else
+		sample_log_size += buf.len;
+	pfree(buf.data);
+}
+
+/*
+ * Creates the log file of the backend. The file is not managed by fd.c
+ * because it lives longer than a transaction.
+ */
+static void
+sample_log_open(void)
+{
+	snprintf(sample_log_path, MAXPGPATH, "%s/aqo_samples_%d_" INT64_FORMAT ".log",
+			 sample_log_dir, MyProcPid, (int64) GetCurrentTimestamp());
+	sample_log_file = fopen(sample_log_path, PG_BINARY_A);
+	if (sample_log_file == NULL)
+	{
+		elog(WARNING, "could not create AQO sample log \"%s\": %m",
+			 sample_log_path);
+		return;
+	}
+	sample_log_size = 0;
+
+	if (!sample_log_exit_callback_registered)
+	{
+		on_proc_exit(sample_log_at_exit, (Datum) 0);
+		sample_log_exit_callback_registered = true;
+	}
+}
+
+/*
+ * Starts a new log file of the backend. The file before the current one is
+ * removed, so its objects are no longer retrained.
+ */
+static void
+sample_log_rotate(void)
+{
+	fclose(sample_log_file);
+	sample_log_file = NULL;
+
+	if (sample_log_prev_path[0] != '\0' && unlink(sample_log_prev_path) != 0 &&
+		errno != ENOENT)
+		elog(WARNING, "could not remove AQO sample log \"%s\": %m",
+			 sample_log_prev_path);
+	strlcpy(sample_log_prev_path, sample_log_path, MAXPGPATH);
+
+	sample_log_open();
+}
+
+static void
+sample_log_at_exit(int code, Datum arg)
+{
+	if (sample_log_file != NULL)
+		fclose(sample_log_file);
+	sample_log_file = NULL;
+}
+
+PG_FUNCTION_INFO_V1(aqo_retrain);
+
+/*
+ * Rebuilds the models of the feature subspaces found in the sample log using
+ * nworkers background workers. Returns the number of learned objects.
+ */
+Datum
+aqo_retrain(PG_FUNCTION_ARGS)
+{
+	int			nworkers = PG_GETARG_INT32(0);
+	dsm_segment *seg;
+	RetrainShared *shared;
+	BackgroundWorkerHandle **handles;
+	int64		nsamples = 0;
+	int			failed = -1;
+	bool		ready;
+	int			i;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to use aqo_retrain")));
+	if (RecoveryInProgress())
+		elog(ERROR, "aqo_retrain cannot be executed during recovery");
+	if (!sample_log_is_enabled())
+		elog(ERROR, "aqo_retrain needs aqo.sample_log_dir to be set");
+	if (nworkers < 0 || nworkers > max_worker_processes)
+		elog(ERROR, "aqo_retrain: the number of workers must be between 0 and %d",
+			 max_worker_processes);
+
+	/* Objects of this backend must be in the log */
+	if (sample_log_file != NULL)
+		fflush(sample_log_file);
+
+	if (nworkers == 0)
+		PG_RETURN_INT64(retrain_part(sample_log_dir, 0, 1));
+
+	seg = dsm_create(offsetof(RetrainShared, parts) +
+					 sizeof(shared->parts[0]) * nworkers, 0);
+	shared = (RetrainShared *) dsm_segment_address(seg);
+	strlcpy(shared->dir, sample_log_dir, MAXPGPATH);
+	shared->database = MyDatabaseId;
+	shared->user = GetUserId();
+	shared->nparts = nworkers;
+	shared->decision = RETRAIN_PENDING;
+	for (i = 0; i < nworkers; ++i)
+	{
+		shared->parts[i].state = RETRAIN_PART_RUNNING;
+		shared->parts[i].nsamples = 0;
+	}
+
+	handles = palloc0(sizeof(*handles) * nworkers);
+	PG_TRY();
+	{
+		for (i = 0; i < nworkers; ++i)
+		{
+			BackgroundWorker worker;
+
+			memset(&worker, 0, sizeof(worker));
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+				BGWORKER_BACKEND_DATABASE_CONNECTION;
+			worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+			worker.bgw_restart_time = BGW_NEVER_RESTART;
+			snprintf(worker.bgw_name, BGW_MAXLEN, "aqo retrain %d", i);
+			snprintf(worker.bgw_library_name, BGW_MAXLEN, "aqo");
+			snprintf(worker.bgw_function_name, BGW_MAXLEN, "aqo_retrain_main");
+			worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+			memcpy(worker.bgw_extra, &i, sizeof(i));
+			worker.bgw_notify_pid = MyProcPid;
+
+			if (!RegisterDynamicBackgroundWorker(&worker, &handles[i]))
+				handles[i] = NULL;
+		}
+
+		/*
+		 * Parts without a worker are retrained here, in the transaction of
+		 * the caller, so they are committed with it.
+		 */
+		for (i = 0; i < nworkers; ++i)
+			if (handles[i] == NULL)
+			{
+				elog(NOTICE, "aqo_retrain: no background worker slot, part %d is retrained by the backend", i);
+				shared->parts[i].nsamples = retrain_part(sample_log_dir, i, nworkers);
+				shared->parts[i].state = RETRAIN_PART_READY;
+			}
+
+		/* All parts commit or none */
+		ready = retrain_wait_parts(shared, handles, &failed);
+		pg_memory_barrier();
+		shared->decision = ready ? RETRAIN_COMMIT : RETRAIN_ABORT;
+
+		for (i = 0; i < nworkers; ++i)
+			if (handles[i] != NULL)
+				WaitForBackgroundWorkerShutdown(handles[i]);
+	}
+	PG_CATCH();
+	{
+		for (i = 0; i < nworkers; ++i)
+			if (handles[i] != NULL)
+				TerminateBackgroundWorker(handles[i]);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (!ready)
+		ereport(ERROR,
+				(errmsg("aqo_retrain: worker %d failed, see the server log", failed),
+				 errdetail("No model was changed.")));
+
+	for (i = 0; i < nworkers; ++i)
+	{
+		if (handles[i] != NULL &&
+			shared->parts[i].state != RETRAIN_PART_COMMITTED)
+		{
+			ereport(WARNING,
+					(errmsg("aqo_retrain: worker %d could not commit its part, see the server log", i),
+					 errdetail("The feature subspaces of the part keep their old models.")));
+			continue;
+		}
+		nsamples += shared->parts[i].nsamples;
+	}
+	dsm_detach(seg);
+
+	PG_RETURN_INT64(nsamples);
+}
+
+/*
+ * Waits until every worker has retrained its part. Returns false and sets
+ * *failed if a worker exited before that.
+ */
+static bool
+retrain_wait_parts(RetrainShared *shared, BackgroundWorkerHandle **handles,
+				   int *failed)
+{
+	for (;;)
+	{
+		bool		ready = true;
+		int			i;
+		int			rc;
+
+		for (i = 0; i < shared->nparts; ++i)
+		{
+			pid_t		pid;
+
+			if (shared->parts[i].state != RETRAIN_PART_RUNNING)
+				continue;
+			ready = false;
+			/* A worker exits only after the decision unless it failed */
+			if (GetBackgroundWorkerPid(handles[i], &pid) == BGWH_STOPPED)
+			{
+				pg_memory_barrier();
+				if (shared->parts[i].state == RETRAIN_PART_RUNNING)
+				{
+					*failed = i;
+					return false;
+				}
+			}
+		}
+		if (ready)
+			return true;
+
+		/* The latch is set when a worker exits, as bgw_notify_pid is ours */
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   100L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Retrains the part of feature subspaces given by bgw_extra in its own
+ * transaction. The transaction is committed or aborted as aqo_retrain
+ * decides after all parts are retrained.
+ */
+void
+aqo_retrain_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	RetrainShared *shared;
+	int			part;
+	int64		nsamples;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "aqo retrain worker");
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("aqo retrain worker: could not map dynamic shared memory segment")));
+	shared = (RetrainShared *) dsm_segment_address(seg);
+	memcpy(&part, MyBgworkerEntry->bgw_extra, sizeof(part));
+
+	BackgroundWorkerInitializeConnectionByOid(shared->database, shared->user);
+
+	/* Queries of the worker itself are not optimized by AQO */
+	SetConfigOption("aqo.mode", "disabled", PGC_SUSET, PGC_S_OVERRIDE);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "aqo retrain");
+
+	nsamples = retrain_part(shared->dir, part, shared->nparts);
+
+	shared->parts[part].nsamples = nsamples;
+	pg_memory_barrier();
+	shared->parts[part].state = RETRAIN_PART_READY;
+
+	pgstat_report_activity(STATE_RUNNING, "aqo retrain: waiting for other parts");
+	while (shared->decision == RETRAIN_PENDING)
+	{
+		int			rc;
+
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   10L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		CHECK_FOR_INTERRUPTS();
+	}
+	pg_memory_barrier();
+
+	PopActiveSnapshot();
+	if (shared->decision == RETRAIN_COMMIT)
+	{
+		CommitTransactionCommand();
+		shared->parts[part].state = RETRAIN_PART_COMMITTED;
+	}
+	else
+		AbortCurrentTransaction();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	dsm_detach(seg);
+	proc_exit(0);
+}
+
+/*
+ * Rebuilds the models of the feature subspaces of the part from the log
+ * files of the directory. Returns the number of learned objects.
+ */
+static int64
+retrain_part(const char *dir, int part, int nparts)
+{
+	MemoryContext retrain_cxt;
+	MemoryContext oldcxt;
+	RetrainSample **samples = NULL;
+	int			nsamples = 0;
+	int			maxsamples = 0;
+	DIR		   *dirdesc;
+	struct dirent *de;
+	int			i;
+
+	retrain_cxt = AllocSetContextCreate(CurrentMemoryContext,
+										"AQO retrain",
+										ALLOCSET_DEFAULT_SIZES);
+	oldcxt = MemoryContextSwitchTo(retrain_cxt);
+
+	dirdesc = AllocateDir(dir);
+	while ((de = ReadDir(dirdesc, dir)) != NULL)
+	{
+		size_t		len = strlen(de->d_name);
+
+		if (strncmp(de->d_name, "aqo_samples_", strlen("aqo_samples_")) != 0 ||
+			len < strlen(".log") ||
+			strcmp(de->d_name + len - strlen(".log"), ".log") != 0)
+			continue;
+		retrain_read_file(psprintf("%s/%s", dir, de->d_name), part, nparts,
+						  &samples, &nsamples, &maxsamples);
+	}
+	FreeDir(dirdesc);
+
+	if (nsamples > 0)
+	{
+		qsort(samples, nsamples, sizeof(*samples), retrain_sample_cmp);
+		retrain_delete_models(samples, nsamples);
+	}
+
+	for (i = 0; i < nsamples; ++i)
+	{
+		RetrainSample *s = samples[i];
+
+		learn_replayed_sample(s->header.fspace_hash, s->header.fss_hash,
+							  s->header.query_template, s->relids,
+							  s->header.nfeatures, s->features,
+							  s->header.target);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextDelete(retrain_cxt);
+	return nsamples;
+}
+
+/*
+ * Reads the objects of the part from one log file. A truncated record at the
+ * end of the file is being written by its backend and is skipped.
+ */
+static void
+retrain_read_file(const char *path, int part, int nparts,
+				  RetrainSample ***samples, int *nsamples, int *maxsamples)
+{
+	FILE	   *file;
+	SampleLogRecord header;
+	int64		seqno = *nsamples;
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+
+	while (fread(&header, sizeof(header), 1, file) == 1)
+	{
+		RetrainSample *s;
+		Oid		   *relids;
+		int			i;
+
+		if (header.nfeatures <= 0 || header.nfeatures > SAMPLE_LOG_MAX_FEATURES ||
+			header.nrelids < 0 || header.nrelids > SAMPLE_LOG_MAX_RELIDS ||
+			header.len != sizeof(header) + sizeof(Oid) * header.nrelids +
+			sizeof(double) * header.nfeatures)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("AQO sample log \"%s\" is corrupted", path)));
+
+		if (retrain_part_of(header.fss_hash, nparts) != part)
+		{
+			if (fseek(file, header.len - sizeof(header), SEEK_CUR) != 0)
+				break;
+			continue;
+		}
+
+		s = palloc(sizeof(*s));
+		s->header = header;
+		s->seqno = seqno++;
+		s->relids = NIL;
+		s->features = palloc(sizeof(double) * header.nfeatures);
+		relids = palloc(sizeof(Oid) * (header.nrelids + 1));
+		if ((header.nrelids > 0 &&
+			 fread(relids, sizeof(Oid) * header.nrelids, 1, file) != 1) ||
+			fread(s->features, sizeof(double) * header.nfeatures, 1, file) != 1)
+			break;
+		for (i = 0; i < header.nrelids; ++i)
+			s->relids = lappend_int(s->relids, (int) relids[i]);
+		pfree(relids);
+
+		if (*nsamples == *maxsamples)
+		{
+			*maxsamples = Max(*maxsamples * 2, 1024);
+			*samples = *samples == NULL ?
+				palloc(sizeof(**samples) * *maxsamples) :
+				repalloc(*samples, sizeof(**samples) * *maxsamples);
+		}
+		(*samples)[(*nsamples)++] = s;
+	}
+
+	if (ferror(file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", path)));
+	FreeFile(file);
+}
+
+/* Orders objects by their timestamps, then by the order of reading */
+static int
+retrain_sample_cmp(const void *a, const void *b)
+{
+	const RetrainSample *sa = *(RetrainSample *const *) a;
+	const RetrainSample *sb = *(RetrainSample *const *) b;
+
+	if (sa->header.time != sb->header.time)
+		return sa->header.time < sb->header.time ? -1 : 1;
+	if (sa->seqno != sb->seqno)
+		return sa->seqno < sb->seqno ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Deletes the models, data houses and relations of the feature subspaces of
+ * the objects, so that they are learned from scratch.
+ */
+static void
+retrain_delete_models(RetrainSample **samples, int nsamples)
+{
+	static const char *const queries[] = {
+		"DELETE FROM public.aqo_data_lwpr d USING unnest($1, $2) AS m(fspace, fss) "
+		"WHERE d.fspace_hash = m.fspace AND d.fsspace_hash = m.fss",
+		"DELETE FROM public.aqo_data_house_lwpr h USING unnest($1, $2) AS m(fspace, fss) "
+		"WHERE h.fspace_hash = m.fspace AND h.fsspace_hash = m.fss",
+		"DELETE FROM public.aqo_fss_relations r USING unnest($1, $2) AS m(fspace, fss) "
+		"WHERE r.fspace_hash = m.fspace AND r.fsspace_hash = m.fss",
+		"DELETE FROM public.aqo_data a USING unnest($1, $2) AS m(fspace, fss) "
+		"WHERE a.fspace_hash = m.fspace AND a.fsspace_hash = m.fss",
+		"DELETE FROM public.aqo_fss_models s USING unnest($1, $2) AS m(fspace, fss) "
+		"WHERE s.fspace_hash = m.fspace AND s.fsspace_hash = m.fss"
+	};
+	Datum	   *fspaces = palloc(sizeof(Datum) * nsamples);
+	Datum	   *fsses = palloc(sizeof(Datum) * nsamples);
+	Oid			argtypes[2] = {INT4ARRAYOID, INT4ARRAYOID};
+	Datum		args[2];
+	int			i;
+
+	/* Duplicates do no harm to the deletes */
+	for (i = 0; i < nsamples; ++i)
+	{
+		fspaces[i] = Int32GetDatum(samples[i]->header.fspace_hash);
+		fsses[i] = Int32GetDatum(samples[i]->header.fss_hash);
+	}
+	args[0] = PointerGetDatum(construct_array(fspaces, nsamples, INT4OID,
+											  4, true, 'i'));
+	args[1] = PointerGetDatum(construct_array(fsses, nsamples, INT4OID,
+											  4, true, 'i'));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "aqo_retrain: SPI_connect failed");
+	for (i = 0; i < lengthof(queries); ++i)
+	{
+		int			ret;
+
+		ret = SPI_execute_with_args(queries[i], 2, argtypes, args, NULL,
+									false, 0);
+		if (ret < 0)
+			elog(ERROR, "aqo_retrain: cannot execute \"%s\": %s",
+				 queries[i], SPI_result_code_string(ret));
+	}
+	SPI_finish();
+	CommandCounterIncrement();
+}
+
+static int
+retrain_part_of(int fss_hash, int nparts)
+{
+	return (int) ((uint32) fss_hash % (uint32) nparts);
+}
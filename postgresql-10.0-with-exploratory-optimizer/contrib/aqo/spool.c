@@ -0,0 +1,501 @@
+#include "aqo.h"
+#include "access/parallel.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "storage/fd.h"
+
+/*****************************************************************************
+ *
+ *	STANDBY SPOOL
+ *
+ * A hot standby plans with the models replicated from the primary but cannot
+ * learn. If aqo.standby_spool_dir is set, the objects a standby backend
+ * would learn on are written into files of that directory instead:
+ *
+ *	aqo_spool_<pid>_<timestamp>.tmp
+ *
+ * A file is renamed to *.spool when it is complete: after
+ * AQO_SPOOL_FILE_SAMPLES objects or at the exit of the backend. The
+ * complete files are to be copied to the primary (or the directory is
+ * shared), where aqo_ingest_spool(dir) learns the objects and removes the
+ * files.
+ *
+ * aqo_ingest_spool renames a file to *.ingest before it learns the objects,
+ * so a concurrent call does not learn them too. The file is removed when the
+ * learned models are committed and renamed back to *.spool if the
+ * (sub)transaction aborts. A *.ingest file left by a crash of the server may
+ * or may not be learned; it is to be renamed back by hand to be learned.
+ *
+ * A *.tmp file is left by a standby backend which crashed or was killed
+ * before it could rename the file. A live backend still writes its file, so
+ * only once no process has the pid of the file name, the operator renames the
+ * file to *.spool to have its objects learned. The last line of such a
+ * file may be cut in the middle of a number, so it is to be deleted first if
+ * the file does not end with a newline.
+ *
+ * Every object is one text line:
+ *
+ *	fspace_hash fss_hash nrelids relid... nfeatures feature... target
+ *
+ *****************************************************************************/
+
+/* Objects in a spool file */
+#define AQO_SPOOL_FILE_SAMPLES	1000
+/* Limits of a sane spool line */
+#define AQO_SPOOL_MAX_RELIDS	1000
+#define AQO_SPOOL_MAX_FEATURES	10000
+
+/* A spool file being ingested by the current transaction */
+typedef struct SpoolClaim
+{
+	char	   *path;			/* of the *.ingest file */
+	SubTransactionId subid;		/* the subtransaction which renamed it */
+} SpoolClaim;
+
+static FILE *spool_file = NULL;
+static char spool_path[MAXPGPATH];
+static int	spool_file_samples = 0;
+static bool spool_exit_callback_registered = false;
+
+/* Claimed files, in TopMemoryContext */
+static List *spool_claims = NIL;
+static bool spool_xact_callback_registered = false;
+
+static void spool_open(void);
+static void spool_close(void);
+static void spool_at_exit(int code, Datum arg);
+static bool spool_read_line(FILE *file, StringInfo line);
+static bool spool_parse_line(char *line, int *fspace_hash, int *fss_hash,
+				 List **relids, int *nfeatures, double **features,
+				 double *target);
+static int64 spool_ingest_file(const char *path);
+static char *spool_claim_file(const char *path);
+static void spool_release_claims(bool commit, SubTransactionId subid);
+static void spool_xact_callback(XactEvent event, void *arg);
+static void spool_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					   SubTransactionId parentSubid, void *arg);
+
+
+/*
+ * Whether objects observed by this backend are spooled.
+ */
+bool
+spool_is_enabled(void)
+{
+	return standby_spool_dir != NULL && standby_spool_dir[0] != '\0' &&
+		RecoveryInProgress() && !IsParallelWorker();
+}
+
+/*
+ * Writes the object into the spool file of the backend. Failures are
+ * reported as warnings: the query must not fail because of the spool.
+ */
+void
+spool_sample(int fspace_hash, int fss_hash, List *relids,
+			 int nfeatures, double *features, double target)
+{
+	StringInfoData line;
+	ListCell   *l;
+	int			i;
+
+	if (spool_file == NULL)
+		spool_open();
+	if (spool_file == NULL)
+		return;
+
+	initStringInfo(&line);
+	appendStringInfo(&line, "%d %d %d", fspace_hash, fss_hash,
+					 list_length(relids));
+	foreach(l, relids)
+		appendStringInfo(&line, " %u", (Oid) lfirst_int(l));
+	appendStringInfo(&line, " %d", nfeatures);
+	for (i = 0; i < nfeatures; ++i)
+		appendStringInfo(&line, " %.17g", features[i]);
+	appendStringInfo(&line, " %.17g\n", target);
+
+	if (fwrite(line.data, line.len, 1, spool_file) != 1 ||
+		fflush(spool_file) != 0)
+	{
+		elog(WARNING, "could not write AQO spool file \"%s\": %m",
+			 spool_path);
+		fclose(spool_file);
+		spool_file = NULL;
+		unlink(spool_path);
+	}
+	else if (++spool_file_samples >= AQO_SPOOL_FILE_SAMPLES)
+		spool_close();
+
+	pfree(line.data);
+}
+
+/*
+ * Creates a new spool file. The file is not managed by fd.c because it lives
+ * longer than a transaction.
+ */
+static void
+spool_open(void)
+{
+	snprintf(spool_path, MAXPGPATH, "%s/aqo_spool_%d_" INT64_FORMAT ".tmp",
+			 standby_spool_dir, MyProcPid, (int64) GetCurrentTimestamp());
+	spool_file = fopen(spool_path, PG_BINARY_W);
+	if (spool_file == NULL)
+	{
+		elog(WARNING, "could not create AQO spool file \"%s\": %m",
+			 spool_path);
+		return;
+	}
+	spool_file_samples = 0;
+
+	if (!spool_exit_callback_registered)
+	{
+		on_proc_exit(spool_at_exit, (Datum) 0);
+		spool_exit_callback_registered = true;
+	}
+}
+
+/*
+ * Closes the spool file and makes it visible to aqo_ingest_spool.
+ */
+static void
+spool_close(void)
+{
+	char		done_path[MAXPGPATH];
+	int			len = strlen(spool_path) - strlen(".tmp");
+
+	if (fclose(spool_file) != 0)
+		elog(WARNING, "could not close AQO spool file \"%s\": %m",
+			 spool_path);
+	spool_file = NULL;
+
+	snprintf(done_path, MAXPGPATH, "%.*s.spool", len, spool_path);
+	if (rename(spool_path, done_path) != 0)
+		elog(WARNING, "could not rename AQO spool file \"%s\": %m",
+			 spool_path);
+}
+
+static void
+spool_at_exit(int code, Datum arg)
+{
+	if (spool_file != NULL)
+		spool_close();
+}
+
+PG_FUNCTION_INFO_V1(aqo_ingest_spool);
+
+/*
+ * Learns the objects of complete spool files of the directory. The files are
+ * removed when the transaction commits. Returns the number of learned objects.
+ */
+Datum
+aqo_ingest_spool(PG_FUNCTION_ARGS)
+{
+	char	   *dir = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	DIR		   *dirdesc;
+	struct dirent *de;
+	List	   *files = NIL;
+	ListCell   *l;
+	int64		nsamples = 0;
+
+	if (!spool_xact_callback_registered)
+	{
+		RegisterXactCallback(spool_xact_callback, NULL);
+		RegisterSubXactCallback(spool_subxact_callback, NULL);
+		spool_xact_callback_registered = true;
+	}
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to use aqo_ingest_spool")));
+	if (RecoveryInProgress())
+		elog(ERROR, "aqo_ingest_spool cannot be executed during recovery");
+
+	dirdesc = AllocateDir(dir);
+	while ((de = ReadDir(dirdesc, dir)) != NULL)
+	{
+		size_t		len = strlen(de->d_name);
+
+		if (strncmp(de->d_name, "aqo_spool_", strlen("aqo_spool_")) != 0 ||
+			len < strlen(".spool") ||
+			strcmp(de->d_name + len - strlen(".spool"), ".spool") != 0)
+			continue;
+		files = lappend(files, psprintf("%s/%s", dir, de->d_name));
+	}
+	FreeDir(dirdesc);
+
+	foreach(l, files)
+	{
+		char	   *path = spool_claim_file((char *) lfirst(l));
+
+		/* Another call has taken the file */
+		if (path == NULL)
+			continue;
+		nsamples += spool_ingest_file(path);
+	}
+	list_free_deep(files);
+
+	PG_RETURN_INT64(nsamples);
+}
+
+/*
+ * Renames the complete spool file to *.ingest and remembers it until the end
+ * of the transaction. Returns the new path or NULL if the file is gone.
+ */
+static char *
+spool_claim_file(const char *path)
+{
+	MemoryContext oldcxt;
+	SpoolClaim *claim;
+	char	   *claimed;
+	int			len = strlen(path) - strlen(".spool");
+
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+	claimed = psprintf("%.*s.ingest", len, path);
+	if (rename(path, claimed) != 0)
+	{
+		int			save_errno = errno;
+
+		pfree(claimed);
+		MemoryContextSwitchTo(oldcxt);
+		if (save_errno == ENOENT)
+			return NULL;
+		errno = save_errno;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not rename file \"%s\": %m", path)));
+	}
+	claim = palloc(sizeof(*claim));
+	claim->path = claimed;
+	claim->subid = GetCurrentSubTransactionId();
+	spool_claims = lappend(spool_claims, claim);
+	MemoryContextSwitchTo(oldcxt);
+
+	return claimed;
+}
+
+/*
+ * Removes the files claimed by the subtransaction subid (any if
+ * InvalidSubTransactionId) if commit, or returns them to the spool.
+ */
+static void
+spool_release_claims(bool commit, SubTransactionId subid)
+{
+	ListCell   *l;
+	ListCell   *prev = NULL;
+	ListCell   *next;
+
+	for (l = list_head(spool_claims); l != NULL; l = next)
+	{
+		SpoolClaim *claim = (SpoolClaim *) lfirst(l);
+		int			len = strlen(claim->path) - strlen(".ingest");
+		char		spool[MAXPGPATH];
+
+		next = lnext(l);
+		if (subid != InvalidSubTransactionId && claim->subid != subid)
+		{
+			prev = l;
+			continue;
+		}
+
+		if (commit)
+		{
+			if (unlink(claim->path) != 0)
+				ereport(WARNING,
+						(errcode_for_file_access(),
+						 errmsg("could not remove file \"%s\": %m",
+								claim->path)));
+		}
+		else
+		{
+			snprintf(spool, MAXPGPATH, "%.*s.spool", len, claim->path);
+			if (rename(claim->path, spool) != 0)
+				ereport(WARNING,
+						(errcode_for_file_access(),
+						 errmsg("could not rename file \"%s\": %m",
+								claim->path)));
+		}
+		pfree(claim->path);
+		pfree(claim);
+		spool_claims = list_delete_cell(spool_claims, l, prev);
+	}
+}
+
+static void
+spool_xact_callback(XactEvent event, void *arg)
+{
+	if (spool_claims == NIL)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+			spool_release_claims(true, InvalidSubTransactionId);
+			break;
+		case XACT_EVENT_ABORT:
+			spool_release_claims(false, InvalidSubTransactionId);
+			break;
+		case XACT_EVENT_PRE_PREPARE:
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("cannot PREPARE a transaction that has ingested AQO spool files")));
+			break;
+		default:
+			break;
+	}
+}
+
+static void
+spool_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					   SubTransactionId parentSubid, void *arg)
+{
+	ListCell   *l;
+
+	if (spool_claims == NIL)
+		return;
+
+	switch (event)
+	{
+		case SUBXACT_EVENT_COMMIT_SUB:
+			/* The parent is responsible for the files now */
+			foreach(l, spool_claims)
+			{
+				SpoolClaim *claim = (SpoolClaim *) lfirst(l);
+
+				if (claim->subid == mySubid)
+					claim->subid = parentSubid;
+			}
+			break;
+		case SUBXACT_EVENT_ABORT_SUB:
+			spool_release_claims(false, mySubid);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Learns the objects of one spool file. Malformed lines are skipped.
+ */
+static int64
+spool_ingest_file(const char *path)
+{
+	FILE	   *file;
+	StringInfoData line;
+	int64		nsamples = 0;
+	int			lineno = 0;
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+
+	initStringInfo(&line);
+	while (spool_read_line(file, &line))
+	{
+		int			fspace_hash;
+		int			fss_hash;
+		List	   *relids;
+		int			nfeatures;
+		double	   *features;
+		double		target;
+
+		lineno++;
+		if (!spool_parse_line(line.data, &fspace_hash, &fss_hash, &relids,
+							  &nfeatures, &features, &target))
+		{
+			elog(WARNING, "malformed line %d in AQO spool file \"%s\"",
+				 lineno, path);
+			continue;
+		}
+
+		learn_replayed_sample(fspace_hash, fss_hash, 0, relids,
+							  nfeatures, features, target);
+		nsamples++;
+
+		list_free(relids);
+		pfree(features);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	if (ferror(file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", path)));
+	FreeFile(file);
+	pfree(line.data);
+
+	return nsamples;
+}
+
+/*
+ * Reads the next line without the newline. Returns false at the end of file.
+ */
+static bool
+spool_read_line(FILE *file, StringInfo line)
+{
+	char		buf[1024];
+
+	resetStringInfo(line);
+	while (fgets(buf, sizeof(buf), file) != NULL)
+	{
+		appendStringInfoString(line, buf);
+		if (line->len > 0 && line->data[line->len - 1] == '\n')
+		{
+			line->data[--line->len] = '\0';
+			return true;
+		}
+	}
+	return line->len > 0;
+}
+
+static bool
+spool_parse_line(char *line, int *fspace_hash, int *fss_hash, List **relids,
+				 int *nfeatures, double **features, double *target)
+{
+	char	   *p = line;
+	char	   *end;
+	long		nrelids;
+	int			i;
+
+	*relids = NIL;
+	*features = NULL;
+
+	*fspace_hash = (int) strtol(p, &end, 10);
+	if (end == p)
+		return false;
+	*fss_hash = (int) strtol(p = end, &end, 10);
+	if (end == p)
+		return false;
+	nrelids = strtol(p = end, &end, 10);
+	if (end == p || nrelids < 0 || nrelids > AQO_SPOOL_MAX_RELIDS)
+		return false;
+	for (i = 0; i < nrelids; ++i)
+	{
+		Oid			relid = (Oid) strtoul(p = end, &end, 10);
+
+		if (end == p)
+			goto malformed;
+		*relids = lappend_int(*relids, (int) relid);
+	}
+	*nfeatures = (int) strtol(p = end, &end, 10);
+	if (end == p || *nfeatures <= 0 || *nfeatures > AQO_SPOOL_MAX_FEATURES)
+		goto malformed;
+	*features = palloc(sizeof(**features) * *nfeatures);
+	for (i = 0; i < *nfeatures; ++i)
+	{
+		(*features)[i] = strtod(p = end, &end);
+		if (end == p)
+			goto malformed;
+	}
+	*target = strtod(p = end, &end);
+	if (end == p)
+		goto malformed;
+	return true;
+
+malformed:
+	list_free(*relids);
+	if (*features != NULL)
+		pfree(*features);
+	return false;
+}
@@ -0,0 +1,36 @@
+CREATE EXTENSION aqo;
+SET aqo.mode = 'disabled';
+
+CREATE TABLE aqo_drift_test (x int);
+INSERT INTO aqo_drift_test SELECT i FROM generate_series(1, 1000) i;
+ANALYZE aqo_drift_test;
+
+-- A model learned on aqo_drift_test when it had 1000 rows
+INSERT INTO public.aqo_queries VALUES (1, true, true, 1, false);
+INSERT INTO public.aqo_data_lwpr (fspace_hash, fsspace_hash, nfeatures, numRFS)
+	VALUES (1, 42, 0, 0);
+INSERT INTO public.aqo_fss_relations
+	VALUES (1, 42, 'aqo_drift_test'::regclass, 1000);
+
+-- A change within aqo.stale_threshold keeps the model fresh
+INSERT INTO aqo_drift_test SELECT i FROM generate_series(1, 100) i;
+ANALYZE aqo_drift_test;
+SET aqo.mode = 'controlled';
+SELECT count(*) FROM aqo_drift_test;
+SET aqo.mode = 'disabled';
+SELECT staleness FROM public.aqo_data_lwpr WHERE fsspace_hash = 42;
+SELECT reltuples FROM public.aqo_fss_relations WHERE fsspace_hash = 42;
+
+-- A bulk load makes it stale at the next planning with AQO, and the new
+-- number of tuples is remembered
+INSERT INTO aqo_drift_test SELECT i FROM generate_series(1, 2000) i;
+ANALYZE aqo_drift_test;
+SELECT staleness FROM public.aqo_data_lwpr WHERE fsspace_hash = 42;
+SET aqo.mode = 'controlled';
+SELECT count(*) FROM aqo_drift_test;
+SET aqo.mode = 'disabled';
+SELECT staleness FROM public.aqo_data_lwpr WHERE fsspace_hash = 42;
+SELECT reltuples FROM public.aqo_fss_relations WHERE fsspace_hash = 42;
+
+DROP TABLE aqo_drift_test;
+DROP EXTENSION aqo;
@@ -0,0 +1,56 @@
+CREATE EXTENSION aqo;
+SET aqo.mode = 'disabled';
+
+-- Models of every kind survive the export and import round trip
+INSERT INTO public.aqo_queries VALUES (1, true, true, 1, false);
+INSERT INTO public.aqo_query_texts VALUES (1, 'SELECT 1;');
+INSERT INTO public.aqo_data VALUES (1, 42, 2, '{{1,2},{3,4}}', '{5,6}');
+INSERT INTO public.aqo_fss_models
+	VALUES (1, 42, 1, 2, 5.5, '{0.5,0.25,0.125}', '{-1,1,2}');
+INSERT INTO public.aqo_node_latency VALUES (7, 1, '{{1}}', '{2}');
+
+SELECT aqo_export_models('aqo_export_test.bin');
+
+-- Removing the query removes its models by cascade
+DELETE FROM public.aqo_queries WHERE query_hash = 1;
+SELECT count(*) FROM public.aqo_data;
+SELECT count(*) FROM public.aqo_fss_models;
+
+SELECT aqo_import_models('aqo_export_test.bin');
+
+SELECT query_hash, learn_aqo, use_aqo, fspace_hash, auto_tuning
+FROM public.aqo_queries ORDER BY query_hash;
+SELECT query_text FROM public.aqo_query_texts ORDER BY query_hash;
+SELECT features = '{{1,2},{3,4}}' AND targets = '{5,6}' AS aqo_data_equal
+FROM public.aqo_data WHERE fspace_hash = 1 AND fsspace_hash = 42;
+SELECT model, nsamples, mean_target, errors, latencies
+FROM public.aqo_fss_models WHERE fspace_hash = 1 AND fsspace_hash = 42;
+SELECT node_type, nfeatures FROM public.aqo_node_latency;
+
+-- A failed import leaves the models as they are
+-- The bad files are written through large objects created beforehand
+SELECT lo_from_bytea(0, 'not an AQO model file') AS lo \gset
+SELECT lo_export(:lo, 'aqo_export_bad.bin'), lo_unlink(:lo);
+SELECT aqo_import_models('aqo_export_bad.bin');
+SELECT lo_from_bytea(0, substr(pg_read_binary_file('aqo_export_test.bin'), 1, 40))
+	AS lo \gset
+SELECT lo_export(:lo, 'aqo_export_truncated.bin'), lo_unlink(:lo);
+SELECT aqo_import_models('aqo_export_truncated.bin');
+SELECT lo_from_bytea(0, set_byte(b, length(b) - 1,
+								 (get_byte(b, length(b) - 1) + 1) % 256)) AS lo
+FROM (SELECT pg_read_binary_file('aqo_export_test.bin') AS b) AS f \gset
+SELECT lo_export(:lo, 'aqo_export_checksum.bin'), lo_unlink(:lo);
+SELECT aqo_import_models('aqo_export_checksum.bin');
+SELECT aqo_import_models('aqo_export_missing.bin');
+SELECT count(*) FROM public.aqo_data;
+SELECT count(*) FROM public.aqo_fss_models;
+
+-- The files are on the server, so only a superuser may use them
+CREATE ROLE regress_aqo_user;
+SET ROLE regress_aqo_user;
+SELECT aqo_export_models('aqo_export_user.bin');
+SELECT aqo_import_models('aqo_export_test.bin');
+RESET ROLE;
+DROP ROLE regress_aqo_user;
+
+DROP EXTENSION aqo;
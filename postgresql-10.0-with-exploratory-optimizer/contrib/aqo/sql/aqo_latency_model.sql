@@ -0,0 +1,54 @@
+CREATE EXTENSION aqo;
+SET aqo.mode = 'learn';
+SET aqo.default_query_template = 1;
+
+CREATE TABLE aqo_latency_a (a int, b text);
+CREATE TABLE aqo_latency_b (a int, b text);
+INSERT INTO aqo_latency_a SELECT i, repeat('x', 20) FROM generate_series(1, 1000) i;
+INSERT INTO aqo_latency_b SELECT i % 500, repeat('x', 20) FROM generate_series(1, 2000) i;
+CREATE INDEX aqo_latency_b_idx ON aqo_latency_b (a);
+ANALYZE aqo_latency_a;
+ANALYZE aqo_latency_b;
+
+-- The model is off by default, so executions are not timed
+SELECT count(*) FROM aqo_latency_a JOIN aqo_latency_b USING (a)
+WHERE aqo_latency_a.a < 300;
+SELECT count(*) FROM public.aqo_node_latency;
+
+-- With the model on, every executed node type gets a model
+SET aqo.use_latency_model = on;
+SELECT count(*) FROM aqo_latency_a JOIN aqo_latency_b USING (a)
+WHERE aqo_latency_a.a < 300;
+SELECT count(*) > 0 AS learned, min(nfeatures), max(nfeatures)
+FROM public.aqo_node_latency;
+
+-- Replace the learned models by ones which predict a slow Hash Join (node
+-- type 37 in PostgreSQL 10); scans, Hash and Nested Loop are fast
+SET aqo.use_latency_model = off;
+DELETE FROM public.aqo_node_latency;
+INSERT INTO public.aqo_node_latency
+	SELECT node_type, 4, '{{0,0,0,0},{10,10,10,10}}',
+		   CASE WHEN node_type = 37 THEN '{20,20}'::float8[] ELSE '{0,0}' END
+	FROM unnest('{18,20,35,37,46}'::int[]) AS node_type;
+
+EXPLAIN (COSTS OFF)
+SELECT * FROM aqo_latency_a JOIN aqo_latency_b USING (a)
+WHERE aqo_latency_a.a < 300;
+
+-- The model prefers the more expensive Nested Loop within the cost window
+SET aqo.use_latency_model = on;
+SET aqo.latency_model_cost_window = 1000;
+EXPLAIN (COSTS OFF)
+SELECT * FROM aqo_latency_a JOIN aqo_latency_b USING (a)
+WHERE aqo_latency_a.a < 300;
+
+-- and keeps the cheapest plan when no other plan is within the window
+SET aqo.latency_model_cost_window = 1;
+EXPLAIN (COSTS OFF)
+SELECT * FROM aqo_latency_a JOIN aqo_latency_b USING (a)
+WHERE aqo_latency_a.a < 300;
+
+RESET aqo.latency_model_cost_window;
+RESET aqo.use_latency_model;
+DROP TABLE aqo_latency_a, aqo_latency_b;
+DROP EXTENSION aqo;
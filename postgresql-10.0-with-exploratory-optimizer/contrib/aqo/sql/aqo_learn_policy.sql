@@ -0,0 +1,52 @@
+CREATE EXTENSION aqo;
+SELECT aqo_planning_stats_reset();
+
+CREATE TABLE aqo_policy_test (x int, y int);
+INSERT INTO aqo_policy_test SELECT i % 10, i % 10 FROM generate_series(1, 1000) i;
+ANALYZE aqo_policy_test;
+SET aqo.mode = 'learn';
+SET aqo.default_query_template = 1;
+-- Objects with any error are sampled and rate-limited
+SET aqo.learn_large_error = 1e10;
+
+CREATE FUNCTION aqo_policy_run(n int) RETURNS void AS $$
+BEGIN
+	FOR i IN 1..n LOOP
+		PERFORM count(*) FROM aqo_policy_test WHERE x = 1 AND y = 1;
+	END LOOP;
+END
+$$ LANGUAGE plpgsql;
+
+-- Objects predicted within the threshold are not learned
+SET aqo.learn_error_threshold = 1e9;
+SELECT aqo_policy_run(5);
+RESET aqo.learn_error_threshold;
+SELECT function, calls FROM aqo_planning_stats
+WHERE function LIKE 'learn_skip_%' OR function = 'learn_fss_object'
+ORDER BY function;
+SELECT aqo_planning_stats_reset();
+
+-- Only a few of the objects after the first one enter the reservoir
+SET aqo.learn_sample_size = 1;
+SELECT aqo_policy_run(20);
+RESET aqo.learn_sample_size;
+SELECT function, calls > 0 AS counted FROM aqo_planning_stats
+WHERE function IN ('learn_skip_accurate', 'learn_skip_sampled', 'learn_skip_rate')
+ORDER BY function;
+SELECT aqo_planning_stats_reset();
+
+-- A subspace is updated once a second; the loop may cross one second only
+SET aqo.learn_max_per_second = 1;
+SELECT aqo_policy_run(5);
+RESET aqo.learn_max_per_second;
+SELECT function, calls >= 3 AS counted FROM aqo_planning_stats
+WHERE function IN ('learn_skip_accurate', 'learn_skip_sampled', 'learn_skip_rate')
+ORDER BY function;
+
+RESET aqo.learn_large_error;
+RESET aqo.default_query_template;
+RESET aqo.mode;
+SELECT aqo_planning_stats_reset();
+DROP FUNCTION aqo_policy_run(int);
+DROP TABLE aqo_policy_test;
+DROP EXTENSION aqo;
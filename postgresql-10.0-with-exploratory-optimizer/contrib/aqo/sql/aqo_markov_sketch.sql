@@ -0,0 +1,48 @@
+CREATE EXTENSION aqo;
+SET aqo.mode = 'disabled';
+
+-- The reset forgets the queries planned by the previous tests
+SELECT aqo_markov_sketch_reset();
+SELECT count(*) FROM aqo_markov_sketch();
+
+-- Anyone may read the sketch, only a superuser may reset it
+CREATE ROLE regress_aqo_user;
+SET ROLE regress_aqo_user;
+SELECT count(*) FROM aqo_markov_sketch();
+SELECT aqo_markov_sketch_reset();
+RESET ROLE;
+DROP ROLE regress_aqo_user;
+
+-- Queries of one template fill the history and then count as its next query
+CREATE TABLE aqo_markov_test (a int);
+INSERT INTO aqo_markov_test SELECT generate_series(1, 100);
+ANALYZE aqo_markov_test;
+SET aqo.mode = 'learn';
+SET aqo.default_query_template = 1;
+SELECT count(*) FROM aqo_markov_test WHERE a < 10;
+SELECT count(*) FROM aqo_markov_test WHERE a < 20;
+SELECT count(*) FROM aqo_markov_test WHERE a < 30;
+SELECT count(*) FROM aqo_markov_test WHERE a < 40;
+SELECT count(*) FROM aqo_markov_test WHERE a < 50;
+SET aqo.mode = 'disabled';
+SELECT template, probability FROM aqo_markov_sketch();
+
+-- The imported aqo_markov_table replaces the queries seen so far
+SELECT aqo_export_models('aqo_markov_test.bin') > 0 AS exported;
+SELECT aqo_import_models('aqo_markov_test.bin') > 0 AS imported;
+SELECT count(*) FROM aqo_markov_sketch();
+
+SET aqo.mode = 'learn';
+SELECT count(*) FROM aqo_markov_test WHERE a < 60;
+SET aqo.mode = 'disabled';
+SELECT template, probability FROM aqo_markov_sketch();
+
+-- So does a new AQO
+DROP EXTENSION aqo;
+CREATE EXTENSION aqo;
+SELECT count(*) FROM aqo_markov_sketch();
+
+RESET aqo.mode;
+RESET aqo.default_query_template;
+DROP TABLE aqo_markov_test;
+DROP EXTENSION aqo;
@@ -0,0 +1,58 @@
+CREATE EXTENSION aqo;
+
+-- x and y are equal, so the planner underestimates rows of reopt_a by 100x
+CREATE TABLE aqo_reopt_a (x int, y int);
+CREATE TABLE aqo_reopt_b (x int);
+INSERT INTO aqo_reopt_a SELECT i % 100, i % 100 FROM generate_series(1, 10000) i;
+INSERT INTO aqo_reopt_b SELECT i % 100 FROM generate_series(1, 10000) i;
+ANALYZE aqo_reopt_a;
+ANALYZE aqo_reopt_b;
+
+SET aqo.mode = 'learn';
+SET aqo.default_query_template = 1;
+SET aqo.reoptimize_explore_threshold = 0;
+
+-- The join returns 10000 rows instead of 100, but not above this factor
+SET aqo.reoptimize_factor = 1000;
+SET client_min_messages = debug1;
+SELECT aqo_reopt_a.x, count(*)
+FROM aqo_reopt_a JOIN aqo_reopt_b USING (x)
+WHERE aqo_reopt_a.x = 1 AND aqo_reopt_a.y = 1
+GROUP BY aqo_reopt_a.x;
+RESET client_min_messages;
+
+-- Forget what the query above learned
+DROP EXTENSION aqo;
+CREATE EXTENSION aqo;
+SELECT aqo_planning_stats_reset();
+
+-- The execution is stopped at the join and the query is planned again. The
+-- client gets the rows of the second execution only.
+SET aqo.reoptimize_factor = 2;
+SET client_min_messages = debug1;
+SELECT aqo_reopt_a.x, count(*)
+FROM aqo_reopt_a JOIN aqo_reopt_b USING (x)
+WHERE aqo_reopt_a.x = 1 AND aqo_reopt_a.y = 1
+GROUP BY aqo_reopt_a.x;
+RESET client_min_messages;
+
+-- The join learned the rows it returned before the checkpoint as well as all
+-- its rows in the second execution; the scans learned only the latter
+SELECT calls FROM aqo_planning_stats
+WHERE function = 'learn_fss_object' ORDER BY calls;
+
+-- A query with a checkpoint which sends its rows as they come is restarted
+-- before the first one
+SET client_min_messages = debug1;
+SELECT aqo_reopt_b.x, count(*)
+FROM aqo_reopt_a JOIN aqo_reopt_b USING (x)
+WHERE aqo_reopt_a.x < 3 AND aqo_reopt_a.y < 3
+GROUP BY aqo_reopt_b.x ORDER BY aqo_reopt_b.x;
+RESET client_min_messages;
+
+RESET aqo.reoptimize_factor;
+RESET aqo.reoptimize_explore_threshold;
+RESET aqo.default_query_template;
+RESET aqo.mode;
+DROP TABLE aqo_reopt_a, aqo_reopt_b;
+DROP EXTENSION aqo;
@@ -0,0 +1,21 @@
+CREATE EXTENSION aqo;
+SET aqo.mode = 'disabled';
+
+-- Retraining needs the sample log
+SELECT aqo_retrain();
+SET aqo.sample_log_dir = '.';
+SELECT aqo_retrain(-1);
+
+-- An empty log changes no model, with or without workers
+SELECT aqo_retrain();
+SELECT aqo_retrain(2);
+RESET aqo.sample_log_dir;
+
+-- Only a superuser may rebuild models
+CREATE ROLE regress_aqo_user;
+SET ROLE regress_aqo_user;
+SELECT aqo_retrain();
+RESET ROLE;
+DROP ROLE regress_aqo_user;
+
+DROP EXTENSION aqo;
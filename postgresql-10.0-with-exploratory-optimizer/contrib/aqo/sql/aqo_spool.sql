@@ -0,0 +1,34 @@
+CREATE EXTENSION aqo;
+SET aqo.mode = 'disabled';
+
+-- A spool file of a standby with one valid and one malformed object
+INSERT INTO public.aqo_queries VALUES (1, true, true, 1, false);
+DO $$
+BEGIN
+	EXECUTE format('COPY (VALUES (%L), (%L)) TO %L',
+				   '1 42 0 2 1.5 2.5 3.5', '1 42 0 2 1.5 junk',
+				   current_setting('data_directory') || '/aqo_spool_1_1.spool');
+END
+$$;
+
+-- The file is claimed during the transaction and given back if it aborts
+BEGIN;
+SELECT aqo_ingest_spool('.');
+SELECT f FROM pg_ls_dir('.') AS f WHERE f LIKE 'aqo_spool_%' ORDER BY f;
+ROLLBACK;
+SELECT f FROM pg_ls_dir('.') AS f WHERE f LIKE 'aqo_spool_%' ORDER BY f;
+SELECT count(*) FROM public.aqo_data_lwpr;
+
+-- The valid object is learned and the file is removed at commit
+SELECT aqo_ingest_spool('.');
+SELECT f FROM pg_ls_dir('.') AS f WHERE f LIKE 'aqo_spool_%' ORDER BY f;
+SELECT fspace_hash, fsspace_hash, nfeatures FROM public.aqo_data_lwpr;
+
+-- Only a superuser may ingest spool files
+CREATE ROLE regress_aqo_user;
+SET ROLE regress_aqo_user;
+SELECT aqo_ingest_spool('.');
+RESET ROLE;
+DROP ROLE regress_aqo_user;
+
+DROP EXTENSION aqo;
@@ -0,0 +1,35 @@
+CREATE EXTENSION aqo;
+SET aqo.mode = 'disabled';
+
+-- float4 changes the types of the largest matrices only
+INSERT INTO public.aqo_queries VALUES (1, true, true, 1, false);
+INSERT INTO public.aqo_data_house_lwpr VALUES (1, 42, 7, '{{0.1,0.25}}', '{3}');
+SELECT aqo_set_storage_precision('float4');
+SELECT attrelid::regclass AS relation, attname, format_type(atttypid, NULL)
+FROM pg_attribute
+WHERE attrelid IN ('public.aqo_data_lwpr'::regclass,
+				   'public.aqo_data_house_lwpr'::regclass) AND
+	  attname IN ('d', 'm', 'u', 'p', 'history_data_matrix', 'features')
+ORDER BY attrelid::regclass::text, attnum;
+SELECT features, targets FROM public.aqo_data_house_lwpr;
+
+-- float8 keeps the rounded values
+SELECT aqo_set_storage_precision('float8');
+SELECT attrelid::regclass AS relation, attname, format_type(atttypid, NULL)
+FROM pg_attribute
+WHERE attrelid IN ('public.aqo_data_lwpr'::regclass,
+				   'public.aqo_data_house_lwpr'::regclass) AND
+	  attname IN ('d', 'm', 'u', 'p', 'history_data_matrix', 'features')
+ORDER BY attrelid::regclass::text, attnum;
+SELECT features, targets FROM public.aqo_data_house_lwpr;
+
+SELECT aqo_set_storage_precision('float2');
+
+-- Only a superuser may change the tables
+CREATE ROLE regress_aqo_user;
+SET ROLE regress_aqo_user;
+SELECT aqo_set_storage_precision('float4');
+RESET ROLE;
+DROP ROLE regress_aqo_user;
+
+DROP EXTENSION aqo;
@@ -0,0 +1,34 @@
+CREATE EXTENSION aqo;
+SET aqo.mode = 'disabled';
+
+-- Models unused for aqo.vacuum_max_age are evicted with the rows they left
+INSERT INTO public.aqo_queries VALUES (1, true, true, 1, false);
+INSERT INTO public.aqo_data_lwpr (fspace_hash, fsspace_hash, nfeatures, numRFS,
+								  last_used)
+	VALUES (1, 42, 0, 0, now() - interval '2 days'),
+		   (1, 43, 0, 0, now());
+INSERT INTO public.aqo_data_house_lwpr
+	VALUES (1, 42, 7, '{{1,2}}', '{3}'), (1, 44, 7, '{{1,2}}', '{3}');
+INSERT INTO public.aqo_data VALUES (1, 42, 2, '{{1,2},{3,4}}', '{5,6}');
+INSERT INTO public.aqo_fss_models
+	VALUES (1, 42, 1, 2, 5.5, '{0.5,0.25,0.125}', '{0.1,1,2}'),
+		   (1, 45, 2, 2, 5.5, '{0.5,0.25,0.125}', '{-1,1,2}');
+SET aqo.vacuum_max_age = '1d';
+SELECT evicted_fss, removed_rfs, deleted_datahouse_rows,
+	   bytes_before > bytes_after AS shrunk
+FROM aqo_vacuum();
+SELECT fsspace_hash FROM public.aqo_data_lwpr;
+SELECT count(*) FROM public.aqo_data_house_lwpr;
+SELECT count(*) FROM public.aqo_data;
+-- The constant model of a subspace without features has no LWPR model
+SELECT fsspace_hash FROM public.aqo_fss_models;
+RESET aqo.vacuum_max_age;
+
+-- Only a superuser may delete models
+CREATE ROLE regress_aqo_user;
+SET ROLE regress_aqo_user;
+SELECT * FROM aqo_vacuum();
+RESET ROLE;
+DROP ROLE regress_aqo_user;
+
+DROP EXTENSION aqo;
@@ -1,4 +1,5 @@
 #include "aqo.h"
+#include "executor/spi.h"
 
 /*****************************************************************************
  *
@@ -19,6 +20,8 @@ HTAB *deactivated_queries = NULL;
 static bool my_simple_heap_update(Relation relation,
 								  ItemPointer otid,
 								  HeapTuple tup);
+static bool my_heap_update(Relation relation, ItemPointer otid, HeapTuple tup,
+			   bool *busy);
 
 static bool my_index_insert(Relation indexRelation,
 							Datum *values,
@@ -27,6 +30,13 @@ static bool my_index_insert(Relation indexRelation,
 							Relation heapRelation,
 							IndexUniqueCheck checkUnique);
 
+static void deform_array_slow(ArrayType *array, double **matrix, int cols);
+static void fit_float_arrays(TupleDesc tupdesc, Datum *values, bool *isnull,
+				 bool *replace);
+static void deform_history(Datum matrix_datum, Datum nums_datum,
+			   LWPR_Model *model);
+static void deform_rf_matrix(Datum datum, LWPR_Model *model, size_t offset,
+				 double **rows);
 
 /*
  * Returns whether the query with given hash is in aqo_queries.
@@ -681,11 +691,14 @@ load_rf_datahouse(int fss_hash, int rf_hash, double **matrix, double *targets, i
 	bool		isnull[5];
 
 	bool		success = true;
+	AqoStatTimer stat_timer;
 
+	aqo_stat_begin(&stat_timer);
 	data_index_rel_oid = RelnameGetRelid("aqo_fss_lwpr_datahouse_idx");
 	if (!OidIsValid(data_index_rel_oid))
 	{
 		disable_aqo_for_query();
+		aqo_stat_end(&stat_timer, AQO_STAT_LOAD_RF_DATAHOUSE, fss_hash);
 		return false;
 	}
 
@@ -734,6 +747,7 @@ load_rf_datahouse(int fss_hash, int rf_hash, double **matrix, double *targets, i
 	index_close(data_index_rel, lockmode);
 	heap_close(aqo_data_heap, lockmode);
 
+	aqo_stat_end(&stat_timer, AQO_STAT_LOAD_RF_DATAHOUSE, fss_hash);
 	return success;
 }
 
@@ -815,9 +829,105 @@ load_best_two_costs(int query_pattern, double **matrix, double *est_cost, double
 	return success;
 }
 
+/*
+ * Loads the latency model of given executor node type.
+ * Returns false if the model does not exist yet.
+ *
+ * 'matrix' is an allocated memory for matrix with the size of
+ *			latency_model_K rows and ncols columns
+ * 'targets' is an allocated memory with size latency_model_K
+ * 'rows' is the pointer in which the function stores actual number of
+ *			objects in the model
+ */
+bool
+load_latency_model(int node_type, int ncols,
+				   double **matrix, double *targets, int *rows)
+{
+	RangeVar   *aqo_data_table_rv;
+	Relation	aqo_data_heap;
+	HeapTuple	tuple;
+
+	Relation	data_index_rel;
+	Oid			data_index_rel_oid;
+	IndexScanDesc data_index_scan;
+	ScanKeyData	key[1];
+
+	LOCKMODE	lockmode = AccessShareLock;
+
+	Datum		values[4];
+	bool		isnull[4];
+
+	bool		success = true;
+
+	data_index_rel_oid = RelnameGetRelid("aqo_node_latency_idx");
+	if (!OidIsValid(data_index_rel_oid))
+	{
+		disable_aqo_for_query();
+		return false;
+	}
+
+	aqo_data_table_rv = makeRangeVar("public", "aqo_node_latency", -1);
+	aqo_data_heap = heap_openrv(aqo_data_table_rv, lockmode);
+
+	data_index_rel = index_open(data_index_rel_oid, lockmode);
+	data_index_scan = index_beginscan(aqo_data_heap,
+									  data_index_rel,
+									  SnapshotSelf,
+									  1,
+									  0);
+
+	ScanKeyInit(&key[0],
+				1,
+				BTEqualStrategyNumber,
+				F_INT4EQ,
+				Int32GetDatum(node_type));
+
+	index_rescan(data_index_scan, key, 1, NULL, 0);
+
+	tuple = index_getnext(data_index_scan, ForwardScanDirection);
+
+	if (tuple)
+	{
+		ArrayType  *stored_targets;
+
+		heap_deform_tuple(tuple, aqo_data_heap->rd_att, values, isnull);
+		stored_targets = DatumGetArrayTypeP(values[3]);
+
+		if (DatumGetInt32(values[1]) != ncols)
+		{
+			elog(WARNING, "unexpected number of features for node type %d:\
+						   expected %d features, obtained %d",
+						   node_type, ncols, DatumGetInt32(values[1]));
+			success = false;
+		}
+		else if (ArrayGetNItems(ARR_NDIM(stored_targets),
+								ARR_DIMS(stored_targets)) > latency_model_K)
+		{
+			/* Learned with a larger aqo.latency_model_k */
+			success = false;
+		}
+		else
+		{
+			deform_matrix(values[2], matrix);
+			deform_vector(values[3], targets, rows);
+		}
+	}
+	else
+		success = false;
+
+	index_endscan(data_index_scan);
+
+	index_close(data_index_rel, lockmode);
+	heap_close(aqo_data_heap, lockmode);
+
+	return success;
+}
+
 /**
  * load query distribution
  * modified by jim 2021.2.13
+ * The Markov sketch in shared memory is preferred to aqo_markov_table once it
+ * has seen enough queries of the state.
  * */
 bool load_query_distribution(int num_history_data, int query_history_hash, QueryContextData	*query_context2){
 	if(num_history_data < num_history_data_compute_probability_fs){
@@ -847,6 +957,10 @@ bool load_query_distribution(int num_history_data, int query_history_hash, Query
 		bool		success = true;
 		int         num_query_pattern_test = 0;
 
+		query_context2->query_distribution = palloc0(sizeof(*query_context2->query_distribution) * num_query_pattern);
+		if (markov_sketch_predict(query_history_hash, query_context2->query_distribution))
+			return success;
+
 		data_index_rel_oid = RelnameGetRelid("aqo_markov_table_idx");
 		if (!OidIsValid(data_index_rel_oid))
 		{
@@ -876,12 +990,10 @@ bool load_query_distribution(int num_history_data, int query_history_hash, Query
 
 		if (tuple)
 		{
-			query_context2->query_distribution = palloc0(sizeof(*query_context2->query_distribution) * num_query_pattern);
 			heap_deform_tuple(tuple, aqo_data_heap->rd_att, values, isnull);
 			deform_vector(values[1], query_context2->query_distribution, &num_query_pattern_test);
 		}else{
 			success = false;
-			query_context2->query_distribution = palloc0(sizeof(*query_context2->query_distribution) * num_query_pattern);
 			for(int i=0; i<num_query_pattern; i++){
 				query_context2->query_distribution[i] = 1./num_query_pattern;
 			}
@@ -919,53 +1031,23 @@ load_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model){
 
 	LOCKMODE	lockmode = AccessShareLock;
 
-	Datum		values[35];
-	bool		isnull[35];
+	Datum		values[37];
+	bool		isnull[37];
 
 	bool		success = true;
-    //定义输出的RF变量
-	double *nReg;
-	double *trustworthy;
-	double *slopeReady;
-	double *sum_e2;
-	double *beta0;
-	double *ssp; /* used for calculating confidence bound */
-	double **D;
-	double **M;
-    double **alpha;
-	double **beta;
-	double **c;
-	double **SXresYres;
-	double **SSs2;
-	double **SSYres;
-	double **SSXres;
-	double **U;
-	double **P;
-	double **H;
-	double **r;
-	double **sum_w;
-	double **sum_e_cv2;
-	double **n_data;
-	double **lambda;
-	double **mean_x;
-	double **var_x;
-	double **s;
-	double **slope;
-	double **history_data_matrix;
-	double *num_history_data;//保存的历史数据
-	int num_query_pattern_test = 0;
-	/*add by jim in 2021.1.22*/
-	double **history_error_matrix;
-	double *num_history_error;
-	int num_rf;  //rf个数
-	int i;
-	int dim;   //rf的方向个数
-	int nInS = model->nInStore; 
+	double	  **rows;		/* rows of a matrix, point into RFs */
+	double	   *vec;		/* a value of each RF */
+	int			num_rf;  //rf个数
+	int			i;
 	LWPR_ReceptiveField *RF;
+	AqoStatTimer stat_timer;
+
+	aqo_stat_begin(&stat_timer);
 	data_index_rel_oid = RelnameGetRelid("aqo_fss_lwpr_access_idx");
 	if (!OidIsValid(data_index_rel_oid))
 	{
 		disable_aqo_for_query();
+		aqo_stat_end(&stat_timer, AQO_STAT_LOAD_FSS_RFWR, fss_hash);
 		return false;
 	}
 
@@ -1001,301 +1083,72 @@ load_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model){
 
 		if (DatumGetInt32(values[2]) == ncols)
 		{
-			//分配内存
+			/*
+			 * Receptive fields are created first, and the stored matrices are
+			 * deformed right into their arrays, without temporary copies.
+			 */
+			Assert(model->numRFS == 0);
 			num_rf = DatumGetInt32(values[3]);
-			nReg = palloc0(sizeof(*nReg) * num_rf);
-			trustworthy = palloc0(sizeof(*trustworthy) * num_rf);
-			slopeReady = palloc0(sizeof(*slopeReady) * num_rf);
-			sum_e2 = palloc0(sizeof(*sum_e2) * num_rf);
-			beta0 = palloc0(sizeof(*beta0) * num_rf);
-			ssp = palloc0(sizeof(*ssp) * num_rf);
-            //cubic
-			D = palloc(sizeof(*D) * num_rf);
-			for (i = 0; i < num_rf; ++i){
-				D[i] = palloc0(sizeof(**D) * nInS* ncols);
-				// for(j = 0; j < ncols; ++j){
-				// 	D[i][j] = palloc0(sizeof(***D) * ncols);
-				// }
-			}
-			M = palloc(sizeof(*M) * num_rf);
-			for (i = 0; i < num_rf; ++i){
-				M[i] = palloc0(sizeof(**M) * nInS* ncols);
-				// for(j = 0; j < ncols; ++j){
-				// 	M[i][j] = palloc0(sizeof(***M) * ncols);
-				// }
-			}
-			alpha = palloc(sizeof(*alpha) * num_rf);
-			for (i = 0; i < num_rf; ++i){
-				alpha[i] = palloc0(sizeof(**alpha) * nInS* ncols);
-				// for(j = 0; j < ncols; ++j){
-				// 	alpha[i][j] = palloc0(sizeof(***alpha) * ncols);
-				// }
-			}
-			//matric
-			beta = palloc(sizeof(*beta) * num_rf);
-		    for (i = 0; i < num_rf; ++i)
-				beta[i] = palloc0(sizeof(**beta) * ncols);
-			c = palloc(sizeof(*c) * num_rf);
-		    for (i = 0; i < num_rf; ++i)
-				c[i] = palloc0(sizeof(**c) * ncols);
-			SXresYres = palloc(sizeof(*SXresYres) * num_rf);
-			for (i = 0; i < num_rf; ++i){
-				SXresYres[i] = palloc0(sizeof(**SXresYres) * nInS* ncols);
-				// for(j = 0; j < ncols; ++j){
-				// 	SXresYres[i][j] = palloc0(sizeof(***SXresYres) * ncols);
-				// }
-			}
-			SSs2 = palloc(sizeof(*SSs2) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				SSs2[i] = palloc0(sizeof(**SSs2) * ncols);
-			SSYres = palloc(sizeof(*SSYres) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				SSYres[i] = palloc0(sizeof(**SSYres) * ncols);
-			SSXres = palloc(sizeof(*SSXres) * num_rf);
-			for (i = 0; i < num_rf; ++i){
-				SSXres[i] = palloc0(sizeof(**SSXres) * nInS* ncols);
-				// for(j = 0; j < ncols; ++j){
-				// 	SSXres[i][j] = palloc0(sizeof(***SSXres) * ncols);
-				// }
-			}
-			U = palloc(sizeof(*U) * num_rf);
-			for (i = 0; i < num_rf; ++i){
-				U[i] = palloc0(sizeof(**U) * nInS* ncols);
-				// for(j = 0; j < ncols; ++j){
-				// 	U[i][j] = palloc0(sizeof(***U) * ncols);
-				// }
-			}
-			P = palloc(sizeof(*P) * num_rf);
-			for (i = 0; i < num_rf; ++i){
-				P[i] = palloc0(sizeof(**P) * nInS* ncols);
-				// for(j = 0; j < ncols; ++j){
-				// 	P[i][j] = palloc0(sizeof(***P) * ncols);
-				// }
-			}
-			H = palloc(sizeof(*H) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				H[i] = palloc0(sizeof(**H) * ncols);
-			r = palloc(sizeof(*r) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				r[i] = palloc0(sizeof(**r) * ncols);
-			sum_w = palloc(sizeof(*sum_w) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				sum_w[i] = palloc0(sizeof(**sum_w) * ncols);
-			sum_e_cv2 = palloc(sizeof(*sum_e_cv2) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				sum_e_cv2[i] = palloc0(sizeof(**sum_e_cv2) * ncols);
-			n_data = palloc(sizeof(*n_data) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				n_data[i] = palloc0(sizeof(**n_data) * ncols);
-			lambda = palloc(sizeof(*lambda) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				lambda[i] = palloc0(sizeof(**lambda) * ncols);
-			mean_x = palloc(sizeof(*mean_x) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				mean_x[i] = palloc0(sizeof(**mean_x) * ncols);
-			var_x = palloc(sizeof(*var_x) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				var_x[i] = palloc0(sizeof(**var_x) * ncols);
-			s = palloc(sizeof(*s) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				s[i] = palloc0(sizeof(**s) * ncols);
-			slope = palloc(sizeof(*slope) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				slope[i] = palloc0(sizeof(**slope) * ncols);
-			/*初始化历史数据的矩阵和数量 */
-			history_data_matrix = palloc(sizeof(*history_data_matrix) * num_query_pattern);
-			for (i = 0; i < num_query_pattern; ++i)
-				history_data_matrix[i] = palloc0(sizeof(**history_data_matrix) * (1 + ncols*num_history_data_compute_probability_rf));
-			num_history_data = palloc0(sizeof(*num_history_data) * num_query_pattern);
-			//初始化误差矩阵
-			history_error_matrix = palloc(sizeof(*history_error_matrix) * num_rf);
-			for (i = 0; i < num_rf; ++i)
-				history_error_matrix[i] = palloc0(sizeof(**history_error_matrix) * num_pred_error_history);
-			num_history_error = palloc0(sizeof(*num_history_error) * num_rf);
-			//获取表中信息
-			deform_vector(values[4], nReg, &num_rf); 
-			deform_vector(values[5], trustworthy, &num_rf);
-			deform_vector(values[6], slopeReady, &num_rf);
-			deform_vector(values[7], sum_e2, &num_rf);
-			deform_vector(values[8], beta0, &num_rf);
-			deform_matrix(values[9], D);
-			deform_matrix(values[10], M);
-			deform_matrix(values[11], alpha);
-			deform_matrix(values[12], beta);
-			deform_matrix(values[13], c);
-			deform_matrix(values[14], SXresYres);
-			deform_matrix(values[15], SSs2);
-			deform_matrix(values[16], SSYres);
-			deform_matrix(values[17], SSXres);
-			deform_matrix(values[18], U);
-			deform_matrix(values[19], P);
-			deform_matrix(values[20], H);
-			deform_matrix(values[21], r);
-			deform_matrix(values[22], sum_w);
-			deform_matrix(values[23], sum_e_cv2);
-			deform_matrix(values[24], n_data);
-			deform_matrix(values[25], lambda);
-			deform_matrix(values[26], mean_x);
-			deform_matrix(values[27], var_x);
-			deform_matrix(values[28], s);
-			deform_matrix(values[29], slope);
-			deform_matrix(values[30], history_data_matrix);
-			deform_vector(values[31], num_history_data, &num_query_pattern_test);
-			deform_vector(values[32], ssp, &num_rf);
-			deform_matrix(values[33], history_error_matrix);
-			deform_vector(values[34], num_history_error, &num_rf);
+			rows = palloc(sizeof(*rows) * Max(num_rf, 1));
+			vec = palloc(sizeof(*vec) * Max(num_rf, 1));
+
 			//读取各个rf的信息
-			//model->numRFS = num_rf;
-			for(i=0;i<num_rf;i++){
-				dim = (int)nReg[i];
-				RF = lwpr_aux_add_rf(model,dim);
-                if (RF==NULL) return 0;
-				//将信息写入RF中
-				RF->nReg = dim;
-				RF->trustworthy = (int)trustworthy[i];
-				RF->slopeReady = (int)slopeReady[i];
-				RF->sum_e2 = sum_e2[i];
-				RF->beta0 = beta0[i];
-				RF->SSp = ssp[i];
-				memcpy(RF->D, D[i], nInS*ncols*sizeof(double));
-				memcpy(RF->M, M[i], nInS*ncols*sizeof(double));
-				memcpy(RF->alpha, alpha[i], nInS*ncols*sizeof(double));
-				memcpy(RF->beta, beta[i], ncols*sizeof(double));
-				memcpy(RF->c, c[i], ncols*sizeof(double));
-				memcpy(RF->SXresYres, SXresYres[i], nInS*ncols*sizeof(double));
-				memcpy(RF->SSs2, SSs2[i], ncols*sizeof(double));
-				memcpy(RF->SSYres, SSYres[i], ncols*sizeof(double));
-				memcpy(RF->SSXres, SSXres[i], nInS*ncols*sizeof(double));
-				memcpy(RF->U, U[i], nInS*ncols*sizeof(double));
-				memcpy(RF->P, P[i], nInS*ncols*sizeof(double));
-				memcpy(RF->H, H[i], ncols*sizeof(double));
-				memcpy(RF->r, r[i], ncols*sizeof(double));
-				memcpy(RF->sum_w, sum_w[i], ncols*sizeof(double));
-				memcpy(RF->sum_e_cv2, sum_e_cv2[i], ncols*sizeof(double));
-				memcpy(RF->n_data, n_data[i], ncols*sizeof(double));
-				memcpy(RF->lambda, lambda[i], ncols*sizeof(double));
-				memcpy(RF->mean_x, mean_x[i], ncols*sizeof(double));
-				memcpy(RF->var_x, var_x[i], ncols*sizeof(double));
-				memcpy(RF->s, s[i], ncols*sizeof(double));
-				memcpy(RF->slope, slope[i], ncols*sizeof(double));
-				memcpy(RF->pred_error_history, history_error_matrix[i], num_pred_error_history*sizeof(double));
-				RF->pred_error_num = num_history_error[i];
+			deform_vector(values[4], vec, &num_rf);
+			for (i = 0; i < num_rf; i++)
+			{
+				RF = lwpr_aux_add_rf(model, (int) vec[i]);
+				RF->nReg = (int) vec[i];
 			}
+			deform_vector(values[5], vec, &num_rf);
+			for (i = 0; i < num_rf; i++)
+				model->rf[i]->trustworthy = (int) vec[i];
+			deform_vector(values[6], vec, &num_rf);
+			for (i = 0; i < num_rf; i++)
+				model->rf[i]->slopeReady = (int) vec[i];
+			deform_vector(values[7], vec, &num_rf);
+			for (i = 0; i < num_rf; i++)
+				model->rf[i]->sum_e2 = vec[i];
+			deform_vector(values[8], vec, &num_rf);
+			for (i = 0; i < num_rf; i++)
+				model->rf[i]->beta0 = vec[i];
+			deform_vector(values[32], vec, &num_rf);
+			for (i = 0; i < num_rf; i++)
+				model->rf[i]->SSp = vec[i];
+			deform_vector(values[34], vec, &num_rf);
+			for (i = 0; i < num_rf; i++)
+				model->rf[i]->pred_error_num = vec[i];
+
+			deform_rf_matrix(values[9], model, offsetof(LWPR_ReceptiveField, D), rows);
+			deform_rf_matrix(values[10], model, offsetof(LWPR_ReceptiveField, M), rows);
+			deform_rf_matrix(values[11], model, offsetof(LWPR_ReceptiveField, alpha), rows);
+			deform_rf_matrix(values[12], model, offsetof(LWPR_ReceptiveField, beta), rows);
+			deform_rf_matrix(values[13], model, offsetof(LWPR_ReceptiveField, c), rows);
+			deform_rf_matrix(values[14], model, offsetof(LWPR_ReceptiveField, SXresYres), rows);
+			deform_rf_matrix(values[15], model, offsetof(LWPR_ReceptiveField, SSs2), rows);
+			deform_rf_matrix(values[16], model, offsetof(LWPR_ReceptiveField, SSYres), rows);
+			deform_rf_matrix(values[17], model, offsetof(LWPR_ReceptiveField, SSXres), rows);
+			deform_rf_matrix(values[18], model, offsetof(LWPR_ReceptiveField, U), rows);
+			deform_rf_matrix(values[19], model, offsetof(LWPR_ReceptiveField, P), rows);
+			deform_rf_matrix(values[20], model, offsetof(LWPR_ReceptiveField, H), rows);
+			deform_rf_matrix(values[21], model, offsetof(LWPR_ReceptiveField, r), rows);
+			deform_rf_matrix(values[22], model, offsetof(LWPR_ReceptiveField, sum_w), rows);
+			deform_rf_matrix(values[23], model, offsetof(LWPR_ReceptiveField, sum_e_cv2), rows);
+			deform_rf_matrix(values[24], model, offsetof(LWPR_ReceptiveField, n_data), rows);
+			deform_rf_matrix(values[25], model, offsetof(LWPR_ReceptiveField, lambda), rows);
+			deform_rf_matrix(values[26], model, offsetof(LWPR_ReceptiveField, mean_x), rows);
+			deform_rf_matrix(values[27], model, offsetof(LWPR_ReceptiveField, var_x), rows);
+			deform_rf_matrix(values[28], model, offsetof(LWPR_ReceptiveField, s), rows);
+			deform_rf_matrix(values[29], model, offsetof(LWPR_ReceptiveField, slope), rows);
+			deform_rf_matrix(values[33], model, offsetof(LWPR_ReceptiveField, pred_error_history), rows);
+
+			/* the history of queries goes right into the model too */
+			deform_history(values[30], values[31], model);
+			model->staleness = isnull[36] ? 0 : DatumGetFloat8(values[36]);
 			//把当前hash值保存到model中
 			model->fss_hash = fss_hash;
-			memcpy(model->num_history_data, num_history_data, num_query_pattern*sizeof(double));
-			//also save the history data
-			for (i=0; i< num_query_pattern; i++){
-				memcpy(model->history_data_matrix[i], history_data_matrix[i], (1 + ncols*num_history_data_compute_probability_rf)*sizeof(double));
-			}
-		   //释放内存
-			pfree(nReg);
-			pfree(trustworthy);
-			pfree(slopeReady);
-			pfree(sum_e2);
-			pfree(beta0);
-			pfree(ssp);
-            //cubic
-			for (i = 0; i < num_rf; ++i){
-				// for(j = 0; j < ncols; ++j){
-				// 	pfree(D[i][j]);
-				// }
-				pfree(D[i]);
-			}
-			pfree(D);
-			for (i = 0; i < num_rf; ++i){
-				// for(j = 0; j < ncols; ++j){
-				// 	pfree(M[i][j]);
-				// }
-				pfree(M[i]);
-			}
-			pfree(M);
-			for (i = 0; i < num_rf; ++i){
-				// for(j = 0; j < ncols; ++j){
-				// 	pfree(alpha[i][j]);
-				// }
-				pfree(alpha[i]);
-			}
-			pfree(alpha);
-			for (i = 0; i < num_rf; ++i)
-				pfree(beta[i]);
-		    pfree(beta);
-			//matric
-			for (i = 0; i < num_rf; ++i)
-				pfree(c[i]);
-		    pfree(c);
-			for (i = 0; i < num_rf; ++i){
-				// for(j = 0; j < ncols; ++j){
-				// 	pfree(SXresYres[i][j]);
-				// }
-				pfree(SXresYres[i]);
-			}
-			pfree(SXresYres);
-			for (i = 0; i < num_rf; ++i)
-				pfree(SSs2[i]);
-		    pfree(SSs2);
-			for (i = 0; i < num_rf; ++i)
-				pfree(SSYres[i]);
-		    pfree(SSYres);
-	        for (i = 0; i < num_rf; ++i){
-				// for(j = 0; j < ncols; ++j){
-				// 	pfree(SSXres[i][j]);
-				// }
-				pfree(SSXres[i]);
-			}
-			pfree(SSXres);
-			for (i = 0; i < num_rf; ++i){
-				// for(j = 0; j < ncols; ++j){
-				// 	pfree(U[i][j]);
-				// }
-				pfree(U[i]);
-			}
-			pfree(U);
-			for (i = 0; i < num_rf; ++i){
-				// for(j = 0; j < ncols; ++j){
-				// 	pfree(P[i][j]);
-				// }
-				pfree(P[i]);
-			}
-			pfree(P);
-			for (i = 0; i < num_rf; ++i)
-				pfree(H[i]);
-		    pfree(H);
-			for (i = 0; i < num_rf; ++i)
-				pfree(r[i]);
-		    pfree(r);
-			for (i = 0; i < num_rf; ++i)
-				pfree(sum_w[i]);
-		    pfree(sum_w);
-			for (i = 0; i < num_rf; ++i)
-				pfree(sum_e_cv2[i]);
-		    pfree(sum_e_cv2);
-			for (i = 0; i < num_rf; ++i)
-				pfree(n_data[i]);
-		    pfree(n_data);
-			for (i = 0; i < num_rf; ++i)
-				pfree(lambda[i]);
-		    pfree(lambda);
-			for (i = 0; i < num_rf; ++i)
-				pfree(mean_x[i]);
-		    pfree(mean_x);
-			for (i = 0; i < num_rf; ++i)
-				pfree(var_x[i]);
-		    pfree(var_x);
-			for (i = 0; i < num_rf; ++i)
-				pfree(s[i]);
-		    pfree(s);
-			for (i = 0; i < num_rf; ++i)
-				pfree(slope[i]);
-		    pfree(slope);
-			for (i = 0; i < num_query_pattern; ++i)
-				pfree(history_data_matrix[i]);
-		    pfree(history_data_matrix);
-			pfree(num_history_data);
-			for (i = 0; i < num_rf; ++i)
-				pfree(history_error_matrix[i]);
-		    pfree(history_error_matrix);
-			pfree(num_history_error);
+
+			pfree(rows);
+			pfree(vec);
 		}
 		else
 		{
@@ -1316,6 +1169,7 @@ load_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model){
 	index_close(data_index_rel, lockmode);
 	heap_close(aqo_data_heap, lockmode);
 
+	aqo_stat_end(&stat_timer, AQO_STAT_LOAD_FSS_RFWR, fss_hash);
 	return success;
 }
 /*
@@ -1346,6 +1200,7 @@ update_fss(int fss_hash, int nrows, int ncols,
 
 	LOCKMODE	lockmode = RowExclusiveLock;
 
+	bool		updated = true;
 	Datum		values[5];
 	bool		isnull[5] = { false, false, false, false, false };
 	bool		replace[5] = { false, false, false, true, true };
@@ -1422,12 +1277,10 @@ update_fss(int fss_hash, int nrows, int ncols,
 		else
 		{
 			/*
-			 * Ooops, somebody concurrently updated the tuple. We have to
-			 * merge our changes somehow, but now we just discard ours. We
-			 * don't believe in high probability of simultaneously finishing
-			 * of two long, complex, and important queries, so we don't loss
-			 * important data.
+			 * Ooops, somebody concurrently updated the tuple. The caller
+			 * merges our changes into the new version of the model.
 			 */
+			updated = false;
 		}
 	}
 
@@ -1438,7 +1291,7 @@ update_fss(int fss_hash, int nrows, int ncols,
 
 	CommandCounterIncrement();
 
-	return true;
+	return updated;
 }
 /* updata rf's datahouse */
 bool
@@ -1509,6 +1362,7 @@ update_rf_datahouse(int fss_hash, int rf_hash, int ncols, int nrows, double **ma
 		values[2] = Int32GetDatum(rf_hash);
 		values[3] = PointerGetDatum(form_matrix(matrix, nrows, ncols));
 		values[4] = PointerGetDatum(form_vector(targets, nrows));
+		fit_float_arrays(tuple_desc, values, isnull, NULL);
 		tuple = heap_form_tuple(tuple_desc, values, isnull);
 		PG_TRY();
 		{
@@ -1529,6 +1383,7 @@ update_rf_datahouse(int fss_hash, int rf_hash, int ncols, int nrows, double **ma
 		heap_deform_tuple(tuple, aqo_data_heap->rd_att, values, isnull);
 		values[3] = PointerGetDatum(form_matrix(matrix, nrows, ncols));
 		values[4] = PointerGetDatum(form_vector(targets, nrows));
+		fit_float_arrays(tuple_desc, values, isnull, replace);
 		nw_tuple = heap_modify_tuple(tuple, tuple_desc,
 									 values, isnull, replace);
 		if (my_simple_heap_update(aqo_data_heap, &(nw_tuple->t_self), nw_tuple))
@@ -1666,11 +1521,121 @@ update_best_two_costs(int query_pattern, int ncols, int nrows, double **matrix,
 
 	return true;
 }
+/*
+ * Updates the latency model of given executor node type.
+ * Returns false if the operation failed, true otherwise.
+ */
+bool
+update_latency_model(int node_type, int nrows, int ncols,
+					 double **matrix, double *targets)
+{
+	RangeVar   *aqo_data_table_rv;
+	Relation	aqo_data_heap;
+	TupleDesc	tuple_desc;
+	HeapTuple	tuple,
+				nw_tuple;
+
+	Relation	data_index_rel;
+	Oid			data_index_rel_oid;
+	IndexScanDesc data_index_scan;
+	ScanKeyData	key[1];
+
+	LOCKMODE	lockmode = RowExclusiveLock;
+
+	Datum		values[4];
+	bool		isnull[4] = { false, false, false, false };
+	bool		replace[4] = { false, true, true, true };
+
+	data_index_rel_oid = RelnameGetRelid("aqo_node_latency_idx");
+	if (!OidIsValid(data_index_rel_oid))
+	{
+		disable_aqo_for_query();
+		return false;
+	}
+
+	aqo_data_table_rv = makeRangeVar("public", "aqo_node_latency", -1);
+	aqo_data_heap = heap_openrv(aqo_data_table_rv, lockmode);
+
+	tuple_desc = RelationGetDescr(aqo_data_heap);
+
+	data_index_rel = index_open(data_index_rel_oid, lockmode);
+	data_index_scan = index_beginscan(aqo_data_heap,
+									  data_index_rel,
+									  SnapshotSelf,
+									  1,
+									  0);
+
+	ScanKeyInit(&key[0],
+				1,
+				BTEqualStrategyNumber,
+				F_INT4EQ,
+				Int32GetDatum(node_type));
+
+	index_rescan(data_index_scan, key, 1, NULL, 0);
+
+	tuple = index_getnext(data_index_scan, ForwardScanDirection);
+
+	if (!tuple)
+	{
+		values[0] = Int32GetDatum(node_type);
+		values[1] = Int32GetDatum(ncols);
+		values[2] = PointerGetDatum(form_matrix(matrix, nrows, ncols));
+		values[3] = PointerGetDatum(form_vector(targets, nrows));
+
+		tuple = heap_form_tuple(tuple_desc, values, isnull);
+		PG_TRY();
+		{
+			simple_heap_insert(aqo_data_heap, tuple);
+			my_index_insert(data_index_rel, values, isnull, &(tuple->t_self),
+							aqo_data_heap, UNIQUE_CHECK_YES);
+		}
+		PG_CATCH();
+		{
+			CommandCounterIncrement();
+			simple_heap_delete(aqo_data_heap, &(tuple->t_self));
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+	}
+	else
+	{
+		heap_deform_tuple(tuple, aqo_data_heap->rd_att, values, isnull);
+		values[1] = Int32GetDatum(ncols);
+		values[2] = PointerGetDatum(form_matrix(matrix, nrows, ncols));
+		values[3] = PointerGetDatum(form_vector(targets, nrows));
+
+		nw_tuple = heap_modify_tuple(tuple, tuple_desc,
+									 values, isnull, replace);
+		if (my_simple_heap_update(aqo_data_heap, &(nw_tuple->t_self), nw_tuple))
+		{
+			my_index_insert(data_index_rel, values, isnull, &(nw_tuple->t_self),
+							aqo_data_heap, UNIQUE_CHECK_YES);
+		}
+		else
+		{
+			/*
+			 * Somebody concurrently updated the model. We discard our
+			 * changes.
+			 */
+		}
+	}
+
+	index_endscan(data_index_scan);
+
+	index_close(data_index_rel, lockmode);
+	heap_close(aqo_data_heap, lockmode);
+
+	CommandCounterIncrement();
+
+	return true;
+}
 /*
  * 更新rfwr
+ * If busy is not NULL, the update does not wait for a concurrent transaction
+ * which updates the model: it fails and sets *busy instead.
  */
 bool
-update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model)
+update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model, bool *busy)
 {
 	RangeVar   *aqo_data_table_rv;
 	Relation	aqo_data_heap;
@@ -1683,21 +1648,24 @@ update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model)
 	IndexScanDesc data_index_scan;
 	ScanKeyData	key[2];
 	LOCKMODE	lockmode = RowExclusiveLock;
-	Datum		values[35];
-	bool		isnull[35] = {false, false, false, false, false, 
+	bool		updated = true;
+	Datum		values[37];
+	bool		isnull[37] = {false, false, false, false, false, 
 							  false, false, false, false, false,
 							  false, false, false, false, false,
 							  false, false, false, false, false,
 							  false, false, false, false, false, 
 							  false, false, false, false, false,
-							  false, false, false, false, false};
-	bool		replace[35] = {false, false, false, true, true, 
+							  false, false, false, false, false,
+							  false, false};
+	bool		replace[37] = {false, false, false, true, true, 
 							  true, true, true, true, true,
 							  true, true, true, true, true,
 							  true, true, true, true, true,
 							  true, true, true, true, true, 
 							  true, true, true, true, true,
-							  true, true, true, true, true};
+							  true, true, true, true, true,
+							  true, true};
 	//定义输入的RF变量
 	double *nReg;
 	double *trustworthy;
@@ -1726,8 +1694,6 @@ update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model)
 	double **var_x;
 	double **s;
 	double **slope;
-	double **history_data_matrix;
-	double *num_history_data;
 	/*add by jim in 2021.1.22*/
 	double **history_error_matrix;
 	double *num_history_error = 0;
@@ -1837,11 +1803,6 @@ update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model)
 	slope = palloc(sizeof(*slope) * num_rf);
 	for (i = 0; i < num_rf; ++i)
 		slope[i] = palloc0(sizeof(**slope) * ncols);
-	//初始化history_data
-	history_data_matrix = palloc(sizeof(*history_data_matrix) * num_query_pattern);
-	for (i = 0; i < num_query_pattern; ++i)
-		history_data_matrix[i] = palloc0(sizeof(**history_data_matrix) * (1 + ncols*num_history_data_compute_probability_rf));
-	num_history_data = palloc0(sizeof(*num_history_data) * num_query_pattern);
 	//初始化误差矩阵
 	history_error_matrix = palloc(sizeof(*history_error_matrix) * num_rf);
 	for (i = 0; i < num_rf; ++i)
@@ -1882,11 +1843,6 @@ update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model)
 		memcpy(history_error_matrix[i], RF->pred_error_history, num_pred_error_history*sizeof(double));
         num_history_error[i] = RF->pred_error_num;
 	}
-	memcpy(num_history_data, model->num_history_data, num_query_pattern*sizeof(double));
-	//将历史数据也写入到数据库
-	for (i=0; i< num_query_pattern; i++){
-		memcpy(history_data_matrix[i], model->history_data_matrix[i], (1 + ncols*num_history_data_compute_probability_rf)*sizeof(double));
-	}
 	data_index_rel_oid = RelnameGetRelid("aqo_fss_lwpr_access_idx");
 	if (!OidIsValid(data_index_rel_oid))
 	{
@@ -1963,11 +1919,14 @@ update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model)
 		values[27] = PointerGetDatum(form_matrix(var_x, num_rf, ncols));
 		values[28] = PointerGetDatum(form_matrix(s, num_rf, ncols));
 		values[29] = PointerGetDatum(form_matrix(slope, num_rf, ncols));
-		values[30] = PointerGetDatum(form_matrix(history_data_matrix, num_query_pattern, 1 + ncols*num_history_data_compute_probability_rf));
-		values[31] = PointerGetDatum(form_vector(num_history_data, num_query_pattern));
+		//将历史数据也写入到数据库
+		form_history(model, &values[30], &values[31]);
 		values[32] = PointerGetDatum(form_vector(ssp, num_rf)); /*new add for calculating confidence bound */
 		values[33] = PointerGetDatum(form_matrix(history_error_matrix, num_rf, num_pred_error_history));
 		values[34] = PointerGetDatum(form_vector(num_history_error, num_rf));
+		values[35] = TimestampTzGetDatum(GetCurrentTimestamp());
+		values[36] = Float8GetDatum(model->staleness);
+		fit_float_arrays(tuple_desc, values, isnull, NULL);
 		tuple = heap_form_tuple(tuple_desc, values, isnull);
 		PG_TRY();
 		{
@@ -2020,14 +1979,24 @@ update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model)
 		values[27] = PointerGetDatum(form_matrix(var_x, num_rf, ncols));
 		values[28] = PointerGetDatum(form_matrix(s, num_rf, ncols));
 		values[29] = PointerGetDatum(form_matrix(slope, num_rf, ncols));
-		values[30] = PointerGetDatum(form_matrix(history_data_matrix, num_query_pattern, 1 + ncols*num_history_data_compute_probability_rf));
-		values[31] = PointerGetDatum(form_vector(num_history_data, num_query_pattern));
+		//将历史数据也写入到数据库
+		form_history(model, &values[30], &values[31]);
 		values[32] = PointerGetDatum(form_vector(ssp, num_rf)); /*new add for calculating confidence bound */
 		values[33] = PointerGetDatum(form_matrix(history_error_matrix, num_rf, num_pred_error_history));
 		values[34] = PointerGetDatum(form_vector(num_history_error, num_rf));
+		/* aqo_vacuum rewrites the model, but does not use it */
+		if (!aqo_vacuum_in_progress)
+		{
+			values[35] = TimestampTzGetDatum(GetCurrentTimestamp());
+			isnull[35] = false;
+		}
+		values[36] = Float8GetDatum(model->staleness);
+		isnull[36] = false;
+		fit_float_arrays(tuple_desc, values, isnull, replace);
 		nw_tuple = heap_modify_tuple(tuple, tuple_desc,
 									 values, isnull, replace);
-		if (my_simple_heap_update(aqo_data_heap, &(nw_tuple->t_self), nw_tuple))
+		if (my_heap_update(aqo_data_heap, &(nw_tuple->t_self), nw_tuple,
+						   busy))
 		{
 			my_index_insert(data_index_rel, values, isnull, &(nw_tuple->t_self),
 							aqo_data_heap, UNIQUE_CHECK_NO);
@@ -2035,12 +2004,10 @@ update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model)
 		else
 		{
 			/*
-			 * Ooops, somebody concurrently updated the tuple. We have to
-			 * merge our changes somehow, but now we just discard ours. We
-			 * don't believe in high probability of simultaneously finishing
-			 * of two long, complex, and important queries, so we don't loss
-			 * important data.
+			 * Ooops, somebody concurrently updated the tuple. The caller
+			 * merges our changes into the new version of the model.
 			 */
+			updated = false;
 		}
 	}
     //释放内存
@@ -2144,11 +2111,6 @@ update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model)
 		pfree(slope[i]);
 	pfree(slope);
 
-	for (i = 0; i < num_query_pattern; ++i)
-		pfree(history_data_matrix[i]);
-	pfree(history_data_matrix);
-	pfree(num_history_data);
-
 	for (i = 0; i < num_rf; ++i)
 		pfree(history_error_matrix[i]);
 	pfree(history_error_matrix);
@@ -2161,10 +2123,29 @@ update_fss_rfwr(int fss_hash, int ncols, LWPR_Model *model)
 
 	CommandCounterIncrement();
 
-	return true;
+	return updated;
 }
+
+/* Writes back the history of queries of the model */
 bool
 update_fss_rfwr2(int fss_hash, int ncols, LWPR_Model *model)
+{
+	Datum		history_data_matrix;
+	Datum		num_history_data;
+
+	form_history(model, &history_data_matrix, &num_history_data);
+	return update_fss_history(query_context.fspace_hash, fss_hash,
+							  history_data_matrix, num_history_data);
+}
+
+/*
+ * Updates only the history of queries (history_data_matrix and
+ * num_history_data) of the given LWPR model. Used to write back the history
+ * collected by predictions at planning time.
+ */
+bool
+update_fss_history(int fspace_hash, int fss_hash,
+				   Datum history_data_matrix, Datum num_history_data)
 {
 	RangeVar   *aqo_data_table_rv;
 	Relation	aqo_data_heap;
@@ -2177,42 +2158,24 @@ update_fss_rfwr2(int fss_hash, int ncols, LWPR_Model *model)
 	IndexScanDesc data_index_scan;
 	ScanKeyData	key[2];
 	LOCKMODE	lockmode = RowExclusiveLock;
-	Datum		values[35];
-	bool		isnull[35] = {false, false, false, false, false, 
-							  false, false, false, false, false,
-							  false, false, false, false, false,
-							  false, false, false, false, false,
-							  false, false, false, false, false, 
-							  false, false, false, false, false,
-							  false, false, false, false, false};
-	bool		replace[35] = {false, false, false, true, true, 
-							  true, true, true, true, true,
-							  true, true, true, true, true,
-							  true, true, true, true, true,
-							  true, true, true, true, true, 
-							  true, true, true, true, true,
-							  true, true, true, true, true};
-	
-	/*add by jim in 2021.2.26*/
-	double **history_data_matrix;
-	double *num_history_data;
-    int i;
-	//初始化history_data
-	history_data_matrix = palloc(sizeof(*history_data_matrix) * num_query_pattern);
-	for (i = 0; i < num_query_pattern; ++i)
-		history_data_matrix[i] = palloc0(sizeof(**history_data_matrix) * (1 + ncols*num_history_data_compute_probability_rf));
-	num_history_data = palloc0(sizeof(*num_history_data) * num_query_pattern);
-	//复制
-	memcpy(num_history_data, model->num_history_data, num_query_pattern*sizeof(double));
-	//将历史数据也写入到数据库
-	for (i=0; i< num_query_pattern; i++){
-		memcpy(history_data_matrix[i], model->history_data_matrix[i], (1 + ncols*num_history_data_compute_probability_rf)*sizeof(double));
-	}
-	//写入
-	data_index_rel_oid = RelnameGetRelid("aqo_fss_lwpr_access_idx");
+	Datum		values[37];
+	bool		isnull[37];
+	bool		replace[37];
+	bool		success = true;
+	bool		busy;
+	AqoStatTimer stat_timer;
+
+	MemSet(replace, false, sizeof(replace));
+	replace[30] = true;
+	replace[31] = true;
+	replace[35] = true;
+
+	aqo_stat_begin(&stat_timer);
+	data_index_rel_oid = RelnameGetRelid("aqo_fss_lwpr_access_idx");
 	if (!OidIsValid(data_index_rel_oid))
 	{
 		disable_aqo_for_query();
+		aqo_stat_end(&stat_timer, AQO_STAT_UPDATE_FSS_HISTORY, fss_hash);
 		return false;
 	}
 
@@ -2232,7 +2195,7 @@ update_fss_rfwr2(int fss_hash, int ncols, LWPR_Model *model)
 				1,
 				BTEqualStrategyNumber,
 				F_INT4EQ,
-				Int32GetDatum(query_context.fspace_hash));
+				Int32GetDatum(fspace_hash));
 
 	ScanKeyInit(&key[1],
 				2,
@@ -2246,17 +2209,22 @@ update_fss_rfwr2(int fss_hash, int ncols, LWPR_Model *model)
 
 	if (!tuple)
 	{
-		//三个不能修改的
-		return false;
+		/* The model itself is created by learning only */
+		success = false;
 	}
 	else
 	{
 		heap_deform_tuple(tuple, aqo_data_heap->rd_att, values, isnull);
-		values[30] = PointerGetDatum(form_matrix(history_data_matrix, num_query_pattern, 1 + ncols*num_history_data_compute_probability_rf));
-		values[31] = PointerGetDatum(form_vector(num_history_data, num_query_pattern));
+		values[30] = history_data_matrix;
+		values[31] = num_history_data;
+		values[35] = TimestampTzGetDatum(GetCurrentTimestamp());
+		isnull[30] = false;
+		isnull[31] = false;
+		isnull[35] = false;
+		fit_float_arrays(tuple_desc, values, isnull, replace);
 		nw_tuple = heap_modify_tuple(tuple, tuple_desc,
 									 values, isnull, replace);
-		if (my_simple_heap_update(aqo_data_heap, &(nw_tuple->t_self), nw_tuple))
+		if (my_heap_update(aqo_data_heap, &(nw_tuple->t_self), nw_tuple, &busy))
 		{
 			my_index_insert(data_index_rel, values, isnull, &(nw_tuple->t_self),
 							aqo_data_heap, UNIQUE_CHECK_NO);
@@ -2268,16 +2236,11 @@ update_fss_rfwr2(int fss_hash, int ncols, LWPR_Model *model)
 			 * merge our changes somehow, but now we just discard ours. We
 			 * don't believe in high probability of simultaneously finishing
 			 * of two long, complex, and important queries, so we don't loss
-			 * important data.
+			 * important data. For the same reason we do not wait for a
+			 * concurrent writer of the model.
 			 */
 		}
 	}
-    //释放内存
-
-	for (i = 0; i < num_query_pattern; ++i)
-		pfree(history_data_matrix[i]);
-	pfree(history_data_matrix);
-	pfree(num_history_data);
 
 	index_endscan(data_index_scan);
 
@@ -2286,8 +2249,421 @@ update_fss_rfwr2(int fss_hash, int ncols, LWPR_Model *model)
 
 	CommandCounterIncrement();
 
+	aqo_stat_end(&stat_timer, AQO_STAT_UPDATE_FSS_HISTORY, fss_hash);
+	return success;
+}
+
+/*
+ * Remembers the relations the feature subspace is built on together with
+ * their current number of tuples, so that the model can be marked stale when
+ * the relations change. Relations which are already remembered are skipped.
+ */
+bool
+register_fss_relations(int fspace_hash, int fss_hash, List *relids)
+{
+	RangeVar   *rv;
+	Relation	heap;
+	Relation	access_index_rel;
+	Relation	relid_index_rel;
+	Oid			access_index_rel_oid;
+	Oid			relid_index_rel_oid;
+	IndexScanDesc index_scan;
+	ScanKeyData	key[3];
+	LOCKMODE	lockmode = RowExclusiveLock;
+	HeapTuple	tuple;
+	Datum		values[4];
+	bool		isnull[4] = {false, false, false, false};
+	ListCell   *l;
+
+	access_index_rel_oid = RelnameGetRelid("aqo_fss_relations_access_idx");
+	relid_index_rel_oid = RelnameGetRelid("aqo_fss_relations_relid_idx");
+	if (!OidIsValid(access_index_rel_oid) || !OidIsValid(relid_index_rel_oid))
+	{
+		disable_aqo_for_query();
+		return false;
+	}
+
+	rv = makeRangeVar("public", "aqo_fss_relations", -1);
+	heap = heap_openrv(rv, lockmode);
+	access_index_rel = index_open(access_index_rel_oid, lockmode);
+	relid_index_rel = index_open(relid_index_rel_oid, lockmode);
+
+	foreach(l, relids)
+	{
+		Oid			relid = (Oid) lfirst_int(l);
+		double		reltuples;
+		bool		found;
+
+		if (!OidIsValid(relid) || !get_relation_reltuples(relid, &reltuples))
+			continue;
+
+		index_scan = index_beginscan(heap, access_index_rel, SnapshotSelf, 3, 0);
+		ScanKeyInit(&key[0], 1, BTEqualStrategyNumber, F_INT4EQ,
+					Int32GetDatum(fspace_hash));
+		ScanKeyInit(&key[1], 2, BTEqualStrategyNumber, F_INT4EQ,
+					Int32GetDatum(fss_hash));
+		ScanKeyInit(&key[2], 3, BTEqualStrategyNumber, F_OIDEQ,
+					ObjectIdGetDatum(relid));
+		index_rescan(index_scan, key, 3, NULL, 0);
+		found = (index_getnext(index_scan, ForwardScanDirection) != NULL);
+		index_endscan(index_scan);
+
+		if (found)
+			continue;
+
+		values[0] = Int32GetDatum(fspace_hash);
+		values[1] = Int32GetDatum(fss_hash);
+		values[2] = ObjectIdGetDatum(relid);
+		values[3] = Float4GetDatum((float4) reltuples);
+		tuple = heap_form_tuple(RelationGetDescr(heap), values, isnull);
+		simple_heap_insert(heap, tuple);
+		my_index_insert(access_index_rel, values, isnull, &(tuple->t_self),
+						heap, UNIQUE_CHECK_NO);
+		my_index_insert(relid_index_rel, &values[2], &isnull[2],
+						&(tuple->t_self), heap, UNIQUE_CHECK_NO);
+		heap_freetuple(tuple);
+	}
+
+	index_close(relid_index_rel, lockmode);
+	index_close(access_index_rel, lockmode);
+	heap_close(heap, lockmode);
+
+	CommandCounterIncrement();
+
 	return true;
 }
+
+/*
+ * Sets the staleness of the model of the feature subspace. Returns false if
+ * there is no model or it was concurrently updated; *concurrent tells the
+ * latter case.
+ */
+static bool
+set_fss_staleness(int fspace_hash, int fss_hash, double staleness,
+				  bool *concurrent)
+{
+	RangeVar   *aqo_data_table_rv;
+	Relation	aqo_data_heap;
+	HeapTuple	tuple,
+				nw_tuple;
+	Relation	data_index_rel;
+	Oid			data_index_rel_oid;
+	IndexScanDesc data_index_scan;
+	ScanKeyData	key[2];
+	LOCKMODE	lockmode = RowExclusiveLock;
+	Datum		values[37];
+	bool		isnull[37];
+	bool		replace[37];
+	bool		success = false;
+
+	*concurrent = false;
+	data_index_rel_oid = RelnameGetRelid("aqo_fss_lwpr_access_idx");
+	if (!OidIsValid(data_index_rel_oid))
+		return false;
+
+	MemSet(replace, false, sizeof(replace));
+	MemSet(isnull, false, sizeof(isnull));
+	replace[36] = true;
+	values[36] = Float8GetDatum(staleness);
+
+	aqo_data_table_rv = makeRangeVar("public", "aqo_data_lwpr", -1);
+	aqo_data_heap = heap_openrv(aqo_data_table_rv, lockmode);
+	data_index_rel = index_open(data_index_rel_oid, lockmode);
+	data_index_scan = index_beginscan(aqo_data_heap, data_index_rel,
+									  SnapshotSelf, 2, 0);
+	ScanKeyInit(&key[0], 1, BTEqualStrategyNumber, F_INT4EQ,
+				Int32GetDatum(fspace_hash));
+	ScanKeyInit(&key[1], 2, BTEqualStrategyNumber, F_INT4EQ,
+				Int32GetDatum(fss_hash));
+	index_rescan(data_index_scan, key, 2, NULL, 0);
+
+	tuple = index_getnext(data_index_scan, ForwardScanDirection);
+	if (tuple)
+	{
+		nw_tuple = heap_modify_tuple(tuple, RelationGetDescr(aqo_data_heap),
+									 values, isnull, replace);
+		success = my_simple_heap_update(aqo_data_heap, &(nw_tuple->t_self),
+										nw_tuple);
+		*concurrent = !success;
+		if (success && !HeapTupleIsHeapOnly(nw_tuple))
+		{
+			heap_deform_tuple(nw_tuple, RelationGetDescr(aqo_data_heap),
+							  values, isnull);
+			my_index_insert(data_index_rel, values, isnull,
+							&(nw_tuple->t_self), aqo_data_heap,
+							UNIQUE_CHECK_NO);
+		}
+	}
+
+	index_endscan(data_index_scan);
+	index_close(data_index_rel, lockmode);
+	heap_close(aqo_data_heap, lockmode);
+
+	return success;
+}
+
+/*
+ * Loads the model selection statistics of the feature subspace of the current
+ * feature space. Returns false if there are none.
+ */
+bool
+load_fss_model_stats(int fss_hash, FssModelStats *stats)
+{
+	RangeVar   *rv;
+	Relation	heap;
+	Relation	index_rel;
+	Oid			index_rel_oid;
+	IndexScanDesc index_scan;
+	ScanKeyData	key[2];
+	LOCKMODE	lockmode = AccessShareLock;
+	HeapTuple	tuple;
+	Datum		values[7];
+	bool		isnull[7];
+	bool		success = false;
+
+	index_rel_oid = RelnameGetRelid("aqo_fss_models_access_idx");
+	if (!OidIsValid(index_rel_oid))
+	{
+		disable_aqo_for_query();
+		return false;
+	}
+
+	rv = makeRangeVar("public", "aqo_fss_models", -1);
+	heap = heap_openrv(rv, lockmode);
+	index_rel = index_open(index_rel_oid, lockmode);
+	index_scan = index_beginscan(heap, index_rel, SnapshotSelf, 2, 0);
+	ScanKeyInit(&key[0], 1, BTEqualStrategyNumber, F_INT4EQ,
+				Int32GetDatum(query_context.fspace_hash));
+	ScanKeyInit(&key[1], 2, BTEqualStrategyNumber, F_INT4EQ,
+				Int32GetDatum(fss_hash));
+	index_rescan(index_scan, key, 2, NULL, 0);
+
+	tuple = index_getnext(index_scan, ForwardScanDirection);
+	if (tuple)
+	{
+		ArrayType  *errors;
+		ArrayType  *latencies;
+
+		heap_deform_tuple(tuple, RelationGetDescr(heap), values, isnull);
+		errors = DatumGetArrayTypeP(values[5]);
+		latencies = DatumGetArrayTypeP(values[6]);
+		/* statistics of another set of models are useless */
+		if (DatumGetInt32(values[2]) >= 0 &&
+			DatumGetInt32(values[2]) < AQO_NUM_MODELS &&
+			ArrayGetNItems(ARR_NDIM(errors), ARR_DIMS(errors)) == AQO_NUM_MODELS &&
+			ArrayGetNItems(ARR_NDIM(latencies), ARR_DIMS(latencies)) == AQO_NUM_MODELS)
+		{
+			int			nelems;
+
+			stats->model = (AqoModelKind) DatumGetInt32(values[2]);
+			stats->nsamples = DatumGetInt32(values[3]);
+			stats->mean_target = DatumGetFloat8(values[4]);
+			deform_vector(PointerGetDatum(errors), stats->errors, &nelems);
+			deform_vector(PointerGetDatum(latencies), stats->latencies, &nelems);
+			success = true;
+		}
+	}
+
+	index_endscan(index_scan);
+	index_close(index_rel, lockmode);
+	heap_close(heap, lockmode);
+
+	return success;
+}
+
+/*
+ * Stores the model selection statistics of the feature subspace. A concurrent
+ * update wins: the statistics are just means over recent objects.
+ */
+bool
+update_fss_model_stats(int fss_hash, FssModelStats *stats)
+{
+	RangeVar   *rv;
+	Relation	heap;
+	TupleDesc	tupdesc;
+	Relation	index_rel;
+	Oid			index_rel_oid;
+	IndexScanDesc index_scan;
+	ScanKeyData	key[2];
+	LOCKMODE	lockmode = RowExclusiveLock;
+	HeapTuple	tuple,
+				nw_tuple;
+	Datum		values[7];
+	bool		isnull[7] = {false, false, false, false, false, false, false};
+	bool		replace[7] = {false, false, true, true, true, true, true};
+	bool		updated = true;
+
+	index_rel_oid = RelnameGetRelid("aqo_fss_models_access_idx");
+	if (!OidIsValid(index_rel_oid))
+	{
+		disable_aqo_for_query();
+		return false;
+	}
+
+	rv = makeRangeVar("public", "aqo_fss_models", -1);
+	heap = heap_openrv(rv, lockmode);
+	tupdesc = RelationGetDescr(heap);
+	index_rel = index_open(index_rel_oid, lockmode);
+	index_scan = index_beginscan(heap, index_rel, SnapshotSelf, 2, 0);
+	ScanKeyInit(&key[0], 1, BTEqualStrategyNumber, F_INT4EQ,
+				Int32GetDatum(query_context.fspace_hash));
+	ScanKeyInit(&key[1], 2, BTEqualStrategyNumber, F_INT4EQ,
+				Int32GetDatum(fss_hash));
+	index_rescan(index_scan, key, 2, NULL, 0);
+
+	values[0] = Int32GetDatum(query_context.fspace_hash);
+	values[1] = Int32GetDatum(fss_hash);
+	values[2] = Int32GetDatum((int) stats->model);
+	values[3] = Int32GetDatum(stats->nsamples);
+	values[4] = Float8GetDatum(stats->mean_target);
+	values[5] = PointerGetDatum(form_vector(stats->errors, AQO_NUM_MODELS));
+	values[6] = PointerGetDatum(form_vector(stats->latencies, AQO_NUM_MODELS));
+
+	tuple = index_getnext(index_scan, ForwardScanDirection);
+	if (!tuple)
+	{
+		tuple = heap_form_tuple(tupdesc, values, isnull);
+		PG_TRY();
+		{
+			simple_heap_insert(heap, tuple);
+			my_index_insert(index_rel, values, isnull, &(tuple->t_self),
+							heap, UNIQUE_CHECK_YES);
+		}
+		PG_CATCH();
+		{
+			CommandCounterIncrement();
+			simple_heap_delete(heap, &(tuple->t_self));
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+	}
+	else
+	{
+		nw_tuple = heap_modify_tuple(tuple, tupdesc, values, isnull, replace);
+		if (my_simple_heap_update(heap, &(nw_tuple->t_self), nw_tuple))
+			my_index_insert(index_rel, values, isnull, &(nw_tuple->t_self),
+							heap, UNIQUE_CHECK_YES);
+		else
+			updated = false;
+	}
+
+	index_endscan(index_scan);
+	index_close(index_rel, lockmode);
+	heap_close(heap, lockmode);
+
+	CommandCounterIncrement();
+
+	return updated;
+}
+
+/*
+ * Compares the current number of tuples of the relation (of all relations if
+ * relid is InvalidOid) with the one remembered for the feature subspaces built
+ * on it. Models of feature subspaces whose relations changed by more than
+ * aqo.stale_threshold are marked stale, and the new number of tuples is
+ * remembered. Returns the number of models marked stale.
+ */
+int
+mark_stale_fss(Oid relid)
+{
+	RangeVar   *rv;
+	Relation	heap;
+	Relation	access_index_rel;
+	Relation	relid_index_rel;
+	Oid			access_index_rel_oid;
+	Oid			relid_index_rel_oid;
+	IndexScanDesc index_scan = NULL;
+	HeapScanDesc heap_scan = NULL;
+	ScanKeyData	key;
+	LOCKMODE	lockmode = RowExclusiveLock;
+	HeapTuple	tuple,
+				nw_tuple;
+	Datum		values[4];
+	bool		isnull[4];
+	bool		replace[4] = {false, false, false, true};
+	int			nstale = 0;
+
+	access_index_rel_oid = RelnameGetRelid("aqo_fss_relations_access_idx");
+	relid_index_rel_oid = RelnameGetRelid("aqo_fss_relations_relid_idx");
+	if (!OidIsValid(access_index_rel_oid) || !OidIsValid(relid_index_rel_oid))
+		return 0;
+
+	rv = makeRangeVar("public", "aqo_fss_relations", -1);
+	heap = heap_openrv(rv, lockmode);
+	access_index_rel = index_open(access_index_rel_oid, lockmode);
+	relid_index_rel = index_open(relid_index_rel_oid, lockmode);
+
+	if (OidIsValid(relid))
+	{
+		index_scan = index_beginscan(heap, relid_index_rel, SnapshotSelf, 1, 0);
+		ScanKeyInit(&key, 1, BTEqualStrategyNumber, F_OIDEQ,
+					ObjectIdGetDatum(relid));
+		index_rescan(index_scan, &key, 1, NULL, 0);
+	}
+	else
+		heap_scan = heap_beginscan(heap, SnapshotSelf, 0, NULL);
+
+	for (;;)
+	{
+		double		old_reltuples;
+		double		reltuples;
+		bool		concurrent;
+
+		if (index_scan)
+			tuple = index_getnext(index_scan, ForwardScanDirection);
+		else
+			tuple = heap_getnext(heap_scan, ForwardScanDirection);
+		if (!tuple)
+			break;
+
+		heap_deform_tuple(tuple, RelationGetDescr(heap), values, isnull);
+		old_reltuples = DatumGetFloat4(values[3]);
+
+		/* Rows of dropped relations are removed by aqo_vacuum */
+		if (!get_relation_reltuples(DatumGetObjectId(values[2]), &reltuples))
+			continue;
+		if (fabs(reltuples - old_reltuples) <=
+			stale_threshold * Max(old_reltuples, 1))
+			continue;
+
+		/*
+		 * If the model is being updated, the change is checked again by the
+		 * next planning; the pending relations are already forgotten.
+		 */
+		if (!set_fss_staleness(DatumGetInt32(values[0]),
+							   DatumGetInt32(values[1]), 1, &concurrent))
+		{
+			if (concurrent)
+				aqo_drift_recheck(DatumGetObjectId(values[2]));
+			continue;
+		}
+		nstale++;
+
+		values[3] = Float4GetDatum((float4) reltuples);
+		nw_tuple = heap_modify_tuple(tuple, RelationGetDescr(heap),
+									 values, isnull, replace);
+		if (my_simple_heap_update(heap, &(nw_tuple->t_self), nw_tuple) &&
+			!HeapTupleIsHeapOnly(nw_tuple))
+		{
+			my_index_insert(access_index_rel, values, isnull,
+							&(nw_tuple->t_self), heap, UNIQUE_CHECK_NO);
+			my_index_insert(relid_index_rel, &values[2], &isnull[2],
+							&(nw_tuple->t_self), heap, UNIQUE_CHECK_NO);
+		}
+	}
+
+	if (index_scan)
+		index_endscan(index_scan);
+	else
+		heap_endscan(heap_scan);
+	index_close(relid_index_rel, lockmode);
+	index_close(access_index_rel, lockmode);
+	heap_close(heap, lockmode);
+
+	CommandCounterIncrement();
+
+	return nstale;
+}
 /*
  * Returns QueryStat for the given query_hash. Returns empty QueryStat if
  * no statistics is stored for the given query_hash in table aqo_query_stat.
@@ -2516,27 +2892,38 @@ deform_cubic(Datum datum, double ***cubic)
 void
 deform_matrix(Datum datum, double **matrix)
 {
-	ArrayType  *array = DatumGetArrayTypePCopy(PG_DETOAST_DATUM(datum));
-	int			nelems;
-	Datum	   *values;
+	ArrayType  *array = DatumGetArrayTypeP(datum);
 	int			rows;
 	int			cols;
 	int			i,
 				j;
 
-	deconstruct_array(array,
-					  FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-					  &values, NULL, &nelems);
-	if (nelems != 0)
+	if (ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array)) != 0)
 	{
 		rows = ARR_DIMS(array)[0];
 		cols = ARR_DIMS(array)[1];
-		for (i = 0; i < rows; ++i)
-			for (j = 0; j < cols; ++j)
-				matrix[i][j] = DatumGetFloat8(values[i * cols + j]);
+		if (ARR_HASNULL(array))
+			deform_array_slow(array, matrix, cols);
+		else if (ARR_ELEMTYPE(array) == FLOAT4OID)
+		{
+			/* float4 storage, promoted for the computations */
+			float4	   *data = (float4 *) ARR_DATA_PTR(array);
+
+			for (i = 0; i < rows; ++i)
+				for (j = 0; j < cols; ++j)
+					matrix[i][j] = data[i * cols + j];
+		}
+		else
+		{
+			/* float8 elements are stored as a plain C array */
+			for (i = 0; i < rows; ++i)
+				memcpy(matrix[i], (double *) ARR_DATA_PTR(array) + i * cols,
+					   sizeof(double) * cols);
+		}
 	}
-	pfree(values);
-	pfree(array);
+	aqo_detoasted_bytes += ARR_SIZE(array);
+	if ((Pointer) array != DatumGetPointer(datum))
+		pfree(array);
 }
 
 /*
@@ -2546,17 +2933,271 @@ deform_matrix(Datum datum, double **matrix)
 void
 deform_vector(Datum datum, double *vector, int *nelems)
 {
-	ArrayType  *array = DatumGetArrayTypePCopy(PG_DETOAST_DATUM(datum));
+	ArrayType  *array = DatumGetArrayTypeP(datum);
+	int			i;
+
+	*nelems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+	if (ARR_HASNULL(array))
+		deform_array_slow(array, &vector, *nelems);
+	else if (ARR_ELEMTYPE(array) == FLOAT4OID)
+	{
+		for (i = 0; i < *nelems; ++i)
+			vector[i] = ((float4 *) ARR_DATA_PTR(array))[i];
+	}
+	else
+		memcpy(vector, ARR_DATA_PTR(array), sizeof(double) * *nelems);
+	aqo_detoasted_bytes += ARR_SIZE(array);
+	if ((Pointer) array != DatumGetPointer(datum))
+		pfree(array);
+}
+
+/*
+ * Deforms an array with nulls element by element; nulls become zeros. AQO
+ * never stores them, but the tables may be edited by hand.
+ */
+static void
+deform_array_slow(ArrayType *array, double **matrix, int cols)
+{
 	Datum	   *values;
+	bool	   *nulls;
+	int			nelems;
 	int			i;
 
-	deconstruct_array(array,
-					  FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-					  &values, NULL, nelems);
-	for (i = 0; i < *nelems; ++i)
-		vector[i] = DatumGetFloat8(values[i]);
+	if (ARR_ELEMTYPE(array) == FLOAT4OID)
+	{
+		deconstruct_array(array,
+						  FLOAT4OID, 4, FLOAT4PASSBYVAL, 'i',
+						  &values, &nulls, &nelems);
+		for (i = 0; i < nelems; ++i)
+			matrix[i / cols][i % cols] = nulls[i] ? 0 : DatumGetFloat4(values[i]);
+	}
+	else
+	{
+		deconstruct_array(array,
+						  FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
+						  &values, &nulls, &nelems);
+		for (i = 0; i < nelems; ++i)
+			matrix[i / cols][i % cols] = nulls[i] ? 0 : DatumGetFloat8(values[i]);
+	}
 	pfree(values);
-	pfree(array);
+	pfree(nulls);
+}
+
+/*
+ * Expands the history of queries into the model. A row of the matrix is a
+ * template followed by its inputs from the oldest one, the vector holds the
+ * numbers of inputs of the rows. Rows without inputs are skipped: models
+ * stored before the history became sparse have a row for every template.
+ */
+static void
+deform_history(Datum matrix_datum, Datum nums_datum, LWPR_Model *model)
+{
+	ArrayType  *array = DatumGetArrayTypeP(matrix_datum);
+	int			nIn = model->nIn;
+	int			rows = 0;
+	int			cols = 0;
+	double	  **matrix;
+	double	   *nums;
+	int			nnums;
+	int			i;
+
+	if (ARR_NDIM(array) == 2)
+	{
+		rows = ARR_DIMS(array)[0];
+		cols = ARR_DIMS(array)[1];
+	}
+	if (rows == 0 || cols < 1 + nIn)
+	{
+		if ((Pointer) array != DatumGetPointer(matrix_datum))
+			pfree(array);
+		return;
+	}
+
+	matrix = palloc(sizeof(*matrix) * rows);
+	for (i = 0; i < rows; ++i)
+		matrix[i] = palloc(sizeof(**matrix) * cols);
+	deform_matrix(PointerGetDatum(array), matrix);
+	if ((Pointer) array != DatumGetPointer(matrix_datum))
+		pfree(array);
+
+	array = DatumGetArrayTypeP(nums_datum);
+	nnums = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+	if ((Pointer) array != DatumGetPointer(nums_datum))
+		pfree(array);
+	nums = palloc0(sizeof(*nums) * Max(nnums, rows));
+	deform_vector(nums_datum, nums, &nnums);
+
+	for (i = 0; i < rows; ++i)
+	{
+		LWPR_TemplateHistory *history;
+		int			query_hash = (int) matrix[i][0];
+		int			num = Min((int) nums[i], (cols - 1) / nIn);
+		int			first;
+
+		if (num <= 0 || query_hash < 1 || query_hash > num_query_pattern)
+			continue;
+
+		/* the newest inputs are kept if the buffer became shorter */
+		first = Max(num - num_history_data_compute_probability_rf, 0);
+		history = lwpr_history_entry(model, query_hash, true);
+		history->num = num - first;
+		history->next = history->num % num_history_data_compute_probability_rf;
+		memcpy(history->xn, matrix[i] + 1 + first * nIn,
+			   sizeof(double) * nIn * history->num);
+	}
+
+	for (i = 0; i < rows; ++i)
+		pfree(matrix[i]);
+	pfree(matrix);
+	pfree(nums);
+}
+
+/*
+ * Forms the history of queries of the model for storage (see
+ * deform_history), a row per template the model was observed with.
+ */
+void
+form_history(LWPR_Model *model, Datum *matrix, Datum *nums)
+{
+	int			nIn = model->nIn;
+	int			ncols = 1 + nIn * num_history_data_compute_probability_rf;
+	double	  **rows;
+	double	   *num;
+	int			i,
+				k;
+
+	rows = palloc(sizeof(*rows) * Max(model->num_history, 1));
+	num = palloc(sizeof(*num) * Max(model->num_history, 1));
+	for (i = 0; i < model->num_history; ++i)
+	{
+		LWPR_TemplateHistory *history = &model->history[i];
+		int			oldest;
+
+		oldest = (history->num < num_history_data_compute_probability_rf) ?
+			0 : history->next;
+		rows[i] = palloc0(sizeof(**rows) * ncols);
+		rows[i][0] = history->query_hash;
+		for (k = 0; k < history->num; ++k)
+			memcpy(rows[i] + 1 + k * nIn,
+				   history->xn + ((oldest + k) % num_history_data_compute_probability_rf) * nIn,
+				   sizeof(double) * nIn);
+		num[i] = history->num;
+	}
+
+	*matrix = PointerGetDatum(form_matrix(rows, model->num_history, ncols));
+	*nums = PointerGetDatum(form_vector(num, model->num_history));
+
+	for (i = 0; i < model->num_history; ++i)
+		pfree(rows[i]);
+	pfree(rows);
+	pfree(num);
+}
+
+/*
+ * Deforms the matrix whose i-th row is stored in the i-th receptive field of
+ * the model at the given offset. 'rows' is a buffer for numRFS row pointers.
+ */
+static void
+deform_rf_matrix(Datum datum, LWPR_Model *model, size_t offset, double **rows)
+{
+	int			i;
+
+	for (i = 0; i < model->numRFS; ++i)
+		rows[i] = *(double **) ((char *) model->rf[i] + offset);
+	deform_matrix(datum, rows);
+}
+
+/*
+ * Matrices are formed as float8 arrays, but an installation may keep the
+ * large ones as real[] (see aqo_set_storage_precision). Converts the float8
+ * arrays of the tuple which go to real[] columns. replace may be NULL.
+ */
+static void
+fit_float_arrays(TupleDesc tupdesc, Datum *values, bool *isnull, bool *replace)
+{
+	int			i,
+				j;
+
+	for (i = 0; i < tupdesc->natts; ++i)
+	{
+		ArrayType  *array;
+		Datum	   *elems;
+		int			nelems;
+
+		if (isnull[i] || (replace != NULL && !replace[i]) ||
+			TupleDescAttr(tupdesc, i)->atttypid != FLOAT4ARRAYOID)
+			continue;
+
+		array = DatumGetArrayTypeP(values[i]);
+		if (ARR_ELEMTYPE(array) != FLOAT8OID || ARR_HASNULL(array))
+			continue;
+
+		nelems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+		elems = palloc(sizeof(*elems) * Max(nelems, 1));
+		for (j = 0; j < nelems; ++j)
+			elems[j] = Float4GetDatum((float4) ((double *) ARR_DATA_PTR(array))[j]);
+		values[i] = PointerGetDatum(construct_md_array(elems, NULL,
+													   ARR_NDIM(array),
+													   ARR_DIMS(array),
+													   ARR_LBOUND(array),
+													   FLOAT4OID, 4,
+													   FLOAT4PASSBYVAL, 'i'));
+		pfree(elems);
+	}
+}
+
+PG_FUNCTION_INFO_V1(aqo_set_storage_precision);
+
+/*
+ * Sets the precision the large matrices of the models are stored with: the
+ * distance metrics D, the projections U and P, the query history and the
+ * features of the RF data houses. 'float4' halves their size and the
+ * bandwidth of loading models at the cost of rounding, 'float8' (the default)
+ * stores them exactly. Computations are always done in double precision.
+ */
+Datum
+aqo_set_storage_precision(PG_FUNCTION_ARGS)
+{
+	char	   *precision = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	const char *type;
+	char	   *queries[2];
+	int			i;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to use aqo_set_storage_precision")));
+
+	if (strcmp(precision, "float4") == 0)
+		type = "real[]";
+	else if (strcmp(precision, "float8") == 0)
+		type = "double precision[]";
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("storage precision must be \"float4\" or \"float8\"")));
+
+	queries[0] = psprintf("ALTER TABLE public.aqo_data_lwpr "
+						  "ALTER COLUMN d TYPE %s, ALTER COLUMN u TYPE %s, "
+						  "ALTER COLUMN p TYPE %s, "
+						  "ALTER COLUMN history_data_matrix TYPE %s",
+						  type, type, type, type);
+	queries[1] = psprintf("ALTER TABLE public.aqo_data_house_lwpr "
+						  "ALTER COLUMN features TYPE %s", type);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "aqo_set_storage_precision: SPI_connect failed");
+	for (i = 0; i < lengthof(queries); ++i)
+	{
+		int			ret = SPI_execute(queries[i], false, 0);
+
+		if (ret != SPI_OK_UTILITY)
+			elog(ERROR, "aqo_set_storage_precision: cannot execute \"%s\": %s",
+				 queries[i], SPI_result_code_string(ret));
+	}
+	SPI_finish();
+
+	PG_RETURN_VOID();
 }
 
 /*
@@ -2676,11 +3317,41 @@ form_vector(double *vector, int nrows)
  */
 static bool
 my_simple_heap_update(Relation relation, ItemPointer otid, HeapTuple tup)
+{
+	return my_heap_update(relation, otid, tup, NULL);
+}
+
+/*
+ * Updates the tuple like my_simple_heap_update. If busy is not NULL, does not
+ * wait for a concurrent transaction which updates or locks the tuple, but
+ * sets *busy and returns false. heap_update does not support not waiting, so
+ * the tuple is locked first in the way of SELECT FOR NO KEY UPDATE SKIP
+ * LOCKED, and then heap_update finds it locked by us.
+ */
+static bool
+my_heap_update(Relation relation, ItemPointer otid, HeapTuple tup, bool *busy)
 {
 	HTSU_Result result;
 	HeapUpdateFailureData hufd;
 	LockTupleMode lockmode;
 
+	if (busy != NULL)
+	{
+		HeapTupleData oldtup;
+		Buffer		buffer;
+
+		*busy = false;
+		oldtup.t_self = *otid;
+		result = heap_lock_tuple(relation, &oldtup, GetCurrentCommandId(true),
+								 LockTupleNoKeyExclusive, LockWaitSkip,
+								 false, &buffer, &hufd);
+		ReleaseBuffer(buffer);
+		if (result == HeapTupleWouldBlock)
+			*busy = true;
+		if (result != HeapTupleMayBeUpdated)
+			return false;
+	}
+
 	result = heap_update(relation, otid, tup,
 						 GetCurrentCommandId(true), InvalidSnapshot,
 						 true /* wait for commit */ ,
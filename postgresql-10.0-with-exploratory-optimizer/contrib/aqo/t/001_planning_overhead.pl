@@ -0,0 +1,149 @@
+# Planning and learning overhead of AQO compared to the disabled AQO baseline.
+#
+# Trains AQO on a synthetic multi-join template and checks upper bounds of the
+# planning time, the learning time in ExecutorEnd and the growth of the model
+# tables. The measurements are written to tmp_check/log/aqo_planning_overhead.csv.
+# The bounds are loose enough for a laptop and can be changed by the
+# environment variables below.
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More tests => 7;
+
+# Median planning time with AQO must not exceed the larger of factor * baseline
+# and baseline + slack.
+my $planning_factor   = $ENV{AQO_PERF_PLANNING_FACTOR}   // 10;
+my $planning_slack_ms = $ENV{AQO_PERF_PLANNING_SLACK_MS} // 20;
+# Mean time of learning from one execution.
+my $learning_ms       = $ENV{AQO_PERF_LEARNING_MS}       // 100;
+# Size of model tables after the second half of training relative to the first.
+my $growth_factor     = $ENV{AQO_PERF_GROWTH_FACTOR}     // 1.5;
+my $iterations        = $ENV{AQO_PERF_ITERATIONS}        // 50;
+
+my $node = get_new_node('aqo_perf');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'aqo'
+aqo.default_query_template = 1
+aqo.track_planning_stats = on
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION aqo');
+
+# Four tables joined in a chain, each with a filtered column
+foreach my $t (qw(t1 t2 t3 t4))
+{
+	$node->safe_psql(
+		'postgres', qq{
+CREATE TABLE $t (id int, fk int, val int);
+INSERT INTO $t SELECT i, (i * 7) % 10000, i % 100
+	FROM generate_series(1, 10000) i;
+CREATE INDEX ${t}_fk_idx ON $t (fk);
+ANALYZE $t;
+});
+}
+
+# The same template with different constants
+sub workload
+{
+	my ($first, $count) = @_;
+	my $sql = '';
+
+	foreach my $i ($first .. $first + $count - 1)
+	{
+		my $v1 = ($i * 13) % 100;
+		my $v2 = ($i * 29) % 100;
+		$sql .= qq{EXPLAIN (ANALYZE, FORMAT JSON)
+SELECT count(*) FROM t1, t2, t3, t4
+WHERE t1.id = t2.fk AND t2.id = t3.fk AND t3.id = t4.fk
+	AND t1.val < $v1 AND t4.val < $v2;
+};
+	}
+	return $sql;
+}
+
+# Runs the queries in one session and returns references to arrays of their
+# planning and execution times.
+sub run_phase
+{
+	my ($mode, $first, $count) = @_;
+	my $out = $node->safe_psql('postgres',
+		"SET aqo.mode = '$mode';\n" . workload($first, $count));
+	my @planning  = ($out =~ /"Planning Time": ([0-9.]+)/g);
+	my @execution = ($out =~ /"Execution Time": ([0-9.]+)/g);
+
+	is(scalar(@planning), $count, "$mode queries from $first are explained");
+	return (\@planning, \@execution);
+}
+
+sub median
+{
+	my @sorted = sort { $a <=> $b } @_;
+	return $sorted[ int($#sorted / 2) ];
+}
+
+sub model_size
+{
+	return $node->safe_psql('postgres',
+		"SELECT pg_total_relation_size('aqo_data_lwpr') + "
+		  . "pg_total_relation_size('aqo_data_house_lwpr')");
+}
+
+my $half = int($iterations / 2);
+my ($base_planning, $base_execution) = run_phase('disabled', 1, $iterations);
+
+$node->safe_psql('postgres', 'SELECT aqo_planning_stats_reset()');
+my ($learn1_planning, $learn1_execution) = run_phase('learn', 1, $half);
+my $size1 = model_size();
+my ($learn2_planning, $learn2_execution) =
+  run_phase('learn', $half + 1, $iterations - $half);
+my $size2 = model_size();
+my ($learning_calls, $learning_total) = split /\|/,
+  $node->safe_psql('postgres',
+	"SELECT coalesce(sum(calls), 0), coalesce(sum(total_time), 0) "
+	  . "FROM aqo_planning_stats WHERE function = 'learn_query_stat'");
+
+# Keep the measurements for review
+open my $csv, '>', "$TestLib::log_path/aqo_planning_overhead.csv"
+  or die "could not open csv file: $!";
+print $csv "phase,iteration,planning_ms,execution_ms\n";
+foreach my $phase (
+	[ 'disabled', $base_planning,   $base_execution ],
+	[ 'learn1',   $learn1_planning, $learn1_execution ],
+	[ 'learn2',   $learn2_planning, $learn2_execution ])
+{
+	my ($name, $planning, $execution) = @$phase;
+	foreach my $i (0 .. $#$planning)
+	{
+		print $csv "$name,", $i + 1, ",$planning->[$i],$execution->[$i]\n";
+	}
+}
+print $csv "summary,model_bytes_half,$size1,\n";
+print $csv "summary,model_bytes_full,$size2,\n";
+print $csv "summary,learning_calls,$learning_calls,\n";
+print $csv "summary,learning_total_ms,$learning_total,\n";
+close $csv;
+
+my $base_median  = median(@$base_planning);
+my $learn_median = median(@$learn2_planning);
+note "median planning: disabled $base_median ms, trained aqo $learn_median ms";
+note "model size: $size1 bytes after $half queries, $size2 bytes after $iterations";
+
+ok($learning_calls > 0 && $size2 > 0, 'aqo learned the template');
+
+cmp_ok($learn_median, '<=',
+	($base_median * $planning_factor > $base_median + $planning_slack_ms)
+	? $base_median * $planning_factor
+	: $base_median + $planning_slack_ms,
+	'planning time overhead is bounded');
+
+cmp_ok($learning_calls > 0 ? $learning_total / $learning_calls : 0,
+	'<=', $learning_ms, 'learning time is bounded');
+
+cmp_ok($size2, '<=', $size1 * $growth_factor + 65536,
+	'model tables stop growing on a repeated template');
+
+$node->stop;
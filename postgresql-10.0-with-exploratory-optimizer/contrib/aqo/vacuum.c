@@ -0,0 +1,520 @@
+#include "aqo.h"
+#include "commands/extension.h"
+#include "executor/spi.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/latch.h"
+
+/*****************************************************************************
+ *
+ *	MODEL VACUUM
+ *
+ * aqo_vacuum() keeps the LWPR models small on long-running systems:
+ *
+ *	1. evicts the models of feature subspaces which have not been used for
+ *	   aqo.vacuum_max_age;
+ *	2. removes receptive fields which have seen less than
+ *	   aqo.vacuum_min_rf_data objects, and of two RFs which activate each other
+ *	   as strong as LWPR prunes (w_prune) keeps the better trained one;
+ *	3. deletes the RF data house rows which are not used anymore, i. e. of
+ *	   removed and of trustworthy RFs, the aqo_fss_relations rows of
+ *	   evicted models and dropped relations, and the aqo_data and
+ *	   aqo_fss_models rows of evicted models;
+ *	4. evicts the least recently used models until the models and their data
+ *	   houses take no more than aqo.vacuum_max_size.
+ *
+ * Sizes are the sizes of rows; the relations themselves are shrunk by
+ * the regular (auto)vacuum.
+ *
+ * If AQO is loaded via shared_preload_libraries and aqo.vacuum_database is
+ * set, a background worker runs aqo_vacuum() in that database every
+ * aqo.vacuum_naptime. The worker is not started if the database is not set,
+ * since it could not connect to a missing database and would be restarted
+ * forever.
+ *
+ *****************************************************************************/
+
+/* True while aqo_vacuum() rewrites models, they are not "used" by it */
+bool		aqo_vacuum_in_progress = false;
+
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+static int64 vacuum_models_size(void);
+static int64 vacuum_execute(const char *sql, int nargs, Oid *argtypes,
+			   Datum *values);
+static int64 vacuum_prune_models(int64 *deleted_rows);
+static int	vacuum_prune_rfs(LWPR_Model *model);
+static double vacuum_rf_activation(LWPR_Model *model, LWPR_ReceptiveField *RF,
+					 const double *x);
+static int64 vacuum_trim_datahouse(int fspace_hash, int fss_hash,
+					  LWPR_Model *model);
+static void aqo_vacuum_sigterm(SIGNAL_ARGS);
+static void aqo_vacuum_sighup(SIGNAL_ARGS);
+
+
+PG_FUNCTION_INFO_V1(aqo_vacuum);
+
+/*
+ * Vacuums AQO models. Returns the number of evicted feature subspaces,
+ * removed receptive fields, deleted data house rows, and the size of models
+ * before and after.
+ */
+Datum
+aqo_vacuum(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[5];
+	bool		nulls[5] = {false, false, false, false, false};
+	Datum		args[1];
+	Oid			argtypes[1];
+	int64		evicted = 0;
+	int64		removed_rfs = 0;
+	int64		deleted_rows = 0;
+	int64		bytes_before;
+	int			fspace_hash = query_context.fspace_hash;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to use aqo_vacuum")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	if (RecoveryInProgress())
+		elog(ERROR, "aqo_vacuum cannot be executed during recovery");
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "aqo_vacuum: SPI_connect failed");
+
+	bytes_before = vacuum_models_size();
+
+	if (vacuum_max_age > 0)
+	{
+		args[0] = Int32GetDatum(vacuum_max_age);
+		argtypes[0] = INT4OID;
+		evicted += vacuum_execute("DELETE FROM public.aqo_data_lwpr "
+								  "WHERE last_used < now() - $1 * interval '1 second'",
+								  1, argtypes, args);
+	}
+
+	aqo_vacuum_in_progress = true;
+	PG_TRY();
+	{
+		removed_rfs = vacuum_prune_models(&deleted_rows);
+	}
+	PG_CATCH();
+	{
+		aqo_vacuum_in_progress = false;
+		query_context.fspace_hash = fspace_hash;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	aqo_vacuum_in_progress = false;
+	query_context.fspace_hash = fspace_hash;
+
+	if (vacuum_max_size > 0)
+	{
+		/* Keep the most recently used models which fit into the limit */
+		args[0] = Int64GetDatum((int64) vacuum_max_size * 1024);
+		argtypes[0] = INT8OID;
+		evicted += vacuum_execute(
+			"WITH house AS ("
+			"  SELECT fspace_hash, fsspace_hash, sum(pg_column_size(h.*)) AS bytes"
+			"  FROM public.aqo_data_house_lwpr h GROUP BY fspace_hash, fsspace_hash"
+			"), sizes AS ("
+			"  SELECT d.fspace_hash, d.fsspace_hash,"
+			"    sum(pg_column_size(d.*) + coalesce(house.bytes, 0)) OVER"
+			"      (ORDER BY d.last_used DESC NULLS LAST, d.fspace_hash, d.fsspace_hash)"
+			"    AS total"
+			"  FROM public.aqo_data_lwpr d LEFT JOIN house"
+			"    ON house.fspace_hash = d.fspace_hash AND house.fsspace_hash = d.fsspace_hash"
+			") "
+			"DELETE FROM public.aqo_data_lwpr d USING sizes s "
+			"WHERE d.fspace_hash = s.fspace_hash AND d.fsspace_hash = s.fsspace_hash "
+			"AND s.total > $1",
+			1, argtypes, args);
+	}
+
+	/* Data houses of evicted models */
+	deleted_rows += vacuum_execute("DELETE FROM public.aqo_data_house_lwpr h "
+								   "WHERE NOT EXISTS (SELECT 1 FROM public.aqo_data_lwpr d "
+								   "WHERE d.fspace_hash = h.fspace_hash "
+								   "AND d.fsspace_hash = h.fsspace_hash)",
+								   0, NULL, NULL);
+
+	/* Relations of evicted models and dropped relations */
+	vacuum_execute("DELETE FROM public.aqo_fss_relations r "
+				   "WHERE NOT EXISTS (SELECT 1 FROM public.aqo_data_lwpr d "
+				   "WHERE d.fspace_hash = r.fspace_hash "
+				   "AND d.fsspace_hash = r.fsspace_hash) "
+				   "OR NOT EXISTS (SELECT 1 FROM pg_catalog.pg_class c "
+				   "WHERE c.oid = r.relid)",
+				   0, NULL, NULL);
+
+	/*
+	 * Objects and model statistics of evicted models. Subspaces without
+	 * features have no LWPR model, they never measured its latency.
+	 */
+	deleted_rows += vacuum_execute("DELETE FROM public.aqo_data a "
+								   "WHERE NOT EXISTS (SELECT 1 FROM public.aqo_data_lwpr d "
+								   "WHERE d.fspace_hash = a.fspace_hash "
+								   "AND d.fsspace_hash = a.fsspace_hash)",
+								   0, NULL, NULL);
+	vacuum_execute("DELETE FROM public.aqo_fss_models s "
+				   "WHERE s.latencies[1] >= 0 "
+				   "AND NOT EXISTS (SELECT 1 FROM public.aqo_data_lwpr d "
+				   "WHERE d.fspace_hash = s.fspace_hash "
+				   "AND d.fsspace_hash = s.fsspace_hash)",
+				   0, NULL, NULL);
+
+	values[0] = Int64GetDatum(evicted);
+	values[1] = Int64GetDatum(removed_rfs);
+	values[2] = Int64GetDatum(deleted_rows);
+	values[3] = Int64GetDatum(bytes_before);
+	values[4] = Int64GetDatum(vacuum_models_size());
+
+	SPI_finish();
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Total size of the rows of the models and their data houses. The query is
+ * not read-only, so it sees the rows deleted by aqo_vacuum() so far.
+ */
+static int64
+vacuum_models_size(void)
+{
+	bool		isnull;
+	Datum		size;
+	int			ret;
+
+	ret = SPI_execute("SELECT ((SELECT coalesce(sum(pg_column_size(d.*)), 0) "
+					  "FROM public.aqo_data_lwpr d) + "
+					  "(SELECT coalesce(sum(pg_column_size(h.*)), 0) "
+					  "FROM public.aqo_data_house_lwpr h))::bigint",
+					  false, 1);
+	if (ret != SPI_OK_SELECT || SPI_processed != 1)
+		elog(ERROR, "aqo_vacuum: cannot compute the size of models: %s",
+			 SPI_result_code_string(ret));
+
+	size = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1,
+						 &isnull);
+	return isnull ? 0 : DatumGetInt64(size);
+}
+
+/*
+ * Executes a data modifying statement and returns the number of rows it
+ * processed.
+ */
+static int64
+vacuum_execute(const char *sql, int nargs, Oid *argtypes, Datum *values)
+{
+	int			ret;
+
+	ret = SPI_execute_with_args(sql, nargs, argtypes, values, NULL, false, 0);
+	if (ret < 0)
+		elog(ERROR, "aqo_vacuum: cannot execute \"%s\": %s",
+			 sql, SPI_result_code_string(ret));
+	return (int64) SPI_processed;
+}
+
+/*
+ * Removes redundant receptive fields of every model and trims its data house.
+ * Returns the number of removed RFs.
+ */
+static int64
+vacuum_prune_models(int64 *deleted_rows)
+{
+	int			ret;
+	int			nmodels;
+	int		   *fspace_hashes;
+	int		   *fss_hashes;
+	int		   *nfeatures;
+	int64		removed = 0;
+	int			i;
+
+	/* Not read-only, so the models evicted by age are not listed */
+	ret = SPI_execute("SELECT fspace_hash, fsspace_hash, nfeatures "
+					  "FROM public.aqo_data_lwpr", false, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "aqo_vacuum: cannot read aqo_data_lwpr: %s",
+			 SPI_result_code_string(ret));
+
+	/* The result is overwritten by the next SPI call */
+	nmodels = SPI_processed;
+	fspace_hashes = palloc(sizeof(*fspace_hashes) * Max(nmodels, 1));
+	fss_hashes = palloc(sizeof(*fss_hashes) * Max(nmodels, 1));
+	nfeatures = palloc(sizeof(*nfeatures) * Max(nmodels, 1));
+	for (i = 0; i < nmodels; ++i)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		bool		isnull;
+
+		fspace_hashes[i] = DatumGetInt32(SPI_getbinval(tuple,
+											SPI_tuptable->tupdesc, 1, &isnull));
+		fss_hashes[i] = DatumGetInt32(SPI_getbinval(tuple,
+											SPI_tuptable->tupdesc, 2, &isnull));
+		nfeatures[i] = DatumGetInt32(SPI_getbinval(tuple,
+											SPI_tuptable->tupdesc, 3, &isnull));
+	}
+
+	for (i = 0; i < nmodels; ++i)
+	{
+		LWPR_Model	model;
+		int			nremoved;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (nfeatures[i] <= 0)
+			continue;
+
+		/* The storage reads the model of the current feature space */
+		query_context.fspace_hash = fspace_hashes[i];
+		lwpr_init_model(&model, nfeatures[i], 1);
+		if (load_fss_rfwr(fss_hashes[i], nfeatures[i], &model))
+		{
+			nremoved = vacuum_prune_rfs(&model);
+			if (nremoved > 0)
+				update_fss_rfwr(fss_hashes[i], nfeatures[i], &model, NULL);
+			removed += nremoved;
+			*deleted_rows += vacuum_trim_datahouse(fspace_hashes[i],
+												   fss_hashes[i], &model);
+		}
+		lwpr_free_model(&model);
+	}
+
+	pfree(fspace_hashes);
+	pfree(fss_hashes);
+	pfree(nfeatures);
+	return removed;
+}
+
+/*
+ * Removes RFs which have seen too few objects and near-duplicate RFs. At
+ * least one RF is kept. Returns the number of removed RFs.
+ */
+static int
+vacuum_prune_rfs(LWPR_Model *model)
+{
+	int			removed = 0;
+	int			i,
+				j;
+
+	i = 0;
+	while (i < model->numRFS && model->numRFS > 1)
+	{
+		if (model->rf[i]->n_data[0] < vacuum_min_rf_data)
+		{
+			lwpr_remove_rf(model, i);
+			removed++;
+		}
+		else
+			i++;
+	}
+
+	for (i = 0; i < model->numRFS; ++i)
+	{
+		j = i + 1;
+		while (j < model->numRFS)
+		{
+			LWPR_ReceptiveField *RF = model->rf[i];
+			LWPR_ReceptiveField *other = model->rf[j];
+
+			if (vacuum_rf_activation(model, RF, other->c) > model->w_prune ||
+				vacuum_rf_activation(model, other, RF->c) > model->w_prune)
+			{
+				/* Keep the one which has seen more objects at the i-th place */
+				if (other->n_data[0] > RF->n_data[0])
+				{
+					model->rf[i] = other;
+					model->rf[j] = RF;
+				}
+				/* The last RF takes the j-th place, so j is not advanced */
+				lwpr_remove_rf(model, j);
+				removed++;
+			}
+			else
+				j++;
+		}
+	}
+
+	return removed;
+}
+
+/*
+ * Activation of the RF for the point x. AQO models use the Gaussian kernel
+ * only.
+ */
+static double
+vacuum_rf_activation(LWPR_Model *model, LWPR_ReceptiveField *RF,
+					 const double *x)
+{
+	int			nIn = model->nIn;
+	int			nInS = model->nInStore;
+	double		dist = 0;
+	int			i,
+				j;
+
+	for (j = 0; j < nIn; j++)
+		for (i = 0; i < nIn; i++)
+			dist += (x[j] - RF->c[j]) * RF->D[i + j * nInS] * (x[i] - RF->c[i]);
+
+	return exp(-0.5 * dist);
+}
+
+/*
+ * Deletes the data house rows of the model which belong to removed or
+ * trustworthy RFs: only untrustworthy RFs predict by their data. Returns the
+ * number of deleted rows.
+ */
+static int64
+vacuum_trim_datahouse(int fspace_hash, int fss_hash, LWPR_Model *model)
+{
+	Datum	   *rf_hashes;
+	int			nhashes = 0;
+	Datum		args[3];
+	Oid			argtypes[3] = {INT4OID, INT4OID, INT4ARRAYOID};
+	int64		deleted;
+	int			i;
+
+	rf_hashes = palloc(sizeof(*rf_hashes) * Max(model->numRFS, 1));
+	for (i = 0; i < model->numRFS; ++i)
+		if (!model->rf[i]->trustworthy)
+			rf_hashes[nhashes++] =
+				Int32GetDatum(get_int_array_hash2(model->rf[i]->c, model->nIn));
+
+	args[0] = Int32GetDatum(fspace_hash);
+	args[1] = Int32GetDatum(fss_hash);
+	args[2] = PointerGetDatum(construct_array(rf_hashes, nhashes, INT4OID,
+											  sizeof(int32), true, 'i'));
+	deleted = vacuum_execute("DELETE FROM public.aqo_data_house_lwpr "
+							 "WHERE fspace_hash = $1 AND fsspace_hash = $2 "
+							 "AND rf_hash <> ALL ($3)",
+							 3, argtypes, args);
+
+	pfree(rf_hashes);
+	return deleted;
+}
+
+/*
+ * Registers the vacuum worker if aqo.vacuum_database is set. Must be called
+ * from _PG_init while shared_preload_libraries are loaded.
+ */
+void
+aqo_vacuum_register_worker(void)
+{
+	BackgroundWorker worker;
+
+	if (vacuum_database == NULL || vacuum_database[0] == '\0')
+		return;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 60;
+	snprintf(worker.bgw_name, BGW_MAXLEN, "aqo vacuum");
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "aqo");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "aqo_vacuum_main");
+	worker.bgw_main_arg = (Datum) 0;
+	worker.bgw_notify_pid = 0;
+	RegisterBackgroundWorker(&worker);
+}
+
+static void
+aqo_vacuum_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+aqo_vacuum_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Main loop of the vacuum worker: runs aqo_vacuum() every aqo.vacuum_naptime
+ * seconds if the extension is created in aqo.vacuum_database. Zero naptime
+ * pauses the worker until the configuration is reloaded.
+ */
+void
+aqo_vacuum_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, aqo_vacuum_sighup);
+	pqsignal(SIGTERM, aqo_vacuum_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(vacuum_database, NULL);
+
+	/* Queries of the worker itself are not optimized by AQO */
+	SetConfigOption("aqo.mode", "disabled", PGC_SUSET, PGC_S_OVERRIDE);
+
+	while (!got_sigterm)
+	{
+		int			rc;
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_POSTMASTER_DEATH |
+					   (vacuum_naptime > 0 ? WL_TIMEOUT : 0),
+					   vacuum_naptime * 1000L,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			continue;
+		}
+		if (!(rc & WL_TIMEOUT) || got_sigterm)
+			continue;
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		pgstat_report_activity(STATE_RUNNING, "SELECT * FROM public.aqo_vacuum()");
+
+		if (OidIsValid(get_extension_oid("aqo", true)))
+		{
+			int			ret;
+
+			ret = SPI_execute("SELECT * FROM public.aqo_vacuum()", false, 0);
+			if (ret != SPI_OK_SELECT || SPI_processed != 1)
+				elog(ERROR, "aqo vacuum worker: aqo_vacuum failed: %s",
+					 SPI_result_code_string(ret));
+
+			elog(DEBUG1, "aqo vacuum worker: evicted %s subspaces, removed %s RFs and %s data house rows, %s of %s bytes left",
+				 SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1),
+				 SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2),
+				 SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 3),
+				 SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 5),
+				 SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 4));
+		}
+
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		pgstat_report_stat(false);
+		pgstat_report_activity(STATE_IDLE, NULL);
+	}
+
+	proc_exit(1);
+}
@@ -49,6 +49,9 @@ explain_get_index_name_hook_type explain_get_index_name_hook = NULL;
 /* Hook for plugins to get control in ExplainOnePlan() */
 ExplainOnePlan_hook_type ExplainOnePlan_hook = NULL;
 
+/* Hook for plugins to add details of a plan node in ExplainNode() */
+ExplainOneNode_hook_type ExplainOneNode_hook = NULL;
+
 
 /* OR-able flags for ExplainXMLTag() */
 #define X_OPENING 0
@@ -1707,6 +1710,9 @@ ExplainNode(PlanState *planstate, List *ancestors,
 			ExplainCloseGroup("Workers", "Workers", false, es);
 	}
 
+	if (ExplainOneNode_hook)
+		ExplainOneNode_hook(es, planstate, plan);
+
 	/* Get ready to display the child plans */
 	haschildren = planstate->initPlan ||
 		outerPlanState(planstate) ||
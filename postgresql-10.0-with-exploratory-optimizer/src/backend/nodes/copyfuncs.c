@@ -132,6 +132,7 @@ CopyPlanFields(const Plan *from, Plan *newnode)
 	COPY_SCALAR_FIELD(path_jointype);
 	COPY_SCALAR_FIELD(path_parallel_workers);
 	COPY_SCALAR_FIELD(was_parametrized);
+	COPY_SCALAR_FIELD(path_explore_value);
 	COPY_BITMAPSET_FIELD(extParam);
 	COPY_BITMAPSET_FIELD(allParam);
 }
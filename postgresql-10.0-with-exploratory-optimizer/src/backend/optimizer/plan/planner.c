@@ -65,6 +65,8 @@ int			force_parallel_mode = FORCE_PARALLEL_OFF;
 /* Hook for plugins to get control in planner() */
 planner_hook_type planner_hook = NULL;
 set_estimated_cost_hook_type estimated_cost_hook = NULL;
+/* Hook for plugins to override the choice of the final path */
+choose_final_path_hook_type choose_final_path_hook = NULL;
 /* Hook for plugins to get control when grouping_planner() plans upper rels */
 create_upper_paths_hook_type create_upper_paths_hook = NULL;
 
@@ -344,6 +346,9 @@ standard_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 	{
 		best_path = get_cheapest_explore_fractional_path(final_rel, tuple_fraction, root->rate_to_generate_explore_plan);
 	}
+	/* let a plugin re-rank the candidates, e.g. by predicted execution time */
+	if (choose_final_path_hook)
+		best_path = (*choose_final_path_hook) (root, final_rel, best_path, tuple_fraction);
 	//we need a hook to record best_path's estimated cost.
 	if (estimated_cost_hook)
 		(*estimated_cost_hook)(best_path);
@@ -66,6 +66,11 @@ typedef void (*ExplainOnePlan_hook_type) (PlannedStmt *plannedstmt, IntoClause *
 			   ParamListInfo params, const instr_time *planduration);
 extern PGDLLIMPORT ExplainOnePlan_hook_type ExplainOnePlan_hook;
 
+/* Hook for plugins to add details of a plan node in ExplainNode() */
+typedef void (*ExplainOneNode_hook_type) (ExplainState *es, PlanState *ps,
+			   Plan *plan);
+extern PGDLLIMPORT ExplainOneNode_hook_type ExplainOneNode_hook;
+
 
 extern void ExplainQuery(ParseState *pstate, ExplainStmt *stmt, const char *queryString,
 			 ParamListInfo params, QueryEnvironment *queryEnv, DestReceiver *dest);
@@ -157,6 +157,7 @@ typedef struct Plan
 	JoinType	path_jointype;
 	int			path_parallel_workers;
 	bool		was_parametrized;
+	double		path_explore_value;	/* uncertainty of the node's estimate */
 
 	/*
 	 * Information for management of parameter-change-driven rescanning
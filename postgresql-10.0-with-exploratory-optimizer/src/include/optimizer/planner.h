@@ -74,4 +74,11 @@ typedef void (*set_estimated_cost_hook_type) (Path *path);
 
 extern PGDLLIMPORT set_estimated_cost_hook_type estimated_cost_hook;
 
+/* Hook for plugins to override the choice of the final path of the query */
+typedef Path *(*choose_final_path_hook_type) (PlannerInfo *root,
+											  RelOptInfo *final_rel,
+											  Path *best_path,
+											  double tuple_fraction);
+extern PGDLLIMPORT choose_final_path_hook_type choose_final_path_hook;
+
 #endif							/* PLANNER_H */
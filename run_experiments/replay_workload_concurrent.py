@@ -0,0 +1,281 @@
+# -*- coding: utf-8 -*-
+# Replays a workload CSV with several concurrent clients and an arrival process,
+# once for every given aqo.mode, and writes one result row per query.
+#
+# All clients share the AQO state of template 1: the row query_hash = 1 of
+# aqo_queries keeps the current query features and the template history. By
+# default the clients leave current_query as it is, so the learning modes do
+# not get the per-query features the serial driver sets. With
+# --update-query-state=1 every client sets them like the serial driver does and
+# holds the row lock until its query is learned, so the clients run one at a
+# time and the run measures no concurrency. AQO itself writes the template
+# history into the same row while it plans a query, so in the learning modes
+# the clients still wait for each other on it; that wait is part of what the
+# latency shows.
+import argparse
+import csv
+import datetime
+import json
+import math
+import queue
+import random
+import threading
+import time
+
+import pandas as pd
+import psycopg2
+
+import config_file as cf
+import run_workloads_runtime_experiments as serial
+
+RESULT_FIELDS = ['mode', 'arrival', 'client', 'query_id', 'query_hash',
+                 'scheduled_ms', 'start_ms', 'queue_wait_ms', 'latency_ms',
+                 'planning_ms', 'execution_ms', 'end_ms', 'error']
+
+
+def arrival_times(arrival, rate, num_queries, seed):
+    """Returns the arrival time (s, from the start) of every query.
+    uniform  - constant inter-arrival time 1/rate;
+    poisson  - exponential inter-arrival times with mean 1/rate;
+    randwalk - the rate does a multiplicative random walk around rate;
+    closed   - all queries are available at once, clients run back to back."""
+    rnd = random.Random(seed)
+    times = []
+    now = 0.0
+    current_rate = rate
+    for _ in range(num_queries):
+        times.append(now)
+        if arrival == 'closed':
+            continue
+        if arrival == 'uniform':
+            now += 1.0 / rate
+        elif arrival == 'poisson':
+            now += rnd.expovariate(rate)
+        elif arrival == 'randwalk':
+            current_rate *= math.exp(rnd.gauss(0, 0.1))
+            current_rate = min(max(current_rate, rate / 10), rate * 10)
+            now += rnd.expovariate(current_rate)
+    return times
+
+
+def explain_times(plan_json):
+    """Splits EXPLAIN ANALYZE output into planning, execution and end time (ms).
+    The end time is what ExecutorStart/Finish/End took besides running the plan,
+    that is mostly AQO learning."""
+    if isinstance(plan_json, str):
+        plan_json = json.loads(plan_json)
+    top = plan_json[0]
+    planning = top['Planning Time']
+    total = top['Execution Time']
+    execution = top['Plan']['Actual Total Time'] * top['Plan']['Actual Loops']
+    return planning, execution, max(total - execution, 0.0)
+
+
+class Replay:
+    def __init__(self, args, query_table, mode):
+        self.args = args
+        self.query_table = query_table
+        self.mode = mode
+        self.tasks = queue.Queue()
+        self.results = []
+        self.results_lock = threading.Lock()
+        # the template history of the serial driver is shared by all clients
+        self.state_lock = threading.Lock()
+        self.hist_queries = []
+        self.num_queries = 0
+        self.start = None
+
+    def connect(self):
+        conn = psycopg2.connect(database=cf.db_database, user=cf.db_user_name,
+                                password=cf.db_passwd, host=cf.db_host,
+                                port=cf.db_port)
+        conn.autocommit = True
+        return conn
+
+    def update_query_state(self, query_id, cursor, conn):
+        """Runs the same per-query bookkeeping as the serial driver.
+        aqo_queries keeps one current query for all sessions, so the caller runs
+        this and the query in one transaction: the row lock taken by the update
+        makes other clients wait until the query is planned and learned with its
+        own state. The Python lock only protects the template history."""
+        query_pattern = self.query_table['query_hash'][query_id - 1]
+        current_query = self.query_table['current_query'][query_id - 1]
+        num_feature = self.query_table['num_feature'][query_id - 1]
+        cursor.execute("set aqo.mode='disabled';")
+        if self.mode != 'disabled':
+            with self.state_lock:
+                self.num_queries += 1
+                serial.update_markov_table(self.args.history_num,
+                                           self.args.markov_m, query_pattern,
+                                           cursor, conn, self.num_queries,
+                                           self.hist_queries)
+        # the serial helper prints, so the statement is built here
+        bounds = [current_query.split(',')[0].split('{')[-1],
+                  current_query.split(',')[-1].split('}')[0]]
+        cursor.execute('update aqo_queries set current_query = array[%s], '
+                       'num_feature = %s where query_hash = 1;'
+                       % (','.join(bounds), num_feature))
+
+    def run_query(self, client, query_id, scheduled, cursor, conn):
+        row = {'mode': self.mode, 'arrival': self.args.arrival,
+               'client': client, 'query_id': query_id,
+               'query_hash': self.query_table['query_hash'][query_id - 1],
+               'scheduled_ms': scheduled * 1000, 'planning_ms': '',
+               'execution_ms': '', 'end_ms': '', 'error': ''}
+        sql = self.query_table['queries'][query_id - 1]
+        if self.args.explain:
+            sql = 'explain (analyze, format json) ' + sql
+
+        start = started = time.monotonic()
+        try:
+            if self.args.update_query_state:
+                conn.autocommit = False
+                self.update_query_state(query_id, cursor, conn)
+                cursor.execute("set aqo.mode='%s';" % self.mode)
+            started = time.monotonic()
+            cursor.execute(sql)
+            if self.args.explain:
+                planning, execution, end = explain_times(cursor.fetchone()[0])
+                row['planning_ms'] = planning
+                row['execution_ms'] = execution
+                row['end_ms'] = end
+            elif cursor.description is not None:
+                cursor.fetchall()
+            conn.commit()
+        except psycopg2.Error as e:
+            row['error'] = str(e).strip().replace('\n', ' ')
+            conn.rollback()
+        finally:
+            conn.autocommit = True
+        finished = time.monotonic()
+
+        row['start_ms'] = (start - self.start) * 1000
+        row['queue_wait_ms'] = (start - self.start - scheduled) * 1000
+        row['latency_ms'] = (finished - started) * 1000
+        with self.results_lock:
+            self.results.append(row)
+
+    def client(self, client):
+        conn = self.connect()
+        cursor = conn.cursor()
+        cursor.execute("set aqo.mode='%s';" % self.mode)
+        while True:
+            task = self.tasks.get()
+            if task is None:
+                break
+            query_id, scheduled = task
+            delay = self.start + scheduled - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            self.run_query(client, query_id, scheduled, cursor, conn)
+        cursor.execute("set aqo.mode='disabled';")
+        conn.close()
+
+    def run(self):
+        query_ids = list(range(self.args.begin_num, self.args.end_num + 1))
+        times = arrival_times(self.args.arrival, self.args.rate,
+                              len(query_ids), self.args.seed)
+        # queries are taken by clients in the order of arrival
+        for query_id, scheduled in zip(query_ids, times):
+            self.tasks.put((query_id, scheduled))
+        for _ in range(self.args.clients):
+            self.tasks.put(None)
+
+        threads = [threading.Thread(target=self.client, args=(i,))
+                   for i in range(self.args.clients)]
+        self.start = time.monotonic()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        return time.monotonic() - self.start
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    return values[min(len(values) - 1, int(math.ceil(p / 100.0 * len(values))) - 1)]
+
+
+def mean(values):
+    return sum(values) / len(values) if values else float('nan')
+
+
+def print_summary(mode, elapsed, results, serialized):
+    ok = [r for r in results if not r['error']]
+    latency = [r['latency_ms'] for r in ok]
+    print('%-10s queries=%d errors=%d elapsed=%.1fs throughput=%.2f q/s'
+          % (mode, len(results), len(results) - len(ok), elapsed,
+             len(ok) / elapsed if elapsed > 0 else 0))
+    if serialized:
+        print('           clients were serialized on the aqo_queries row '
+              'by --update-query-state=1')
+    print('           latency ms: mean=%.1f p50=%.1f p95=%.1f p99=%.1f'
+          % (mean(latency), percentile(latency, 50), percentile(latency, 95),
+             percentile(latency, 99)))
+    print('           queue wait ms: mean=%.1f p95=%.1f'
+          % (mean([r['queue_wait_ms'] for r in ok]),
+             percentile([r['queue_wait_ms'] for r in ok], 95)))
+    explained = [r for r in ok if r['planning_ms'] != '']
+    if explained:
+        print('           planning ms: mean=%.2f p95=%.2f, execution ms: mean=%.1f, '
+              'end (learning) ms: mean=%.2f p95=%.2f'
+              % (mean([r['planning_ms'] for r in explained]),
+                 percentile([r['planning_ms'] for r in explained], 95),
+                 mean([r['execution_ms'] for r in explained]),
+                 mean([r['end_ms'] for r in explained]),
+                 percentile([r['end_ms'] for r in explained], 95)))
+
+
+def replay_workload_concurrent(args):
+    query_file = args.query_file or "./data/workloads/" + cf.query_file_name
+    print('query_file = ', query_file)
+    query_table = pd.read_csv(query_file, sep=',', escapechar='\\',
+                              encoding='utf-8', low_memory=False, quotechar='"')
+    output = args.output or 'replay_%s_%s.csv' % (
+        args.arrival, datetime.datetime.now().strftime('%Y%m%d_%H%M%S'))
+
+    with open(output, 'w', newline='') as f:
+        writer = csv.DictWriter(f, fieldnames=RESULT_FIELDS)
+        writer.writeheader()
+        for mode in args.modes.split(','):
+            if mode != 'disabled' and args.delete_old_data == 1:
+                print("initialization of aqo")
+                conn = psycopg2.connect(database=cf.db_database,
+                                        user=cf.db_user_name,
+                                        password=cf.db_passwd,
+                                        host=cf.db_host, port=cf.db_port)
+                conn.autocommit = True
+                conn.cursor().execute("drop extension aqo; create extension aqo;")
+                conn.close()
+            replay = Replay(args, query_table, mode)
+            elapsed = replay.run()
+            replay.results.sort(key=lambda r: r['start_ms'])
+            writer.writerows(replay.results)
+            print_summary(mode, elapsed, replay.results,
+                          args.update_query_state)
+    print('results are written to', output)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--query-file', type=str, default='', help='workload csv, default is from config_file.py')
+    parser.add_argument('--modes', type=str, default='disabled,learn', help='comma separated aqo.mode values to compare')
+    parser.add_argument('--clients', type=int, default='4', help='number of concurrent clients')
+    parser.add_argument('--arrival', type=str, default='poisson', choices=['uniform', 'poisson', 'randwalk', 'closed'], help='arrival process of queries')
+    parser.add_argument('--rate', type=float, default='1', help='mean arrival rate (queries per second)')
+    parser.add_argument('--seed', type=int, default='1', help='seed of the arrival process')
+    parser.add_argument('--begin-num', type=int, default='1', help='begin num')
+    parser.add_argument('--end-num', type=int, default='4000', help='end num')
+    parser.add_argument('--explain', type=int, default='1', help='run queries under explain analyze to split planning, execution and learning time')
+    parser.add_argument('--update-query-state', type=int, default='0', help='do the per-query aqo_queries and markov bookkeeping of the serial driver; clients then run one at a time on the shared aqo_queries row')
+    parser.add_argument('--delete-old-data', type=int, default='1', help='recreate aqo before every learning mode')
+    parser.add_argument('--history-num', type=int, default='7', help='historic data')
+    parser.add_argument('--markov-m', type=int, default='3', help='the order of markov')
+    parser.add_argument('--output', type=str, default='', help='result csv')
+
+    args = parser.parse_args()
+    if args.rate <= 0 and args.arrival != 'closed':
+        parser.error('--rate must be positive')
+    replay_workload_concurrent(args)